@@ -0,0 +1,447 @@
+#include "../src/hash_table.c"
+#include "../src/thread_pool.c"
+#include "../src/bench.c"
+#include "../src/memdb.c"
+#include "../src/resp.c"
+#include "../src/histogram.c"
+#include "../src/protocol.c"
+#include "../src/buffer.c"
+#include "../src/malloc.c"
+#include "../src/sys.c"
+
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Microbenchmarks of the hash table used the way the keyspace uses it: each
+ * operation hashes its key once, the hash is kept with the key, and keys are
+ * copied in on insertion.
+ *
+ * Each case changes one parameter from the baseline. For each operation it
+ * prints one CSV line, taken from the fastest of several rounds:
+ *
+ *   op,entries,load,key_len,hash,skew,ns_per_op,cycles_per_op,bytes_per_entry
+ *
+ * Column meanings:
+ *
+ *   - `load` is entries per bucket during the operation.
+ *   - `cycles_per_op` counts time-stamp counter ticks, or is zero where
+ *     there is no counter.
+ *   - `bytes_per_entry` is what the table asked the allocator for, buckets
+ *     and key copies included.
+ *
+ * A `rehash` op is one entry moved.
+ */
+
+#define BENCH_MIN_OPS (1 << 20)
+#define BENCH_MIN_ROUNDS 3
+#define BENCH_MAX_KEY_LEN 256
+
+struct key {
+    const char *data;
+    size_t len;
+    uint32_t hash;
+};
+
+struct hash {
+    const char *name;
+    uint32_t (*fn)(const void *data, size_t len);
+};
+
+static uint32_t murmur(const void *data, size_t len)
+{
+    return murmur_hash_x86_32(data, len, 0);
+}
+
+static uint32_t fnv1a(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ p[i]) * 16777619u;
+
+    return hash;
+}
+
+static const struct hash hashes[] = {
+    { "murmur3", murmur },
+    { "fnv1a", fnv1a },
+};
+
+/*
+ * `zipf` is the skew of lookups, uniform if zero.
+ */
+struct bench_case {
+    size_t entries;
+    double load;
+    size_t key_len;
+    const struct hash *hash;
+    double zipf;
+};
+
+static const struct bench_case baseline = {
+    .entries = 1 << 18,
+    .load = 0.75,
+    .key_len = 16,
+    .hash = &hashes[0],
+};
+
+static uint64_t key_hash(const void *key)
+{
+    return ((const struct key *)key)->hash;
+}
+
+static void *key_dup(struct hash_table *table, const void *key)
+{
+    const struct key *src = key;
+    struct key *dest = malloc(sizeof(*dest) + src->len + 1);
+
+    (void)table;
+
+    if (!dest)
+        return NULL;
+
+    char *data = (char *)(dest + 1);
+
+    memcpy(data, src->data, src->len);
+    data[src->len] = '\0';
+    *dest = (struct key){ data, src->len, src->hash };
+
+    return dest;
+}
+
+static void key_free(struct hash_table *table, void *key)
+{
+    (void)table;
+
+    free(key);
+}
+
+static int key_cmp(struct hash_table *table, const void *key_a,
+                   const void *key_b)
+{
+    const struct key *a = key_a;
+    const struct key *b = key_b;
+
+    (void)table;
+
+    return a->hash != b->hash || a->len != b->len ||
+           memcmp(a->data, b->data, a->len);
+}
+
+static struct hash_table_interface interface = {
+    .hash_fn = key_hash,
+    .key_dup = key_dup,
+    .free_key = key_free,
+    .key_cmp = key_cmp,
+};
+
+/*
+ * A case being run. `keys` holds twice `entries` keys, the first half stored
+ * and the second half never, and `order` the keys looked up in turn.
+ * `table` holds the stored keys at the case's load; `scratch` is built and
+ * torn down around operations that change it.
+ */
+struct run {
+    const struct bench_case *c;
+    char *keys;
+    uint32_t *order;
+    struct hash_table *table;
+    struct hash_table *scratch;
+    size_t found;
+};
+
+static struct key run_key(const struct run *r, size_t i)
+{
+    struct key key = {
+        .data = r->keys + i * r->c->key_len,
+        .len = r->c->key_len,
+    };
+
+    key.hash = r->c->hash->fn(key.data, key.len);
+    return key;
+}
+
+static struct hash_table *create(void)
+{
+    struct hash_table *table = hash_table_create(&interface);
+
+    if (!table)
+        fatal("Out of memory\n");
+
+    return table;
+}
+
+static void insert(struct run *r, struct hash_table *table)
+{
+    for (size_t i = 0; i < r->c->entries; i++) {
+        struct key key = run_key(r, i);
+
+        if (hash_table_insert(table, &key, r))
+            fatal("Out of memory\n");
+    }
+}
+
+/*
+ * Rehashes `table` to the case's load.
+ */
+static void set_load(struct run *r, struct hash_table *table)
+{
+    size_t buckets = max(r->c->entries / r->c->load, 1.0);
+
+    if (hash_table_rehash(table, buckets))
+        fatal("Out of memory\n");
+}
+
+static void setup_empty(struct run *r)
+{
+    r->scratch = create();
+}
+
+static void setup_reserved(struct run *r)
+{
+    r->scratch = create();
+
+    if (hash_table_reserve(r->scratch, r->c->entries))
+        fatal("Out of memory\n");
+}
+
+static void setup_full(struct run *r)
+{
+    r->scratch = create();
+    insert(r, r->scratch);
+    set_load(r, r->scratch);
+}
+
+static void setup_lookup(struct run *r)
+{
+    r->scratch = r->table;
+    r->found = 0;
+}
+
+static void setup_rehash(struct run *r)
+{
+    r->scratch = r->table;
+    set_load(r, r->table);
+}
+
+static void teardown_scratch(struct run *r)
+{
+    hash_table_destroy(r->scratch);
+}
+
+static void teardown_hit(struct run *r)
+{
+    if (r->found != r->c->entries)
+        fatal("Lookups of stored keys missed\n");
+}
+
+static void teardown_miss(struct run *r)
+{
+    if (r->found)
+        fatal("Lookups of keys never stored hit\n");
+}
+
+static void run_insert(struct run *r)
+{
+    insert(r, r->scratch);
+}
+
+static void run_hit(struct run *r)
+{
+    for (size_t i = 0; i < r->c->entries; i++) {
+        struct key key = run_key(r, r->order[i]);
+
+        r->found += !!hash_table_get(r->table, &key);
+    }
+}
+
+static void run_miss(struct run *r)
+{
+    for (size_t i = 0; i < r->c->entries; i++) {
+        struct key key = run_key(r, r->c->entries + r->order[i]);
+
+        r->found += !!hash_table_get(r->table, &key);
+    }
+}
+
+static void run_delete(struct run *r)
+{
+    for (size_t i = 0; i < r->c->entries; i++) {
+        struct key key = run_key(r, i);
+
+        hash_table_rm(r->scratch, &key);
+    }
+}
+
+static void run_rehash(struct run *r)
+{
+    if (hash_table_rehash(r->table, 2 * r->table->bucket_count))
+        fatal("Out of memory\n");
+}
+
+struct op {
+    const char *name;
+    void (*setup)(struct run *r);
+    void (*run)(struct run *r);
+    void (*teardown)(struct run *r);
+};
+
+static const struct op ops[] = {
+    { "insert", setup_empty, run_insert, teardown_scratch },
+    { "insert_reserved", setup_reserved, run_insert, teardown_scratch },
+    { "get_hit", setup_lookup, run_hit, teardown_hit },
+    { "get_miss", setup_lookup, run_miss, teardown_miss },
+    { "delete", setup_full, run_delete, teardown_scratch },
+    { "rehash", setup_rehash, run_rehash, NULL },
+};
+
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Bytes the table asked for per entry, with its load.
+ */
+static double footprint(const struct run *r, double *load)
+{
+    const struct hash_table *table = r->scratch;
+    size_t entry_size = sizeof(struct hash_table_entry) + sizeof(struct key) +
+                        r->c->key_len + 1;
+    size_t bytes = table->bucket_count * sizeof(*table->entries) +
+                   table->entry_count * entry_size;
+
+    *load = (double)table->entry_count / table->bucket_count;
+    return (double)bytes / max(table->entry_count, (size_t)1);
+}
+
+/*
+ * Runs `op` for as many rounds as it takes to reach `BENCH_MIN_OPS`, and
+ * prints its fastest. The footprint is taken with the table at its fullest.
+ */
+static void bench_op(struct run *r, const struct op *op)
+{
+    const struct bench_case *c = r->c;
+    size_t rounds = max(BENCH_MIN_OPS / c->entries, (size_t)BENCH_MIN_ROUNDS);
+    uint64_t best_ns = UINT64_MAX, best_cycles = 0;
+    double bytes = 0, load = 0;
+
+    for (size_t i = 0; i < rounds; i++) {
+        op->setup(r);
+
+        size_t before = r->scratch->entry_count;
+        double load_before;
+        double bytes_before = footprint(r, &load_before);
+        uint64_t start_cycles = cycles();
+        uint64_t start = monotonic_ns();
+
+        op->run(r);
+
+        uint64_t ns = monotonic_ns() - start;
+        uint64_t ticks = cycles() - start_cycles;
+
+        if (ns < best_ns) {
+            best_ns = ns;
+            best_cycles = ticks;
+        }
+
+        if (r->scratch->entry_count > before)
+            bytes = footprint(r, &load);
+        else
+            bytes = bytes_before, load = load_before;
+
+        if (op->teardown)
+            op->teardown(r);
+    }
+
+    printf("%s,%zu,%.3f,%zu,%s,%.2f,%.2f,%.2f,%.1f\n", op->name, c->entries,
+           load, c->key_len, c->hash->name, c->zipf,
+           (double)best_ns / c->entries, (double)best_cycles / c->entries,
+           bytes);
+    fflush(stdout);
+}
+
+static void bench_case(const struct bench_case *c)
+{
+    struct run r = {
+        .c = c,
+        .keys = xmalloc(2 * c->entries * c->key_len + 1),
+        .order = xmalloc(c->entries * sizeof(*r.order)),
+    };
+    char key[BENCH_MAX_KEY_LEN + 1];
+    struct bench_zipf zipf;
+    uint64_t rng = 1;
+
+    /*
+     * Keys are numbers, zero-padded to length, so share a prefix as real keys
+     * often do.
+     */
+    for (size_t i = 0; i < 2 * c->entries; i++) {
+        snprintf(key, sizeof(key), "%0*zu", (int)c->key_len, i);
+        memcpy(r.keys + i * c->key_len, key, c->key_len);
+    }
+
+    if (c->zipf)
+        bench_zipf_init(&zipf, c->entries, c->zipf);
+
+    for (size_t i = 0; i < c->entries; i++)
+        r.order[i] = c->zipf ? bench_zipf_next(&zipf, &rng)
+                             : bench_random(&rng) % c->entries;
+
+    r.table = create();
+    insert(&r, r.table);
+    set_load(&r, r.table);
+
+    for (size_t i = 0; i < ARRAY_SIZE(ops); i++)
+        bench_op(&r, &ops[i]);
+
+    hash_table_destroy(r.table);
+    free(r.order);
+    free(r.keys);
+}
+
+int main()
+{
+    static const size_t entries[] = { 1 << 10, 1 << 14, 1 << 18, 1 << 20 };
+    static const double loads[] = { 0.5, 1, 2, 4 };
+    static const size_t key_lens[] = { 8, 32, 128 };
+    struct bench_case c;
+
+    printf("op,entries,load,key_len,hash,skew,ns_per_op,cycles_per_op,"
+           "bytes_per_entry\n");
+
+    for (size_t i = 0; i < ARRAY_SIZE(entries); i++) {
+        c = baseline;
+        c.entries = entries[i];
+        bench_case(&c);
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(loads); i++) {
+        c = baseline;
+        c.load = loads[i];
+        bench_case(&c);
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(key_lens); i++) {
+        c = baseline;
+        c.key_len = key_lens[i];
+        bench_case(&c);
+    }
+
+    c = baseline;
+    c.hash = &hashes[1];
+    bench_case(&c);
+
+    c = baseline;
+    c.zipf = 0.99;
+    bench_case(&c);
+}
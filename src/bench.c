@@ -0,0 +1,724 @@
+#include "bench.h"
+#include "buffer.h"
+#include "histogram.h"
+#include "memdb.h"
+#include "protocol.h"
+#include "resp.h"
+#include "sys.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_POLL_MS 100
+
+/*
+ * Requests kept in flight per connection while prefilling, and how long
+ * responses still outstanding once the run is over are waited for.
+ */
+#define BENCH_PREFILL_PIPELINE 64
+#define BENCH_DRAIN_NS 5000000000ull
+
+static const char *const bench_op_names[] = {
+    [BENCH_GET] = "GET",
+    [BENCH_SET] = "SET",
+    [BENCH_MGET] = "MGET",
+};
+
+void bench_config_init(struct bench_config *cfg)
+{
+    cfg->host = "127.0.0.1";
+    cfg->port = "11111";
+    cfg->resp = false;
+    cfg->threads = 4;
+    cfg->connections = 50;
+    cfg->pipeline = 1;
+    cfg->requests = 0;
+    cfg->duration = 10;
+    cfg->mix[BENCH_GET] = 90;
+    cfg->mix[BENCH_SET] = 10;
+    cfg->mix[BENCH_MGET] = 0;
+    cfg->mget_keys = 10;
+    cfg->value_size = 100;
+    cfg->keys = 100000;
+    cfg->zipf = 0;
+    cfg->prefill = false;
+    cfg->seed = 1;
+}
+
+uint64_t bench_random(uint64_t *rng)
+{
+    uint64_t z = (*rng += 0x9e3779b97f4a7c15ull);
+
+    z = (z ^ z >> 30) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ z >> 27) * 0x94d049bb133111ebull;
+
+    return z ^ z >> 31;
+}
+
+/*
+ * Uniform in [0, 1).
+ */
+static double bench_uniform(uint64_t *rng)
+{
+    return (bench_random(rng) >> 11) * 0x1p-53;
+}
+
+static double bench_zeta(uint64_t n, double theta)
+{
+    double sum = 0;
+
+    for (uint64_t i = 1; i <= n; i++)
+        sum += 1 / pow(i, theta);
+
+    return sum;
+}
+
+void bench_zipf_init(struct bench_zipf *z, uint64_t n, double theta)
+{
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1 / (1 - theta);
+    z->zetan = bench_zeta(n, theta);
+    z->eta = (1 - pow(2.0 / n, 1 - theta)) /
+             (1 - bench_zeta(2, theta) / z->zetan);
+}
+
+uint64_t bench_zipf_next(const struct bench_zipf *z, uint64_t *rng)
+{
+    double u = bench_uniform(rng);
+    double uz = u * z->zetan;
+
+    if (uz < 1)
+        return 0;
+
+    if (uz < 1 + pow(0.5, z->theta))
+        return min((uint64_t)1, z->n - 1);
+
+    uint64_t rank = z->n * pow(z->eta * u - z->eta + 1, z->alpha);
+
+    return min(rank, z->n - 1);
+}
+
+/*
+ * A request in flight, and when it was queued.
+ */
+struct bench_slot {
+    enum bench_op op;
+    uint64_t queued;
+};
+
+/*
+ * A connection, with its requests in flight in a ring of `depth` starting at
+ * `head`, in the order the library calls them back.
+ */
+struct bench_conn {
+    struct memdb_conn conn;
+    struct bench_thread *thread;
+    struct bench_slot *slots;
+    size_t depth;
+    size_t head;
+    size_t inflight;
+};
+
+struct bench_stats {
+    struct histogram latency[BENCH_OP_COUNT];
+    uint64_t misses;
+    uint64_t errors;
+};
+
+/*
+ * Shared by the threads of a run. `ready` counts threads connected, and
+ * prefilled if asked; `go` is then set with the run's `deadline`, zero if it
+ * stops by request count instead.
+ */
+struct bench_shared {
+    const struct bench_config *cfg;
+    struct bench_zipf zipf;
+    char *value;
+    atomic_long issued;
+    atomic_long prefilled;
+    atomic_size_t ready;
+    atomic_bool go;
+    atomic_bool failed;
+    _Atomic uint64_t deadline;
+};
+
+/*
+ * `now` is when the replies being handed over arrived, and `err` is set by a
+ * reply failing the run.
+ */
+struct bench_thread {
+    struct bench_shared *shared;
+    pthread_t thread;
+    struct bench_conn *conns;
+    struct pollfd *fds;
+    struct bench_slot *slots;
+    size_t conn_count;
+    uint64_t rng;
+    struct buffer scratch;
+    struct buffer command;
+    struct bench_stats stats;
+    bool prefilling;
+    uint64_t now;
+    uint64_t stopped;
+    int err;
+};
+
+/*
+ * Writes the name of key `index` to `name`, returning its length.
+ */
+static size_t bench_key_name(char *name, uint64_t index)
+{
+    return sprintf(name, "key:%" PRIu64, index);
+}
+
+static uint64_t bench_pick_key(struct bench_thread *t)
+{
+    struct bench_shared *shared = t->shared;
+
+    if (shared->cfg->zipf)
+        return bench_zipf_next(&shared->zipf, &t->rng);
+
+    return bench_random(&t->rng) % shared->cfg->keys;
+}
+
+static enum bench_op bench_pick_op(struct bench_thread *t)
+{
+    const long *mix = t->shared->cfg->mix;
+    long total = mix[BENCH_GET] + mix[BENCH_SET] + mix[BENCH_MGET];
+    long pick = bench_random(&t->rng) % total;
+    int op = 0;
+
+    while (pick >= mix[op])
+        pick -= mix[op++];
+
+    return op;
+}
+
+/*
+ * Encodes the RESP command for `op` on key `index`, and for `MGET` on more
+ * keys drawn as it goes, to `out`. Returns non-zero on allocation failure.
+ */
+static int bench_encode_resp(struct bench_thread *t, struct buffer *out,
+                             enum bench_op op, uint64_t index)
+{
+    const struct bench_config *cfg = t->shared->cfg;
+    char name[32];
+    size_t len = bench_key_name(name, index);
+
+    switch (op) {
+    case BENCH_GET:
+        return resp_array(out, 2) || resp_bulk(out, "GET", 3) ||
+               resp_bulk(out, name, len);
+    case BENCH_SET:
+        return resp_array(out, 3) || resp_bulk(out, "SET", 3) ||
+               resp_bulk(out, name, len) ||
+               resp_bulk(out, t->shared->value, cfg->value_size);
+    default:
+        if (resp_array(out, 1 + cfg->mget_keys) ||
+            resp_bulk(out, "MGET", 4) || resp_bulk(out, name, len))
+            return 1;
+
+        for (long i = 1; i < cfg->mget_keys; i++) {
+            len = bench_key_name(name, bench_pick_key(t));
+            if (resp_bulk(out, name, len))
+                return 1;
+        }
+
+        return 0;
+    }
+}
+
+static void bench_done(struct memdb_conn *mc, const struct memdb_reply *reply,
+                       void *arg);
+
+/*
+ * Queues the request for `op` on key `index` on `conn`, drawing keys as
+ * `bench_encode_resp()` does. Returns non-zero on failure.
+ */
+static int bench_send(struct bench_thread *t, struct bench_conn *conn,
+                      enum bench_op op, uint64_t index)
+{
+    const struct bench_config *cfg = t->shared->cfg;
+    char name[32];
+    size_t len;
+
+    if (cfg->resp) {
+        struct buffer *out = &t->command;
+
+        buffer_consume(out, buffer_len(out));
+
+        return bench_encode_resp(t, out, op, index) ||
+               memdb_command_raw(&conn->conn, buffer_head(out),
+                                 buffer_len(out), bench_done, conn);
+    }
+
+    len = bench_key_name(name, index);
+
+    switch (op) {
+    case BENCH_GET:
+        return memdb_get(&conn->conn, name, len, bench_done, conn);
+    case BENCH_SET:
+        return memdb_set(&conn->conn, name, len, t->shared->value,
+                         cfg->value_size, 0, bench_done, conn);
+    default:
+        buffer_consume(&t->scratch, buffer_len(&t->scratch));
+
+        for (long i = 0; i < cfg->mget_keys; i++) {
+            if (i)
+                len = bench_key_name(name, bench_pick_key(t));
+
+            struct proto_item item = { .key = name, .key_len = len };
+
+            if (proto_write_item(&t->scratch, &item, true, false))
+                return 1;
+        }
+
+        struct proto_request req = {
+            .opcode = PROTO_MGET,
+            .val = buffer_head(&t->scratch),
+            .val_len = buffer_len(&t->scratch),
+        };
+
+        return memdb_request(&conn->conn, &req, bench_done, conn);
+    }
+}
+
+/*
+ * Queues the next request on `conn`. Returns positive if there was one, zero
+ * once there is none left to send, or negative on failure.
+ */
+static int bench_issue(struct bench_thread *t, struct bench_conn *conn,
+                       uint64_t now)
+{
+    struct bench_shared *shared = t->shared;
+    const struct bench_config *cfg = shared->cfg;
+    enum bench_op op = BENCH_SET;
+    uint64_t index;
+
+    if (t->prefilling) {
+        if ((index = atomic_fetch_add(&shared->prefilled, 1)) >= cfg->keys)
+            return 0;
+    } else {
+        if (cfg->requests &&
+            atomic_fetch_add(&shared->issued, 1) >= cfg->requests)
+            return 0;
+
+        op = bench_pick_op(t);
+        index = bench_pick_key(t);
+    }
+
+    if (bench_send(t, conn, op, index))
+        return -1;
+
+    size_t slot = (conn->head + conn->inflight++) % conn->depth;
+
+    conn->slots[slot] = (struct bench_slot){ .op = op, .queued = now };
+
+    return 1;
+}
+
+/*
+ * Takes the reply to the oldest request in flight on the connection.
+ */
+static void bench_done(struct memdb_conn *mc, const struct memdb_reply *reply,
+                       void *arg)
+{
+    struct bench_conn *conn = arg;
+    struct bench_thread *t = conn->thread;
+    struct bench_slot slot = conn->slots[conn->head];
+    bool error, miss;
+
+    (void)mc;
+
+    conn->head = (conn->head + 1) % conn->depth;
+    conn->inflight--;
+
+    if (reply->status == MEMDB_CLOSED)
+        return;
+
+    if (t->shared->cfg->resp) {
+        error = reply->val[0] == '-';
+        miss = reply->val_len == 5 && !memcmp(reply->val, "$-1\r\n", 5);
+    } else {
+        error = reply->status != PROTO_OK &&
+                reply->status != PROTO_NOT_FOUND;
+        miss = reply->status == PROTO_NOT_FOUND;
+    }
+
+    if (t->prefilling) {
+        if (error)
+            t->err = EIO;
+        return;
+    }
+
+    histogram_record(&t->stats.latency[slot.op], t->now - slot.queued);
+    t->stats.errors += error;
+    t->stats.misses += miss && slot.op == BENCH_GET;
+}
+
+/*
+ * Drives every connection of the thread until there is nothing left to send,
+ * or `deadline` passes, and every response is in. Returns non-zero on
+ * failure, setting `errno`.
+ */
+static int bench_drive(struct bench_thread *t, uint64_t deadline)
+{
+    const struct bench_config *cfg = t->shared->cfg;
+    size_t depth = t->prefilling ? BENCH_PREFILL_PIPELINE : cfg->pipeline;
+    uint64_t drain_until = 0;
+    bool issuing = true;
+
+    while (true) {
+        uint64_t now = monotonic_ns();
+        size_t inflight = 0;
+
+        if (deadline && now >= deadline)
+            issuing = false;
+
+        for (size_t i = 0; i < t->conn_count; i++) {
+            struct bench_conn *conn = &t->conns[i];
+
+            while (issuing && conn->inflight < depth) {
+                int issued = bench_issue(t, conn, now);
+
+                if (issued < 0)
+                    return -1;
+                if (!issued)
+                    issuing = false;
+            }
+
+            t->fds[i] = (struct pollfd){
+                .fd = memdb_fd(&conn->conn),
+                .events = memdb_events(&conn->conn),
+            };
+            inflight += conn->inflight;
+        }
+
+        if (!inflight && !issuing)
+            break;
+
+        if (!issuing) {
+            if (!drain_until)
+                drain_until = now + BENCH_DRAIN_NS;
+            else if (now >= drain_until) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        }
+
+        if (poll(t->fds, t->conn_count, BENCH_POLL_MS) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        t->now = monotonic_ns();
+
+        for (size_t i = 0; i < t->conn_count; i++) {
+            if (t->fds[i].revents &&
+                memdb_process(&t->conns[i].conn, t->fds[i].revents))
+                return -1;
+        }
+
+        if (t->err) {
+            errno = t->err;
+            return -1;
+        }
+    }
+
+    t->stopped = monotonic_ns();
+
+    return 0;
+}
+
+static void bench_pinged(struct memdb_conn *mc,
+                         const struct memdb_reply *reply, void *arg)
+{
+    (void)mc;
+    (void)reply;
+    (void)arg;
+}
+
+/*
+ * Connects every connection of the thread, waiting for each to answer a
+ * ping. Returns non-zero on failure, setting `errno`.
+ */
+static int bench_connect(struct bench_thread *t)
+{
+    const struct bench_config *cfg = t->shared->cfg;
+    const char *ping = "PING";
+    size_t ping_len = 4;
+
+    for (size_t i = 0; i < t->conn_count; i++) {
+        struct memdb_conn *conn = &t->conns[i].conn;
+
+        if (memdb_connect(conn, cfg->host, cfg->port))
+            return -1;
+
+        if (cfg->resp ? memdb_command(conn, 1, &ping, &ping_len,
+                                      bench_pinged, NULL)
+                      : memdb_request(conn,
+                                      &(struct proto_request){
+                                          .opcode = PROTO_NOOP },
+                                      bench_pinged, NULL))
+            return -1;
+    }
+
+    for (size_t i = 0; i < t->conn_count; i++) {
+        if (memdb_wait(&t->conns[i].conn, BENCH_DRAIN_NS / 1000000))
+            return -1;
+    }
+
+    return 0;
+}
+
+static int bench_thread_init(struct bench_thread *t, struct bench_shared *shared,
+                             size_t id, size_t conn_count)
+{
+    const struct bench_config *cfg = shared->cfg;
+    size_t depth = max((size_t)cfg->pipeline, (size_t)BENCH_PREFILL_PIPELINE);
+
+    t->shared = shared;
+    t->conn_count = 0;
+    t->rng = cfg->seed ^ (id + 1) * 0x9e3779b97f4a7c15ull;
+    t->prefilling = false;
+    t->stopped = 0;
+    t->err = 0;
+    buffer_init(&t->scratch);
+    buffer_init(&t->command);
+    t->stats.misses = 0;
+    t->stats.errors = 0;
+
+    for (int i = 0; i < BENCH_OP_COUNT; i++)
+        histogram_init(&t->stats.latency[i]);
+
+    /*
+     * The slots of every connection share one allocation.
+     */
+    if (!(t->conns = calloc(conn_count, sizeof(*t->conns))))
+        return -1;
+
+    if (!(t->fds = calloc(conn_count, sizeof(*t->fds))))
+        goto error_fds;
+
+    if (!(t->slots = calloc(conn_count * depth, sizeof(*t->slots))))
+        goto error_slots;
+
+    while (t->conn_count < conn_count) {
+        struct bench_conn *conn = &t->conns[t->conn_count];
+
+        memdb_init(&conn->conn, cfg->resp ? MEMDB_RESP : 0);
+        conn->thread = t;
+        conn->depth = depth;
+        conn->slots = t->slots + t->conn_count++ * depth;
+    }
+
+    return 0;
+
+error_slots:
+    free(t->fds);
+error_fds:
+    free(t->conns);
+    return -1;
+}
+
+static void bench_thread_destroy(struct bench_thread *t)
+{
+    for (size_t i = 0; i < t->conn_count; i++) {
+        memdb_destroy(&t->conns[i].conn);
+    }
+
+    buffer_destroy(&t->scratch);
+    buffer_destroy(&t->command);
+    free(t->conns);
+    free(t->fds);
+    free(t->slots);
+}
+
+static void *bench_thread_main(void *arg)
+{
+    struct bench_thread *t = arg;
+    struct bench_shared *shared = t->shared;
+    int err = 0;
+
+    if (bench_connect(t))
+        err = errno;
+
+    t->prefilling = shared->cfg->prefill;
+
+    if (!err && t->prefilling && bench_drive(t, 0))
+        err = errno;
+
+    t->prefilling = false;
+
+    if (err)
+        atomic_store(&shared->failed, true);
+
+    atomic_fetch_add(&shared->ready, 1);
+
+    while (!atomic_load(&shared->go))
+        nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+
+    if (!err && !atomic_load(&shared->failed) &&
+        bench_drive(t, atomic_load(&shared->deadline)))
+        err = errno;
+
+    t->err = err;
+
+    return NULL;
+}
+
+/*
+ * Prints a latency in microseconds.
+ */
+static void bench_print_us(FILE *out, uint64_t ns)
+{
+    fprintf(out, " %9.1f", ns / 1000.0);
+}
+
+static void bench_print_latency(FILE *out, const char *name,
+                                const struct histogram *h, double seconds)
+{
+    uint64_t count = histogram_count(h);
+
+    fprintf(out, "%-5s %12" PRIu64 " %12.0f", name, count, count / seconds);
+    bench_print_us(out, histogram_mean(h));
+    bench_print_us(out, histogram_percentile(h, 50));
+    bench_print_us(out, histogram_percentile(h, 99));
+    bench_print_us(out, histogram_percentile(h, 99.9));
+    bench_print_us(out, histogram_max(h));
+    fprintf(out, "\n");
+}
+
+static void bench_report(const struct bench_config *cfg,
+                         const struct bench_stats *stats, uint64_t elapsed_ns,
+                         FILE *out)
+{
+    double seconds = elapsed_ns / 1e9;
+    struct histogram all;
+    char dist[32] = "uniform";
+
+    histogram_init(&all);
+    for (int i = 0; i < BENCH_OP_COUNT; i++)
+        histogram_merge(&all, &stats->latency[i]);
+
+    if (cfg->zipf)
+        snprintf(dist, sizeof(dist), "zipfian %.2f", cfg->zipf);
+
+    fprintf(out, "%s protocol, %ld threads, %ld connections, pipeline %ld\n",
+            cfg->resp ? "RESP" : "binary", cfg->threads, cfg->connections,
+            cfg->pipeline);
+    fprintf(out,
+            "%ld keys, %s, %ld byte values, GET/SET/MGET %ld/%ld/%ld, "
+            "%ld keys per MGET\n",
+            cfg->keys, dist, cfg->value_size, cfg->mix[BENCH_GET],
+            cfg->mix[BENCH_SET], cfg->mix[BENCH_MGET], cfg->mget_keys);
+    fprintf(out,
+            "%" PRIu64 " requests in %.2f s, %.0f requests/s, %" PRIu64
+            " GET misses, %" PRIu64 " errors\n\n",
+            histogram_count(&all), seconds, histogram_count(&all) / seconds,
+            stats->misses, stats->errors);
+    fprintf(out, "%-5s %12s %12s %9s %9s %9s %9s %9s\n", "op", "requests",
+            "requests/s", "mean us", "p50 us", "p99 us", "p99.9 us",
+            "max us");
+
+    for (int i = 0; i < BENCH_OP_COUNT; i++) {
+        if (histogram_count(&stats->latency[i]))
+            bench_print_latency(out, bench_op_names[i], &stats->latency[i],
+                                seconds);
+    }
+
+    bench_print_latency(out, "all", &all, seconds);
+}
+
+int bench_run(const struct bench_config *cfg, FILE *out)
+{
+    size_t thread_count = min(cfg->threads, cfg->connections);
+    struct bench_shared shared = { .cfg = cfg };
+    struct bench_thread *threads = calloc(thread_count, sizeof(*threads));
+    size_t started = 0;
+    int err = 0;
+
+    if (!threads || !(shared.value = malloc(cfg->value_size + 1))) {
+        free(threads);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset(shared.value, 'x', cfg->value_size);
+    atomic_init(&shared.issued, 0);
+    atomic_init(&shared.prefilled, 0);
+    atomic_init(&shared.ready, 0);
+    atomic_init(&shared.go, false);
+    atomic_init(&shared.failed, false);
+    atomic_init(&shared.deadline, 0);
+
+    if (cfg->zipf)
+        bench_zipf_init(&shared.zipf, cfg->keys, cfg->zipf);
+
+    for (; started < thread_count; started++) {
+        struct bench_thread *t = &threads[started];
+        size_t conns = cfg->connections / thread_count +
+                       (started < cfg->connections % thread_count);
+
+        if (bench_thread_init(t, &shared, started, conns)) {
+            err = ENOMEM;
+            break;
+        }
+
+        if ((err = pthread_create(&t->thread, NULL, bench_thread_main, t))) {
+            bench_thread_destroy(t);
+            break;
+        }
+    }
+
+    if (err)
+        atomic_store(&shared.failed, true);
+
+    while (atomic_load(&shared.ready) < started)
+        nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+
+    uint64_t start = monotonic_ns();
+
+    if (!cfg->requests)
+        atomic_store(&shared.deadline, start + cfg->duration * 1e9);
+    atomic_store(&shared.go, true);
+
+    struct bench_stats stats = {0};
+    uint64_t stopped = start;
+
+    for (int i = 0; i < BENCH_OP_COUNT; i++)
+        histogram_init(&stats.latency[i]);
+
+    for (size_t i = 0; i < started; i++) {
+        struct bench_thread *t = &threads[i];
+
+        pthread_join(t->thread, NULL);
+
+        if (t->err && !err)
+            err = t->err;
+
+        for (int j = 0; j < BENCH_OP_COUNT; j++)
+            histogram_merge(&stats.latency[j], &t->stats.latency[j]);
+
+        stats.misses += t->stats.misses;
+        stats.errors += t->stats.errors;
+        stopped = max(stopped, t->stopped);
+        bench_thread_destroy(t);
+    }
+
+    if (!err)
+        bench_report(cfg, &stats, max(stopped - start, (uint64_t)1), out);
+
+    free(threads);
+    free(shared.value);
+
+    errno = err;
+    return err ? -1 : 0;
+}
@@ -0,0 +1,91 @@
+#ifndef MEMDB_BENCH_H_
+#define MEMDB_BENCH_H_
+
+#include <stdio.h>
+#include "common.h"
+
+/*
+ * Load generator behind `mem-db-cli bench`.
+ *
+ * Each thread drives its share of the connections, libmemdb ones, from one
+ * `poll()` loop, keeping `pipeline` requests in flight on each, and times
+ * every request from when it is queued to when its response is parsed into
+ * a histogram of its operation. Keys are drawn from `key:0` to `key:<keys - 1>`, uniformly or
+ * by a Zipfian distribution over their index, from a generator seeded per
+ * thread from `seed`, so a run can be repeated exactly.
+ */
+
+enum bench_op {
+    BENCH_GET,
+    BENCH_SET,
+    BENCH_MGET,
+    BENCH_OP_COUNT,
+};
+
+struct bench_config {
+    const char *host;
+    const char *port;
+    bool resp;
+
+    long threads;
+    long connections;
+    long pipeline;
+
+    /*
+     * The run stops after `requests` requests, or if zero, after `duration`
+     * seconds.
+     */
+    long requests;
+    double duration;
+
+    /*
+     * Relative weights of the operations, keys per `MGET`, and the size of
+     * values set.
+     */
+    long mix[BENCH_OP_COUNT];
+    long mget_keys;
+    long value_size;
+
+    /*
+     * Keyspace, and the skew of the Zipfian distribution over it, in
+     * (0, 1), or zero for uniform. With `prefill` every key is set before
+     * the run, so reads hit.
+     */
+    long keys;
+    double zipf;
+    bool prefill;
+    uint64_t seed;
+};
+
+void bench_config_init(struct bench_config *cfg);
+
+/*
+ * Runs the benchmark, printing a report to `out`. Returns non-zero on
+ * failure, setting `errno`.
+ */
+int bench_run(const struct bench_config *cfg, FILE *out);
+
+/*
+ * Generator of ranks in [0, `n`) with probability falling with rank as
+ * `1 / (rank + 1)^theta`, after Gray et al., "Quickly Generating
+ * Billion-Record Synthetic Databases". Setting up costs a pass over `n`;
+ * each draw is constant time.
+ */
+struct bench_zipf {
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+};
+
+void bench_zipf_init(struct bench_zipf *z, uint64_t n, double theta);
+uint64_t bench_zipf_next(const struct bench_zipf *z, uint64_t *rng);
+
+/*
+ * Advances the generator state `*rng`, returning a uniformly distributed
+ * number.
+ */
+uint64_t bench_random(uint64_t *rng);
+
+#endif
@@ -0,0 +1,114 @@
+#include "buffer.h"
+#include "malloc.h"
+
+void buffer_init(struct buffer *buf)
+{
+    buf->data = NULL;
+    buf->start = 0;
+    buf->end = 0;
+    buf->cap = 0;
+}
+
+void buffer_destroy(struct buffer *buf)
+{
+    tagged_free(MALLOC_TAG_BUFFER, buf->data);
+    buffer_init(buf);
+}
+
+int buffer_reserve(struct buffer *buf, size_t size)
+{
+    /*
+     * An empty buffer has no storage, so room requires `data`.
+     */
+    if (!size || (buf->data && buffer_space(buf) >= size))
+        return 0;
+
+    size_t len = buffer_len(buf);
+
+    if (buf->start && buf->cap - len >= size) {
+        memmove(buf->data, buffer_head(buf), len);
+        buf->start = 0;
+        buf->end = len;
+        return 0;
+    }
+
+    size_t cap = max(buf->cap * 3 / 2, len + size);
+    char *data = tagged_malloc(MALLOC_TAG_BUFFER, cap);
+
+    if (!data)
+        return 1;
+
+    if (len)
+        memcpy(data, buffer_head(buf), len);
+
+    tagged_free(MALLOC_TAG_BUFFER, buf->data);
+    buf->data = data;
+    buf->start = 0;
+    buf->end = len;
+    buf->cap = cap;
+
+    return 0;
+}
+
+int buffer_append(struct buffer *buf, const void *src, size_t size)
+{
+    if (!size)
+        return 0;
+
+    if (buffer_reserve(buf, size))
+        return 1;
+
+    memcpy(buffer_tail(buf), src, size);
+    buf->end += size;
+
+    return 0;
+}
+
+int buffer_pool_init(struct buffer_pool *pool, size_t size, size_t cap)
+{
+    if (!(pool->blocks = malloc(cap * sizeof(*pool->blocks))))
+        return 1;
+
+    pool->size = size;
+    pool->count = 0;
+    pool->cap = cap;
+
+    return 0;
+}
+
+void buffer_pool_destroy(struct buffer_pool *pool)
+{
+    while (pool->count)
+        tagged_free(MALLOC_TAG_BUFFER, pool->blocks[--pool->count]);
+
+    free(pool->blocks);
+}
+
+int buffer_pool_get(struct buffer_pool *pool, struct buffer *buf)
+{
+    char *data = pool->count ? pool->blocks[--pool->count]
+                             : tagged_malloc(MALLOC_TAG_BUFFER, pool->size);
+
+    if (!data)
+        return 1;
+
+    buf->data = data;
+    buf->start = 0;
+    buf->end = 0;
+    buf->cap = pool->size;
+
+    return 0;
+}
+
+void buffer_pool_put(struct buffer_pool *pool, struct buffer *buf)
+{
+    if (!buf->data || buffer_len(buf))
+        return;
+
+    if (buf->cap == pool->size && pool->count < pool->cap)
+        pool->blocks[pool->count++] = buf->data;
+    else
+        tagged_free(MALLOC_TAG_BUFFER, buf->data);
+
+    buffer_init(buf);
+}
@@ -0,0 +1,94 @@
+#ifndef MEMDB_BUFFER_H_
+#define MEMDB_BUFFER_H_
+
+#include "common.h"
+
+/*
+ * Growable byte buffer with a consumed prefix. Bytes in [`start`, `end`) of
+ * `data` are pending; bytes in [`end`, `cap`) are free for appending.
+ */
+struct buffer {
+    char *data;
+    size_t start;
+    size_t end;
+    size_t cap;
+};
+
+void buffer_init(struct buffer *buf);
+void buffer_destroy(struct buffer *buf);
+
+/*
+ * Ensures at least `size` free bytes after `end`, first by moving pending
+ * bytes to the front, then by reallocating. Returns non-zero on allocation
+ * failure.
+ */
+int buffer_reserve(struct buffer *buf, size_t size);
+
+int buffer_append(struct buffer *buf, const void *src, size_t size);
+
+static inline size_t buffer_len(const struct buffer *buf)
+{
+    return buf->end - buf->start;
+}
+
+static inline char *buffer_head(const struct buffer *buf)
+{
+    return buf->data + buf->start;
+}
+
+static inline char *buffer_tail(const struct buffer *buf)
+{
+    return buf->data + buf->end;
+}
+
+static inline size_t buffer_space(const struct buffer *buf)
+{
+    return buf->cap - buf->end;
+}
+
+/*
+ * Marks `size` pending bytes as consumed. Resets to the front of `data` when
+ * nothing is left pending, so the common case never has to move bytes.
+ */
+static inline void buffer_consume(struct buffer *buf, size_t size)
+{
+    buf->start += size;
+
+    if (buf->start == buf->end) {
+        buf->start = 0;
+        buf->end = 0;
+    }
+}
+
+/*
+ * Cache of equally sized blocks for buffers to start out with, so connections
+ * do not allocate per request, and can hand their storage back while idle.
+ * Not thread safe.
+ */
+struct buffer_pool {
+    size_t size;
+    size_t count;
+    size_t cap;
+    void **blocks;
+};
+
+/*
+ * Caches up to `cap` blocks of `size` bytes. Returns non-zero on allocation
+ * failure.
+ */
+int buffer_pool_init(struct buffer_pool *pool, size_t size, size_t cap);
+void buffer_pool_destroy(struct buffer_pool *pool);
+
+/*
+ * Gives `buf`, which must have no storage, a block from the pool. Returns
+ * non-zero on allocation failure.
+ */
+int buffer_pool_get(struct buffer_pool *pool, struct buffer *buf);
+
+/*
+ * Takes the storage of `buf` back if it holds nothing pending, caching it if
+ * it is a block of the pool's size and freeing it otherwise.
+ */
+void buffer_pool_put(struct buffer_pool *pool, struct buffer *buf);
+
+#endif
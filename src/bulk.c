@@ -0,0 +1,340 @@
+#include "bulk.h"
+#include "buffer.h"
+#include "memdb.h"
+#include "resp.h"
+#include "sys.h"
+
+#include <inttypes.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * A load in progress. `sent` counts commands queued for the server, and
+ * `answered` the replies to them, of which `errors` were errors; a `RESERVE`
+ * sent first is counted in neither.
+ */
+struct bulk {
+    const struct bulk_config *cfg;
+    struct memdb_conn conn;
+    bool eof;
+    struct buffer in;
+    struct resp_parser parser;
+    struct buffer batch;
+    struct buffer command;
+    size_t batch_keys;
+    uint64_t lines;
+    uint64_t keys;
+    uint64_t sent;
+    uint64_t answered;
+    uint64_t errors;
+};
+
+/*
+ * Counts the lines of `fd` from its offset on, if it is a regular file,
+ * without moving the offset. Returns zero otherwise, or on failure.
+ */
+static long bulk_count_lines(int fd)
+{
+    struct stat st;
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    char buf[BULK_READ_SIZE];
+    long lines = 0;
+    char last = '\n';
+    ssize_t n;
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || offset < 0)
+        return 0;
+
+    while ((n = pread(fd, buf, sizeof(buf), offset)) > 0) {
+        for (char *c = buf; (c = memchr(c, '\n', buf + n - c)); c++)
+            lines++;
+
+        last = buf[n - 1];
+        offset += n;
+    }
+
+    return n < 0 ? 0 : lines + (last != '\n');
+}
+
+static void bulk_replied(struct memdb_conn *conn,
+                         const struct memdb_reply *reply, void *arg)
+{
+    struct bulk *b = arg;
+
+    (void)conn;
+
+    if (reply->status == MEMDB_CLOSED)
+        return;
+
+    b->answered++;
+
+    if (reply->val[0] == '-' && b->errors++ < BULK_MAX_ERRORS)
+        fprintf(stderr, "Error from command %" PRIu64 ": %.*s\n", b->answered,
+                (int)reply->val_len - 3, reply->val + 1);
+}
+
+static void bulk_reserved(struct memdb_conn *conn,
+                          const struct memdb_reply *reply, void *arg)
+{
+    (void)conn;
+    (void)arg;
+
+    if (reply->status != MEMDB_CLOSED && reply->val[0] == '-')
+        fprintf(stderr, "Could not reserve: %.*s\n", (int)reply->val_len - 3,
+                reply->val + 1);
+}
+
+/*
+ * Queues the command in `buf`.
+ */
+static int bulk_send(struct bulk *b, const char *buf, size_t len)
+{
+    if (memdb_command_raw(&b->conn, buf, len, bulk_replied, b))
+        return -1;
+
+    b->sent++;
+    return 0;
+}
+
+/*
+ * Queues the `MSET` being built, if it has any keys.
+ */
+static int bulk_flush_batch(struct bulk *b)
+{
+    struct buffer *out = &b->command;
+
+    if (!b->batch_keys)
+        return 0;
+
+    buffer_consume(out, buffer_len(out));
+
+    if (resp_array(out, 1 + 2 * b->batch_keys) || resp_bulk(out, "MSET", 4) ||
+        buffer_append(out, buffer_head(&b->batch), buffer_len(&b->batch)) ||
+        bulk_send(b, buffer_head(out), buffer_len(out)))
+        return -1;
+
+    buffer_consume(&b->batch, buffer_len(&b->batch));
+    b->batch_keys = 0;
+
+    return 0;
+}
+
+/*
+ * Adds the key and value on a line of `kv` input, without its newline, to the
+ * `MSET` being built. Returns non-zero on failure, setting `errno`.
+ */
+static int bulk_kv_line(struct bulk *b, const char *line, size_t len)
+{
+    b->lines++;
+
+    if (len && line[len - 1] == '\r')
+        len--;
+
+    if (!len)
+        return 0;
+
+    size_t key_len = 0;
+
+    while (key_len < len && line[key_len] != ' ' && line[key_len] != '\t')
+        key_len++;
+
+    if (key_len == len || !key_len) {
+        fprintf(stderr, "Line %" PRIu64 " is not a key and value\n",
+                b->lines);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (resp_bulk(&b->batch, line, key_len) ||
+        resp_bulk(&b->batch, line + key_len + 1, len - key_len - 1))
+        return -1;
+
+    b->keys++;
+
+    if (++b->batch_keys == BULK_BATCH_KEYS ||
+        buffer_len(&b->batch) >= BULK_BATCH_SIZE)
+        return bulk_flush_batch(b);
+
+    return 0;
+}
+
+static int bulk_kv_input(struct bulk *b)
+{
+    char *nl;
+
+    while ((nl = memchr(buffer_head(&b->in), '\n', buffer_len(&b->in)))) {
+        size_t len = nl - buffer_head(&b->in);
+
+        if (bulk_kv_line(b, buffer_head(&b->in), len))
+            return -1;
+
+        buffer_consume(&b->in, len + 1);
+    }
+
+    if (!b->eof)
+        return 0;
+
+    if (buffer_len(&b->in) &&
+        bulk_kv_line(b, buffer_head(&b->in), buffer_len(&b->in)))
+        return -1;
+
+    buffer_consume(&b->in, buffer_len(&b->in));
+
+    return bulk_flush_batch(b);
+}
+
+/*
+ * Forwards each whole command in the input. A last inline command without a
+ * newline is ended with one.
+ */
+static int bulk_command_input(struct bulk *b)
+{
+    ssize_t n = 0;
+
+    while (true) {
+        while (buffer_len(&b->in) &&
+               (n = resp_parse(&b->parser, buffer_head(&b->in),
+                               buffer_len(&b->in))) > 0) {
+            if (b->parser.argn && bulk_send(b, buffer_head(&b->in), n))
+                return -1;
+
+            buffer_consume(&b->in, n);
+        }
+
+        if (buffer_len(&b->in) && n < 0) {
+            fprintf(stderr, "Command %" PRIu64 " is malformed\n",
+                    b->sent + 1);
+            errno = EINVAL;
+            return -1;
+        }
+
+        if (!b->eof || !buffer_len(&b->in))
+            return 0;
+
+        if (*buffer_head(&b->in) == '*' ||
+            buffer_head(&b->in)[buffer_len(&b->in) - 1] == '\n') {
+            fprintf(stderr, "Input ends within command %" PRIu64 "\n",
+                    b->sent + 1);
+            errno = EINVAL;
+            return -1;
+        }
+
+        if (buffer_append(&b->in, "\n", 1))
+            return -1;
+    }
+}
+
+/*
+ * Reads more input and queues what it completes. Returns non-zero on
+ * failure, setting `errno`.
+ */
+static int bulk_read(struct bulk *b)
+{
+    if (buffer_reserve(&b->in, BULK_READ_SIZE))
+        return -1;
+
+    ssize_t n = read(b->cfg->fd, buffer_tail(&b->in), buffer_space(&b->in));
+
+    if (n < 0)
+        return errno == EINTR || errno == EAGAIN ? 0 : -1;
+
+    b->in.end += n;
+    b->eof = !n;
+
+    return b->cfg->kv ? bulk_kv_input(b) : bulk_command_input(b);
+}
+
+/*
+ * Queues a `RESERVE` for `count` keys.
+ */
+static int bulk_reserve(struct bulk *b, long count)
+{
+    char num[24];
+    const char *argv[] = { "RESERVE", num };
+    size_t lens[] = { 7, sprintf(num, "%ld", count) };
+
+    return memdb_command(&b->conn, 2, argv, lens, bulk_reserved, b);
+}
+
+static void bulk_report(const struct bulk *b, long reserved,
+                        uint64_t elapsed_ns, FILE *out)
+{
+    double seconds = elapsed_ns / 1e9;
+
+    if (reserved > 0)
+        fprintf(out, "Reserved room for %ld keys\n", reserved);
+    if (b->cfg->kv)
+        fprintf(out, "%" PRIu64 " keys in %" PRIu64 " MSETs\n", b->keys,
+                b->sent);
+
+    fprintf(out,
+            "%" PRIu64 " commands in %.2f s, %.0f commands/s, %" PRIu64
+            " replies, %" PRIu64 " errors\n",
+            b->sent, seconds, b->sent / seconds, b->answered, b->errors);
+}
+
+int bulk_run(const struct bulk_config *cfg, FILE *out, uint64_t *errors)
+{
+    struct bulk b = { .cfg = cfg };
+    long reserve = cfg->reserve;
+    int ret = -1;
+
+    if (reserve < 0)
+        reserve = cfg->kv ? bulk_count_lines(cfg->fd) : 0;
+
+    memdb_init(&b.conn, MEMDB_RESP);
+    buffer_init(&b.in);
+    buffer_init(&b.batch);
+    buffer_init(&b.command);
+    resp_parser_init(&b.parser);
+
+    uint64_t start = monotonic_ns();
+
+    if (memdb_connect(&b.conn, cfg->host, cfg->port) ||
+        (reserve > 0 && bulk_reserve(&b, reserve)))
+        goto out;
+
+    while (!b.eof || memdb_pending(&b.conn)) {
+        struct pollfd fds[] = {
+            {
+                .fd = !b.eof && memdb_unsent(&b.conn) < BULK_MAX_PENDING
+                          ? cfg->fd
+                          : -1,
+                .events = POLLIN,
+            },
+            {
+                .fd = memdb_fd(&b.conn),
+                .events = memdb_events(&b.conn),
+            },
+        };
+
+        if (poll(fds, ARRAY_SIZE(fds), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            goto out;
+        }
+
+        if (fds[0].revents && bulk_read(&b))
+            goto out;
+
+        if (fds[1].revents && memdb_process(&b.conn, fds[1].revents))
+            goto out;
+    }
+
+    bulk_report(&b, reserve, max(monotonic_ns() - start, (uint64_t)1), out);
+    *errors = b.errors;
+    ret = 0;
+
+out:;
+    int err = errno;
+
+    memdb_destroy(&b.conn);
+    buffer_destroy(&b.in);
+    buffer_destroy(&b.batch);
+    buffer_destroy(&b.command);
+    resp_parser_destroy(&b.parser);
+
+    errno = err;
+    return ret;
+}
@@ -0,0 +1,53 @@
+#ifndef MEMDB_BULK_H_
+#define MEMDB_BULK_H_
+
+#include <stdio.h>
+#include "common.h"
+
+/*
+ * Bulk loading behind `mem-db-cli --pipe`.
+ *
+ * Commands read from the input, as RESP or inline commands the way the
+ * server takes them, are forwarded unchanged. With `kv` the input is instead
+ * lines of a key, a space or tab, and the value up to the end of the line,
+ * which are packed into `MSET`s of up to `BULK_BATCH_KEYS` keys. Input is
+ * sent as fast as the server takes it, with replies read as they arrive
+ * rather than waited for, so the link stays full however far away the
+ * server is.
+ *
+ * Given a number of keys to `reserve`, the server is first asked to size its
+ * table for them, so it does not rehash over and over as the load arrives.
+ */
+
+#define BULK_BATCH_KEYS 128
+#define BULK_BATCH_SIZE (64 * 1024)
+#define BULK_READ_SIZE (64 * 1024)
+
+/*
+ * Output buffered for the server past which input stops being read, and the
+ * number of error replies printed.
+ */
+#define BULK_MAX_PENDING (1 << 20)
+#define BULK_MAX_ERRORS 10
+
+struct bulk_config {
+    const char *host;
+    const char *port;
+    int fd;
+    bool kv;
+
+    /*
+     * Keys to reserve room for, none if zero, or if negative, as many as
+     * `fd` has lines in `kv` mode, when it is a regular file.
+     */
+    long reserve;
+};
+
+/*
+ * Loads the input, printing error replies to `stderr` and a summary to
+ * `out`. Returns non-zero on failure, setting `errno`, malformed input
+ * included, but not on error replies, which are counted in `*errors`.
+ */
+int bulk_run(const struct bulk_config *cfg, FILE *out, uint64_t *errors);
+
+#endif
@@ -7,33 +7,169 @@
 #include <unistd.h>
 #include <pthread.h>
 
+#include "bench.h"
+#include "bulk.h"
 #include "malloc.h"
+#include "memdb.h"
 #include "common.h"
 
 const char version[] = "1.0.0";
 const char usage[] =
-    "Usage: mem-db-cli [options]\n"
+    "Usage: mem-db-cli [options] [command [arguments...]]\n"
+    "       mem-db-cli bench [options]\n"
+    "\n"
+    "Runs the command and prints the reply.\n"
     "\n"
     " --host <hostname>         Server hostname. (Default: 127.0.0.1)\n"
     " --port <port>             Server port. (Default: 11111).\n"
     " --help                    Display this help message.\n"
-    " --version                 Display versioning information.";
+    " --version                 Display versioning information.\n"
+    " --pipe                    Send the commands read from standard input,\n"
+    "                           RESP or inline, pipelined.\n"
+    " --kv                      With --pipe, read lines of a key, a space\n"
+    "                           and a value instead, and set them.\n"
+    " --reserve <count>         With --pipe, have the server make room for\n"
+    "                           this many keys first. (Default: the number\n"
+    "                           of lines of a file read with --kv)\n"
+    "\n"
+    "Benchmark options, after 'bench':\n"
+    " --protocol <binary|resp>  Protocol to speak. (Default: binary)\n"
+    " --threads <count>         Client threads. (Default: 4)\n"
+    " --connections <count>     Connections, across threads. (Default: 50)\n"
+    " --pipeline <depth>        Requests in flight per connection.\n"
+    "                           (Default: 1)\n"
+    " --requests <count>        Stop after this many requests.\n"
+    " --duration <seconds>      Otherwise stop after this long. (Default: 10)\n"
+    " --mix <get:set:mget>      Relative weights of the operations.\n"
+    "                           (Default: 90:10:0)\n"
+    " --mget-keys <count>       Keys per MGET. (Default: 10)\n"
+    " --value-size <bytes>      Size of values set. (Default: 100)\n"
+    " --keys <count>            Keyspace, key:0 onwards. (Default: 100000)\n"
+    " --zipf <theta>            Zipfian skew in (0, 1), uniform if not set.\n"
+    " --prefill                 Set every key before the run.\n"
+    " --seed <seed>             Seed of the key generator. (Default: 1)";
 
 struct cli_cfg {
     char *hostname;
     uint16_t port;
+    bool bench;
+    struct bench_config bench_cfg;
+    bool pipe;
+    struct bulk_config bulk_cfg;
+    char **command;
+    size_t command_argc;
 };
 
+/*
+ * Parses the argument of option `opt` as a number of at least `min`.
+ */
+static long getlong(const char *opt, const char *arg, long min)
+{
+    char *end;
+    long n = strtol(arg, &end, 10);
+
+    if (!*arg || *end || n < min)
+        fatal("Invalid argument for option '%s': '%s'\n", opt, arg);
+
+    return n;
+}
+
+static double getdouble(const char *opt, const char *arg, double min,
+                        double max)
+{
+    char *end;
+    double n = strtod(arg, &end);
+
+    if (!*arg || *end || !(n > min && n < max))
+        fatal("Invalid argument for option '%s': '%s'\n", opt, arg);
+
+    return n;
+}
+
+/*
+ * Parses a benchmark option at `argv[*i]`, advancing `*i` past its argument.
+ * Returns false if it is not one.
+ */
+static bool getbenchopt(struct bench_config *cfg, int argc, char **argv,
+                        int *i)
+{
+    const char *opt = argv[*i];
+    const char *arg = *i + 1 < argc ? argv[*i + 1] : NULL;
+
+    if (!strcmp(opt, "--prefill")) {
+        cfg->prefill = true;
+        return true;
+    }
+
+    if (strcmp(opt, "--protocol") && strcmp(opt, "--threads") &&
+        strcmp(opt, "--connections") && strcmp(opt, "--pipeline") &&
+        strcmp(opt, "--requests") && strcmp(opt, "--duration") &&
+        strcmp(opt, "--mix") && strcmp(opt, "--mget-keys") &&
+        strcmp(opt, "--value-size") && strcmp(opt, "--keys") &&
+        strcmp(opt, "--zipf") && strcmp(opt, "--seed"))
+        return false;
+
+    if (!arg)
+        fatal("Expected argument for option '%s'\n", opt);
+    ++*i;
+
+    if (!strcmp(opt, "--protocol")) {
+        if (strcmp(arg, "binary") && strcmp(arg, "resp"))
+            fatal("Invalid argument for option '%s': '%s'\n", opt, arg);
+        cfg->resp = !strcmp(arg, "resp");
+    } else if (!strcmp(opt, "--threads")) {
+        cfg->threads = getlong(opt, arg, 1);
+    } else if (!strcmp(opt, "--connections")) {
+        cfg->connections = getlong(opt, arg, 1);
+    } else if (!strcmp(opt, "--pipeline")) {
+        cfg->pipeline = getlong(opt, arg, 1);
+    } else if (!strcmp(opt, "--requests")) {
+        cfg->requests = getlong(opt, arg, 1);
+    } else if (!strcmp(opt, "--duration")) {
+        cfg->duration = getdouble(opt, arg, 0, 1e6);
+    } else if (!strcmp(opt, "--mix")) {
+        int n = -1;
+
+        if (sscanf(arg, "%ld:%ld:%ld%n", &cfg->mix[BENCH_GET],
+                   &cfg->mix[BENCH_SET], &cfg->mix[BENCH_MGET], &n) != 3 ||
+            arg[n] || cfg->mix[BENCH_GET] < 0 || cfg->mix[BENCH_SET] < 0 ||
+            cfg->mix[BENCH_MGET] < 0 ||
+            !(cfg->mix[BENCH_GET] + cfg->mix[BENCH_SET] +
+              cfg->mix[BENCH_MGET]))
+            fatal("Invalid argument for option '%s': '%s'\n", opt, arg);
+    } else if (!strcmp(opt, "--mget-keys")) {
+        cfg->mget_keys = getlong(opt, arg, 1);
+    } else if (!strcmp(opt, "--value-size")) {
+        cfg->value_size = getlong(opt, arg, 0);
+    } else if (!strcmp(opt, "--keys")) {
+        cfg->keys = getlong(opt, arg, 1);
+    } else if (!strcmp(opt, "--zipf")) {
+        cfg->zipf = getdouble(opt, arg, 0, 1);
+    } else {
+        cfg->seed = getlong(opt, arg, 0);
+    }
+
+    return true;
+}
+
 struct cli_cfg *getcfg(int argc, char **argv)
 {
     struct cli_cfg *cfg = xzalloc(sizeof(*cfg));
 
+    bench_config_init(&cfg->bench_cfg);
+    cfg->bulk_cfg.fd = STDIN_FILENO;
+    cfg->bulk_cfg.reserve = -1;
+
     int i;
     for (i = 1; i < argc; i++) {
         bool last = i + 1 == argc;
         const char *arg = argv[i];
 
-        if (!strcmp(arg, "--host")) {
+        if (i == 1 && !strcmp(arg, "bench")) {
+            cfg->bench = true;
+        } else if (cfg->bench && getbenchopt(&cfg->bench_cfg, argc, argv, &i)) {
+            continue;
+        } else if (!strcmp(arg, "--host")) {
             if (last)
                 goto err_optarg;
             cfg->hostname = xstrdup(argv[++i]);
@@ -41,6 +177,14 @@ struct cli_cfg *getcfg(int argc, char **argv)
             if (last)
                 goto err_optarg;
             cfg->port = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--pipe")) {
+            cfg->pipe = true;
+        } else if (!strcmp(arg, "--kv")) {
+            cfg->bulk_cfg.kv = true;
+        } else if (!strcmp(arg, "--reserve")) {
+            if (last)
+                goto err_optarg;
+            cfg->bulk_cfg.reserve = getlong(arg, argv[++i], 0);
         } else if (!strcmp(arg, "--version")) {
             printf("%s\n", version);
             exit(0);
@@ -49,8 +193,12 @@ struct cli_cfg *getcfg(int argc, char **argv)
             exit(0);
         } else if (argv[i][0] == '-') {
             fatal("Unknown option: '%s'\n%s\n", argv[i], usage);
-        } else {
+        } else if (cfg->bench || cfg->pipe) {
             fatal("Unexpected argument: '%s'\n%s\n", argv[i], usage);
+        } else {
+            cfg->command = &argv[i];
+            cfg->command_argc = argc - i;
+            break;
         }
     }
 
@@ -65,6 +213,94 @@ err_optarg:
     fatal("Expected argument for option '%s'\n", argv[i]);
 }
 
+/*
+ * Prints the RESP reply at the front of `buf`, an array's elements a line
+ * each. Returns its size, and sets `*error` if it or an element is an error.
+ */
+static size_t print_reply(const char *buf, bool *error)
+{
+    const char *line = buf + 1;
+    size_t line_len = strstr(line, "\r\n") - line;
+    size_t size = line_len + 3;
+    long n;
+
+    switch (buf[0]) {
+    case '+':
+        printf("%.*s\n", (int)line_len, line);
+        return size;
+    case '-':
+        *error = true;
+        printf("(error) %.*s\n", (int)line_len, line);
+        return size;
+    case ':':
+        printf("(integer) %.*s\n", (int)line_len, line);
+        return size;
+    case '$':
+        if ((n = atol(line)) < 0) {
+            printf("(nil)\n");
+            return size;
+        }
+
+        fwrite(buf + size, 1, n, stdout);
+        printf("\n");
+        return size + n + 2;
+    default:
+        if ((n = atol(line)) <= 0)
+            printf(n ? "(nil)\n" : "(empty array)\n");
+
+        for (long i = 0; i < n; i++)
+            size += print_reply(buf + size, error);
+
+        return size;
+    }
+}
+
+/*
+ * Takes the reply to the command, which RESP terminates, so it can be walked
+ * as a string.
+ */
+static void command_done(struct memdb_conn *conn,
+                         const struct memdb_reply *reply, void *arg)
+{
+    bool *error = arg;
+
+    (void)conn;
+
+    if (reply->status == MEMDB_CLOSED)
+        return;
+
+    print_reply(reply->val, error);
+}
+
+/*
+ * Runs the command over RESP. Returns non-zero if it failed or replied with
+ * an error.
+ */
+static int run_command(struct cli_cfg *cfg, const char *port)
+{
+    struct memdb_conn conn;
+    size_t *lens = xmalloc(cfg->command_argc * sizeof(*lens));
+    bool error = false;
+
+    for (size_t i = 0; i < cfg->command_argc; i++)
+        lens[i] = strlen(cfg->command[i]);
+
+    memdb_init(&conn, MEMDB_RESP);
+
+    if (memdb_connect(&conn, cfg->hostname, port) ||
+        memdb_command(&conn, cfg->command_argc,
+                      (const char *const *)cfg->command, lens, command_done,
+                      &error) ||
+        memdb_wait(&conn, -1))
+        fatal("Could not connect to %s:%s: %s\n", cfg->hostname, port,
+              strerror(errno));
+
+    memdb_destroy(&conn);
+    free(lens);
+
+    return error;
+}
+
 // int repl_loop(struct cli_cfg *cfg)
 // {
 //     printf("mem-db %s\n", version);
@@ -77,6 +313,34 @@ err_optarg:
 int main(int argc, char **argv)
 {
     struct cli_cfg *cfg = getcfg(argc, argv);
+    char port[8];
+
+    snprintf(port, sizeof(port), "%u", cfg->port);
+
+    if (cfg->bench) {
+        cfg->bench_cfg.host = cfg->hostname;
+        cfg->bench_cfg.port = port;
+
+        if (bench_run(&cfg->bench_cfg, stdout))
+            fatal("Benchmark failed: %s\n", strerror(errno));
+
+        return 0;
+    }
+
+    if (cfg->pipe) {
+        uint64_t errors;
+
+        cfg->bulk_cfg.host = cfg->hostname;
+        cfg->bulk_cfg.port = port;
+
+        if (bulk_run(&cfg->bulk_cfg, stdout, &errors))
+            fatal("Pipe failed: %s\n", strerror(errno));
+
+        return errors ? 1 : 0;
+    }
+
+    if (cfg->command)
+        return run_command(cfg, port);
 
     printf("%d\n", cfg->port);
 }
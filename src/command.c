@@ -0,0 +1,1595 @@
+#include <ctype.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <strings.h>
+
+#include "command.h"
+#include "malloc.h"
+#include "sys.h"
+#include "trace.h"
+
+#define NS_PER_SEC ((uint64_t)1000000000)
+#define NS_PER_MS ((uint64_t)1000000)
+
+static void command_count_binary(struct command_ctx *ctx,
+                                 const struct proto_request *req,
+                                 const struct command_origin *origin,
+                                 uint64_t start, uint16_t status);
+static void command_counters_print(struct command_ctx *ctx, FILE *out);
+static void command_record_binary(struct command_ctx *ctx,
+                                  const struct proto_request *req,
+                                  const struct command_origin *origin,
+                                  uint64_t start);
+
+char *command_stats(struct command_ctx *ctx, size_t *len)
+{
+    char *text;
+    FILE *stream = open_memstream(&text, len);
+
+    if (!stream)
+        return NULL;
+
+    if (ctx->stats) {
+        ctx->stats(stream, ctx->stats_arg);
+        fprintf(stream, "\n");
+    }
+
+    fprintf(stream, "# Keyspace\n");
+    db_stats_print(ctx->db, stream);
+    fprintf(stream, "\n# Memory\n");
+    malloc_stats_print(stream);
+    fprintf(stream, "\n# Threadpool\n");
+    thread_pool_stats_print(ctx->pool, stream);
+
+    if (ctx->repl) {
+        fprintf(stream, "\n# Replication\n");
+        repl_stats_print(ctx->repl, stream);
+    }
+
+    fprintf(stream, "\n# Commandstats\n");
+    command_counters_print(ctx, stream);
+
+    if (fclose(stream)) {
+        free(text);
+        return NULL;
+    }
+
+    return text;
+}
+
+/*
+ * Converts a relative time to live in nanoseconds to an expiry, saturating
+ * rather than wrapping.
+ */
+static uint64_t command_expires(uint64_t ttl_ns)
+{
+    uint64_t expires;
+
+    if (__builtin_add_overflow(monotonic_ns(), ttl_ns, &expires))
+        return UINT64_MAX;
+
+    return expires;
+}
+
+static int command_get_value(const struct db_value *val, void *out)
+{
+    return reply_value(out, val) ? -1 : 1;
+}
+
+/*
+ * The keys of a multi-key request, and a value for each: to store for `MSET`,
+ * or as found for `MGET`. For `MINCR`, the deltas, replaced by the sums, and
+ * an error for each key instead.
+ */
+struct command_batch {
+    struct db_key *keys;
+    struct db_value **vals;
+    int64_t *nums;
+    int *errs;
+    size_t count;
+};
+
+static void command_batch_destroy(struct command_batch *batch)
+{
+    if (batch->vals) {
+        for (size_t i = 0; i < batch->count; i++) {
+            if (batch->vals[i])
+                db_value_put(batch->vals[i]);
+        }
+    }
+
+    free(batch->keys);
+    free(batch->vals);
+    free(batch->nums);
+    free(batch->errs);
+}
+
+/*
+ * Unpacks the items of a multi-key request, creating the values for `MSET`
+ * to expire at `expires`, or reading the deltas for `MINCR`. Returns a
+ * protocol status.
+ */
+static uint16_t command_batch_init(struct command_batch *batch,
+                                   const struct proto_request *req,
+                                   uint64_t expires)
+{
+    struct proto_item item;
+    size_t pos = 0, count = 0;
+    int ret;
+
+    *batch = (struct command_batch){ 0 };
+
+    while ((ret = proto_next_item(req->val, req->val_len, &pos, req->opcode,
+                                  true, &item)) > 0)
+        count++;
+
+    if (ret < 0)
+        return PROTO_EINVAL;
+
+    if (!count)
+        return PROTO_OK;
+
+    bool incr = req->opcode == PROTO_MINCR;
+
+    batch->keys = malloc(count * sizeof(*batch->keys));
+
+    if (incr) {
+        batch->nums = malloc(count * sizeof(*batch->nums));
+        batch->errs = malloc(count * sizeof(*batch->errs));
+    } else {
+        batch->vals = calloc(count, sizeof(*batch->vals));
+    }
+
+    if (!batch->keys || (incr ? !batch->nums || !batch->errs : !batch->vals))
+        return PROTO_ENOMEM;
+
+    pos = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        proto_next_item(req->val, req->val_len, &pos, req->opcode, true,
+                        &item);
+        db_key_init(&batch->keys[i], item.key, item.key_len);
+        batch->count++;
+
+        if (incr) {
+            if (item.val_len != sizeof(int64_t))
+                return PROTO_EINVAL;
+
+            memcpy(&batch->nums[i], item.val, sizeof(int64_t));
+            continue;
+        }
+
+        if (req->opcode != PROTO_MSET)
+            continue;
+
+        if (!(batch->vals[i] = db_value_create(item.val, item.val_len)))
+            return PROTO_ENOMEM;
+
+        batch->vals[i]->expires = expires;
+    }
+
+    return PROTO_OK;
+}
+
+/*
+ * Appends an item per key of an `MGET`, setting `found` to how many exist.
+ * Values that would not fit in one response are refused as invalid.
+ */
+static uint16_t command_mget_reply(const struct command_batch *batch,
+                                   struct reply *reply, uint64_t *found)
+{
+    size_t size = 0;
+
+    for (size_t i = 0; i < batch->count; i++) {
+        const struct db_value *val = batch->vals[i];
+        uint32_t len = val ? val->len : PROTO_ITEM_MISSING;
+
+        size += sizeof(len) + (val ? val->len : 0);
+
+        if (size > PROTO_MAX_VALUE)
+            return PROTO_EINVAL;
+
+        if (buffer_append(&reply->buf, &len, sizeof(len)) ||
+            (val && reply_value(reply, val)))
+            return PROTO_ENOMEM;
+
+        *found += !!val;
+    }
+
+    return PROTO_OK;
+}
+
+/*
+ * Appends an item per key of an `MINCR`, setting `updated` to how many were.
+ */
+static uint16_t command_mincr_reply(const struct command_batch *batch,
+                                    struct reply *reply, uint64_t *updated)
+{
+    for (size_t i = 0; i < batch->count; i++) {
+        struct proto_item item = { 0 };
+
+        switch (batch->errs[i]) {
+        case 0:
+            item.val = (const char *)&batch->nums[i];
+            item.val_len = sizeof(int64_t);
+            ++*updated;
+            break;
+        case EINVAL:
+            break;
+        default:
+            return PROTO_ENOMEM;
+        }
+
+        if (proto_write_item(&reply->buf, &item, false, true))
+            return PROTO_ENOMEM;
+    }
+
+    return PROTO_OK;
+}
+
+static uint16_t command_multi(struct command_ctx *ctx,
+                              const struct proto_request *req,
+                              struct reply *reply, uint64_t *extra)
+{
+    struct command_batch batch;
+    uint64_t expires = 0;
+    size_t deleted;
+
+    if (req->opcode == PROTO_MSET && req->extra)
+        expires = command_expires(min(req->extra, UINT64_MAX / NS_PER_MS) *
+                                  NS_PER_MS);
+
+    uint16_t status = command_batch_init(&batch, req, expires);
+
+    if (status != PROTO_OK)
+        goto out;
+
+    switch (req->opcode) {
+    case PROTO_MGET:
+        if (db_get_many(ctx->db, batch.keys, batch.count, batch.vals))
+            status = PROTO_ENOMEM;
+        else
+            status = command_mget_reply(&batch, reply, extra);
+        break;
+    case PROTO_MSET: {
+        int err = db_set_many(ctx->db, batch.keys, batch.count, batch.vals);
+
+        /*
+         * Handed over either way.
+         */
+        for (size_t i = 0; i < batch.count; i++)
+            batch.vals[i] = NULL;
+
+        if (err)
+            status = PROTO_ENOMEM;
+        break;
+    }
+    case PROTO_MDEL:
+        if (db_del_many(ctx->db, batch.keys, batch.count, &deleted))
+            status = PROTO_ENOMEM;
+        else
+            *extra = deleted;
+        break;
+    case PROTO_MINCR:
+        if (db_incr_many(ctx->db, batch.keys, batch.nums, batch.count,
+                         batch.nums, batch.errs))
+            status = PROTO_ENOMEM;
+        else
+            status = command_mincr_reply(&batch, reply, extra);
+        break;
+    }
+
+out:
+    command_batch_destroy(&batch);
+    return status;
+}
+
+/*
+ * Maps the result of an integer command to a protocol status.
+ */
+static uint16_t command_int_status(int err)
+{
+    switch (err) {
+    case 0:
+        return PROTO_OK;
+    case EINVAL:
+        return PROTO_EINVAL;
+    default:
+        return PROTO_ENOMEM;
+    }
+}
+
+/*
+ * Returns true if the opcode may change the table.
+ */
+static bool command_binary_writes(uint8_t opcode)
+{
+    switch (opcode) {
+    case PROTO_SET:
+    case PROTO_CAS:
+    case PROTO_DEL:
+    case PROTO_INCR:
+    case PROTO_CMPXCHG:
+    case PROTO_MSET:
+    case PROTO_MDEL:
+    case PROTO_MINCR:
+        return true;
+    default:
+        return false;
+    }
+}
+
+int command_binary(struct command_ctx *ctx, const struct proto_request *req,
+                   const struct command_origin *origin, struct reply *reply)
+{
+    uint64_t start = origin ? origin->started : monotonic_ns();
+    struct buffer *out = &reply->buf;
+    ssize_t offset = proto_begin_response(out, req->opcode, req->id);
+    uint16_t status = PROTO_OK;
+    uint64_t extra = 0;
+    struct db_key key;
+
+    if (offset < 0)
+        return 1;
+
+    if (ctx->record)
+        command_record_binary(ctx, req, origin, start);
+
+    db_key_init(&key, req->key, req->key_len);
+
+    if (ctx->readonly && command_binary_writes(req->opcode)) {
+        status = PROTO_READONLY;
+        goto out;
+    }
+
+    switch (req->opcode) {
+    case PROTO_NOOP:
+        break;
+    case PROTO_GET: {
+        int found = db_read(ctx->db, &key, command_get_value, reply, &extra);
+
+        if (found < 0)
+            status = PROTO_ENOMEM;
+        else if (!found)
+            status = PROTO_NOT_FOUND;
+        break;
+    }
+    case PROTO_SET: {
+        uint64_t expires = 0;
+
+        if (req->extra)
+            expires = command_expires(
+                min(req->extra, UINT64_MAX / NS_PER_MS) * NS_PER_MS);
+
+        if (db_set(ctx->db, &key, req->val, req->val_len, expires))
+            status = PROTO_ENOMEM;
+        break;
+    }
+    case PROTO_CAS: {
+        int err = db_cas(ctx->db, &key, req->val, req->val_len, req->extra,
+                         &extra);
+
+        if (err)
+            status = err == ESTALE ? PROTO_CONFLICT : PROTO_ENOMEM;
+        break;
+    }
+    case PROTO_DEL:
+        if (!db_del(ctx->db, &key))
+            status = PROTO_NOT_FOUND;
+        break;
+    case PROTO_INCR: {
+        int64_t result = 0;
+
+        status = command_int_status(
+            db_incr(ctx->db, &key, (int64_t)req->extra, &result));
+        extra = result;
+        break;
+    }
+    case PROTO_CMPXCHG: {
+        int64_t desired, current;
+
+        if (req->val_len != sizeof(desired)) {
+            status = PROTO_EINVAL;
+            break;
+        }
+
+        memcpy(&desired, req->val, sizeof(desired));
+        status = command_int_status(db_cmpxchg(
+            ctx->db, &key, (int64_t)req->extra, desired, &current));
+        extra = current;
+        break;
+    }
+    case PROTO_MGET:
+    case PROTO_MSET:
+    case PROTO_MDEL:
+    case PROTO_MINCR:
+        status = command_multi(ctx, req, reply, &extra);
+        break;
+    case PROTO_STATS: {
+        size_t len;
+        char *text = command_stats(ctx, &len);
+
+        if (!text || buffer_append(out, text, len))
+            status = PROTO_ENOMEM;
+
+        free(text);
+        break;
+    }
+    default:
+        status = PROTO_EUNKNOWN;
+        break;
+    }
+
+out:
+    /*
+     * A failed command leaves no partial value behind its header.
+     */
+    if (status != PROTO_OK) {
+        reply_truncate(reply, offset + PROTO_HEADER_SIZE);
+
+        /*
+         * A conflict comes back with the version the key is at.
+         */
+        if (status != PROTO_CONFLICT)
+            extra = 0;
+    }
+
+    proto_end_response(out, offset, status, extra,
+                       reply_spliced(reply, offset));
+    command_count_binary(ctx, req, origin, start, status);
+
+    return 0;
+}
+
+/*
+ * A parsed RESP command, with arguments resolved against its frame. Handlers
+ * append to `reply`, whose `buf` they are also passed as `out` for encoders.
+ */
+struct resp_command {
+    struct command_ctx *ctx;
+    struct reply *reply;
+    const char *buf;
+    const struct resp_arg *args;
+    size_t argc;
+};
+
+static const char *arg_data(const struct resp_command *cmd, size_t i)
+{
+    return cmd->buf + cmd->args[i].offset;
+}
+
+static size_t arg_len(const struct resp_command *cmd, size_t i)
+{
+    return cmd->args[i].len;
+}
+
+static bool arg_is(const struct resp_command *cmd, size_t i, const char *str)
+{
+    size_t len = strlen(str);
+
+    return arg_len(cmd, i) == len && !strncasecmp(arg_data(cmd, i), str, len);
+}
+
+static void arg_key(const struct resp_command *cmd, size_t i,
+                    struct db_key *key)
+{
+    db_key_init(key, arg_data(cmd, i), arg_len(cmd, i));
+}
+
+static bool arg_int(const struct resp_command *cmd, size_t i, int64_t *value)
+{
+    char text[24];
+    char *end;
+    size_t len = arg_len(cmd, i);
+
+    if (!len || len >= sizeof(text))
+        return false;
+
+    memcpy(text, arg_data(cmd, i), len);
+    text[len] = '\0';
+
+    errno = 0;
+    *value = strtoll(text, &end, 10);
+
+    return !errno && end == text + len;
+}
+
+static int resp_integer_error(struct buffer *out)
+{
+    return resp_error(out, "ERR value is not an integer or out of range");
+}
+
+static int resp_get_value(const struct db_value *val, void *reply)
+{
+    struct buffer *out = &((struct reply *)reply)->buf;
+
+    return resp_bulk_header(out, val->len) || reply_value(reply, val) ||
+                   buffer_append(out, "\r\n", 2)
+               ? -1
+               : 1;
+}
+
+/*
+ * Appends the value of argument `i` as a bulk string, or null if missing.
+ */
+static int resp_get_key(const struct resp_command *cmd, size_t i,
+                        struct buffer *out)
+{
+    struct db_key key;
+
+    arg_key(cmd, i, &key);
+
+    int found =
+        db_read(cmd->ctx->db, &key, resp_get_value, cmd->reply, NULL);
+
+    return found < 0 || (!found && resp_null(out));
+}
+
+static int resp_get_versioned(const struct db_value *val, void *reply)
+{
+    return resp_array(&((struct reply *)reply)->buf, 2)
+               ? -1
+               : resp_get_value(val, reply);
+}
+
+/*
+ * `GET key [WITHVERSION]`, the latter replying with the value and its version
+ * for a later `CAS`.
+ */
+static int resp_get(const struct resp_command *cmd, struct buffer *out)
+{
+    struct db_key key;
+    uint64_t version;
+
+    if (cmd->argc == 2)
+        return resp_get_key(cmd, 1, out);
+
+    if (cmd->argc > 3 || !arg_is(cmd, 2, "WITHVERSION"))
+        return resp_error(out, "ERR syntax error");
+
+    arg_key(cmd, 1, &key);
+
+    int found = db_read(cmd->ctx->db, &key, resp_get_versioned, cmd->reply,
+                        &version);
+
+    return found < 0 || (found ? resp_integer(out, version) : resp_null(out));
+}
+
+/*
+ * `CAS key version value` replies with the new version, or null if the key's
+ * version was no longer `version`.
+ */
+static int resp_cas(const struct resp_command *cmd, struct buffer *out)
+{
+    struct db_key key;
+    int64_t expected;
+    uint64_t version;
+
+    if (!arg_int(cmd, 2, &expected) || expected < 0)
+        return resp_integer_error(out);
+
+    arg_key(cmd, 1, &key);
+
+    switch (db_cas(cmd->ctx->db, &key, arg_data(cmd, 3), arg_len(cmd, 3),
+                   expected, &version)) {
+    case 0:
+        return resp_integer(out, version);
+    case ESTALE:
+        return resp_null(out);
+    default:
+        return 1;
+    }
+}
+
+static int resp_set(const struct resp_command *cmd, struct buffer *out)
+{
+    uint64_t expires = 0;
+    struct db_key key;
+
+    for (size_t i = 3; i < cmd->argc; i += 2) {
+        uint64_t unit;
+        int64_t ttl;
+
+        if (arg_is(cmd, i, "EX"))
+            unit = NS_PER_SEC;
+        else if (arg_is(cmd, i, "PX"))
+            unit = NS_PER_MS;
+        else
+            return resp_error(out, "ERR syntax error");
+
+        if (i + 1 == cmd->argc)
+            return resp_error(out, "ERR syntax error");
+
+        if (!arg_int(cmd, i + 1, &ttl) || ttl <= 0)
+            return resp_error(out, "ERR invalid expire time in 'set' command");
+
+        expires = command_expires(min((uint64_t)ttl, UINT64_MAX / unit) *
+                                  unit);
+    }
+
+    arg_key(cmd, 1, &key);
+
+    return db_set(cmd->ctx->db, &key, arg_data(cmd, 2), arg_len(cmd, 2),
+                  expires) ||
+           resp_simple(out, "OK");
+}
+
+/*
+ * Resolves every `step`th argument from `first` on as a key, returning an
+ * array to be freed by the caller, or `NULL` on allocation failure.
+ */
+static struct db_key *arg_keys(const struct resp_command *cmd, size_t first,
+                               size_t step, size_t *count)
+{
+    struct db_key *keys;
+
+    *count = (cmd->argc - first + step - 1) / step;
+
+    if (!(keys = malloc(*count * sizeof(*keys))))
+        return NULL;
+
+    for (size_t i = 0; i < *count; i++)
+        arg_key(cmd, first + i * step, &keys[i]);
+
+    return keys;
+}
+
+static int resp_del(const struct resp_command *cmd, struct buffer *out)
+{
+    size_t count, deleted;
+    struct db_key *keys = arg_keys(cmd, 1, 1, &count);
+    int err = !keys || db_del_many(cmd->ctx->db, keys, count, &deleted);
+
+    free(keys);
+    return err || resp_integer(out, deleted);
+}
+
+static int resp_mget(const struct resp_command *cmd, struct buffer *out)
+{
+    size_t count = cmd->argc - 1;
+    struct db_value **vals = calloc(count, sizeof(*vals));
+    struct db_key *keys = arg_keys(cmd, 1, 1, &count);
+    int err = !keys || !vals || db_get_many(cmd->ctx->db, keys, count, vals) ||
+              resp_array(out, count);
+
+    for (size_t i = 0; vals && i < count; i++) {
+        if (!vals[i]) {
+            err = err || resp_null(out);
+            continue;
+        }
+
+        err = err || resp_get_value(vals[i], cmd->reply) < 0;
+        db_value_put(vals[i]);
+    }
+
+    free(keys);
+    free(vals);
+    return err;
+}
+
+static int resp_mset(const struct resp_command *cmd, struct buffer *out)
+{
+    if (cmd->argc < 3 || cmd->argc % 2 == 0)
+        return resp_error(out,
+                          "ERR wrong number of arguments for 'mset' command");
+
+    size_t count;
+    struct db_key *keys = arg_keys(cmd, 1, 2, &count);
+    struct db_value **vals = calloc(count, sizeof(*vals));
+    int err = !keys || !vals;
+
+    for (size_t i = 0; !err && i < count; i++) {
+        vals[i] = db_value_create(arg_data(cmd, 2 + 2 * i),
+                                  arg_len(cmd, 2 + 2 * i));
+        err = !vals[i];
+    }
+
+    if (!err) {
+        err = db_set_many(cmd->ctx->db, keys, count, vals);
+    } else if (vals) {
+        for (size_t i = 0; i < count && vals[i]; i++)
+            db_value_put(vals[i]);
+    }
+
+    free(keys);
+    free(vals);
+    return err || resp_simple(out, "OK");
+}
+
+/*
+ * Replies to an integer command with `num`, or the error it failed with.
+ */
+static int resp_int_result(struct buffer *out, int err, int64_t num)
+{
+    switch (err) {
+    case 0:
+        return resp_integer(out, num);
+    case EINVAL:
+        return resp_integer_error(out);
+    default:
+        return 1;
+    }
+}
+
+/*
+ * `INCR`, `DECR`, `INCRBY` and `DECRBY`, told apart by the first letter of
+ * the name and the number of arguments.
+ */
+static int resp_incr(const struct resp_command *cmd, struct buffer *out)
+{
+    bool decr = toupper((unsigned char)arg_data(cmd, 0)[0]) == 'D';
+    struct db_key key;
+    int64_t delta = 1, result;
+
+    if (cmd->argc == 3 && !arg_int(cmd, 2, &delta))
+        return resp_integer_error(out);
+
+    if (decr) {
+        if (delta == INT64_MIN)
+            return resp_integer_error(out);
+
+        delta = -delta;
+    }
+
+    arg_key(cmd, 1, &key);
+
+    int err = db_incr(cmd->ctx->db, &key, delta, &result);
+
+    return resp_int_result(out, err, result);
+}
+
+/*
+ * `CMPXCHG key expected desired` replies with what the key held before, so
+ * the swap happened if that is `expected`.
+ */
+static int resp_cmpxchg(const struct resp_command *cmd, struct buffer *out)
+{
+    struct db_key key;
+    int64_t expected, desired, current;
+
+    if (!arg_int(cmd, 2, &expected) || !arg_int(cmd, 3, &desired))
+        return resp_integer_error(out);
+
+    arg_key(cmd, 1, &key);
+
+    int err = db_cmpxchg(cmd->ctx->db, &key, expected, desired, &current);
+
+    return resp_int_result(out, err, current);
+}
+
+/*
+ * `MINCRBY key delta [key delta ...]` replies with an array of the sums, or
+ * errors for keys that could not be updated.
+ */
+static int resp_mincrby(const struct resp_command *cmd, struct buffer *out)
+{
+    if (cmd->argc % 2 == 0)
+        return resp_error(
+            out, "ERR wrong number of arguments for 'mincrby' command");
+
+    size_t count = (cmd->argc - 1) / 2;
+    int64_t *nums = malloc(count * sizeof(*nums));
+    int *errs = malloc(count * sizeof(*errs));
+    struct db_key *keys = arg_keys(cmd, 1, 2, &count);
+    int err = !keys || !nums || !errs;
+    bool valid = true;
+
+    for (size_t i = 0; !err && valid && i < count; i++)
+        valid = arg_int(cmd, 2 + 2 * i, &nums[i]);
+
+    if (!err && !valid) {
+        err = resp_integer_error(out);
+    } else {
+        err = err ||
+              db_incr_many(cmd->ctx->db, keys, nums, count, nums, errs) ||
+              resp_array(out, count);
+
+        for (size_t i = 0; !err && i < count; i++)
+            err = resp_int_result(out, errs[i], nums[i]);
+    }
+
+    free(keys);
+    free(nums);
+    free(errs);
+    return err;
+}
+
+static int resp_expire(const struct resp_command *cmd, struct buffer *out)
+{
+    struct db_key key;
+    int64_t seconds;
+
+    if (!arg_int(cmd, 2, &seconds))
+        return resp_integer_error(out);
+
+    arg_key(cmd, 1, &key);
+
+    /*
+     * As in Redis, a time in the past deletes the key.
+     */
+    if (seconds <= 0)
+        return resp_integer(out, db_del(cmd->ctx->db, &key));
+
+    uint64_t expires =
+        command_expires(min((uint64_t)seconds, UINT64_MAX / NS_PER_SEC) *
+                        NS_PER_SEC);
+
+    return resp_integer(out, db_expire(cmd->ctx->db, &key, expires));
+}
+
+struct resp_scan {
+    struct buffer keys;
+    size_t count;
+    const char *pattern;
+};
+
+static int resp_scan_key(const struct db_key *key, void *arg)
+{
+    struct resp_scan *scan = arg;
+
+    /*
+     * Stored keys are NUL-terminated, though keys holding NUL bytes match
+     * only up to the first.
+     */
+    if (scan->pattern && fnmatch(scan->pattern, key->data, 0))
+        return 0;
+
+    scan->count++;
+    return resp_bulk(&scan->keys, key->data, key->len);
+}
+
+static int resp_scan(const struct resp_command *cmd, struct buffer *out)
+{
+    struct resp_scan scan = { .count = 0, .pattern = NULL };
+    char *pattern = NULL;
+    int64_t count = 10;
+    uint64_t cursor;
+    char *end;
+    char text[24];
+    size_t len = arg_len(cmd, 1);
+
+    if (!len || len >= sizeof(text))
+        return resp_error(out, "ERR invalid cursor");
+
+    memcpy(text, arg_data(cmd, 1), len);
+    text[len] = '\0';
+
+    errno = 0;
+    cursor = strtoull(text, &end, 10);
+
+    if (errno || end != text + len)
+        return resp_error(out, "ERR invalid cursor");
+
+    for (size_t i = 2; i < cmd->argc; i += 2) {
+        bool valid = i + 1 < cmd->argc;
+
+        if (valid && arg_is(cmd, i, "COUNT")) {
+            valid = arg_int(cmd, i + 1, &count) && count > 0;
+        } else if (valid && arg_is(cmd, i, "MATCH")) {
+            free(pattern);
+            if (!(pattern = strndup(arg_data(cmd, i + 1), arg_len(cmd, i + 1))))
+                return 1;
+        } else {
+            valid = false;
+        }
+
+        if (!valid) {
+            free(pattern);
+            return resp_error(out, "ERR syntax error");
+        }
+    }
+
+    buffer_init(&scan.keys);
+    scan.pattern = pattern;
+
+    cursor = db_scan(cmd->ctx->db, cursor, count, resp_scan_key, &scan);
+
+    len = sprintf(text, "%" PRIu64, cursor);
+
+    int err = cursor == UINT64_MAX || resp_array(out, 2) ||
+              resp_bulk(out, text, len) || resp_array(out, scan.count) ||
+              buffer_append(out, buffer_head(&scan.keys),
+                            buffer_len(&scan.keys));
+
+    buffer_destroy(&scan.keys);
+    free(pattern);
+
+    return err;
+}
+
+/*
+ * Replies with the statistics text as a bulk string, with RESP line endings.
+ */
+static int resp_info(const struct resp_command *cmd, struct buffer *out)
+{
+    size_t len, lines = 0;
+    char *text = command_stats(cmd->ctx, &len);
+
+    if (!text)
+        return 1;
+
+    for (size_t i = 0; i < len; i++)
+        lines += text[i] == '\n';
+
+    int err = buffer_reserve(out, 32 + len + lines + 2) ||
+              resp_bulk_header(out, len + lines);
+
+    for (size_t i = 0; !err && i < len; i++) {
+        if (text[i] == '\n')
+            out->data[out->end++] = '\r';
+        out->data[out->end++] = text[i];
+    }
+
+    free(text);
+
+    return err || buffer_append(out, "\r\n", 2);
+}
+
+static int resp_ping(const struct resp_command *cmd, struct buffer *out)
+{
+    if (cmd->argc > 1)
+        return resp_bulk(out, arg_data(cmd, 1), arg_len(cmd, 1));
+
+    return resp_simple(out, "PONG");
+}
+
+static int resp_dbsize(const struct resp_command *cmd, struct buffer *out)
+{
+    return resp_integer(out, db_size(cmd->ctx->db));
+}
+
+/*
+ * `RESERVE count` sizes the table for that many more keys ahead of a bulk
+ * load.
+ */
+static int resp_reserve(const struct resp_command *cmd, struct buffer *out)
+{
+    int64_t count;
+
+    if (!arg_int(cmd, 1, &count) || count < 0)
+        return resp_integer_error(out);
+
+    if (db_reserve(cmd->ctx->db, count))
+        return resp_error(out, "ERR out of memory");
+
+    return resp_simple(out, "OK");
+}
+
+static int resp_slowlog_entry(struct buffer *out,
+                              const struct slowlog_entry *entry)
+{
+    return resp_array(out, 10) || resp_integer(out, entry->id) ||
+           resp_integer(out, entry->time) ||
+           resp_integer(out, (entry->wait_ns + entry->exec_ns) / 1000) ||
+           resp_integer(out, entry->wait_ns / 1000) ||
+           resp_integer(out, entry->exec_ns / 1000) ||
+           resp_bulk(out, entry->name, strlen(entry->name)) ||
+           resp_bulk(out, entry->key,
+                     min(entry->key_len, sizeof(entry->key))) ||
+           resp_integer(out, entry->size) || resp_integer(out, entry->conn) ||
+           resp_integer(out, entry->thread);
+}
+
+/*
+ * `SLOWLOG GET [count]` replies with the newest slow requests, 10 unless
+ * told, each as its id, unix time, microseconds in all, waiting and
+ * executing, command, key, request size, connection and thread. `SLOWLOG LEN`
+ * and `SLOWLOG RESET` are as in Redis.
+ */
+static int resp_slowlog(const struct resp_command *cmd, struct buffer *out)
+{
+    struct slowlog *log = cmd->ctx->slowlog;
+    int64_t count = 10;
+
+    if (arg_is(cmd, 1, "LEN") && cmd->argc == 2)
+        return resp_integer(out, log ? slowlog_len(log) : 0);
+
+    if (arg_is(cmd, 1, "RESET") && cmd->argc == 2) {
+        if (log)
+            slowlog_reset(log);
+        return resp_simple(out, "OK");
+    }
+
+    if (!arg_is(cmd, 1, "GET") || cmd->argc > 3)
+        return resp_error(out, "ERR unknown SLOWLOG subcommand or wrong "
+                               "number of arguments");
+
+    if (cmd->argc == 3 && (!arg_int(cmd, 2, &count) || count < 0))
+        return resp_integer_error(out);
+
+    size_t max_len = log ? min((size_t)count, log->capacity) : 0;
+
+    if (!max_len)
+        return resp_array(out, 0);
+
+    struct slowlog_entry *entries = malloc(max_len * sizeof(*entries));
+
+    if (!entries)
+        return 1;
+
+    size_t len = slowlog_get(log, entries, max_len);
+    int err = resp_array(out, len);
+
+    for (size_t i = 0; !err && i < len; i++)
+        err = resp_slowlog_entry(out, &entries[i]);
+
+    free(entries);
+
+    return err;
+}
+
+/*
+ * `TRACE [count]` replies with the last events traced, 1000 unless told, as
+ * text.
+ */
+static int resp_trace(const struct resp_command *cmd, struct buffer *out)
+{
+    int64_t count = 1000;
+    size_t len;
+    char *text;
+
+    if (cmd->argc > 2)
+        return resp_error(out,
+                          "ERR wrong number of arguments for 'TRACE' command");
+
+    if (cmd->argc == 2 && (!arg_int(cmd, 1, &count) || count < 0))
+        return resp_integer_error(out);
+
+    FILE *stream = open_memstream(&text, &len);
+
+    if (!stream)
+        return 1;
+
+    int err = trace_dump(stream, count);
+
+    if (fclose(stream)) {
+        free(text);
+        return 1;
+    }
+
+    err = err || resp_bulk(out, text, len);
+    free(text);
+
+    return err;
+}
+
+/*
+ * `COMMAND` and `CONFIG` are sent by clients and benchmarks on connecting,
+ * and treated as reporting nothing.
+ */
+static int resp_empty(const struct resp_command *cmd, struct buffer *out)
+{
+    (void)cmd;
+
+    return resp_array(out, 0);
+}
+
+/*
+ * Arity counts the command name, and is negative for a minimum. Commands with
+ * a `key_argc` touch only the key in argument 1 when given that many
+ * arguments, or any number if zero; the rest may touch several keys, or none.
+ * Commands that `write` are refused on replicas. Recordings take commands as
+ * the `record` operation, on the keys they touch.
+ */
+static const struct {
+    const char *name;
+    int arity;
+    int key_argc;
+    bool write;
+    enum record_op record;
+    int (*fn)(const struct resp_command *cmd, struct buffer *out);
+} resp_commands[] = {
+    { "GET", -2, 0, false, RECORD_GET, resp_get },
+    { "SET", -3, 0, true, RECORD_SET, resp_set },
+    { "DEL", -2, 2, true, RECORD_DEL, resp_del },
+    { "MGET", -2, 2, false, RECORD_GET, resp_mget },
+    { "MSET", -3, 3, true, RECORD_SET, resp_mset },
+    { "INCR", 2, 0, true, RECORD_INCR, resp_incr },
+    { "DECR", 2, 0, true, RECORD_INCR, resp_incr },
+    { "INCRBY", 3, 0, true, RECORD_INCR, resp_incr },
+    { "DECRBY", 3, 0, true, RECORD_INCR, resp_incr },
+    { "CMPXCHG", 4, 0, true, RECORD_CMPXCHG, resp_cmpxchg },
+    { "EXPIRE", 3, 0, true, RECORD_OTHER, resp_expire },
+    { "MINCRBY", -3, 3, true, RECORD_INCR, resp_mincrby },
+    { "SCAN", -2, -1, false, RECORD_OTHER, resp_scan },
+    { "INFO", -1, -1, false, RECORD_OTHER, resp_info },
+    { "PING", -1, -1, false, RECORD_OTHER, resp_ping },
+    { "COMMAND", -1, -1, false, RECORD_OTHER, resp_empty },
+    { "DBSIZE", 1, -1, false, RECORD_OTHER, resp_dbsize },
+    { "CONFIG", -1, -1, false, RECORD_OTHER, resp_empty },
+    { "CAS", 4, 0, true, RECORD_CAS, resp_cas },
+    { "RESERVE", 2, -1, false, RECORD_OTHER, resp_reserve },
+    { "SLOWLOG", -2, -1, false, RECORD_OTHER, resp_slowlog },
+    { "TRACE", -1, -1, false, RECORD_OTHER, resp_trace },
+};
+
+bool command_binary_key(const struct proto_request *req, struct db_key *key)
+{
+    switch (req->opcode) {
+    case PROTO_GET:
+    case PROTO_SET:
+    case PROTO_DEL:
+    case PROTO_INCR:
+    case PROTO_CMPXCHG:
+    case PROTO_CAS:
+        db_key_init(key, req->key, req->key_len);
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool command_resp_key(const char *buf, const struct resp_parser *parser,
+                      struct db_key *key)
+{
+    struct resp_command cmd = { .buf = buf, .args = parser->args,
+                                .argc = parser->argn };
+
+    if (cmd.argc < 2)
+        return false;
+
+    for (size_t i = 0; i < ARRAY_SIZE(resp_commands); i++) {
+        int key_argc = resp_commands[i].key_argc;
+
+        if (!arg_is(&cmd, 0, resp_commands[i].name))
+            continue;
+
+        if (key_argc < 0 || (key_argc && cmd.argc != (size_t)key_argc))
+            return false;
+
+        arg_key(&cmd, 1, key);
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Starts recording a request on `keys` keys, up to as many as fit in one
+ * buffer, returning its entries for the keys to be filled in. A request on
+ * none is recorded as `RECORD_OTHER`.
+ */
+static struct record_entry *command_record_begin(
+    struct command_ctx *ctx, const struct command_origin *origin,
+    uint64_t start, enum record_op op, size_t *keys, uint8_t flags)
+{
+    uint64_t queued = origin ? min(origin->queued, start) : start;
+
+    *keys = min(*keys, (size_t)RECORD_BUFFER_ENTRIES);
+    if (!*keys)
+        op = RECORD_OTHER;
+
+    size_t count = max(*keys, (size_t)1);
+    struct record_entry *entries = record_reserve(ctx->record, count);
+
+    if (!entries)
+        return NULL;
+
+    for (size_t i = 0; i < count; i++) {
+        entries[i] = (struct record_entry){
+            .ns = record_ns(ctx->record, queued),
+            .conn = origin ? origin->conn : 0,
+            .op = op,
+            .flags = flags | (i ? RECORD_MORE : 0),
+        };
+    }
+
+    entries[0].keys = *keys;
+
+    return entries;
+}
+
+static void command_record_key(struct record_entry *entry, const char *key,
+                               size_t key_len, size_t value_len)
+{
+    struct db_key k;
+
+    db_key_init(&k, key, key_len);
+    entry->key_hash = k.hash;
+    entry->key_len = min(key_len, (size_t)UINT32_MAX);
+    entry->value_len = min(value_len, (size_t)UINT32_MAX);
+}
+
+static void command_record_binary(struct command_ctx *ctx,
+                                  const struct proto_request *req,
+                                  const struct command_origin *origin,
+                                  uint64_t start)
+{
+    enum record_op op = RECORD_OTHER;
+    bool multi = req->opcode == PROTO_MGET || req->opcode == PROTO_MSET ||
+                 req->opcode == PROTO_MDEL || req->opcode == PROTO_MINCR;
+
+    switch (req->opcode) {
+    case PROTO_GET:
+    case PROTO_MGET:
+        op = RECORD_GET;
+        break;
+    case PROTO_SET:
+    case PROTO_MSET:
+        op = RECORD_SET;
+        break;
+    case PROTO_DEL:
+    case PROTO_MDEL:
+        op = RECORD_DEL;
+        break;
+    case PROTO_INCR:
+    case PROTO_MINCR:
+        op = RECORD_INCR;
+        break;
+    case PROTO_CMPXCHG:
+        op = RECORD_CMPXCHG;
+        break;
+    case PROTO_CAS:
+        op = RECORD_CAS;
+        break;
+    }
+
+    struct proto_item item;
+    size_t keys = op != RECORD_OTHER, pos = 0;
+
+    if (multi) {
+        keys = 0;
+        while (proto_next_item(req->val, req->val_len, &pos, req->opcode, true,
+                               &item) > 0)
+            keys++;
+    }
+
+    struct record_entry *entries =
+        command_record_begin(ctx, origin, start, op, &keys, 0);
+
+    if (!entries)
+        return;
+
+    if (!multi && keys)
+        command_record_key(entries, req->key, req->key_len, req->val_len);
+
+    pos = 0;
+    for (size_t i = 0; multi && i < keys; i++) {
+        proto_next_item(req->val, req->val_len, &pos, req->opcode, true,
+                        &item);
+        command_record_key(&entries[i], item.key, item.key_len, item.val_len);
+    }
+
+    record_commit(ctx->record);
+}
+
+/*
+ * Records the command at `index` in `resp_commands`, or past its end if not
+ * known. Commands with a `key_argc` past one take a key every `key_argc - 1`
+ * arguments; the value set, if any, follows a key, or for `CAS` its version.
+ */
+static void command_record_resp(struct command_ctx *ctx,
+                                const struct resp_command *cmd, size_t index,
+                                const struct command_origin *origin,
+                                uint64_t start)
+{
+    bool known = index < ARRAY_SIZE(resp_commands);
+    enum record_op op = known ? resp_commands[index].record : RECORD_OTHER;
+    int key_argc = known ? resp_commands[index].key_argc : -1;
+    size_t step = key_argc > 1 ? key_argc - 1 : cmd->argc;
+    size_t value = op == RECORD_SET ? 1 : op == RECORD_CAS ? 2 : 0;
+    size_t keys = op == RECORD_OTHER || cmd->argc < 2
+                      ? 0
+                      : (cmd->argc - 2) / step + 1;
+    struct record_entry *entries =
+        command_record_begin(ctx, origin, start, op, &keys, RECORD_RESP);
+
+    if (!entries)
+        return;
+
+    for (size_t i = 0; i < keys; i++) {
+        size_t arg = 1 + i * step;
+
+        command_record_key(&entries[i], arg_data(cmd, arg), arg_len(cmd, arg),
+                           value && arg + value < cmd->argc
+                               ? arg_len(cmd, arg + value)
+                               : 0);
+    }
+
+    record_commit(ctx->record);
+}
+
+/*
+ * Statistics are kept for binary requests by opcode, up to `PROTO_CAS`, and
+ * for RESP commands by their index in `resp_commands`, after which come those
+ * not known.
+ */
+#define COMMAND_BINARY_COUNT (PROTO_CAS + 1)
+#define COMMAND_RESP_COUNT (sizeof(resp_commands) / sizeof(*resp_commands) + 1)
+
+static const char *const command_binary_names[COMMAND_BINARY_COUNT] = {
+    [PROTO_NOOP] = "noop",     [PROTO_GET] = "get",
+    [PROTO_SET] = "set",       [PROTO_DEL] = "del",
+    [PROTO_STATS] = "stats",   [PROTO_ATTACH] = "attach",
+    [PROTO_MGET] = "mget",     [PROTO_MSET] = "mset",
+    [PROTO_MDEL] = "mdel",     [PROTO_INCR] = "incr",
+    [PROTO_CMPXCHG] = "cmpxchg", [PROTO_MINCR] = "mincr",
+    [PROTO_CAS] = "cas",
+};
+
+/*
+ * Executions of one command by one thread, timed from dispatch to the reply
+ * being queued, and how many were answered with an error.
+ */
+struct command_counters {
+    _Atomic uint64_t errors;
+    struct histogram latency;
+};
+
+struct command_thread {
+    struct command_thread *next;
+    struct command_counters binary[COMMAND_BINARY_COUNT];
+    struct command_counters resp[COMMAND_RESP_COUNT];
+};
+
+static _Atomic uint64_t command_generations;
+
+void command_ctx_init(struct command_ctx *ctx)
+{
+    ctx->generation = atomic_fetch_add(&command_generations, 1) + 1;
+    atomic_init(&ctx->threads, NULL);
+    ctx->stats = NULL;
+    ctx->stats_arg = NULL;
+    ctx->slowlog = NULL;
+    ctx->record = NULL;
+}
+
+void command_ctx_destroy(struct command_ctx *ctx)
+{
+    struct command_thread *thread = atomic_load(&ctx->threads);
+
+    while (thread) {
+        struct command_thread *next = thread->next;
+
+        free(thread);
+        thread = next;
+    }
+
+    atomic_store(&ctx->threads, NULL);
+}
+
+/*
+ * Returns the calling thread's statistics, set up on its first command, or
+ * `NULL` if they could not be allocated. A thread keeps those of the context
+ * it last served, told apart by generation so a context set up where another
+ * was is not mistaken for it.
+ */
+static struct command_thread *command_thread(struct command_ctx *ctx)
+{
+    static _Thread_local struct command_thread *current;
+    static _Thread_local uint64_t current_generation;
+
+    if (current && current_generation == ctx->generation)
+        return current;
+
+    struct command_thread *thread = malloc(sizeof(*thread));
+
+    if (!thread)
+        return NULL;
+
+    for (size_t i = 0; i < COMMAND_BINARY_COUNT; i++) {
+        atomic_init(&thread->binary[i].errors, 0);
+        histogram_init(&thread->binary[i].latency);
+    }
+
+    for (size_t i = 0; i < COMMAND_RESP_COUNT; i++) {
+        atomic_init(&thread->resp[i].errors, 0);
+        histogram_init(&thread->resp[i].latency);
+    }
+
+    thread->next = atomic_load(&ctx->threads);
+    while (!atomic_compare_exchange_weak(&ctx->threads, &thread->next,
+                                         thread))
+        ;
+
+    current = thread;
+    current_generation = ctx->generation;
+
+    return thread;
+}
+
+/*
+ * Traces a request just done, started at `start`, and logs it if it was slow.
+ * `key` is its first argument, if any. Returns the nanoseconds it ran.
+ */
+static uint64_t command_done(struct command_ctx *ctx,
+                             const struct command_origin *origin,
+                             uint64_t start, const char *name,
+                             const char *key, size_t key_len)
+{
+    uint64_t end = monotonic_ns();
+    uint64_t queued = origin ? min(origin->queued, start) : start;
+    uint32_t conn = origin ? origin->conn : 0;
+
+    trace_record_at(end, TRACE_EXECUTE, conn, end - start, name);
+
+    if (!ctx->slowlog || !slowlog_slow(ctx->slowlog, end - queued))
+        return end - start;
+
+    struct slowlog_entry entry = {
+        .wait_ns = start - queued,
+        .exec_ns = end - start,
+        .size = origin ? origin->len : 0,
+        .key_len = key_len,
+        .conn = conn,
+        .thread = trace_thread(),
+    };
+
+    snprintf(entry.name, sizeof(entry.name), "%s", name);
+    if (key_len)
+        memcpy(entry.key, key, min(key_len, sizeof(entry.key)));
+    slowlog_add(ctx->slowlog, &entry);
+
+    return end - start;
+}
+
+static void command_count(struct command_counters *counters, uint64_t elapsed,
+                          bool error)
+{
+    histogram_record(&counters->latency, elapsed);
+
+    if (error)
+        counter_add(&counters->errors, 1);
+}
+
+static void command_count_binary(struct command_ctx *ctx,
+                                 const struct proto_request *req,
+                                 const struct command_origin *origin,
+                                 uint64_t start, uint16_t status)
+{
+    const char *name = req->opcode < COMMAND_BINARY_COUNT
+                           ? command_binary_names[req->opcode]
+                           : NULL;
+    uint64_t elapsed = command_done(ctx, origin, start, name ? name : "unknown",
+                                    req->key, req->key_len);
+    struct command_thread *thread = command_thread(ctx);
+
+    if (thread && name)
+        command_count(&thread->binary[req->opcode], elapsed,
+                      status != PROTO_OK && status != PROTO_NOT_FOUND);
+}
+
+/*
+ * Writes the merged counters of one command, if it ran at all.
+ */
+static void command_counters_merge_print(struct command_ctx *ctx, FILE *out,
+                                         bool binary, size_t index,
+                                         const char *name,
+                                         struct histogram *merged)
+{
+    uint64_t errors = 0;
+
+    histogram_init(merged);
+
+    for (struct command_thread *thread = atomic_load(&ctx->threads); thread;
+         thread = thread->next) {
+        struct command_counters *counters =
+            binary ? &thread->binary[index] : &thread->resp[index];
+
+        errors += counter_get(&counters->errors);
+        histogram_merge(merged, &counters->latency);
+    }
+
+    if (!histogram_count(merged))
+        return;
+
+    fprintf(out, "%s_", binary ? "binstat" : "cmdstat");
+
+    for (const char *c = name; *c; c++)
+        fputc(tolower((unsigned char)*c), out);
+
+    fprintf(out,
+            ":calls=%" PRIu64 ",errors=%" PRIu64 ",mean_ns=%" PRIu64
+            ",p50_ns=%" PRIu64 ",p99_ns=%" PRIu64 ",p999_ns=%" PRIu64
+            ",max_ns=%" PRIu64 "\n",
+            histogram_count(merged), errors, histogram_mean(merged),
+            histogram_percentile(merged, 50), histogram_percentile(merged, 99),
+            histogram_percentile(merged, 99.9), histogram_max(merged));
+}
+
+static void command_counters_print(struct command_ctx *ctx, FILE *out)
+{
+    struct histogram *merged = malloc(sizeof(*merged));
+
+    if (!merged)
+        return;
+
+    for (size_t i = 0; i < COMMAND_RESP_COUNT; i++)
+        command_counters_merge_print(ctx, out, false, i,
+                                     i < ARRAY_SIZE(resp_commands)
+                                         ? resp_commands[i].name
+                                         : "unknown",
+                                     merged);
+
+    for (size_t i = 0; i < COMMAND_BINARY_COUNT; i++)
+        command_counters_merge_print(ctx, out, true, i,
+                                     command_binary_names[i], merged);
+
+    free(merged);
+}
+
+/*
+ * Runs the command at `index` in `resp_commands`, once its arguments are
+ * checked.
+ */
+static int resp_dispatch(struct resp_command *cmd, size_t index)
+{
+    struct buffer *out = &cmd->reply->buf;
+    int arity = resp_commands[index].arity;
+    char msg[128];
+
+    if (arity > 0 ? cmd->argc != (size_t)arity : cmd->argc < (size_t)-arity) {
+        snprintf(msg, sizeof(msg),
+                 "ERR wrong number of arguments for '%s' command",
+                 resp_commands[index].name);
+        return resp_error(out, msg) ? -1 : 0;
+    }
+
+    if (cmd->ctx->readonly && resp_commands[index].write)
+        return resp_error(out, "READONLY You can't write against a read "
+                               "only replica.")
+                   ? -1
+                   : 0;
+
+    return resp_commands[index].fn(cmd, out) ? -1 : 0;
+}
+
+static int resp_unknown(struct resp_command *cmd)
+{
+    char msg[128];
+
+    snprintf(msg, sizeof(msg), "ERR unknown command '%.*s'",
+             (int)min(arg_len(cmd, 0), (size_t)64), arg_data(cmd, 0));
+
+    /*
+     * The name is echoed, so must not be able to end the error line early.
+     */
+    for (char *c = msg; *c; c++) {
+        if (!isprint((unsigned char)*c))
+            *c = ' ';
+    }
+
+    return resp_error(&cmd->reply->buf, msg) ? -1 : 0;
+}
+
+int command_resp(struct command_ctx *ctx, const char *buf,
+                 const struct resp_parser *parser,
+                 const struct command_origin *origin, struct reply *reply)
+{
+    struct resp_command cmd = { .ctx = ctx, .reply = reply, .buf = buf,
+                                .args = parser->args, .argc = parser->argn };
+    struct buffer *out = &reply->buf;
+
+    if (!cmd.argc)
+        return 0;
+
+    if (arg_is(&cmd, 0, "QUIT"))
+        return resp_simple(out, "OK") ? -1 : 1;
+
+    uint64_t start = origin ? origin->started : monotonic_ns();
+    size_t offset = buffer_len(out);
+    size_t i = 0;
+
+    while (i < ARRAY_SIZE(resp_commands) &&
+           !arg_is(&cmd, 0, resp_commands[i].name))
+        i++;
+
+    if (ctx->record)
+        command_record_resp(ctx, &cmd, i, origin, start);
+
+    int ret = i < ARRAY_SIZE(resp_commands) ? resp_dispatch(&cmd, i)
+                                            : resp_unknown(&cmd);
+    uint64_t elapsed = command_done(
+        ctx, origin, start,
+        i < ARRAY_SIZE(resp_commands) ? resp_commands[i].name : "unknown",
+        cmd.argc > 1 ? arg_data(&cmd, 1) : NULL,
+        cmd.argc > 1 ? arg_len(&cmd, 1) : 0);
+    struct command_thread *thread = command_thread(ctx);
+
+    if (thread && !ret)
+        command_count(&thread->resp[i], elapsed,
+                      buffer_len(out) > offset &&
+                          buffer_head(out)[offset] == '-');
+
+    return ret;
+}
@@ -0,0 +1,93 @@
+#ifndef MEMDB_COMMAND_H_
+#define MEMDB_COMMAND_H_
+
+#include "common.h"
+#include "buffer.h"
+#include "db.h"
+#include "protocol.h"
+#include "record.h"
+#include "repl.h"
+#include "reply.h"
+#include "resp.h"
+#include "slowlog.h"
+#include "thread_pool.h"
+
+struct command_thread;
+
+/*
+ * What commands run against, shared by every connection. Writes are refused
+ * if `readonly`, as on a replica. Requests slow enough are logged to
+ * `slowlog`, and every request is recorded to `record`, each if set.
+ *
+ * Each thread executing commands counts and times them in a `command_thread`
+ * of its own, written by it alone and linked into `threads` on its first
+ * command; statistics merge them without locking. `stats`, if set, writes
+ * sections of the server's own into them.
+ */
+struct command_ctx {
+    struct db *db;
+    struct thread_pool *pool;
+    struct repl *repl;
+    bool readonly;
+    struct slowlog *slowlog;
+    struct record *record;
+    uint64_t generation;
+    _Atomic(struct command_thread *) threads;
+    void (*stats)(FILE *out, void *arg);
+    void *stats_arg;
+};
+
+/*
+ * Sets up the statistics of a context whose other fields are left to the
+ * caller.
+ */
+void command_ctx_init(struct command_ctx *ctx);
+void command_ctx_destroy(struct command_ctx *ctx);
+
+/*
+ * Formats statistics, as `INFO` and `STATS` reply with them, as `# Section`
+ * headers followed by `name:value` lines. Returns a string to be freed by the
+ * caller, or `NULL` on allocation failure.
+ */
+char *command_stats(struct command_ctx *ctx, size_t *len);
+
+/*
+ * Where a request came from, for the slowlog and trace: its connection, the
+ * size of the request, when it started waiting to run, and when it was taken
+ * up to run, in `monotonic_ns()` time. Without one, a request is taken to
+ * have not waited at all.
+ */
+struct command_origin {
+    uint32_t conn;
+    size_t len;
+    uint64_t queued;
+    uint64_t started;
+};
+
+/*
+ * Executes a binary protocol request, appending its response to `out`.
+ * Returns non-zero if the response could not be allocated. `origin` may be
+ * `NULL`.
+ */
+int command_binary(struct command_ctx *ctx, const struct proto_request *req,
+                   const struct command_origin *origin, struct reply *out);
+
+/*
+ * Executes the RESP command just parsed by `parser` from the frame at `buf`,
+ * appending its reply to `out`. Returns negative if the reply could not be
+ * allocated, positive if the client asked for the connection to be closed
+ * once the reply is written, and zero otherwise. `origin` may be `NULL`.
+ */
+int command_resp(struct command_ctx *ctx, const char *buf,
+                 const struct resp_parser *parser,
+                 const struct command_origin *origin, struct reply *out);
+
+/*
+ * Set `key` and return true if the request reads or writes that one key and
+ * nothing else, so may run wherever the key is stored.
+ */
+bool command_binary_key(const struct proto_request *req, struct db_key *key);
+bool command_resp_key(const char *buf, const struct resp_parser *parser,
+                      struct db_key *key);
+
+#endif
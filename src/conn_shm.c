@@ -0,0 +1,295 @@
+#include "server.h"
+
+#ifdef SHM_SUPPORTED
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "sys.h"
+
+/*
+ * Ring capacity unless the client asks otherwise, and how long a channel is
+ * polled after anything last moved on it before the reactor parks on it.
+ */
+#define CONN_SHM_CAPACITY (1 << 20)
+#define CONN_SHM_SPIN_NS (100 * 1000)
+
+static void conn_shm_spin(struct conn_shm *shm)
+{
+    struct reactor *reactor = shm->conn->reactor;
+
+    shm->active = monotonic_ns();
+
+    if (shm->spinning)
+        return;
+
+    shm->spinning = true;
+    shm->prev = NULL;
+    shm->next = reactor->spinning;
+    if (shm->next)
+        shm->next->prev = shm;
+    reactor->spinning = shm;
+}
+
+static void conn_shm_unspin(struct conn_shm *shm)
+{
+    struct reactor *reactor = shm->conn->reactor;
+
+    if (!shm->spinning)
+        return;
+
+    if (shm->prev)
+        shm->prev->next = shm->next;
+    else
+        reactor->spinning = shm->next;
+
+    if (shm->next)
+        shm->next->prev = shm->prev;
+
+    shm->spinning = false;
+}
+
+int conn_shm_read(struct conn *conn)
+{
+    struct conn_shm *shm = conn->shm;
+    size_t moved = 0;
+
+    if (shm->sock_event) {
+        char byte;
+        ssize_t n = recv(conn->fd, &byte, 1, 0);
+
+        shm->sock_event = false;
+
+        if (!n)
+            return 0;
+        if (n > 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            return -1;
+    }
+
+    while (!conn_hold_input(conn, moved)) {
+        if (buffer_reserve(&conn->rbuf, CONN_READ_SIZE))
+            return -1;
+
+        ssize_t n = shm_ring_read(&shm->requests, buffer_tail(&conn->rbuf),
+                                  buffer_space(&conn->rbuf));
+
+        if (n < 0)
+            return -1;
+        if (!n)
+            break;
+
+        conn->rbuf.end += n;
+        moved += n;
+    }
+
+    if (moved) {
+        if (shm_ring_notify_producer(&shm->requests))
+            shm_futex_wake(&shm->requests.ring->head);
+
+        conn_shm_spin(shm);
+    }
+
+    return 1;
+}
+
+bool conn_shm_flush(struct conn *conn)
+{
+    struct conn_shm *shm = conn->shm;
+    struct reply *out = &conn->wbuf;
+    bool moved = false;
+
+    while (!reply_empty(out)) {
+        struct iovec iov[CONN_IOV_MAX];
+        size_t count = reply_iov(out, iov, ARRAY_SIZE(iov), SIZE_MAX);
+        size_t written = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            ssize_t n = shm_ring_write(&shm->responses, iov[i].iov_base,
+                                       iov[i].iov_len);
+
+            if (n < 0)
+                return false;
+
+            written += n;
+
+            if (n < iov[i].iov_len)
+                break;
+        }
+
+        if (!written)
+            break;
+
+        reply_consume(out, written);
+        moved = true;
+    }
+
+    if (moved) {
+        if (shm_ring_notify_consumer(&shm->responses))
+            shm_futex_wake(&shm->responses.ring->tail);
+
+        conn_shm_spin(shm);
+    }
+
+    return true;
+}
+
+/*
+ * Handles the client waking a parked channel.
+ */
+static void conn_shm_wake(struct reactor *reactor,
+                          struct event_handler *handler, unsigned int events)
+{
+    struct conn_shm *shm = container_of(handler, struct conn_shm, waker);
+    struct conn *conn = shm->conn;
+    uint64_t value;
+
+    (void)reactor;
+
+    if (atomic_load(&conn->state) == CONN_CLOSED)
+        return;
+
+    if (events == EVENT_ERROR) {
+        atomic_store(&conn->state, CONN_SCHEDULED);
+        conn_close(conn);
+        return;
+    }
+
+    while (read(shm->wake_fd, &value, sizeof(value)) > 0 || errno == EINTR)
+        ;
+
+    conn_schedule(conn);
+}
+
+/*
+ * Parks the channel if the client has nothing for it: it is woken for
+ * requests, and for room for replies if any are held back. Returns false if
+ * there is something to do after all.
+ */
+static bool conn_shm_park(struct conn_shm *shm)
+{
+    return shm_ring_park_consumer(&shm->requests) &&
+           (reply_empty(&shm->conn->wbuf) ||
+            shm_ring_park_producer(&shm->responses));
+}
+
+bool conn_shm_allowed(struct conn *conn, size_t len)
+{
+    return conn->local && conn->pool && !conn->shm &&
+           conn->server->config->backend == SERVER_BACKEND_EVENT_LOOP &&
+           !conn->pending && reply_empty(&conn->wbuf) &&
+           buffer_len(&conn->rbuf) == len;
+}
+
+bool conn_shm_attach(struct conn *conn, const struct proto_request *req)
+{
+    struct conn_shm *shm = malloc(sizeof(*shm));
+
+    if (!shm)
+        return false;
+
+    if (shm_channel_create(&shm->ch,
+                           req->extra ? req->extra : CONN_SHM_CAPACITY))
+        goto error;
+
+    if ((shm->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        goto error_channel;
+
+    struct proto_header hdr = {
+        .magic = PROTO_RESPONSE_MAGIC,
+        .opcode = PROTO_ATTACH,
+        .key_len = PROTO_OK,
+        .id = req->id,
+        .extra = shm->ch.capacity,
+    };
+    union {
+        char data[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.data,
+        .msg_controllen = sizeof(control.data),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), (int[]){ shm->ch.fd, shm->wake_fd },
+           2 * sizeof(int));
+
+    /*
+     * Nothing else is queued on the socket, so a header always fits.
+     */
+    if (sendmsg(conn->fd, &msg, MSG_NOSIGNAL) != sizeof(hdr) ||
+        event_loop_add(&conn->reactor->loop, shm->wake_fd, &shm->waker))
+        goto error_wake;
+
+    shm->conn = conn;
+    shm_port_init(&shm->requests, &shm->ch, shm->ch.requests);
+    shm_port_init(&shm->responses, &shm->ch, shm->ch.responses);
+    shm->waker.fn = conn_shm_wake;
+    shm->sock_event = false;
+    shm->spinning = false;
+    conn->shm = shm;
+    conn_shm_spin(shm);
+
+    return true;
+
+error_wake:
+    close(shm->wake_fd);
+error_channel:
+    shm_channel_destroy(&shm->ch);
+error:
+    free(shm);
+    return false;
+}
+
+void conn_shm_shut(struct conn *conn)
+{
+    struct conn_shm *shm = conn->shm;
+
+    conn_shm_unspin(shm);
+    event_loop_del(&conn->reactor->loop, shm->wake_fd);
+    shm_futex_wake(&shm->requests.ring->head);
+    shm_futex_wake(&shm->responses.ring->tail);
+}
+
+void conn_shm_free(struct conn *conn)
+{
+    struct conn_shm *shm = conn->shm;
+
+    conn_shm_unspin(shm);
+    close(shm->wake_fd);
+    shm_channel_destroy(&shm->ch);
+    free(shm);
+}
+
+bool reactor_spin(struct reactor *reactor)
+{
+    uint64_t now = monotonic_ns();
+    struct conn_shm *next;
+
+    for (struct conn_shm *shm = reactor->spinning; shm; shm = next) {
+        struct conn *conn = shm->conn;
+
+        next = shm->next;
+
+        if (shm_ring_readable(&shm->requests) ||
+            (!reply_empty(&conn->wbuf) &&
+             shm_ring_writable(&shm->responses))) {
+            conn_schedule(conn);
+            continue;
+        }
+
+        if (now - shm->active >= CONN_SHM_SPIN_NS && conn_shm_park(shm))
+            conn_shm_unspin(shm);
+    }
+
+    return reactor->spinning;
+}
+
+#endif
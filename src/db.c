@@ -0,0 +1,1004 @@
+#include <ctype.h>
+#include <inttypes.h>
+
+#include "db.h"
+#include "malloc.h"
+#include "sys.h"
+
+static uint64_t db_hash(const void *key)
+{
+    return ((const struct db_key *)key)->hash;
+}
+
+static void *db_key_dup(struct hash_table *table, const void *key)
+{
+    const struct db_key *src = key;
+    struct db_key *dest =
+        tagged_malloc(MALLOC_TAG_KEY, sizeof(*dest) + src->len + 1);
+
+    (void)table;
+
+    if (!dest)
+        return NULL;
+
+    char *data = (char *)(dest + 1);
+
+    memcpy(data, src->data, src->len);
+    data[src->len] = '\0';
+
+    dest->data = data;
+    dest->len = src->len;
+    dest->hash = src->hash;
+
+    return dest;
+}
+
+static void db_free(struct hash_table *table, void *ptr)
+{
+    (void)table;
+
+    tagged_free(MALLOC_TAG_KEY, ptr);
+}
+
+/*
+ * Also called on entries yet to get a value.
+ */
+static void db_value_free(struct hash_table *table, void *ptr)
+{
+    (void)table;
+
+    if (ptr)
+        db_value_put(ptr);
+}
+
+static int db_key_cmp(struct hash_table *table, const void *key_a,
+                      const void *key_b)
+{
+    const struct db_key *a = key_a;
+    const struct db_key *b = key_b;
+
+    (void)table;
+
+    return a->hash != b->hash || a->len != b->len ||
+           memcmp(a->data, b->data, a->len);
+}
+
+/*
+ * Values are created by `db_value_create()` and handed over, so are not
+ * duplicated.
+ */
+static struct hash_table_interface db_interface = {
+    .hash_fn = db_hash,
+    .key_dup = db_key_dup,
+    .free_key = db_free,
+    .free_val = db_value_free,
+    .key_cmp = db_key_cmp,
+};
+
+static struct hash_table_interface db_int_interface = {
+    .hash_fn = hash_table_int_hash,
+    .free_val = db_value_free,
+    .key_cmp = hash_table_int_cmp,
+};
+
+/*
+ * Parses `key` if it is a decimal 64-bit integer written as
+ * `db_format_int()` writes them, so every integer has one key: no plus sign,
+ * leading zeros, or minus zero.
+ */
+static bool db_key_int(const struct db_key *key, int64_t *num)
+{
+    const char *at = key->data, *end = key->data + key->len;
+    bool neg = key->len && *at == '-';
+    size_t digits = key->len - neg;
+    uint64_t mag = 0;
+
+    at += neg;
+
+    if (!digits || digits > 19 || (*at == '0' && (digits > 1 || neg)))
+        return false;
+
+    for (; at < end; at++) {
+        if (*at < '0' || *at > '9')
+            return false;
+        mag = mag * 10 + (*at - '0');
+    }
+
+    if (mag > (uint64_t)INT64_MAX + neg)
+        return false;
+
+    *num = neg ? (int64_t)(0 - mag) : (int64_t)mag;
+    return true;
+}
+
+/*
+ * Writes `num` in decimal to end at `end`, returning where it starts. Takes
+ * at most 20 bytes.
+ */
+static char *db_format_int(char *end, int64_t num)
+{
+    uint64_t mag = num < 0 ? -(uint64_t)num : (uint64_t)num;
+
+    do {
+        *--end = '0' + mag % 10;
+        mag /= 10;
+    } while (mag);
+
+    if (num < 0)
+        *--end = '-';
+
+    return end;
+}
+
+/*
+ * Returns the table of `shard` that holds `key`, setting `*slot` to the key
+ * as that table takes it.
+ */
+static struct hash_table *db_table(struct db_shard *shard,
+                                   const struct db_key *key, void **slot)
+{
+    int64_t num;
+
+    if (db_key_int(key, &num)) {
+        *slot = hash_table_int_key(num);
+        return shard->ints;
+    }
+
+    *slot = (void *)key;
+    return shard->table;
+}
+
+/*
+ * A shard's buckets are numbered through its `table`, then its `ints`.
+ */
+static size_t db_bucket_count(const struct db_shard *shard)
+{
+    return shard->table->bucket_count + shard->ints->bucket_count;
+}
+
+/*
+ * Returns the first entry of the shard's bucket numbered `bucket`, setting
+ * `*ints` if it is one of integer keys.
+ */
+static struct hash_table_entry *db_bucket_at(const struct db_shard *shard,
+                                             size_t bucket, bool *ints)
+{
+    struct hash_table *table = shard->table;
+
+    if ((*ints = bucket >= table->bucket_count)) {
+        bucket -= table->bucket_count;
+        table = shard->ints;
+    }
+
+    return table->entries[bucket];
+}
+
+/*
+ * Returns the key of `entry`, writing it out to `key` and `text`, of
+ * `DB_COUNTER_TEXT` bytes, if it is an integer one. Written keys end in a NUL,
+ * as stored ones do.
+ */
+static const struct db_key *db_entry_key(const struct hash_table_entry *entry,
+                                         bool ints, struct db_key *key,
+                                         char *text)
+{
+    if (!ints)
+        return entry->key;
+
+    char *end = text + DB_COUNTER_TEXT - 1;
+    char *start = db_format_int(end, hash_table_key_int(entry->key));
+
+    *end = '\0';
+    db_key_init(key, start, end - start);
+
+    return key;
+}
+
+int db_init(struct db *db)
+{
+    for (size_t i = 0; i < DB_SHARDS; i++) {
+        struct db_shard *shard = &db->shards[i];
+
+        shard->version = 0;
+        shard->db = db;
+
+        if (!(shard->table = hash_table_create(&db_interface)) ||
+            !(shard->ints = hash_table_create(&db_int_interface))) {
+            if (shard->table)
+                hash_table_destroy(shard->table);
+
+            while (i--) {
+                hash_table_destroy(db->shards[i].table);
+                hash_table_destroy(db->shards[i].ints);
+            }
+            return 1;
+        }
+
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+
+    db->changed = NULL;
+    db->changed_arg = NULL;
+
+    return 0;
+}
+
+void db_destroy(struct db *db)
+{
+    for (size_t i = 0; i < DB_SHARDS; i++) {
+        hash_table_destroy(db->shards[i].table);
+        hash_table_destroy(db->shards[i].ints);
+        pthread_mutex_destroy(&db->shards[i].lock);
+    }
+}
+
+void db_key_init(struct db_key *key, const void *data, size_t len)
+{
+    key->data = data;
+    key->len = len;
+    key->hash = murmur_hash_x86_32(data, len, DB_HASH_SEED);
+}
+
+struct db_value *db_value_create(const void *data, size_t len)
+{
+    struct db_value *val = tagged_malloc(MALLOC_TAG_VALUE, sizeof(*val) + len);
+
+    if (!val)
+        return NULL;
+
+    val->expires = 0;
+    val->len = len;
+    val->counter = 0;
+    atomic_init(&val->refs, 1);
+    memcpy(val->data, data, len);
+
+    return val;
+}
+
+void db_value_put(struct db_value *val)
+{
+    /*
+     * Release orders this thread's reads of `data` before the free, and the
+     * acquire fence orders the free after every other thread's.
+     */
+    if (atomic_fetch_sub_explicit(&val->refs, 1, memory_order_release) == 1) {
+        atomic_thread_fence(memory_order_acquire);
+        tagged_free(MALLOC_TAG_VALUE, val);
+    }
+}
+
+static bool db_value_expired(const struct db_value *val, uint64_t now)
+{
+    return val->expires && val->expires <= now;
+}
+
+/*
+ * Looks up `key` in its locked shard, removing it if it has expired.
+ */
+static struct hash_table_entry *db_lookup(struct db_shard *shard,
+                                          const struct db_key *key)
+{
+    void *slot;
+    struct hash_table *table = db_table(shard, key, &slot);
+    struct hash_table_entry *entry = hash_table_get(table, slot);
+
+    if (entry && db_value_expired(entry->val.buf, monotonic_ns())) {
+        hash_table_rm(table, slot);
+        return NULL;
+    }
+
+    return entry;
+}
+
+int db_read(struct db *db, const struct db_key *key,
+            int (*fn)(const struct db_value *val, void *arg), void *arg,
+            uint64_t *version)
+{
+    struct db_shard *shard = db_shard(db, key);
+    int ret = 0;
+
+    pthread_mutex_lock(&shard->lock);
+
+    struct hash_table_entry *entry = db_lookup(shard, key);
+
+    if (entry)
+        ret = fn(entry->val.buf, arg);
+
+    if (version)
+        *version = entry ? entry->version : 0;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return ret;
+}
+
+static int db_get_value(const struct db_value *val, void *out)
+{
+    return buffer_append(out, val->data, val->len) ? -1 : 1;
+}
+
+int db_get(struct db *db, const struct db_key *key, struct buffer *out)
+{
+    return db_read(db, key, db_get_value, out, NULL);
+}
+
+/*
+ * Reports a change to `key` in its locked shard.
+ */
+static void db_changed(struct db_shard *shard, const struct db_key *key,
+                       const struct db_value *val)
+{
+    struct db *db = shard->db;
+
+    if (db->changed)
+        db->changed(key, val, db->changed_arg);
+}
+
+/*
+ * Stores `value` at `key` in its locked shard, taking ownership of it.
+ */
+static int db_store(struct db_shard *shard, const struct db_key *key,
+                    struct db_value *value)
+{
+    void *slot;
+    struct hash_table *table = db_table(shard, key, &slot);
+    struct hash_table_entry *entry = hash_table_put(table, slot, value);
+
+    if (!entry) {
+        db_value_put(value);
+        return 1;
+    }
+
+    entry->version = ++shard->version;
+    db_changed(shard, key, value);
+    return 0;
+}
+
+/*
+ * Removes `key` from its locked shard, returning true if it existed.
+ */
+static bool db_remove(struct db_shard *shard, const struct db_key *key)
+{
+    void *slot;
+    struct hash_table *table = db_table(shard, key, &slot);
+
+    if (!db_lookup(shard, key) || !hash_table_rm(table, slot))
+        return false;
+
+    db_changed(shard, key, NULL);
+    return true;
+}
+
+int db_set(struct db *db, const struct db_key *key, const void *val,
+           size_t len, uint64_t expires)
+{
+    struct db_shard *shard = db_shard(db, key);
+    struct db_value *value = db_value_create(val, len);
+
+    if (!value)
+        return 1;
+
+    value->expires = expires;
+
+    pthread_mutex_lock(&shard->lock);
+    int err = db_store(shard, key, value);
+    pthread_mutex_unlock(&shard->lock);
+
+    return err;
+}
+
+int db_cas(struct db *db, const struct db_key *key, const void *val,
+           size_t len, uint64_t expected, uint64_t *version)
+{
+    struct db_shard *shard = db_shard(db, key);
+    struct db_value *value = db_value_create(val, len);
+    int err = 0;
+
+    if (!value)
+        return ENOMEM;
+
+    pthread_mutex_lock(&shard->lock);
+
+    struct hash_table_entry *entry = db_lookup(shard, key);
+
+    *version = entry ? entry->version : 0;
+
+    if (*version != expected) {
+        err = ESTALE;
+    } else {
+        if (entry)
+            value->expires = ((struct db_value *)entry->val.buf)->expires;
+
+        if (db_store(shard, key, value))
+            err = ENOMEM;
+        else
+            *version = shard->version;
+
+        value = NULL;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    if (value)
+        db_value_put(value);
+
+    return err;
+}
+
+bool db_del(struct db *db, const struct db_key *key)
+{
+    struct db_shard *shard = db_shard(db, key);
+
+    pthread_mutex_lock(&shard->lock);
+    bool found = db_remove(shard, key);
+    pthread_mutex_unlock(&shard->lock);
+
+    return found;
+}
+
+/*
+ * Keys ahead of the current one whose bucket, and twice as far ahead whose
+ * bucket slot, are prefetched in a batch.
+ */
+#define DB_PREFETCH_DISTANCE 4
+
+/*
+ * Orders `count` keys by shard, stably, filling `order` with key indices and
+ * `starts[i]` with where shard `i`'s run begins, `starts[DB_SHARDS]` being the
+ * end.
+ */
+static void db_batch_order(const struct db_key *keys, size_t count,
+                           size_t *order, size_t *starts)
+{
+    size_t next[DB_SHARDS] = { 0 };
+
+    for (size_t i = 0; i < count; i++)
+        next[db_shard_index(&keys[i])]++;
+
+    for (size_t i = 0, pos = 0; i < DB_SHARDS; i++) {
+        starts[i] = pos;
+        pos += next[i];
+        next[i] = starts[i];
+    }
+
+    starts[DB_SHARDS] = count;
+
+    for (size_t i = 0; i < count; i++)
+        order[next[db_shard_index(&keys[i])]++] = i;
+}
+
+/*
+ * The bucket `key` belongs in, in its locked shard.
+ */
+static struct hash_table_entry **db_bucket(struct db_shard *shard,
+                                           const struct db_key *key)
+{
+    void *slot;
+    struct hash_table *table = db_table(shard, key, &slot);
+
+    return hash_table_bucket(table, slot);
+}
+
+/*
+ * Calls `fn` on each key with its shard locked, shard by shard. Lookups in a
+ * large table miss the cache on the bucket slot and again on the entry, so
+ * both are prefetched for keys further along, overlapping the misses of
+ * several keys instead of taking them one after another.
+ */
+static int db_batch(struct db *db, const struct db_key *keys, size_t count,
+                    void (*fn)(struct db_shard *shard,
+                               const struct db_key *key, size_t index,
+                               void *arg),
+                    void *arg)
+{
+    size_t starts[DB_SHARDS + 1];
+    size_t *order;
+
+    if (!count)
+        return 0;
+
+    if (!(order = malloc(count * sizeof(*order))))
+        return 1;
+
+    db_batch_order(keys, count, order, starts);
+
+    for (size_t i = 0; i < DB_SHARDS; i++) {
+        struct db_shard *shard = &db->shards[i];
+        size_t start = starts[i], end = starts[i + 1];
+
+        if (start == end)
+            continue;
+
+        pthread_mutex_lock(&shard->lock);
+
+        for (size_t j = start; j < min(end, start + DB_PREFETCH_DISTANCE); j++)
+            __builtin_prefetch(db_bucket(shard, &keys[order[j]]));
+
+        for (size_t j = start; j < end; j++) {
+            size_t ahead = j + DB_PREFETCH_DISTANCE;
+
+            if (ahead + DB_PREFETCH_DISTANCE < end)
+                __builtin_prefetch(db_bucket(
+                    shard, &keys[order[ahead + DB_PREFETCH_DISTANCE]]));
+
+            if (ahead < end) {
+                struct hash_table_entry *entry =
+                    *db_bucket(shard, &keys[order[ahead]]);
+
+                if (entry)
+                    __builtin_prefetch(entry);
+            }
+
+            fn(shard, &keys[order[j]], order[j], arg);
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    free(order);
+    return 0;
+}
+
+static void db_batch_get(struct db_shard *shard, const struct db_key *key,
+                         size_t index, void *vals)
+{
+    struct hash_table_entry *entry = db_lookup(shard, key);
+
+    ((struct db_value **)vals)[index] =
+        entry ? db_value_get(entry->val.buf) : NULL;
+}
+
+int db_get_many(struct db *db, const struct db_key *keys, size_t count,
+                struct db_value **vals)
+{
+    return db_batch(db, keys, count, db_batch_get, vals);
+}
+
+struct db_batch_set {
+    struct db_value **vals;
+    int err;
+};
+
+static void db_batch_set(struct db_shard *shard, const struct db_key *key,
+                         size_t index, void *arg)
+{
+    struct db_batch_set *batch = arg;
+
+    if (db_store(shard, key, batch->vals[index]))
+        batch->err = 1;
+}
+
+int db_set_many(struct db *db, const struct db_key *keys, size_t count,
+                struct db_value **vals)
+{
+    struct db_batch_set batch = { .vals = vals, .err = 0 };
+
+    if (db_batch(db, keys, count, db_batch_set, &batch)) {
+        for (size_t i = 0; i < count; i++)
+            db_value_put(vals[i]);
+        return 1;
+    }
+
+    return batch.err;
+}
+
+static void db_batch_del(struct db_shard *shard, const struct db_key *key,
+                         size_t index, void *deleted)
+{
+    (void)index;
+
+    if (db_remove(shard, key))
+        ++*(size_t *)deleted;
+}
+
+int db_del_many(struct db *db, const struct db_key *keys, size_t count,
+                size_t *deleted)
+{
+    *deleted = 0;
+    return db_batch(db, keys, count, db_batch_del, deleted);
+}
+
+/*
+ * Parses a decimal 64-bit integer spanning all of `data`.
+ */
+static bool db_parse_int(const char *data, size_t len, int64_t *result)
+{
+    char text[24];
+    char *end;
+
+    if (!len || len >= sizeof(text) || isspace((unsigned char)data[0]))
+        return false;
+
+    memcpy(text, data, len);
+    text[len] = '\0';
+
+    errno = 0;
+    *result = strtoll(text, &end, 10);
+
+    return !errno && end == text + len;
+}
+
+/*
+ * Formats `num` in decimal into the counter `val`.
+ */
+static void db_counter_write(struct db_value *val, int64_t num)
+{
+    char text[DB_COUNTER_TEXT];
+    char *at = db_format_int(text + sizeof(text), num);
+
+    val->len = text + sizeof(text) - at;
+    memcpy(val->data, at, val->len);
+    memcpy(val->data + DB_COUNTER_TEXT, &num, sizeof(num));
+}
+
+static struct db_value *db_counter_create(int64_t num)
+{
+    struct db_value *val = tagged_malloc(
+        MALLOC_TAG_VALUE, sizeof(*val) + DB_COUNTER_TEXT + sizeof(int64_t));
+
+    if (!val)
+        return NULL;
+
+    val->expires = 0;
+    val->counter = 1;
+    atomic_init(&val->refs, 1);
+    db_counter_write(val, num);
+
+    return val;
+}
+
+/*
+ * Reads the integer in `val`, returning false if it is not one.
+ */
+static bool db_value_int(const struct db_value *val, int64_t *num)
+{
+    if (!val->counter)
+        return db_parse_int(val->data, val->len, num);
+
+    memcpy(num, val->data + DB_COUNTER_TEXT, sizeof(*num));
+    return true;
+}
+
+/*
+ * Stores `num` at `key` in its locked shard, where `entry` is what
+ * `db_lookup()` found. A counter no reply holds a reference to is rewritten
+ * in place; anything else is replaced by a new counter with the same expiry.
+ */
+static int db_store_int(struct db_shard *shard, const struct db_key *key,
+                        struct hash_table_entry *entry, int64_t num)
+{
+    struct db_value *val = entry ? entry->val.buf : NULL;
+
+    /*
+     * References are only taken under the lock, and the acquire orders the
+     * reads of whoever dropped the last of them before the rewrite.
+     */
+    if (val && val->counter &&
+        atomic_load_explicit(&val->refs, memory_order_acquire) == 1) {
+        db_counter_write(val, num);
+        entry->version = ++shard->version;
+        db_changed(shard, key, val);
+        return 0;
+    }
+
+    struct db_value *counter = db_counter_create(num);
+
+    if (!counter)
+        return ENOMEM;
+
+    if (val) {
+        void *slot;
+
+        counter->expires = val->expires;
+        hash_table_setval(db_table(shard, key, &slot), entry, counter);
+        entry->version = ++shard->version;
+        db_changed(shard, key, counter);
+        return 0;
+    }
+
+    return db_store(shard, key, counter) ? ENOMEM : 0;
+}
+
+/*
+ * `db_incr()` on a locked shard.
+ */
+static int db_incr_locked(struct db_shard *shard, const struct db_key *key,
+                          int64_t delta, int64_t *result)
+{
+    struct hash_table_entry *entry = db_lookup(shard, key);
+    int64_t current = 0;
+
+    if (entry && !db_value_int(entry->val.buf, &current))
+        return EINVAL;
+
+    if (__builtin_add_overflow(current, delta, result))
+        return EINVAL;
+
+    return db_store_int(shard, key, entry, *result);
+}
+
+int db_incr(struct db *db, const struct db_key *key, int64_t delta,
+            int64_t *result)
+{
+    struct db_shard *shard = db_shard(db, key);
+
+    pthread_mutex_lock(&shard->lock);
+    int err = db_incr_locked(shard, key, delta, result);
+    pthread_mutex_unlock(&shard->lock);
+
+    return err;
+}
+
+int db_cmpxchg(struct db *db, const struct db_key *key, int64_t expected,
+               int64_t desired, int64_t *current)
+{
+    struct db_shard *shard = db_shard(db, key);
+    int err = 0;
+
+    pthread_mutex_lock(&shard->lock);
+
+    struct hash_table_entry *entry = db_lookup(shard, key);
+
+    *current = 0;
+
+    if (entry && !db_value_int(entry->val.buf, current))
+        err = EINVAL;
+    else if (*current == expected)
+        err = db_store_int(shard, key, entry, desired);
+
+    pthread_mutex_unlock(&shard->lock);
+    return err;
+}
+
+struct db_batch_incr {
+    const int64_t *deltas;
+    int64_t *results;
+    int *errs;
+};
+
+static void db_batch_incr(struct db_shard *shard, const struct db_key *key,
+                          size_t index, void *arg)
+{
+    struct db_batch_incr *batch = arg;
+
+    batch->errs[index] = db_incr_locked(shard, key, batch->deltas[index],
+                                        &batch->results[index]);
+}
+
+int db_incr_many(struct db *db, const struct db_key *keys,
+                 const int64_t *deltas, size_t count, int64_t *results,
+                 int *errs)
+{
+    struct db_batch_incr batch = { deltas, results, errs };
+
+    return db_batch(db, keys, count, db_batch_incr, &batch);
+}
+
+bool db_expire(struct db *db, const struct db_key *key, uint64_t expires)
+{
+    struct db_shard *shard = db_shard(db, key);
+
+    pthread_mutex_lock(&shard->lock);
+
+    struct hash_table_entry *entry = db_lookup(shard, key);
+
+    if (entry) {
+        ((struct db_value *)entry->val.buf)->expires = expires;
+        db_changed(shard, key, entry->val.buf);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return entry;
+}
+
+/*
+ * The cursor holds the shard in its low bits and the bucket within it above.
+ */
+uint64_t db_scan(struct db *db, uint64_t cursor, size_t count,
+                 int (*fn)(const struct db_key *key, void *arg), void *arg)
+{
+    size_t index = cursor % DB_SHARDS;
+    uint64_t bucket = cursor / DB_SHARDS;
+    uint64_t now = monotonic_ns();
+
+    for (; index < DB_SHARDS; index++, bucket = 0) {
+        struct db_shard *shard = &db->shards[index];
+
+        pthread_mutex_lock(&shard->lock);
+
+        for (; bucket < db_bucket_count(shard); bucket++) {
+            if (!count--) {
+                pthread_mutex_unlock(&shard->lock);
+                return bucket * DB_SHARDS + index;
+            }
+
+            bool ints;
+            struct hash_table_entry *entry = db_bucket_at(shard, bucket, &ints);
+
+            for (; entry; entry = entry->next) {
+                struct db_key key;
+                char text[DB_COUNTER_TEXT];
+
+                if (db_value_expired(entry->val.buf, now))
+                    continue;
+
+                if (fn(db_entry_key(entry, ints, &key, text), arg)) {
+                    pthread_mutex_unlock(&shard->lock);
+                    return UINT64_MAX;
+                }
+            }
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    return 0;
+}
+
+int db_walk(struct db *db, struct db_walk *walk, size_t count,
+            int (*fn)(const struct db_key *key, const struct db_value *val,
+                      void *arg),
+            void *arg)
+{
+    uint64_t now = monotonic_ns();
+
+    for (; walk->shard < DB_SHARDS; walk->shard++, walk->bucket = 0) {
+        struct db_shard *shard = &db->shards[walk->shard];
+
+        pthread_mutex_lock(&shard->lock);
+
+        /*
+         * Tables only grow, and a key may have moved to a bucket already
+         * walked.
+         */
+        if (walk->bucket_count != db_bucket_count(shard)) {
+            walk->bucket_count = db_bucket_count(shard);
+            walk->bucket = 0;
+        }
+
+        for (; walk->bucket < walk->bucket_count; walk->bucket++) {
+            if (!count--) {
+                pthread_mutex_unlock(&shard->lock);
+                return 1;
+            }
+
+            bool ints;
+            struct hash_table_entry *entry =
+                db_bucket_at(shard, walk->bucket, &ints);
+
+            for (; entry; entry = entry->next) {
+                struct db_key key;
+                char text[DB_COUNTER_TEXT];
+
+                if (db_value_expired(entry->val.buf, now))
+                    continue;
+
+                if (fn(db_entry_key(entry, ints, &key, text), entry->val.buf,
+                       arg)) {
+                    pthread_mutex_unlock(&shard->lock);
+                    return -1;
+                }
+            }
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+        walk->bucket_count = 0;
+    }
+
+    return 0;
+}
+
+static bool db_entry_any(struct hash_table *table,
+                         struct hash_table_entry *entry, void *arg)
+{
+    (void)table;
+    (void)entry;
+    (void)arg;
+
+    return true;
+}
+
+void db_clear(struct db *db)
+{
+    for (size_t i = 0; i < DB_SHARDS; i++) {
+        struct db_shard *shard = &db->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        hash_table_rm_matching(shard->table, NULL, db_entry_any, NULL);
+        hash_table_rm_matching(shard->ints, NULL, db_entry_any, NULL);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+int db_reserve(struct db *db, size_t count)
+{
+    /*
+     * Keys spread over the shards by hash, so each gets its share, with an
+     * eighth more to spare for the spread being uneven. Only string keys are
+     * reserved for, as which are integers is not known: integer keys grow
+     * their tables as they go, rehashing without following pointers to keys.
+     */
+    size_t share = count / DB_SHARDS;
+
+    share += share / 8 + 16;
+
+    for (size_t i = 0; i < DB_SHARDS; i++) {
+        struct db_shard *shard = &db->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        int err = hash_table_reserve(shard->table,
+                                     shard->table->entry_count + share);
+        pthread_mutex_unlock(&shard->lock);
+
+        if (err)
+            return 1;
+    }
+
+    return 0;
+}
+
+static bool db_entry_expired(struct hash_table *table,
+                             struct hash_table_entry *entry, void *now)
+{
+    (void)table;
+
+    return db_value_expired(entry->val.buf, *(uint64_t *)now);
+}
+
+size_t db_expire_shard(struct db *db, size_t index)
+{
+    struct db_shard *shard = &db->shards[index];
+    uint64_t now = monotonic_ns();
+
+    pthread_mutex_lock(&shard->lock);
+    size_t removed =
+        hash_table_rm_matching(shard->table, NULL, db_entry_expired, &now) +
+        hash_table_rm_matching(shard->ints, NULL, db_entry_expired, &now);
+    pthread_mutex_unlock(&shard->lock);
+
+    return removed;
+}
+
+size_t db_size(struct db *db)
+{
+    size_t size = 0;
+
+    for (size_t i = 0; i < DB_SHARDS; i++) {
+        pthread_mutex_lock(&db->shards[i].lock);
+        size += db->shards[i].table->entry_count;
+        size += db->shards[i].ints->entry_count;
+        pthread_mutex_unlock(&db->shards[i].lock);
+    }
+
+    return size;
+}
+
+void db_stats_print(struct db *db, FILE *out)
+{
+    struct hash_table_stats stats = { 0 };
+    size_t largest = 0, ints = 0;
+
+    for (size_t i = 0; i < DB_SHARDS; i++) {
+        struct db_shard *shard = &db->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        largest = max(largest,
+                      shard->table->entry_count + shard->ints->entry_count);
+        ints += shard->ints->entry_count;
+        hash_table_stats(shard->table, &stats);
+        hash_table_stats(shard->ints, &stats);
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    fprintf(out, "keys:%zu\n", stats.entries);
+    fprintf(out, "integer_keys:%zu\n", ints);
+    fprintf(out, "shards:%d\n", DB_SHARDS);
+    fprintf(out, "largest_shard_keys:%zu\n", largest);
+    fprintf(out, "buckets:%zu\n", stats.buckets);
+    fprintf(out, "used_buckets:%zu\n", stats.used_buckets);
+    fprintf(out, "load_factor:%.2f\n",
+            (double)stats.entries / max(stats.buckets, (size_t)1));
+    fprintf(out, "longest_chain:%zu\n", stats.longest_chain);
+    fprintf(out, "rehashes:%" PRIu64 "\n", stats.rehashes);
+}
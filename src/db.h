@@ -0,0 +1,266 @@
+#ifndef MEMDB_DB_H_
+#define MEMDB_DB_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "common.h"
+#include "buffer.h"
+#include "hash_table.h"
+
+/*
+ * The keyspace: `DB_SHARDS` hash tables, each behind its own lock. A key's
+ * shard is picked by the top bits of its hash, and its bucket within the
+ * shard by the remainder, so both come from one hash computation.
+ */
+
+#define DB_SHARD_BITS 6
+#define DB_SHARDS (1 << DB_SHARD_BITS)
+#define DB_HASH_SEED 0x9747b28c
+
+/*
+ * Key as passed to the shard tables. Lookups pass views into request buffers;
+ * stored keys carry their bytes inline after the struct, NUL-terminated. The
+ * hash is computed once, by `db_key_init()`, and kept with stored keys so
+ * rehashing never touches key bytes.
+ */
+struct db_key {
+    const char *data;
+    uint32_t len;
+    uint32_t hash;
+};
+
+/*
+ * `expires` is a `monotonic_ns()` deadline, or zero if the value never
+ * expires. Expired values are removed when next looked up, or by
+ * `db_expire_shard()`.
+ *
+ * Values are reference counted: the table holds one reference, and replies
+ * may take more to send `data` without copying it, so an overwrite or delete
+ * meanwhile only drops the table's. `data` never changes once stored, except
+ * that of a counter held by the table alone.
+ *
+ * Counters are the values integer commands store. Their `data` is the number
+ * in decimal, as for any other value, with room for the longest, followed by
+ * the number itself, so the commands update them in place rather than
+ * allocating.
+ */
+struct db_value {
+    uint64_t expires;
+    uint32_t len : 31;
+    uint32_t counter : 1;
+    atomic_uint refs;
+    char data[];
+};
+
+#define DB_COUNTER_TEXT 24
+
+/*
+ * Every store to a key gives its entry the shard's next `version`. Versions
+ * only grow, so a key deleted and set again never gets back one it had.
+ *
+ * Keys that are decimal 64-bit integers, written as integer commands write
+ * them, are kept apart in `ints`, which stores the numbers themselves in its
+ * entries rather than pointers to copies of the keys. Such keys take no
+ * allocation of their own, and are compared without a further cache miss.
+ * Callbacks are passed them written out again.
+ */
+struct db_shard {
+    _Alignas(64) pthread_mutex_t lock;
+    struct hash_table *table;
+    struct hash_table *ints;
+    uint64_t version;
+    struct db *db;
+};
+
+struct db {
+    struct db_shard shards[DB_SHARDS];
+
+    /*
+     * If set, called with the key's shard locked after each change made by
+     * the functions below, with the value now stored, or `NULL` once the key
+     * is deleted. Keys removed on expiry, or by `db_clear()`, are not
+     * reported.
+     */
+    void (*changed)(const struct db_key *key, const struct db_value *val,
+                    void *arg);
+    void *changed_arg;
+};
+
+int db_init(struct db *db);
+void db_destroy(struct db *db);
+
+void db_key_init(struct db_key *key, const void *data, size_t len);
+
+static inline size_t db_shard_index(const struct db_key *key)
+{
+    return key->hash >> (32 - DB_SHARD_BITS);
+}
+
+static inline struct db_shard *db_shard(struct db *db,
+                                        const struct db_key *key)
+{
+    return &db->shards[db_shard_index(key)];
+}
+
+/*
+ * Returns a value holding one reference, or `NULL` on allocation failure.
+ */
+struct db_value *db_value_create(const void *data, size_t len);
+
+/*
+ * Takes a reference to a value, which may be stored and shared by other
+ * threads. Safe to call from `db_read()` callbacks.
+ */
+static inline struct db_value *db_value_get(const struct db_value *val)
+{
+    struct db_value *ref = (struct db_value *)val;
+
+    atomic_fetch_add_explicit(&ref->refs, 1, memory_order_relaxed);
+    return ref;
+}
+
+void db_value_put(struct db_value *val);
+
+/*
+ * Calls `fn` on the value of `key` with its shard locked, returning what `fn`
+ * returns, or zero if `key` does not exist. `fn` must return non-zero. If
+ * `version` is not `NULL`, it is set to the key's version, zero if missing.
+ */
+int db_read(struct db *db, const struct db_key *key,
+            int (*fn)(const struct db_value *val, void *arg), void *arg,
+            uint64_t *version);
+
+/*
+ * Appends the value of `key` to `out`. Returns positive if found, zero if
+ * not, and negative on allocation failure.
+ */
+int db_get(struct db *db, const struct db_key *key, struct buffer *out);
+
+/*
+ * Sets `key`, clearing any expiry unless `expires` gives a new one. Returns
+ * non-zero on allocation failure.
+ */
+int db_set(struct db *db, const struct db_key *key, const void *val,
+           size_t len, uint64_t expires);
+
+/*
+ * Sets `key` if its version is still `expected`, zero meaning it must not
+ * exist, keeping any expiry. Stores the new version in `version` on success,
+ * or the current one, zero if missing, otherwise. Returns zero, `ENOMEM`, or
+ * `ESTALE` if the version did not match.
+ */
+int db_cas(struct db *db, const struct db_key *key, const void *val,
+           size_t len, uint64_t expected, uint64_t *version);
+
+/*
+ * Returns true if `key` existed.
+ */
+bool db_del(struct db *db, const struct db_key *key);
+
+/*
+ * Multi-key operations. Keys are grouped by shard, each shard locked once for
+ * all of its keys, and buckets prefetched a few keys ahead of the lookups.
+ * Keys of one shard are visited in the order given, so a key repeated in a
+ * batch ends up as its last occurrence leaves it. Each returns non-zero on
+ * allocation failure, before touching the table.
+ *
+ * `db_get_many()` stores in `vals[i]` a reference to the value of `keys[i]`,
+ * or `NULL` if it does not exist; the caller drops them with
+ * `db_value_put()`. `db_set_many()` takes over the values in `vals`, whether
+ * or not it succeeds, returning non-zero if any could not be stored.
+ * `db_del_many()` stores the number of keys that existed in `deleted`.
+ */
+int db_get_many(struct db *db, const struct db_key *keys, size_t count,
+                struct db_value **vals);
+int db_set_many(struct db *db, const struct db_key *keys, size_t count,
+                struct db_value **vals);
+int db_del_many(struct db *db, const struct db_key *keys, size_t count,
+                size_t *deleted);
+
+/*
+ * Integer commands. The value at `key` must be a decimal 64-bit integer, and
+ * counts as zero if missing; its expiry is kept. Each returns zero, `ENOMEM`,
+ * or `EINVAL` if the value is not an integer or the result would overflow.
+ *
+ * `db_incr()` adds `delta`, storing the sum in `result`.
+ *
+ * `db_cmpxchg()` sets the value to `desired` if it equals `expected`, storing
+ * what it was before in `current` either way.
+ *
+ * `db_incr_many()` is the batched `db_incr()`, storing each key's sum in
+ * `results[i]` and error in `errs[i]`. Returns non-zero, before touching the
+ * table, on allocation failure.
+ */
+int db_incr(struct db *db, const struct db_key *key, int64_t delta,
+            int64_t *result);
+int db_cmpxchg(struct db *db, const struct db_key *key, int64_t expected,
+               int64_t desired, int64_t *current);
+int db_incr_many(struct db *db, const struct db_key *keys,
+                 const int64_t *deltas, size_t count, int64_t *results,
+                 int *errs);
+
+/*
+ * Sets the expiry of `key`, zero meaning none. Returns false if `key` does
+ * not exist.
+ */
+bool db_expire(struct db *db, const struct db_key *key, uint64_t expires);
+
+/*
+ * Calls `fn` on each key in the next `count` buckets, starting from `cursor`,
+ * and returns the cursor to resume from, which is zero after the last bucket.
+ * As with Redis `SCAN`, keys present for the whole iteration are seen at
+ * least once, unless a shard is resized in between, when some may be missed
+ * or repeated. `fn` runs with the key's shard locked and returns non-zero to
+ * stop, which `db_scan()` reports by returning `UINT64_MAX`.
+ */
+uint64_t db_scan(struct db *db, uint64_t cursor, size_t count,
+                 int (*fn)(const struct db_key *key, void *arg), void *arg);
+
+/*
+ * Position of a `db_walk()`, zeroed to start.
+ */
+struct db_walk {
+    size_t shard;
+    size_t bucket;
+    size_t bucket_count;
+};
+
+/*
+ * Calls `fn` on each key and its value in the next `count` buckets of the
+ * walk. Unlike with `db_scan()`, every key present for the whole walk is seen
+ * at least once: a shard found resized since the last call is walked again
+ * from its start, so keys may be seen more than once. `fn` runs with the
+ * key's shard locked and returns non-zero to stop. Returns positive while
+ * there is more to walk, zero once done, and negative if `fn` stopped it.
+ */
+int db_walk(struct db *db, struct db_walk *walk, size_t count,
+            int (*fn)(const struct db_key *key, const struct db_value *val,
+                      void *arg),
+            void *arg);
+
+/*
+ * Removes every key.
+ */
+void db_clear(struct db *db);
+
+/*
+ * Sizes the shards for `count` keys more than they hold, so a bulk load of
+ * that many does not rehash them as it goes. Returns non-zero on allocation
+ * failure.
+ */
+int db_reserve(struct db *db, size_t count);
+
+/*
+ * Removes expired keys from one shard, returning how many.
+ */
+size_t db_expire_shard(struct db *db, size_t index);
+
+size_t db_size(struct db *db);
+
+/*
+ * Writes the keyspace's size and the shard tables' occupancy as `name:value`
+ * lines. Locks one shard at a time, for a walk over its buckets.
+ */
+void db_stats_print(struct db *db, FILE *out);
+
+#endif
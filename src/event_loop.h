@@ -0,0 +1,135 @@
+#ifndef MEMDB_EVENT_LOOP_H_
+#define MEMDB_EVENT_LOOP_H_
+
+#include "common.h"
+
+#if defined(__linux__)
+#define EVENT_LOOP_EPOLL
+#include <sys/epoll.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+    defined(__OpenBSD__) || defined(__DragonFly__)
+#define EVENT_LOOP_KQUEUE
+#include <sys/types.h>
+#include <sys/event.h>
+#else
+#error "No event loop backend for this platform."
+#endif
+
+/*
+ * Readiness event loop over `epoll` (Linux) or `kqueue` (BSD, MacOS).
+ *
+ * Descriptors are registered once for both directions, edge triggered
+ * (`EPOLLET`, `EV_CLEAR`): an event is reported when a descriptor becomes
+ * readable or writable, and the consumer must then read or write until
+ * `EAGAIN` before another is reported. This keeps the interest list static
+ * for the life of a descriptor, so no changes are needed per request.
+ */
+
+#define EVENT_READ 0x1
+#define EVENT_WRITE 0x2
+
+/*
+ * Error or hang up. Reported together with `EVENT_READ`, so consumers find
+ * out through `read()`. Reported alone when a batched registration failed,
+ * in which case no further events will follow.
+ */
+#define EVENT_ERROR 0x4
+
+struct event {
+    void *data;
+    unsigned int events;
+};
+
+struct event_loop_change {
+    int fd;
+    void *data;
+};
+
+#ifdef EVENT_LOOP_KQUEUE
+/*
+ * Tracks and describes events and changes for `kqueue`, including arbitrary
+ * 'list' allocations.
+ */
+struct kqueue_table {
+    /*
+     * `kqueue` psuedo file descriptor.
+     */
+    int kq;
+
+    /*
+     * Process ID associated with the `kqueue`. This will be the one that
+     * spawned the descriptor. Use this field when using shared mem mapping.
+     */
+    pid_t pid;
+
+    int nchanges;
+    int nevents;
+    struct kevent *changelist;
+    struct kevent *eventlist;
+
+    /*
+     * Fields `changelist_cap` and `eventlist_cap` are struct internals for
+     * tracking array allocations.
+     */
+    size_t changelist_cap;
+    size_t eventlist_cap;
+};
+#endif
+
+struct event_loop {
+#ifdef EVENT_LOOP_EPOLL
+    int epfd;
+    struct epoll_event *epoll_events;
+
+    /*
+     * Registrations batched until the next `event_loop_wait()`.
+     */
+    struct event_loop_change *changes;
+    size_t nchanges;
+    size_t changes_cap;
+#else
+    struct kqueue_table kt;
+#endif
+
+    /*
+     * Events returned by the last `event_loop_wait()`.
+     */
+    struct event *ready;
+    size_t max_events;
+};
+
+/*
+ * Returns negative on failure, setting `errno`. `max_events` bounds the events
+ * returned per wait.
+ */
+int event_loop_init(struct event_loop *loop, size_t max_events);
+void event_loop_destroy(struct event_loop *loop);
+
+/*
+ * Registers `fd` for reads and writes, reporting `data` with its events.
+ * Registrations are batched and submitted by the next `event_loop_wait()`, so
+ * this must be called from the thread that waits. Returns negative on
+ * failure.
+ */
+int event_loop_add(struct event_loop *loop, int fd, void *data);
+
+/*
+ * Deregisters `fd` immediately. Unlike `event_loop_add()`, safe to call from
+ * any thread, and must be called before `fd` is closed by a thread other than
+ * the waiting one.
+ */
+int event_loop_del(struct event_loop *loop, int fd);
+
+/*
+ * Submits batched registrations and waits up to `timeout_ms` (negative for no
+ * limit) for events, returning the number placed in `loop->ready`, or
+ * negative on failure.
+ */
+int event_loop_wait(struct event_loop *loop, int timeout_ms);
+
+/*
+ * Name of the compiled backend, for logging.
+ */
+const char *event_loop_backend();
+
+#endif
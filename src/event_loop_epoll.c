@@ -0,0 +1,137 @@
+#include "event_loop.h"
+
+#ifdef EVENT_LOOP_EPOLL
+
+#include <unistd.h>
+
+int event_loop_init(struct event_loop *loop, size_t max_events)
+{
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (loop->epfd < 0)
+        return -1;
+
+    loop->max_events = max_events;
+    loop->changes = NULL;
+    loop->nchanges = 0;
+    loop->changes_cap = 0;
+    loop->epoll_events = malloc(max_events * sizeof(*loop->epoll_events));
+    loop->ready = malloc(max_events * sizeof(*loop->ready));
+
+    if (!loop->epoll_events || !loop->ready) {
+        event_loop_destroy(loop);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+void event_loop_destroy(struct event_loop *loop)
+{
+    close(loop->epfd);
+    free(loop->epoll_events);
+    free(loop->ready);
+    free(loop->changes);
+}
+
+int event_loop_add(struct event_loop *loop, int fd, void *data)
+{
+    if (loop->nchanges == loop->changes_cap) {
+        size_t cap = max(loop->changes_cap * 3 / 2, (size_t)16);
+        struct event_loop_change *changes =
+            realloc(loop->changes, cap * sizeof(*changes));
+
+        if (!changes) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        loop->changes = changes;
+        loop->changes_cap = cap;
+    }
+
+    loop->changes[loop->nchanges++] = (struct event_loop_change){ fd, data };
+    return 0;
+}
+
+int event_loop_del(struct event_loop *loop, int fd)
+{
+    /*
+     * Not batched: the caller is about to close `fd`, possibly from another
+     * thread.
+     */
+    return epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/*
+ * `epoll` has no batched `epoll_ctl()`, so batching here buys the single
+ * edge triggered registration per descriptor. A failed registration is
+ * reported to its owner as an error event rather than failing the wait.
+ */
+static int event_loop_flush(struct event_loop *loop, size_t *nready)
+{
+    for (size_t i = 0; i < loop->nchanges; i++) {
+        struct event_loop_change *change = &loop->changes[i];
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = change->data,
+        };
+
+        if (!epoll_ctl(loop->epfd, EPOLL_CTL_ADD, change->fd, &ev))
+            continue;
+
+        if (*nready == loop->max_events) {
+            memmove(loop->changes, change,
+                    (loop->nchanges - i) * sizeof(*change));
+            loop->nchanges -= i;
+            return 1;
+        }
+
+        loop->ready[(*nready)++] = (struct event){
+            .data = change->data,
+            .events = EVENT_ERROR,
+        };
+    }
+
+    loop->nchanges = 0;
+    return 0;
+}
+
+int event_loop_wait(struct event_loop *loop, int timeout_ms)
+{
+    size_t nready = 0;
+
+    if (event_loop_flush(loop, &nready) || nready)
+        timeout_ms = 0;
+
+    int n = epoll_wait(loop->epfd, loop->epoll_events,
+                       loop->max_events - nready, timeout_ms);
+
+    if (n < 0)
+        return nready ? nready : n;
+
+    for (int i = 0; i < n; i++) {
+        uint32_t flags = loop->epoll_events[i].events;
+        struct event *event = &loop->ready[nready++];
+
+        event->data = loop->epoll_events[i].data.ptr;
+        event->events = 0;
+
+        if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            event->events |= EVENT_READ;
+        if (flags & EPOLLOUT)
+            event->events |= EVENT_WRITE;
+        if (flags & (EPOLLHUP | EPOLLERR))
+            event->events |= EVENT_ERROR;
+    }
+
+    return nready;
+}
+
+const char *event_loop_backend()
+{
+    return "epoll";
+}
+
+#endif
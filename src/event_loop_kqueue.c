@@ -0,0 +1,184 @@
+#include "event_loop.h"
+
+#ifdef EVENT_LOOP_KQUEUE
+
+#include <unistd.h>
+
+/*
+ * kqueue (2) documentation:
+ *
+ * FreeBSD: https://www.freebsd.org/cgi/man.cgi?query=kevent&apropos=0&sektion=
+ * 0&manpath=FreeBSD+9.0-RELEASE&arch=default&format=html
+ *
+ * MacOS: https://developer.apple.com/library/archive/documentation/System/Conc
+ * eptual/ManPages_iPhoneOS/man2/kqueue.2.html
+ */
+
+/*
+ * `EV_SET` wrapper.
+ */
+void kevent_set(struct kevent *event, uintptr_t ident, int16_t filter,
+                uint16_t flags, uint32_t fflags, intptr_t data, void *udata)
+{
+    EV_SET(event, ident, filter, flags, fflags, data, udata);
+}
+
+int kqueue_table_init(struct kqueue_table *kt, size_t nevents)
+{
+    int kq = kqueue();
+    if (kq < 0)
+        return kq;
+
+    kt->kq = kq;
+    kt->pid = getpid();
+    kt->nchanges = 0;
+    kt->nevents = 0;
+    kt->changelist = NULL;
+    kt->changelist_cap = 0;
+    kt->eventlist_cap = nevents;
+    kt->eventlist = malloc(nevents * sizeof(*kt->eventlist));
+
+    if (!kt->eventlist) {
+        close(kq);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Adds to change list. Returns negative on failure. May reallocate changelist.
+ */
+int kqueue_table_change(struct kqueue_table *kt, uintptr_t ident,
+                        int16_t filter, uint16_t flags, uint32_t fflags,
+                        intptr_t data, void *udata)
+{
+    if (kt->changelist_cap == kt->nchanges) {
+        size_t cap = max(kt->changelist_cap * 3 / 2, (size_t)16);
+        struct kevent *changelist =
+            realloc(kt->changelist, cap * sizeof(*kt->changelist));
+
+        if (!changelist) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        kt->changelist = changelist;
+        kt->changelist_cap = cap;
+    }
+
+    kevent_set(kt->changelist + kt->nchanges++, ident, filter, flags, fflags,
+               data, udata);
+    return 0;
+}
+
+/*
+ * Passes data to `kevent()` system call, submitting and clearing the change
+ * list. At most `eventlist_cap` events are returned, into `eventlist`. Specify
+ * timeout, or `NULL` for infinite wait. Put zero'd `timespec` to exact a poll.
+ */
+int kqueue_table_commit(struct kqueue_table *kt, struct timespec *timeout)
+{
+    kt->nevents = kevent(kt->kq, kt->changelist, kt->nchanges, kt->eventlist,
+                         kt->eventlist_cap, timeout);
+
+    if (kt->nevents >= 0)
+        kt->nchanges = 0;
+
+    return kt->nevents;
+}
+
+/*
+ * Registered events are dropped by the kernel when `kq` is closed.
+ */
+void kqueue_table_destroy(struct kqueue_table *kt)
+{
+    close(kt->kq);
+    free(kt->changelist);
+    free(kt->eventlist);
+}
+
+int event_loop_init(struct event_loop *loop, size_t max_events)
+{
+    if (kqueue_table_init(&loop->kt, max_events))
+        return -1;
+
+    loop->max_events = max_events;
+    loop->ready = malloc(max_events * sizeof(*loop->ready));
+
+    if (!loop->ready) {
+        kqueue_table_destroy(&loop->kt);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+void event_loop_destroy(struct event_loop *loop)
+{
+    kqueue_table_destroy(&loop->kt);
+    free(loop->ready);
+}
+
+int event_loop_add(struct event_loop *loop, int fd, void *data)
+{
+    /*
+     * `EV_RECEIPT` is left off, so errors on these changes come back through
+     * the event list of the commit that submits them.
+     */
+    if (kqueue_table_change(&loop->kt, fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0,
+                            0, data) ||
+        kqueue_table_change(&loop->kt, fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0,
+                            0, data))
+        return -1;
+
+    return 0;
+}
+
+int event_loop_del(struct event_loop *loop, int fd)
+{
+    struct kevent changes[2];
+
+    kevent_set(&changes[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    kevent_set(&changes[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+
+    return kevent(loop->kt.kq, changes, 2, NULL, 0, NULL);
+}
+
+int event_loop_wait(struct event_loop *loop, int timeout_ms)
+{
+    struct timespec timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000,
+    };
+
+    int n = kqueue_table_commit(&loop->kt, timeout_ms < 0 ? NULL : &timeout);
+
+    if (n < 0)
+        return n;
+
+    for (int i = 0; i < n; i++) {
+        struct kevent *kev = &loop->kt.eventlist[i];
+        struct event *event = &loop->ready[i];
+
+        event->data = kev->udata;
+
+        if (kev->flags & EV_ERROR)
+            event->events = EVENT_ERROR;
+        else if (kev->filter == EVFILT_WRITE)
+            event->events = EVENT_WRITE;
+        else
+            event->events = EVENT_READ;
+    }
+
+    return n;
+}
+
+const char *event_loop_backend()
+{
+    return "kqueue";
+}
+
+#endif
@@ -1,4 +1,7 @@
+#include <stdatomic.h>
+
 #include "hash_table.h"
+#include "malloc.h"
 
 #define MURMUR_C1 0xcc9e2d51
 #define MURMUR_C2 0x1b873593
@@ -79,6 +82,28 @@ void hex(char *dest, const void *src, size_t bytes)
     dest[bytes << 1] = '\0';
 }
 
+/*
+ * The finaliser of MurmurHash3's 64-bit variant, so consecutive integers land
+ * in unrelated buckets.
+ */
+uint64_t hash_table_int_hash(const void *key)
+{
+    uint64_t x = (uint64_t)hash_table_key_int(key);
+
+    x = (x ^ (x >> 33)) * 0xff51afd7ed558ccdULL;
+    x = (x ^ (x >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+
+    return x ^ (x >> 33);
+}
+
+int hash_table_int_cmp(struct hash_table *table, const void *key_a,
+                       const void *key_b)
+{
+    (void)table;
+
+    return key_a != key_b;
+}
+
 int hash_table_keycmp(struct hash_table *table, void *key_a, void *key_b)
 {
     return table->interface->key_cmp(table, key_a, key_b);
@@ -128,16 +153,19 @@ struct hash_table_entry **hash_table_bucket(struct hash_table *table,
            (hash_table_hashkey(table, key) % table->bucket_count);
 }
 
-int hash_table_insert(struct hash_table *table, void *key, void *val)
+/*
+ * Frees `dup`, a value from `val_dup()` that was never stored. Values stored
+ * as given stay the caller's.
+ */
+static void hash_table_dropval(struct hash_table *table, void *dup)
 {
-    table->entry_count += 1;
-
-    if (table->entry_count == table->bucket_count) {
-        int err = hash_table_rehash(table, 3 * table->bucket_count >> 1);
-        if (err)
-            return err;
-    }
+    if (table->interface->val_dup && table->interface->free_val)
+        table->interface->free_val(table, dup);
+}
 
+struct hash_table_entry *hash_table_put(struct hash_table *table, void *key,
+                                        void *val)
+{
     struct hash_table_entry **bucket = hash_table_bucket(table, key);
     struct hash_table_entry *last = NULL;
     struct hash_table_entry *entry = *bucket;
@@ -147,23 +175,80 @@ int hash_table_insert(struct hash_table *table, void *key, void *val)
         entry = entry->next;
     }
 
-    if (!entry) {
-        if (!(entry = calloc(1, sizeof(*entry))))
-            return 1;
+    if (!entry && table->entry_count + 1 >= table->bucket_count) {
+        if (hash_table_rehash(table, 3 * table->bucket_count >> 1))
+            return NULL;
+
+        return hash_table_put(table, key, val);
+    }
 
-        if (last)
-            last->next = entry;
-        else
-            *bucket = entry;
+    /*
+     * The value is duplicated before anything changes, so a failed put leaves
+     * the table as it was. A `NULL` value is stored as given, so only
+     * `val_dup` fails here.
+     */
+    void *dup = table->interface->val_dup
+                    ? table->interface->val_dup(table, val)
+                    : val;
 
-        if (!hash_table_setkey(table, entry, key))
-            return 1;
+    if (!dup && val)
+        return NULL;
+
+    if (entry) {
+        hash_table_freeval(table, entry);
+        entry->val.buf = dup;
+        return entry;
     }
 
-    if (!hash_table_setval(table, entry, val))
-        return 1;
+    if (!(entry = tagged_calloc(MALLOC_TAG_TABLE, 1, sizeof(*entry)))) {
+        hash_table_dropval(table, dup);
+        return NULL;
+    }
 
-    return 0;
+    /*
+     * A `NULL` key, such as integer zero, is stored as given.
+     */
+    if (!hash_table_setkey(table, entry, key) && key) {
+        hash_table_dropval(table, dup);
+        tagged_free(MALLOC_TAG_TABLE, entry);
+        return NULL;
+    }
+
+    entry->val.buf = dup;
+    entry->prev = last;
+
+    if (last)
+        last->next = entry;
+    else
+        *bucket = entry;
+
+    table->entry_count += 1;
+    return entry;
+}
+
+int hash_table_insert(struct hash_table *table, void *key, void *val)
+{
+    return !hash_table_put(table, key, val);
+}
+
+/*
+ * Unlinks `entry` from `bucket` and frees it.
+ */
+static void hash_table_unlink(struct hash_table *table,
+                              struct hash_table_entry **bucket,
+                              struct hash_table_entry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        *bucket = entry->next;
+
+    if (entry->next)
+        entry->next->prev = entry->prev;
+
+    hash_table_freekey(table, entry);
+    hash_table_freeval(table, entry);
+    tagged_free(MALLOC_TAG_TABLE, entry);
 }
 
 int hash_table_rm(struct hash_table *table, void *key)
@@ -171,19 +256,13 @@ int hash_table_rm(struct hash_table *table, void *key)
     struct hash_table_entry **bucket = hash_table_bucket(table, key);
     struct hash_table_entry *entry = *bucket;
 
-    while (entry && !hash_table_keycmp(table, entry->key, key)) {
+    while (entry && hash_table_keycmp(table, entry->key, key)) {
         entry = entry->next;
     }
 
     if (entry) {
-        if (entry->prev)
-            entry->prev->next = entry->next;
-        else
-            *bucket = entry->next;
-
-        hash_table_freekey(table, entry);
-        hash_table_freeval(table, entry);
-        free(entry);
+        hash_table_unlink(table, bucket, entry);
+        table->entry_count -= 1;
 
         return 1;
     } else {
@@ -203,27 +282,33 @@ struct hash_table_entry *hash_table_get(struct hash_table *table, void *key)
 
 struct hash_table *hash_table_create(struct hash_table_interface *interface)
 {
-    struct hash_table *table = malloc(sizeof(*table));
+    struct hash_table *table = tagged_malloc(MALLOC_TAG_TABLE, sizeof(*table));
 
     if (!table)
         return NULL;
 
     table->bucket_count = HASH_TABLE_INIT_BUCKET_COUNT;
     table->entry_count = 0;
+    table->rehashes = 0;
     table->interface = interface;
-    table->entries = malloc(table->entry_count * sizeof(*table->entries));
+    table->entries = tagged_calloc(MALLOC_TAG_TABLE, table->bucket_count,
+                                   sizeof(*table->entries));
 
     if (!table->entries) {
-        free(table);
+        tagged_free(MALLOC_TAG_TABLE, table);
         return NULL;
     }
 
     return table;
 }
 
-void hash_table_destroy(struct hash_table *table)
+/*
+ * Frees every entry in buckets [`lo`, `hi`).
+ */
+static void hash_table_free_buckets(struct hash_table *table, size_t lo,
+                                    size_t hi)
 {
-    for (int i = 0; i < table->bucket_count; i++) {
+    for (size_t i = lo; i < hi; i++) {
         struct hash_table_entry *entry = table->entries[i];
 
         while (entry) {
@@ -231,19 +316,24 @@ void hash_table_destroy(struct hash_table *table)
 
             hash_table_freekey(table, entry);
             hash_table_freeval(table, entry);
-            free(entry);
+            tagged_free(MALLOC_TAG_TABLE, entry);
 
             entry = next;
         }
     }
+}
 
-    free(table->entries);
-    free(table);
+void hash_table_destroy(struct hash_table *table)
+{
+    hash_table_free_buckets(table, 0, table->bucket_count);
+    tagged_free(MALLOC_TAG_TABLE, table->entries);
+    tagged_free(MALLOC_TAG_TABLE, table);
 }
 
 int hash_table_rehash(struct hash_table *table, size_t bucket_count)
 {
-    struct hash_table_entry **entries = malloc(bucket_count * sizeof(*entries));
+    struct hash_table_entry **entries =
+        tagged_calloc(MALLOC_TAG_TABLE, bucket_count, sizeof(*entries));
 
     if (!entries)
         return 1;
@@ -252,14 +342,315 @@ int hash_table_rehash(struct hash_table *table, size_t bucket_count)
         struct hash_table_entry *entry = table->entries[i];
 
         while (entry) {
+            struct hash_table_entry *next = entry->next;
             size_t index = hash_table_hashkey(table, entry->key) % bucket_count;
+
+            entry->prev = NULL;
+            entry->next = entries[index];
+            if (entry->next)
+                entry->next->prev = entry;
             entries[index] = entry;
-            entry = entry->next;
+
+            entry = next;
         }
     }
 
+    tagged_free(MALLOC_TAG_TABLE, table->entries);
     table->bucket_count = bucket_count;
     table->entries = entries;
+    table->rehashes++;
+
+    return 0;
+}
+
+void hash_table_stats(const struct hash_table *table,
+                      struct hash_table_stats *stats)
+{
+    for (size_t i = 0; i < table->bucket_count; i++) {
+        size_t chain = 0;
+
+        for (struct hash_table_entry *entry = table->entries[i]; entry;
+             entry = entry->next)
+            chain++;
+
+        stats->used_buckets += chain > 0;
+        stats->longest_chain = max(stats->longest_chain, chain);
+    }
+
+    stats->entries += table->entry_count;
+    stats->buckets += table->bucket_count;
+    stats->rehashes += table->rehashes;
+}
+
+int hash_table_reserve(struct hash_table *table, size_t count)
+{
+    /*
+     * Inserting rehashes once entries would reach the bucket count.
+     */
+    if (count < table->bucket_count)
+        return 0;
+
+    return hash_table_rehash(table, count + 1);
+}
+
+/*
+ * Buckets per `thread_pool_parallel_for()` range. Keeps at least a few ranges
+ * per worker for balance, without making ranges so small that claiming them
+ * dominates.
+ */
+static size_t hash_table_grain(struct thread_pool *tp, size_t bucket_count)
+{
+    size_t ranges = 4 * (tp ? tp->thread_count : 1);
+    return max(bucket_count / max(ranges, (size_t)1),
+               (size_t)HASH_TABLE_PARALLEL_GRAIN);
+}
+
+static bool hash_table_use_parallel(struct thread_pool *tp,
+                                    size_t bucket_count)
+{
+    return tp && tp->thread_count > 0 &&
+           bucket_count >= HASH_TABLE_PARALLEL_MIN_BUCKETS;
+}
+
+static void hash_table_destroy_range(void *arg, size_t lo, size_t hi)
+{
+    hash_table_free_buckets(arg, lo, hi);
+}
+
+void hash_table_destroy_parallel(struct hash_table *table,
+                                 struct thread_pool *tp)
+{
+    if (!hash_table_use_parallel(tp, table->bucket_count) ||
+        thread_pool_parallel_for(tp, 0, table->bucket_count,
+                                 hash_table_grain(tp, table->bucket_count),
+                                 hash_table_destroy_range, table)) {
+        hash_table_destroy(table);
+        return;
+    }
+
+    tagged_free(MALLOC_TAG_TABLE, table->entries);
+    tagged_free(MALLOC_TAG_TABLE, table);
+}
+
+/*
+ * Parallel rehash runs in two passes. The first walks source bucket ranges and
+ * sorts entries onto one list per (source range, destination partition). The
+ * second gives each worker a disjoint partition of destination buckets, which
+ * it links from the lists of every source range, so neither pass needs locks.
+ *
+ * Between the passes `prev` holds the entry's destination index, since it is
+ * rewritten during linking anyway and saves hashing every key twice.
+ */
+struct hash_table_rehash_ctx {
+    struct hash_table *table;
+    struct hash_table_entry **entries;
+    size_t bucket_count;
+
+    size_t src_grain;
+    size_t src_ranges;
+    size_t dest_grain;
+    size_t dest_ranges;
+
+    /*
+     * `src_ranges` by `dest_ranges` list heads.
+     */
+    struct hash_table_entry **lists;
+};
+
+static void hash_table_rehash_scatter(void *arg, size_t lo, size_t hi)
+{
+    struct hash_table_rehash_ctx *ctx = arg;
+    struct hash_table_entry **lists =
+        ctx->lists + (lo / ctx->src_grain) * ctx->dest_ranges;
+
+    for (size_t i = lo; i < hi; i++) {
+        struct hash_table_entry *entry = ctx->table->entries[i];
+
+        while (entry) {
+            struct hash_table_entry *next = entry->next;
+            size_t index =
+                hash_table_hashkey(ctx->table, entry->key) % ctx->bucket_count;
+            size_t part = index / ctx->dest_grain;
+
+            entry->prev = (struct hash_table_entry *)(uintptr_t)index;
+            entry->next = lists[part];
+            lists[part] = entry;
+
+            entry = next;
+        }
+    }
+}
+
+/*
+ * Links every destination partition in [lo, hi), which is a single one unless
+ * the pass is run serially.
+ */
+static void hash_table_rehash_gather(void *arg, size_t lo, size_t hi)
+{
+    struct hash_table_rehash_ctx *ctx = arg;
+
+    for (size_t part = lo / ctx->dest_grain; part * ctx->dest_grain < hi;
+         part++) {
+        for (size_t r = 0; r < ctx->src_ranges; r++) {
+            struct hash_table_entry *entry =
+                ctx->lists[r * ctx->dest_ranges + part];
+
+            while (entry) {
+                struct hash_table_entry *next = entry->next;
+                size_t index = (uintptr_t)entry->prev;
+
+                entry->prev = NULL;
+                entry->next = ctx->entries[index];
+                if (entry->next)
+                    entry->next->prev = entry;
+                ctx->entries[index] = entry;
+
+                entry = next;
+            }
+        }
+    }
+}
+
+int hash_table_rehash_parallel(struct hash_table *table, size_t bucket_count,
+                               struct thread_pool *tp)
+{
+    if (!hash_table_use_parallel(tp, max(table->bucket_count, bucket_count)))
+        return hash_table_rehash(table, bucket_count);
+
+    struct hash_table_rehash_ctx ctx = {
+        .table = table,
+        .bucket_count = bucket_count,
+        .src_grain = hash_table_grain(tp, table->bucket_count),
+        .dest_grain = hash_table_grain(tp, bucket_count),
+    };
+
+    ctx.src_ranges = (table->bucket_count + ctx.src_grain - 1) / ctx.src_grain;
+    ctx.dest_ranges = (bucket_count + ctx.dest_grain - 1) / ctx.dest_grain;
+    ctx.entries =
+        tagged_calloc(MALLOC_TAG_TABLE, bucket_count, sizeof(*ctx.entries));
+    ctx.lists = tagged_calloc(MALLOC_TAG_TABLE,
+                              ctx.src_ranges * ctx.dest_ranges,
+                              sizeof(*ctx.lists));
+
+    if (!ctx.entries || !ctx.lists) {
+        tagged_free(MALLOC_TAG_TABLE, ctx.entries);
+        tagged_free(MALLOC_TAG_TABLE, ctx.lists);
+        return 1;
+    }
+
+    /*
+     * The scatter pass relinks entries as it goes, so it cannot be abandoned
+     * half way. Should the pool fail to start either pass, run it serially.
+     */
+    if (thread_pool_parallel_for(tp, 0, table->bucket_count, ctx.src_grain,
+                                 hash_table_rehash_scatter, &ctx))
+        hash_table_rehash_scatter(&ctx, 0, table->bucket_count);
+
+    if (thread_pool_parallel_for(tp, 0, bucket_count, ctx.dest_grain,
+                                 hash_table_rehash_gather, &ctx))
+        hash_table_rehash_gather(&ctx, 0, bucket_count);
+
+    tagged_free(MALLOC_TAG_TABLE, ctx.lists);
+    tagged_free(MALLOC_TAG_TABLE, table->entries);
+    table->bucket_count = bucket_count;
+    table->entries = ctx.entries;
+    table->rehashes++;
 
     return 0;
 }
+
+struct hash_table_foreach_ctx {
+    struct hash_table *table;
+    void (*fn)(struct hash_table *table, struct hash_table_entry *entry,
+               void *arg);
+    void *arg;
+};
+
+static void hash_table_foreach_range(void *arg, size_t lo, size_t hi)
+{
+    struct hash_table_foreach_ctx *ctx = arg;
+
+    for (size_t i = lo; i < hi; i++) {
+        struct hash_table_entry *entry = ctx->table->entries[i];
+
+        while (entry) {
+            struct hash_table_entry *next = entry->next;
+            ctx->fn(ctx->table, entry, ctx->arg);
+            entry = next;
+        }
+    }
+}
+
+int hash_table_foreach_parallel(
+    struct hash_table *table, struct thread_pool *tp,
+    void (*fn)(struct hash_table *table, struct hash_table_entry *entry,
+               void *arg),
+    void *arg)
+{
+    struct hash_table_foreach_ctx ctx = { table, fn, arg };
+
+    if (!hash_table_use_parallel(tp, table->bucket_count)) {
+        hash_table_foreach_range(&ctx, 0, table->bucket_count);
+        return 0;
+    }
+
+    return thread_pool_parallel_for(tp, 0, table->bucket_count,
+                                    hash_table_grain(tp, table->bucket_count),
+                                    hash_table_foreach_range, &ctx);
+}
+
+struct hash_table_rm_ctx {
+    struct hash_table *table;
+    bool (*match)(struct hash_table *table, struct hash_table_entry *entry,
+                  void *arg);
+    void *arg;
+    atomic_size_t removed;
+};
+
+static void hash_table_rm_range(void *arg, size_t lo, size_t hi)
+{
+    struct hash_table_rm_ctx *ctx = arg;
+    size_t removed = 0;
+
+    for (size_t i = lo; i < hi; i++) {
+        struct hash_table_entry **bucket = ctx->table->entries + i;
+        struct hash_table_entry *entry = *bucket;
+
+        while (entry) {
+            struct hash_table_entry *next = entry->next;
+
+            if (ctx->match(ctx->table, entry, ctx->arg)) {
+                hash_table_unlink(ctx->table, bucket, entry);
+                removed++;
+            }
+
+            entry = next;
+        }
+    }
+
+    atomic_fetch_add_explicit(&ctx->removed, removed, memory_order_relaxed);
+}
+
+size_t hash_table_rm_matching(
+    struct hash_table *table, struct thread_pool *tp,
+    bool (*match)(struct hash_table *table, struct hash_table_entry *entry,
+                  void *arg),
+    void *arg)
+{
+    struct hash_table_rm_ctx ctx = { .table = table,
+                                     .match = match,
+                                     .arg = arg };
+
+    atomic_init(&ctx.removed, 0);
+
+    if (!hash_table_use_parallel(tp, table->bucket_count) ||
+        thread_pool_parallel_for(tp, 0, table->bucket_count,
+                                 hash_table_grain(tp, table->bucket_count),
+                                 hash_table_rm_range, &ctx))
+        hash_table_rm_range(&ctx, 0, table->bucket_count);
+
+    size_t removed = atomic_load(&ctx.removed);
+    table->entry_count -= removed;
+
+    return removed;
+}
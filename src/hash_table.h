@@ -2,6 +2,7 @@
 #define MEMDB_HASH_TABLE_H_
 
 #include "common.h"
+#include "thread_pool.h"
 
 // Not considering other machines currently.
 static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
@@ -16,6 +17,14 @@ void hex(char *dest, const void *src, size_t bytes);
 
 #define HASH_TABLE_INIT_BUCKET_COUNT 2
 
+/*
+ * Tables with fewer buckets than this are walked serially by the `_parallel`
+ * operations, and no range handed to a worker is shorter than
+ * `HASH_TABLE_PARALLEL_GRAIN` buckets.
+ */
+#define HASH_TABLE_PARALLEL_MIN_BUCKETS (1 << 14)
+#define HASH_TABLE_PARALLEL_GRAIN (1 << 12)
+
 struct hash_table; // Predeclare
 
 struct hash_table_interface {
@@ -28,11 +37,16 @@ struct hash_table_interface {
                    const void *key_b);
 };
 
+/*
+ * `rehashes` counts rehashes over the table's life. Each is done whole, so
+ * one is never seen half way.
+ */
 struct hash_table {
     size_t entry_count;
     size_t bucket_count;
     struct hash_table_entry **entries;
     struct hash_table_interface *interface;
+    uint64_t rehashes;
 };
 
 union hash_table_value {
@@ -41,14 +55,48 @@ union hash_table_value {
     int64_t i64;
 };
 
+/*
+ * `version` is zero in a new entry and otherwise left to the owner, which may
+ * use it to tell values stored under the same key apart.
+ */
 struct hash_table_entry {
     void *key;
     union hash_table_value val;
+    uint64_t version;
     struct hash_table_entry *next;
     struct hash_table_entry *prev;
 };
 
+/*
+ * Integer keys. A table whose interface uses these holds 64-bit integers in
+ * `key` itself rather than pointers to keys, so leaves `key_dup` and
+ * `free_key` unset, and compares keys without following them.
+ */
+uint64_t hash_table_int_hash(const void *key);
+int hash_table_int_cmp(struct hash_table *table, const void *key_a,
+                       const void *key_b);
+
+static inline void *hash_table_int_key(int64_t num)
+{
+    return (void *)(uintptr_t)num;
+}
+
+static inline int64_t hash_table_key_int(const void *key)
+{
+    return (int64_t)(uintptr_t)key;
+}
+
+struct hash_table *hash_table_create(struct hash_table_interface *interface);
+void hash_table_destroy(struct hash_table *table);
+
 int hash_table_insert(struct hash_table *table, void *key, void *val);
+
+/*
+ * As `hash_table_insert()`, but returns the entry `val` was stored in, or
+ * `NULL` on failure.
+ */
+struct hash_table_entry *hash_table_put(struct hash_table *table, void *key,
+                                        void *val);
 int hash_table_rm(struct hash_table *table, void *key);
 struct hash_table_entry *hash_table_get(struct hash_table *table, void *key);
 struct hash_table_entry **hash_table_bucket(struct hash_table *table,
@@ -68,4 +116,53 @@ void hash_table_freeval(struct hash_table *table,
                         struct hash_table_entry *entry);
 int hash_table_rehash(struct hash_table *table, size_t bucket_count);
 
+struct hash_table_stats {
+    size_t entries;
+    size_t buckets;
+    size_t used_buckets;
+    size_t longest_chain;
+    uint64_t rehashes;
+};
+
+/*
+ * Adds the table's occupancy to `stats`, taking the longer of the longest
+ * chains. Walks every bucket.
+ */
+void hash_table_stats(const struct hash_table *table,
+                      struct hash_table_stats *stats);
+
+/*
+ * Grows the table, if need be, so it holds `count` entries before rehashing
+ * again. Returns non-zero on allocation failure.
+ */
+int hash_table_reserve(struct hash_table *table, size_t count);
+
+/*
+ * Whole-table operations split over bucket ranges on `tp`. Each falls back to
+ * a serial walk when `tp` is `NULL` or the table is small. The caller must
+ * hold the table exclusively for the duration; callbacks run concurrently on
+ * distinct entries and must be thread safe.
+ */
+
+int hash_table_rehash_parallel(struct hash_table *table, size_t bucket_count,
+                               struct thread_pool *tp);
+void hash_table_destroy_parallel(struct hash_table *table,
+                                 struct thread_pool *tp);
+int hash_table_foreach_parallel(
+    struct hash_table *table, struct thread_pool *tp,
+    void (*fn)(struct hash_table *table, struct hash_table_entry *entry,
+               void *arg),
+    void *arg);
+
+/*
+ * Removes every entry for which `match` returns true, returning the number
+ * removed. Keys are opaque to the table, so pattern matching is left to the
+ * predicate.
+ */
+size_t hash_table_rm_matching(
+    struct hash_table *table, struct thread_pool *tp,
+    bool (*match)(struct hash_table *table, struct hash_table_entry *entry,
+                  void *arg),
+    void *arg);
+
 #endif
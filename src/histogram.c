@@ -0,0 +1,116 @@
+#include "histogram.h"
+
+#define relaxed memory_order_relaxed
+
+size_t histogram_bucket_index(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_COUNT)
+        return value;
+
+    size_t exp = 63 - __builtin_clzll(value);
+    size_t sub =
+        (value >> (exp - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_COUNT - 1);
+
+    return (exp - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT + sub;
+}
+
+uint64_t histogram_bucket_value(size_t index)
+{
+    if (index < HISTOGRAM_SUB_COUNT)
+        return index;
+
+    size_t exp = index / HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub = index % HISTOGRAM_SUB_COUNT;
+
+    return (HISTOGRAM_SUB_COUNT | sub) << (exp - HISTOGRAM_SUB_BITS);
+}
+
+void histogram_init(struct histogram *h)
+{
+    atomic_init(&h->count, 0);
+    atomic_init(&h->sum, 0);
+    atomic_init(&h->max, 0);
+
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        atomic_init(&h->buckets[i], 0);
+}
+
+/*
+ * Single writer, so a relaxed load and store replaces a locked
+ * read-modify-write.
+ */
+static inline void add_relaxed(_Atomic uint64_t *obj, uint64_t value)
+{
+    atomic_store_explicit(obj, atomic_load_explicit(obj, relaxed) + value,
+                          relaxed);
+}
+
+void histogram_record(struct histogram *h, uint64_t value)
+{
+    add_relaxed(&h->buckets[histogram_bucket_index(value)], 1);
+    add_relaxed(&h->count, 1);
+    add_relaxed(&h->sum, value);
+
+    if (value > atomic_load_explicit(&h->max, relaxed))
+        atomic_store_explicit(&h->max, value, relaxed);
+}
+
+void histogram_merge(struct histogram *dest, const struct histogram *src)
+{
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        uint64_t n = atomic_load_explicit(&src->buckets[i], relaxed);
+        if (n)
+            add_relaxed(&dest->buckets[i], n);
+    }
+
+    add_relaxed(&dest->count, atomic_load_explicit(&src->count, relaxed));
+    add_relaxed(&dest->sum, atomic_load_explicit(&src->sum, relaxed));
+
+    uint64_t max = atomic_load_explicit(&src->max, relaxed);
+    if (max > atomic_load_explicit(&dest->max, relaxed))
+        atomic_store_explicit(&dest->max, max, relaxed);
+}
+
+uint64_t histogram_percentile(const struct histogram *h, double p)
+{
+    uint64_t total = 0;
+
+    /*
+     * Sum the buckets rather than trusting `count`, which a concurrent writer
+     * may have advanced past the buckets we read.
+     */
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        total += atomic_load_explicit(&h->buckets[i], relaxed);
+
+    if (!total)
+        return 0;
+
+    uint64_t rank = (uint64_t)(p / 100 * total + 0.5);
+    uint64_t seen = 0;
+
+    rank = max(rank, (uint64_t)1);
+
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += atomic_load_explicit(&h->buckets[i], relaxed);
+        if (seen >= rank)
+            return histogram_bucket_value(i);
+    }
+
+    return histogram_max(h);
+}
+
+uint64_t histogram_count(const struct histogram *h)
+{
+    return atomic_load_explicit(&h->count, relaxed);
+}
+
+uint64_t histogram_mean(const struct histogram *h)
+{
+    uint64_t count = histogram_count(h);
+    return count ? atomic_load_explicit(&h->sum, relaxed) / count : 0;
+}
+
+uint64_t histogram_max(const struct histogram *h)
+{
+    return atomic_load_explicit(&h->max, relaxed);
+}
@@ -0,0 +1,70 @@
+#ifndef MEMDB_HISTOGRAM_H_
+#define MEMDB_HISTOGRAM_H_
+
+#include <stdatomic.h>
+#include "common.h"
+
+/*
+ * Log-linear histogram of unsigned 64 bit values, in the style of HDR
+ * histograms. Values below `2^HISTOGRAM_SUB_BITS` are counted exactly; above,
+ * each power of two is split into `2^HISTOGRAM_SUB_BITS` linear buckets, so
+ * recorded values keep a relative precision of about 6%.
+ *
+ * Recording is single writer: each thread records into its own histogram with
+ * relaxed loads and stores, and readers merge histograms without locking.
+ */
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+struct histogram {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+void histogram_init(struct histogram *h);
+
+/*
+ * Must only be called by the histogram's owning thread.
+ */
+void histogram_record(struct histogram *h, uint64_t value);
+
+/*
+ * Adds the counts of `src` to `dest`. `dest` must not be concurrently recorded
+ * into; `src` may be.
+ */
+void histogram_merge(struct histogram *dest, const struct histogram *src);
+
+/*
+ * Returns the lower bound of the bucket holding the `p`th percentile, for `p`
+ * in [0, 100]. Returns zero for an empty histogram.
+ */
+uint64_t histogram_percentile(const struct histogram *h, double p);
+
+uint64_t histogram_count(const struct histogram *h);
+uint64_t histogram_mean(const struct histogram *h);
+uint64_t histogram_max(const struct histogram *h);
+
+size_t histogram_bucket_index(uint64_t value);
+uint64_t histogram_bucket_value(size_t index);
+
+/*
+ * Counters kept the same way: written only by their owning thread, read by
+ * any without locking.
+ */
+static inline void counter_add(_Atomic uint64_t *counter, uint64_t value)
+{
+    atomic_store_explicit(
+        counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+        memory_order_relaxed);
+}
+
+static inline uint64_t counter_get(_Atomic uint64_t *counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+#endif
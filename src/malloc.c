@@ -1,4 +1,16 @@
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+
+#if defined(__linux__)
+#include <malloc.h>
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#endif
+
+#include "histogram.h"
 #include "malloc.h"
+#include "sys.h"
 
 static inline void *check_alloc(void *mem)
 {
@@ -37,3 +49,285 @@ char *xstrdup(char *str)
 {
     return check_alloc(strdup(str));
 }
+
+#ifdef MALLOC_TAGS
+/*
+ * A thread's counts for a tag, written only by it. `bytes` has not yet been
+ * added to the totals, and allocations freed by another thread count against
+ * that one, so either may be negative on its own.
+ */
+struct malloc_counts {
+    _Atomic uint64_t allocs;
+    _Atomic uint64_t frees;
+    _Atomic int64_t bytes;
+};
+
+/*
+ * Set up on a thread's first tagged allocation or free, and kept after it
+ * exits, so its counts still add up.
+ */
+struct malloc_thread {
+    struct malloc_thread *next;
+    struct malloc_counts tags[MALLOC_TAG_COUNT];
+};
+
+struct malloc_totals {
+    _Atomic int64_t bytes;
+    _Atomic int64_t peak;
+};
+
+static const char *const malloc_tag_names[MALLOC_TAG_COUNT] = {
+    [MALLOC_TAG_TABLE] = "table", [MALLOC_TAG_KEY] = "keys",
+    [MALLOC_TAG_VALUE] = "values", [MALLOC_TAG_BUFFER] = "buffers",
+    [MALLOC_TAG_JOB] = "jobs",
+};
+
+static _Thread_local struct malloc_thread *malloc_local;
+static _Atomic(struct malloc_thread *) malloc_threads;
+static struct malloc_totals malloc_totals[MALLOC_TAG_COUNT];
+
+/*
+ * Returns `NULL` if the thread's counts could not be allocated, when its
+ * allocations go uncounted.
+ */
+static struct malloc_thread *malloc_thread_get(void)
+{
+    struct malloc_thread *thread = malloc_local;
+
+    if (thread)
+        return thread;
+    if (!(thread = calloc(1, sizeof(*thread))))
+        return NULL;
+
+    thread->next = atomic_load(&malloc_threads);
+    while (!atomic_compare_exchange_weak(&malloc_threads, &thread->next,
+                                         thread))
+        ;
+
+    return malloc_local = thread;
+}
+
+static size_t malloc_block_size(void *ptr)
+{
+#ifdef __APPLE__
+    return malloc_size(ptr);
+#else
+    return malloc_usable_size(ptr);
+#endif
+}
+
+static void malloc_flush(enum malloc_tag tag, int64_t bytes)
+{
+    struct malloc_totals *totals = &malloc_totals[tag];
+    int64_t now = atomic_fetch_add_explicit(&totals->bytes, bytes,
+                                            memory_order_relaxed) +
+                  bytes;
+    int64_t peak = atomic_load_explicit(&totals->peak, memory_order_relaxed);
+
+    while (now > peak &&
+           !atomic_compare_exchange_weak_explicit(&totals->peak, &peak, now,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
+        ;
+}
+
+/*
+ * Counts a block of `size` bytes allocated, if positive, or freed.
+ */
+static void malloc_account(enum malloc_tag tag, int64_t size)
+{
+    struct malloc_thread *thread = malloc_thread_get();
+
+    if (!thread)
+        return;
+
+    struct malloc_counts *counts = &thread->tags[tag];
+    int64_t bytes = atomic_load_explicit(&counts->bytes, memory_order_relaxed);
+
+    counter_add(size > 0 ? &counts->allocs : &counts->frees, 1);
+
+    if ((bytes += size) >= MALLOC_FLUSH_BYTES ||
+        bytes <= -MALLOC_FLUSH_BYTES) {
+        malloc_flush(tag, bytes);
+        bytes = 0;
+    }
+
+    atomic_store_explicit(&counts->bytes, bytes, memory_order_relaxed);
+}
+
+void *tagged_malloc(enum malloc_tag tag, size_t size)
+{
+    void *ptr = malloc(size);
+
+    if (ptr)
+        malloc_account(tag, malloc_block_size(ptr));
+    return ptr;
+}
+
+void *tagged_calloc(enum malloc_tag tag, size_t count, size_t size)
+{
+    void *ptr = calloc(count, size);
+
+    if (ptr)
+        malloc_account(tag, malloc_block_size(ptr));
+    return ptr;
+}
+
+/*
+ * The old block is counted freed, and the new one allocated, only once the
+ * reallocation succeeded, as the old block is left alone if it failed.
+ */
+void *tagged_realloc(enum malloc_tag tag, void *ptr, size_t size)
+{
+    size_t old = ptr ? malloc_block_size(ptr) : 0;
+    void *new = realloc(ptr, size);
+
+    if (!new)
+        return NULL;
+    if (ptr)
+        malloc_account(tag, -(int64_t)old);
+    malloc_account(tag, malloc_block_size(new));
+
+    return new;
+}
+
+void tagged_free(enum malloc_tag tag, void *ptr)
+{
+    if (!ptr)
+        return;
+
+    malloc_account(tag, -(int64_t)malloc_block_size(ptr));
+    free(ptr);
+}
+
+/*
+ * Reads every thread's counts without stopping them, so may be off by what
+ * they count meanwhile.
+ */
+void malloc_tag_stats(enum malloc_tag tag, struct malloc_tag_stats *stats)
+{
+    uint64_t allocs = 0, frees = 0;
+    int64_t bytes = atomic_load_explicit(&malloc_totals[tag].bytes,
+                                         memory_order_relaxed);
+    int64_t peak = atomic_load_explicit(&malloc_totals[tag].peak,
+                                        memory_order_relaxed);
+
+    for (struct malloc_thread *thread = atomic_load(&malloc_threads); thread;
+         thread = thread->next) {
+        struct malloc_counts *counts = &thread->tags[tag];
+
+        allocs += counter_get(&counts->allocs);
+        frees += counter_get(&counts->frees);
+        bytes += atomic_load_explicit(&counts->bytes, memory_order_relaxed);
+    }
+
+    stats->count = allocs > frees ? allocs - frees : 0;
+    stats->bytes = max(bytes, (int64_t)0);
+    stats->peak = max(max(peak, bytes), (int64_t)0);
+}
+#else
+void *tagged_malloc(enum malloc_tag tag, size_t size)
+{
+    return malloc(size);
+}
+
+void *tagged_calloc(enum malloc_tag tag, size_t count, size_t size)
+{
+    return calloc(count, size);
+}
+
+void *tagged_realloc(enum malloc_tag tag, void *ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+void tagged_free(enum malloc_tag tag, void *ptr)
+{
+    free(ptr);
+}
+
+void malloc_tag_stats(enum malloc_tag tag, struct malloc_tag_stats *stats)
+{
+    *stats = (struct malloc_tag_stats){ 0 };
+}
+#endif
+
+/*
+ * Pages resident, or zero where unknown.
+ */
+static size_t resident_pages()
+{
+    size_t pages = 0;
+
+#ifdef __linux__
+    FILE *statm = fopen("/proc/self/statm", "r");
+
+    if (statm) {
+        if (fscanf(statm, "%*s %zu", &pages) != 1)
+            pages = 0;
+        fclose(statm);
+    }
+#endif
+
+    return pages;
+}
+
+/*
+ * Fragmentation is reported as the ratio of what the process holds to what is
+ * in use: resident pages to live allocations, and the heap to them.
+ */
+void malloc_stats_print(FILE *out)
+{
+    size_t used = 0;
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+
+    used = info.uordblks + info.hblkhd;
+    fprintf(out, "used_memory:%zu\n", used);
+    fprintf(out, "heap_memory:%zu\n", info.arena + info.hblkhd);
+    fprintf(out, "heap_free:%zu\n", info.fordblks);
+    fprintf(out, "heap_releasable:%zu\n", info.keepcost);
+    if (used)
+        fprintf(out, "allocator_fragmentation_ratio:%.2f\n",
+                (double)(info.arena + info.hblkhd) / used);
+#endif
+
+    struct rusage usage;
+    size_t pages = resident_pages();
+    ssize_t page = page_size();
+
+#ifdef MALLOC_TAGS
+    struct malloc_tag_stats stats;
+    uint64_t tagged = 0;
+
+    for (int tag = 0; tag < MALLOC_TAG_COUNT; tag++) {
+        malloc_tag_stats(tag, &stats);
+        tagged += stats.bytes;
+        fprintf(out,
+                "alloc_%s:count=%" PRIu64 ",bytes=%" PRIu64
+                ",peak_bytes=%" PRIu64 "\n",
+                malloc_tag_names[tag], stats.count, stats.bytes, stats.peak);
+    }
+    fprintf(out, "tagged_memory:%" PRIu64 "\n", tagged);
+#endif
+
+    if (pages && page > 0) {
+        fprintf(out, "rss:%zu\n", pages * page);
+        if (used)
+            fprintf(out, "mem_fragmentation_ratio:%.2f\n",
+                    (double)pages * page / used);
+    }
+
+    if (!getrusage(RUSAGE_SELF, &usage)) {
+        long peak = usage.ru_maxrss;
+
+        /*
+         * In kilobytes, except on Apple systems.
+         */
+#ifndef __APPLE__
+        peak *= 1024;
+#endif
+        fprintf(out, "peak_rss:%ld\n", peak);
+    }
+}
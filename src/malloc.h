@@ -16,4 +16,58 @@ void *xzalloc(size_t size);
 void *xrealloc(void *ptr, size_t size);
 char *xstrdup(char *str);
 
+/*
+ * Subsystems allocations are accounted to.
+ */
+enum malloc_tag {
+    MALLOC_TAG_TABLE,
+    MALLOC_TAG_KEY,
+    MALLOC_TAG_VALUE,
+    MALLOC_TAG_BUFFER,
+    MALLOC_TAG_JOB,
+    MALLOC_TAG_COUNT,
+};
+
+/*
+ * As their untagged counterparts, but counting the allocation, and the bytes
+ * the allocator set aside for it, against `tag`. Memory must be freed or
+ * reallocated under the tag it was allocated with.
+ *
+ * Counts are kept per thread and added to shared totals once a thread's
+ * bytes under a tag have moved by `MALLOC_FLUSH_BYTES`, when the high-water
+ * mark is updated. So the mark may miss up to that much per thread.
+ *
+ * Accounting needs the allocator to tell the size of a block, and is left out
+ * where it cannot, or if `MALLOC_NO_TAGS` is defined.
+ */
+#if !defined(MALLOC_NO_TAGS) && (defined(__linux__) || defined(__APPLE__))
+#define MALLOC_TAGS
+#endif
+
+#define MALLOC_FLUSH_BYTES (64 * 1024)
+
+void *tagged_malloc(enum malloc_tag tag, size_t size);
+void *tagged_calloc(enum malloc_tag tag, size_t count, size_t size);
+void *tagged_realloc(enum malloc_tag tag, void *ptr, size_t size);
+void tagged_free(enum malloc_tag tag, void *ptr);
+
+/*
+ * Allocations live under a tag, the bytes set aside for them, and the most
+ * bytes there have been.
+ */
+struct malloc_tag_stats {
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t peak;
+};
+
+void malloc_tag_stats(enum malloc_tag tag, struct malloc_tag_stats *stats);
+
+/*
+ * Writes the heap usage the allocator reports, where it is glibc's, the
+ * resident set size, and what is accounted to each tag, as `name:value`
+ * lines. Takes the allocator's locks.
+ */
+void malloc_stats_print(FILE *out);
+
 #endif
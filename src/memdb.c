@@ -0,0 +1,558 @@
+#include "memdb.h"
+#include "resp.h"
+#include "sys.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MEMDB_MIN_REQUESTS 16
+
+void memdb_init(struct memdb_conn *conn, int flags)
+{
+    *conn = (struct memdb_conn){ .fd = -1, .flags = flags };
+    buffer_init(&conn->in);
+    buffer_init(&conn->out);
+}
+
+/*
+ * Closes the socket, drops what was queued or received, and calls back every
+ * outstanding request with `MEMDB_CLOSED`. The callbacks find the connection
+ * failed, so cannot queue more.
+ */
+static void memdb_fail(struct memdb_conn *conn, int err)
+{
+    struct memdb_reply reply = { .status = MEMDB_CLOSED };
+
+    if (conn->fd >= 0)
+        close(conn->fd);
+
+    conn->fd = -1;
+    conn->connecting = false;
+    conn->err = err;
+    buffer_consume(&conn->in, buffer_len(&conn->in));
+    buffer_consume(&conn->out, buffer_len(&conn->out));
+
+    while (conn->count) {
+        struct memdb_request req = conn->requests[conn->head];
+
+        conn->head = (conn->head + 1) & (conn->cap - 1);
+        conn->count--;
+        req.cb(conn, &reply, req.arg);
+    }
+}
+
+static int memdb_failed(struct memdb_conn *conn, int err)
+{
+    memdb_fail(conn, err);
+    errno = err;
+    return -1;
+}
+
+void memdb_destroy(struct memdb_conn *conn)
+{
+    memdb_fail(conn, ENOTCONN);
+    buffer_destroy(&conn->in);
+    buffer_destroy(&conn->out);
+    free(conn->requests);
+    conn->requests = NULL;
+    conn->cap = 0;
+}
+
+int memdb_connect(struct memdb_conn *conn, const char *host,
+                  const char *port)
+{
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *addrs;
+    int fd = -1;
+    int err = getaddrinfo(host, port, &hints, &addrs);
+
+    if (conn->fd >= 0)
+        memdb_fail(conn, ECONNRESET);
+
+    if (err) {
+        errno = err == EAI_SYSTEM ? errno : EHOSTUNREACH;
+        return -1;
+    }
+
+    for (struct addrinfo *ai = addrs; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family,
+                    ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        if (!setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1},
+                        sizeof(int)) &&
+            (!connect(fd, ai->ai_addr, ai->ai_addrlen) ||
+             errno == EINPROGRESS))
+            break;
+
+        err = errno;
+        close(fd);
+        errno = err;
+        fd = -1;
+    }
+
+    freeaddrinfo(addrs);
+
+    if (fd < 0)
+        return -1;
+
+    conn->fd = fd;
+    conn->connecting = true;
+    conn->err = 0;
+
+    return 0;
+}
+
+short memdb_events(const struct memdb_conn *conn)
+{
+    if (conn->fd < 0)
+        return 0;
+
+    if (conn->connecting)
+        return POLLOUT;
+
+    return POLLIN | (buffer_len(&conn->out) ? POLLOUT : 0);
+}
+
+/*
+ * Writes what is queued until the socket takes no more.
+ */
+static int memdb_flush(struct memdb_conn *conn)
+{
+    while (buffer_len(&conn->out)) {
+        ssize_t n = send(conn->fd, buffer_head(&conn->out),
+                         buffer_len(&conn->out), MSG_NOSIGNAL);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        buffer_consume(&conn->out, n);
+    }
+
+    return 0;
+}
+
+/*
+ * Hands each whole reply received to its request's callback. Returns non-zero
+ * on a malformed or unexpected reply, setting `errno`.
+ */
+static int memdb_replies(struct memdb_conn *conn)
+{
+    while (conn->count) {
+        struct memdb_request req = conn->requests[conn->head];
+        const char *buf = buffer_head(&conn->in);
+        size_t len = buffer_len(&conn->in);
+        struct memdb_reply reply = { .status = PROTO_OK };
+        ssize_t n;
+
+        if (conn->flags & MEMDB_RESP) {
+            n = resp_reply_size(buf, len);
+            reply.val = buf;
+            reply.val_len = max(n, (ssize_t)0);
+        } else {
+            struct proto_response res;
+
+            if ((n = proto_parse_response(buf, len, &res)) > 0 &&
+                res.id != req.id)
+                n = -1;
+
+            reply = (struct memdb_reply){
+                .status = res.status,
+                .extra = res.extra,
+                .val = res.val,
+                .val_len = res.val_len,
+            };
+        }
+
+        if (n < 0) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (!n)
+            return 0;
+
+        conn->head = (conn->head + 1) & (conn->cap - 1);
+        conn->count--;
+        req.cb(conn, &reply, req.arg);
+        buffer_consume(&conn->in, n);
+    }
+
+    if (buffer_len(&conn->in)) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int memdb_read(struct memdb_conn *conn)
+{
+    if (buffer_reserve(&conn->in, MEMDB_READ_SIZE))
+        return -1;
+
+    ssize_t n = recv(conn->fd, buffer_tail(&conn->in),
+                     buffer_space(&conn->in), 0);
+
+    if (!n) {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0
+                                                                         : -1;
+
+    conn->in.end += n;
+
+    return memdb_replies(conn);
+}
+
+int memdb_process(struct memdb_conn *conn, short revents)
+{
+    if (conn->fd < 0) {
+        errno = conn->err ? conn->err : ENOTCONN;
+        return -1;
+    }
+
+    if (conn->connecting) {
+        int err = 0;
+
+        if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+            return 0;
+
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err,
+                       &(socklen_t){ sizeof(err) }))
+            err = errno;
+
+        if (err)
+            return memdb_failed(conn, err);
+
+        conn->connecting = false;
+        revents |= POLLOUT;
+    }
+
+    if ((revents & POLLOUT) && memdb_flush(conn))
+        return memdb_failed(conn, errno);
+
+    if ((revents & (POLLIN | POLLERR | POLLHUP)) && memdb_read(conn))
+        return memdb_failed(conn, errno);
+
+    return 0;
+}
+
+/*
+ * Milliseconds to wait for until `deadline`, a `monotonic_ns()` time, or -1
+ * if zero, for none. Returns negative, setting `errno`, once it has passed.
+ */
+static int memdb_poll_timeout(uint64_t deadline, int *timeout_ms)
+{
+    if (!deadline) {
+        *timeout_ms = -1;
+        return 0;
+    }
+
+    uint64_t now = monotonic_ns();
+
+    if (now >= deadline) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    *timeout_ms = (deadline - now + 999999) / 1000000;
+    return 0;
+}
+
+static uint64_t memdb_deadline(int timeout_ms)
+{
+    return timeout_ms < 0 ? 0 : monotonic_ns() + timeout_ms * 1000000ull;
+}
+
+int memdb_wait(struct memdb_conn *conn, int timeout_ms)
+{
+    uint64_t deadline = memdb_deadline(timeout_ms);
+
+    while (conn->count) {
+        struct pollfd pfd = { .fd = conn->fd, .events = memdb_events(conn) };
+        int wait;
+
+        if (conn->fd < 0) {
+            errno = conn->err ? conn->err : ENOTCONN;
+            return -1;
+        }
+
+        if (memdb_poll_timeout(deadline, &wait))
+            return -1;
+
+        int n = poll(&pfd, 1, wait);
+
+        if (n < 0 && errno != EINTR)
+            return -1;
+
+        if (n > 0 && memdb_process(conn, pfd.revents))
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Records a request just queued, growing the ring if full. Returns non-zero
+ * on allocation failure.
+ */
+static int memdb_push(struct memdb_conn *conn, memdb_callback cb, void *arg,
+                      uint32_t id)
+{
+    if (conn->count == conn->cap) {
+        size_t cap = max(conn->cap * 2, (size_t)MEMDB_MIN_REQUESTS);
+        struct memdb_request *requests = malloc(cap * sizeof(*requests));
+
+        if (!requests)
+            return -1;
+
+        for (size_t i = 0; i < conn->count; i++)
+            requests[i] = conn->requests[(conn->head + i) & (conn->cap - 1)];
+
+        free(conn->requests);
+        conn->requests = requests;
+        conn->cap = cap;
+        conn->head = 0;
+    }
+
+    conn->requests[(conn->head + conn->count++) & (conn->cap - 1)] =
+        (struct memdb_request){ .cb = cb, .arg = arg, .id = id };
+
+    return 0;
+}
+
+/*
+ * Checks a request may be queued in the connection's protocol, `resp`.
+ */
+static int memdb_check(struct memdb_conn *conn, bool resp)
+{
+    if (conn->err) {
+        errno = conn->err;
+        return -1;
+    }
+
+    if (!(conn->flags & MEMDB_RESP) != !resp) {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Completes queueing a request whose bytes follow the first `len` of the
+ * output, taking them back if it cannot be recorded.
+ */
+static int memdb_queued(struct memdb_conn *conn, size_t len, int err,
+                        memdb_callback cb, void *arg, uint32_t id)
+{
+    if (err || memdb_push(conn, cb, arg, id)) {
+        conn->out.end = conn->out.start + len;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+int memdb_request(struct memdb_conn *conn, const struct proto_request *req,
+                  memdb_callback cb, void *arg)
+{
+    if (memdb_check(conn, false))
+        return -1;
+
+    struct proto_request r = *req;
+    size_t len = buffer_len(&conn->out);
+
+    r.id = conn->next_id++;
+
+    return memdb_queued(conn, len, proto_write_request(&conn->out, &r), cb,
+                        arg, r.id);
+}
+
+int memdb_get(struct memdb_conn *conn, const void *key, size_t key_len,
+              memdb_callback cb, void *arg)
+{
+    struct proto_request req = {
+        .opcode = PROTO_GET,
+        .key = key,
+        .key_len = key_len,
+    };
+
+    return memdb_request(conn, &req, cb, arg);
+}
+
+int memdb_set(struct memdb_conn *conn, const void *key, size_t key_len,
+              const void *val, size_t val_len, uint64_t ttl_ms,
+              memdb_callback cb, void *arg)
+{
+    struct proto_request req = {
+        .opcode = PROTO_SET,
+        .extra = ttl_ms,
+        .key = key,
+        .key_len = key_len,
+        .val = val,
+        .val_len = val_len,
+    };
+
+    return memdb_request(conn, &req, cb, arg);
+}
+
+int memdb_del(struct memdb_conn *conn, const void *key, size_t key_len,
+              memdb_callback cb, void *arg)
+{
+    struct proto_request req = {
+        .opcode = PROTO_DEL,
+        .key = key,
+        .key_len = key_len,
+    };
+
+    return memdb_request(conn, &req, cb, arg);
+}
+
+int memdb_command(struct memdb_conn *conn, size_t argc,
+                  const char *const *argv, const size_t *lens,
+                  memdb_callback cb, void *arg)
+{
+    if (memdb_check(conn, true))
+        return -1;
+
+    size_t len = buffer_len(&conn->out);
+    int err = resp_array(&conn->out, argc);
+
+    for (size_t i = 0; !err && i < argc; i++)
+        err = resp_bulk(&conn->out, argv[i], lens[i]);
+
+    return memdb_queued(conn, len, err, cb, arg, 0);
+}
+
+int memdb_command_raw(struct memdb_conn *conn, const char *buf, size_t len,
+                      memdb_callback cb, void *arg)
+{
+    if (memdb_check(conn, true))
+        return -1;
+
+    size_t queued = buffer_len(&conn->out);
+
+    return memdb_queued(conn, queued, buffer_append(&conn->out, buf, len),
+                        cb, arg, 0);
+}
+
+int memdb_pool_init(struct memdb_pool *pool, const char *host,
+                    const char *port, int flags, size_t size)
+{
+    *pool = (struct memdb_pool){
+        .host = strdup(host),
+        .port = strdup(port),
+        .conns = malloc(size * sizeof(*pool->conns)),
+    };
+
+    if (!pool->host || !pool->port || !pool->conns) {
+        memdb_pool_destroy(pool);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (; pool->size < size; pool->size++)
+        memdb_init(&pool->conns[pool->size], flags);
+
+    for (size_t i = 0; i < size; i++) {
+        if (memdb_connect(&pool->conns[i], host, port)) {
+            int err = errno;
+
+            memdb_pool_destroy(pool);
+            errno = err;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void memdb_pool_destroy(struct memdb_pool *pool)
+{
+    for (size_t i = 0; i < pool->size; i++)
+        memdb_destroy(&pool->conns[i]);
+
+    free(pool->conns);
+    free(pool->host);
+    free(pool->port);
+    *pool = (struct memdb_pool){ 0 };
+}
+
+struct memdb_conn *memdb_pool_get(struct memdb_pool *pool)
+{
+    struct memdb_conn *best = NULL;
+
+    for (size_t i = 0; i < pool->size; i++) {
+        struct memdb_conn *conn = &pool->conns[i];
+
+        if (!best || memdb_pending(conn) < memdb_pending(best))
+            best = conn;
+    }
+
+    if (best && best->fd < 0 &&
+        memdb_connect(best, pool->host, pool->port))
+        return NULL;
+
+    return best;
+}
+
+int memdb_pool_wait(struct memdb_pool *pool, int timeout_ms)
+{
+    uint64_t deadline = memdb_deadline(timeout_ms);
+    struct pollfd *fds = malloc(pool->size * sizeof(*fds));
+    int err = 0;
+
+    if (!fds)
+        return -1;
+
+    while (true) {
+        size_t count = 0;
+        int wait;
+
+        for (size_t i = 0; i < pool->size; i++) {
+            struct memdb_conn *conn = &pool->conns[i];
+
+            fds[i] = (struct pollfd){
+                .fd = memdb_pending(conn) ? conn->fd : -1,
+                .events = memdb_events(conn),
+            };
+            count += fds[i].fd >= 0;
+        }
+
+        if (!count)
+            break;
+
+        if (memdb_poll_timeout(deadline, &wait) ||
+            (poll(fds, pool->size, wait) < 0 && errno != EINTR)) {
+            err = errno;
+            break;
+        }
+
+        for (size_t i = 0; i < pool->size; i++) {
+            if (fds[i].revents && memdb_process(&pool->conns[i],
+                                                fds[i].revents))
+                err = errno;
+        }
+    }
+
+    free(fds);
+
+    errno = err;
+    return err ? -1 : 0;
+}
@@ -0,0 +1,196 @@
+#ifndef MEMDB_MEMDB_H_
+#define MEMDB_MEMDB_H_
+
+#include <poll.h>
+#include "common.h"
+#include "buffer.h"
+#include "protocol.h"
+
+/*
+ * libmemdb, the client library, built as `bin/libmemdb.a`.
+ *
+ * A connection is non-blocking from the start. Requests made on it are
+ * queued, each with a callback, and written out together the next time the
+ * socket is writable, so however many are made between two turns of the
+ * event loop they go out pipelined. Replies come back in the order requests
+ * were made, and each is handed to its request's callback as soon as it is
+ * whole.
+ *
+ * The caller drives a connection from its own event loop, waiting for
+ * `memdb_events()` on `memdb_fd()` and passing what it got to
+ * `memdb_process()`, or lets `memdb_wait()` do the polling. Callbacks may
+ * make more requests on the connection, but must not destroy it.
+ *
+ * Replies are not copied: a value points into the receive buffer, and is only
+ * valid until its callback returns.
+ *
+ * A connection speaks the binary protocol, or with `MEMDB_RESP`, RESP, in
+ * which case each reply is handed over undecoded, as its whole RESP text.
+ *
+ * A pool keeps several connections to one server, handing out the least
+ * loaded and reconnecting those that failed.
+ */
+
+#define MEMDB_RESP 1
+
+/*
+ * Status of the replies to requests outstanding when their connection
+ * failed or was destroyed.
+ */
+#define MEMDB_CLOSED UINT16_MAX
+
+#define MEMDB_READ_SIZE (64 * 1024)
+
+/*
+ * With the binary protocol, `status` is the response's, `extra` its extra
+ * field, and `val` its value. With RESP, `status` is `PROTO_OK` and `val` the
+ * reply.
+ */
+struct memdb_reply {
+    uint16_t status;
+    uint64_t extra;
+    const char *val;
+    size_t val_len;
+};
+
+struct memdb_conn;
+
+typedef void (*memdb_callback)(struct memdb_conn *conn,
+                               const struct memdb_reply *reply, void *arg);
+
+struct memdb_request {
+    memdb_callback cb;
+    void *arg;
+    uint32_t id;
+};
+
+/*
+ * Requests awaiting replies are kept in a ring of `cap`, a power of two, from
+ * `head`. `err` is set once the connection has failed, until it reconnects.
+ */
+struct memdb_conn {
+    int fd;
+    int flags;
+    bool connecting;
+    int err;
+    uint32_t next_id;
+    struct buffer in;
+    struct buffer out;
+    struct memdb_request *requests;
+    size_t cap;
+    size_t head;
+    size_t count;
+};
+
+/*
+ * Sets up a connection, not yet connected. Requests may be queued on it
+ * already, to be written once it is.
+ */
+void memdb_init(struct memdb_conn *conn, int flags);
+
+/*
+ * Fails what is outstanding, with `MEMDB_CLOSED`, and closes the connection.
+ */
+void memdb_destroy(struct memdb_conn *conn);
+
+/*
+ * Starts connecting to `host`, `port`, or reconnecting a connection that
+ * failed. Completes as the connection is processed. Returns non-zero on
+ * failure, setting `errno`.
+ */
+int memdb_connect(struct memdb_conn *conn, const char *host,
+                  const char *port);
+
+static inline int memdb_fd(const struct memdb_conn *conn)
+{
+    return conn->fd;
+}
+
+/*
+ * Requests awaiting replies, and bytes of them not yet written.
+ */
+static inline size_t memdb_pending(const struct memdb_conn *conn)
+{
+    return conn->count;
+}
+
+static inline size_t memdb_unsent(const struct memdb_conn *conn)
+{
+    return buffer_len(&conn->out);
+}
+
+/*
+ * `poll()` events to wait for on the connection.
+ */
+short memdb_events(const struct memdb_conn *conn);
+
+/*
+ * Does what the `poll()` events `revents` allow: finishes connecting, writes
+ * queued requests, and reads replies, calling their callbacks. Returns
+ * non-zero if the connection failed, setting `errno`, having failed what was
+ * outstanding.
+ */
+int memdb_process(struct memdb_conn *conn, short revents);
+
+/*
+ * Polls and processes the connection until no request is outstanding, or
+ * `timeout_ms` passes if not negative. Returns non-zero on failure, setting
+ * `errno`, to `ETIMEDOUT` on timeout.
+ */
+int memdb_wait(struct memdb_conn *conn, int timeout_ms);
+
+/*
+ * Queues a binary protocol request, whose id is assigned. Returns non-zero on
+ * allocation failure, or if the connection failed or speaks RESP, setting
+ * `errno`.
+ */
+int memdb_request(struct memdb_conn *conn, const struct proto_request *req,
+                  memdb_callback cb, void *arg);
+
+int memdb_get(struct memdb_conn *conn, const void *key, size_t key_len,
+              memdb_callback cb, void *arg);
+int memdb_set(struct memdb_conn *conn, const void *key, size_t key_len,
+              const void *val, size_t val_len, uint64_t ttl_ms,
+              memdb_callback cb, void *arg);
+int memdb_del(struct memdb_conn *conn, const void *key, size_t key_len,
+              memdb_callback cb, void *arg);
+
+/*
+ * Queues a RESP command of `argc` arguments, or one already encoded in `buf`.
+ * Returns as `memdb_request()`.
+ */
+int memdb_command(struct memdb_conn *conn, size_t argc,
+                  const char *const *argv, const size_t *lens,
+                  memdb_callback cb, void *arg);
+int memdb_command_raw(struct memdb_conn *conn, const char *buf, size_t len,
+                      memdb_callback cb, void *arg);
+
+struct memdb_pool {
+    char *host;
+    char *port;
+    struct memdb_conn *conns;
+    size_t size;
+};
+
+/*
+ * Sets up a pool of `size` connections to `host`, `port`, all started
+ * connecting. Returns non-zero on failure, setting `errno`.
+ */
+int memdb_pool_init(struct memdb_pool *pool, const char *host,
+                    const char *port, int flags, size_t size);
+void memdb_pool_destroy(struct memdb_pool *pool);
+
+/*
+ * Returns the connection with the fewest requests outstanding, reconnecting
+ * it first if it failed, or `NULL` if it cannot, setting `errno`.
+ */
+struct memdb_conn *memdb_pool_get(struct memdb_pool *pool);
+
+/*
+ * As `memdb_wait()`, over every connection of the pool. Connections failing
+ * meanwhile are left for `memdb_pool_get()` to reconnect, and reported once
+ * the rest are done.
+ */
+int memdb_pool_wait(struct memdb_pool *pool, int timeout_ms);
+
+#endif
@@ -0,0 +1,133 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "server.h"
+
+/*
+ * How long the metrics endpoint waits on a client's request, or for it to take
+ * the reply, before giving up on it.
+ */
+#define METRICS_TIMEOUT_MS 1000
+
+/*
+ * Answers one metrics request on `fd` with the `INFO` text, whatever was
+ * asked for. Plain HTTP/1.0, so each request has a connection of its own.
+ */
+static void metrics_serve(struct server *server, int fd)
+{
+    struct timeval timeout = {
+        .tv_sec = METRICS_TIMEOUT_MS / 1000,
+        .tv_usec = METRICS_TIMEOUT_MS % 1000 * 1000,
+    };
+    char req[1024], head[256];
+    size_t req_len = 0, len, head_len;
+    ssize_t n;
+
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) ||
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)))
+        return;
+
+    /*
+     * The request is read to its end, lest closing with it unread reset the
+     * connection before the client has the reply.
+     */
+    while (req_len < sizeof(req) - 1 &&
+           (n = read(fd, req + req_len, sizeof(req) - 1 - req_len)) > 0) {
+        req_len += n;
+        req[req_len] = '\0';
+
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+            break;
+    }
+
+    char *body = command_stats(&server->commands, &len);
+
+    if (!body)
+        return;
+
+    head_len = snprintf(head, sizeof(head),
+                        "HTTP/1.0 200 OK\r\n"
+                        "Content-Type: text/plain; charset=utf-8\r\n"
+                        "Content-Length: %zu\r\n"
+                        "Connection: close\r\n\r\n",
+                        len);
+
+    struct iovec iov[] = {
+        { head, head_len },
+        { body, len },
+    };
+    struct iovec *v = iov;
+    int count = ARRAY_SIZE(iov);
+
+    while (count && (n = writev(fd, v, count)) > 0) {
+        for (; count && (size_t)n >= v->iov_len; v++, count--)
+            n -= v->iov_len;
+
+        if (count) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+
+    free(body);
+}
+
+/*
+ * Serves the metrics endpoint, one request at a time, until the server stops.
+ */
+static void *metrics_main(void *arg)
+{
+    struct server *server = arg;
+    struct pollfd pfd = { .fd = server->metrics.fd, .events = POLLIN };
+
+    while (!server_stopping) {
+        if (poll(&pfd, 1, SERVER_TICK_MS) <= 0)
+            continue;
+
+        int fd = accept(server->metrics.fd, NULL, NULL);
+
+        if (fd < 0)
+            continue;
+
+        metrics_serve(server, fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+int metrics_init(struct server *server)
+{
+    server->metrics.fd = -1;
+
+    if (!server->config->metrics_port)
+        return 0;
+
+    return server_socket_init(&server->metrics, server->config->metrics_port,
+                              SERVER_BACKLOG, false);
+}
+
+int metrics_start(struct server *server)
+{
+    if ((errno = pthread_create(&server->metrics_thread, NULL, metrics_main,
+                                server)))
+        return -1;
+
+    return 0;
+}
+
+void metrics_stop(struct server *server)
+{
+    pthread_join(server->metrics_thread, NULL);
+}
+
+void metrics_destroy(struct server *server)
+{
+    if (server->metrics.fd >= 0)
+        close(server->metrics.fd);
+}
@@ -0,0 +1,225 @@
+#include "protocol.h"
+
+/*
+ * Reads the header shared by requests and responses. Returns positive once
+ * the whole header is in `buf`, zero if only part of it is, or negative if it
+ * is malformed.
+ */
+static int proto_read_header(const char *buf, size_t len, uint8_t magic,
+                             struct proto_header *hdr)
+{
+    if (len && (uint8_t)buf[0] != magic)
+        return -1;
+
+    if (len < PROTO_HEADER_SIZE)
+        return 0;
+
+    memcpy(hdr, buf, sizeof(*hdr));
+
+    return hdr->val_len > PROTO_MAX_VALUE ? -1 : 1;
+}
+
+ssize_t proto_parse_request(const char *buf, size_t len,
+                            struct proto_request *req)
+{
+    struct proto_header hdr;
+    int status = proto_read_header(buf, len, PROTO_REQUEST_MAGIC, &hdr);
+
+    if (status <= 0)
+        return status;
+
+    size_t size = PROTO_HEADER_SIZE + hdr.key_len + hdr.val_len;
+
+    if (len < size)
+        return 0;
+
+    req->opcode = hdr.opcode;
+    req->id = hdr.id;
+    req->flags = hdr.flags;
+    req->extra = hdr.extra;
+    req->key = buf + PROTO_HEADER_SIZE;
+    req->key_len = hdr.key_len;
+    req->val = req->key + hdr.key_len;
+    req->val_len = hdr.val_len;
+
+    return size;
+}
+
+ssize_t proto_parse_response(const char *buf, size_t len,
+                             struct proto_response *res)
+{
+    struct proto_header hdr;
+    int status = proto_read_header(buf, len, PROTO_RESPONSE_MAGIC, &hdr);
+
+    if (status <= 0)
+        return status;
+
+    size_t size = PROTO_HEADER_SIZE + hdr.val_len;
+
+    if (len < size)
+        return 0;
+
+    res->opcode = hdr.opcode;
+    res->status = hdr.key_len;
+    res->id = hdr.id;
+    res->extra = hdr.extra;
+    res->val = buf + PROTO_HEADER_SIZE;
+    res->val_len = hdr.val_len;
+
+    return size;
+}
+
+int proto_next_item(const char *buf, size_t len, size_t *pos, uint8_t opcode,
+                    bool key, struct proto_item *item)
+{
+    bool val = !key || opcode == PROTO_MSET || opcode == PROTO_MINCR;
+    uint16_t key_len = 0;
+    uint32_t val_len = 0;
+    size_t at = *pos;
+
+    if (at == len)
+        return 0;
+
+    item->key = NULL;
+    item->key_len = 0;
+    item->val = NULL;
+    item->val_len = 0;
+
+    if (key) {
+        if (len - at < sizeof(key_len))
+            return -1;
+
+        memcpy(&key_len, buf + at, sizeof(key_len));
+        at += sizeof(key_len);
+
+        if (len - at < key_len)
+            return -1;
+
+        item->key = buf + at;
+        item->key_len = key_len;
+        at += key_len;
+    }
+
+    if (val) {
+        if (len - at < sizeof(val_len))
+            return -1;
+
+        memcpy(&val_len, buf + at, sizeof(val_len));
+        at += sizeof(val_len);
+
+        if (!key && val_len == PROTO_ITEM_MISSING)
+            goto out;
+
+        if (len - at < val_len)
+            return -1;
+
+        item->val = buf + at;
+        item->val_len = val_len;
+        at += val_len;
+    }
+
+out:
+    *pos = at;
+    return 1;
+}
+
+int proto_write_item(struct buffer *out, const struct proto_item *item,
+                     bool key, bool val)
+{
+    uint16_t key_len = item->key_len;
+    uint32_t val_len = item->val ? item->val_len : PROTO_ITEM_MISSING;
+
+    if ((key && item->key_len > PROTO_MAX_KEY) ||
+        (val && item->val && item->val_len > PROTO_MAX_VALUE))
+        return 1;
+
+    if (buffer_reserve(out, sizeof(key_len) + item->key_len +
+                                sizeof(val_len) + item->val_len))
+        return 1;
+
+    if (key) {
+        buffer_append(out, &key_len, sizeof(key_len));
+        if (item->key_len)
+            buffer_append(out, item->key, item->key_len);
+    }
+
+    if (val) {
+        buffer_append(out, &val_len, sizeof(val_len));
+        if (item->val)
+            buffer_append(out, item->val, item->val_len);
+    }
+
+    return 0;
+}
+
+int proto_write_request(struct buffer *out, const struct proto_request *req)
+{
+    if (req->key_len > PROTO_MAX_KEY || req->val_len > PROTO_MAX_VALUE)
+        return 1;
+
+    struct proto_header hdr = {
+        .magic = PROTO_REQUEST_MAGIC,
+        .opcode = req->opcode,
+        .key_len = req->key_len,
+        .val_len = req->val_len,
+        .id = req->id,
+        .flags = req->flags,
+        .extra = req->extra,
+    };
+
+    if (buffer_reserve(out, sizeof(hdr) + req->key_len + req->val_len))
+        return 1;
+
+    buffer_append(out, &hdr, sizeof(hdr));
+    buffer_append(out, req->key, req->key_len);
+    buffer_append(out, req->val, req->val_len);
+
+    return 0;
+}
+
+int proto_write_response(struct buffer *out, const struct proto_response *res)
+{
+    struct proto_header hdr = {
+        .magic = PROTO_RESPONSE_MAGIC,
+        .opcode = res->opcode,
+        .key_len = res->status,
+        .val_len = res->val_len,
+        .id = res->id,
+        .extra = res->extra,
+    };
+
+    if (buffer_reserve(out, sizeof(hdr) + res->val_len))
+        return 1;
+
+    buffer_append(out, &hdr, sizeof(hdr));
+    buffer_append(out, res->val, res->val_len);
+
+    return 0;
+}
+
+ssize_t proto_begin_response(struct buffer *out, uint8_t opcode, uint32_t id)
+{
+    struct proto_header hdr = {
+        .magic = PROTO_RESPONSE_MAGIC,
+        .opcode = opcode,
+        .id = id,
+    };
+
+    if (buffer_append(out, &hdr, sizeof(hdr)))
+        return -1;
+
+    return buffer_len(out) - sizeof(hdr);
+}
+
+void proto_end_response(struct buffer *out, size_t offset, uint16_t status,
+                        uint64_t extra, size_t spliced)
+{
+    struct proto_header hdr;
+    char *at = buffer_head(out) + offset;
+
+    memcpy(&hdr, at, sizeof(hdr));
+    hdr.key_len = status;
+    hdr.val_len = buffer_len(out) - offset - sizeof(hdr) + spliced;
+    hdr.extra = extra;
+    memcpy(at, &hdr, sizeof(hdr));
+}
@@ -0,0 +1,205 @@
+#ifndef MEMDB_PROTOCOL_H_
+#define MEMDB_PROTOCOL_H_
+
+#include "common.h"
+#include "buffer.h"
+
+/*
+ * Binary wire protocol.
+ *
+ * Every request and response is a fixed 24 byte header followed by a body.
+ * All integers are little-endian.
+ *
+ *   offset  size  request              response
+ *        0     1  magic (0xdb)         magic (0xdc)
+ *        1     1  opcode               opcode, echoed
+ *        2     2  key length           status
+ *        4     4  value length         value length
+ *        8     4  request id           request id, echoed
+ *       12     4  flags (reserved)     flags (reserved)
+ *       16     8  extra                extra
+ *
+ * A request body is the key followed by the value; a response body is the
+ * value. `extra` carries a per-opcode integer argument or result: for `SET`,
+ * a time to live in milliseconds, zero meaning none.
+ *
+ * `MGET`, `MSET` and `MDEL` carry their keys packed in the value as items:
+ * a 2 byte length and the key, followed for `MSET` by a 4 byte length and
+ * the value to set. `MSET` takes a time to live in `extra` as `SET` does.
+ * The `MGET` response value holds an item per key, in order, with no key: the
+ * value, or a length of `PROTO_ITEM_MISSING` alone if the key does not exist.
+ * Its `extra` is the number of keys found; for `MDEL`, the number deleted.
+ *
+ * Integer opcodes take and return signed 64-bit numbers in two's complement.
+ * `INCR` adds `extra` to the key's value and returns the sum in `extra`.
+ * `CMPXCHG` sets the key to the 8 byte value if it holds `extra`, returning
+ * what it held in `extra` either way, so it succeeded if that equals what was
+ * sent. `MINCR` items carry an 8 byte delta as their value, and its response
+ * holds an item per key with the 8 byte sum, or `PROTO_ITEM_MISSING` if the
+ * key's value is not an integer or would overflow; its `extra` is the number
+ * of keys updated. Missing keys count as zero.
+ *
+ * Every store to a key gives it a new, greater version, which `GET` returns
+ * in `extra`. `CAS` sets the key to the value only if its version is still
+ * `extra`, zero meaning the key must not exist, and keeps any expiry. It
+ * returns the new version in `extra`, or `PROTO_CONFLICT` with the current
+ * one, zero if missing, so a read-modify-write takes one round trip more
+ * than the read.
+ *
+ * Requests on a connection are executed in order and answered in order, but
+ * a client need not wait for a response before sending the next request:
+ * request ids let it pipeline and match responses as they come. A server
+ * falling behind may answer requests with `PROTO_EBUSY` without executing
+ * them, in which case the client should back off before retrying.
+ *
+ * On a Unix domain socket, `ATTACH` moves the connection to a shared memory
+ * channel (see `shm.h`) with rings of `extra` bytes, zero for the server's
+ * default. The response gives the capacity in `extra`, and carries the
+ * channel's `memfd` and an `eventfd` to wake the server as `SCM_RIGHTS`.
+ * Every later request and response goes through the channel, while the
+ * socket stays open, and idle, until either side is done with it.
+ *
+ * `SYNC` makes the connection a replication link (see `repl.h`). Its value is
+ * the id of the stream the replica follows, empty for none, and `extra` the
+ * offset in it applied up to. The response value is the id of the primary's
+ * stream, and `extra` the offset it resumes from. Unless that is where the
+ * replica left off, the primary first sends a snapshot of every key as `SET`
+ * requests, ended by a `NOOP`, none of which count towards the offset. Every
+ * later change follows as a `SET`, with the time to live left, or a `DEL`.
+ * The replica sends nothing more but `ACK`s of the offset applied, in
+ * `extra`, which get no response. Replicas answer writes with
+ * `PROTO_READONLY`.
+ */
+
+#define PROTO_REQUEST_MAGIC 0xdb
+#define PROTO_RESPONSE_MAGIC 0xdc
+#define PROTO_HEADER_SIZE 24
+
+#define PROTO_MAX_KEY UINT16_MAX
+#define PROTO_MAX_VALUE (64 << 20)
+
+enum proto_opcode {
+    PROTO_NOOP = 0x00,
+    PROTO_GET = 0x01,
+    PROTO_SET = 0x02,
+    PROTO_DEL = 0x03,
+    PROTO_STATS = 0x04,
+    PROTO_ATTACH = 0x05,
+    PROTO_MGET = 0x06,
+    PROTO_MSET = 0x07,
+    PROTO_MDEL = 0x08,
+    PROTO_INCR = 0x09,
+    PROTO_CMPXCHG = 0x0a,
+    PROTO_MINCR = 0x0b,
+    PROTO_CAS = 0x0c,
+    PROTO_SYNC = 0x0d,
+    PROTO_ACK = 0x0e,
+};
+
+enum proto_status {
+    PROTO_OK = 0,
+    PROTO_NOT_FOUND = 1,
+    PROTO_EINVAL = 2,
+    PROTO_EUNKNOWN = 3,
+    PROTO_ENOMEM = 4,
+    PROTO_CONFLICT = 5,
+    PROTO_EBUSY = 6,
+    PROTO_READONLY = 7,
+};
+
+struct proto_header {
+    uint8_t magic;
+    uint8_t opcode;
+    uint16_t key_len;
+    uint32_t val_len;
+    uint32_t id;
+    uint32_t flags;
+    uint64_t extra;
+} __attribute__((packed));
+
+static_assert(sizeof(struct proto_header) == PROTO_HEADER_SIZE);
+
+/*
+ * Parsed request. `key` and `val` point into the parsed buffer and are valid
+ * only as long as it is.
+ */
+struct proto_request {
+    uint8_t opcode;
+    uint32_t id;
+    uint32_t flags;
+    uint64_t extra;
+    const char *key;
+    size_t key_len;
+    const char *val;
+    size_t val_len;
+};
+
+/*
+ * A key packed in a multi-key request, with its value for `MSET`, or a value
+ * in an `MGET` response, with `val` `NULL` if missing.
+ */
+struct proto_item {
+    const char *key;
+    size_t key_len;
+    const char *val;
+    size_t val_len;
+};
+
+#define PROTO_ITEM_MISSING UINT32_MAX
+
+struct proto_response {
+    uint8_t opcode;
+    uint16_t status;
+    uint32_t id;
+    uint64_t extra;
+    const char *val;
+    size_t val_len;
+};
+
+/*
+ * Parses one request from the front of `buf` without copying. Returns its
+ * size, zero if `buf` holds only part of it, or negative if it is malformed.
+ */
+ssize_t proto_parse_request(const char *buf, size_t len,
+                            struct proto_request *req);
+ssize_t proto_parse_response(const char *buf, size_t len,
+                             struct proto_response *res);
+
+/*
+ * Unpacks the item at `*pos` of a multi-key request's value, or of an `MGET`
+ * or `MINCR` response's with `key` false, advancing `*pos`, which starts at
+ * zero. Values are only read for `MSET` and `MINCR` requests, and responses.
+ * Returns positive if there was one, zero at the end, or negative if the item
+ * is malformed.
+ */
+int proto_next_item(const char *buf, size_t len, size_t *pos, uint8_t opcode,
+                    bool key, struct proto_item *item);
+
+/*
+ * Appends an item, the key only if `key`, and the value only if `val`.
+ * Returns non-zero on allocation failure, or if a length is out of range.
+ */
+int proto_write_item(struct buffer *out, const struct proto_item *item,
+                     bool key, bool val);
+
+/*
+ * Appends an encoded request or response. Returns non-zero on allocation
+ * failure.
+ */
+int proto_write_request(struct buffer *out, const struct proto_request *req);
+int proto_write_response(struct buffer *out, const struct proto_response *res);
+
+/*
+ * Appends a response header whose value the caller appends directly after
+ * it, returning the header's offset from `buffer_head(out)` for
+ * `proto_end_response()` to fill in the value length. Nothing may be consumed
+ * from `out` in between. Returns negative on allocation failure.
+ *
+ * `spliced` counts value bytes the caller sends after the header without
+ * appending them to `out`.
+ */
+ssize_t proto_begin_response(struct buffer *out, uint8_t opcode, uint32_t id);
+void proto_end_response(struct buffer *out, size_t offset, uint16_t status,
+                        uint64_t extra, size_t spliced);
+
+#endif
@@ -0,0 +1,443 @@
+#include <stdio.h>
+
+#include "server.h"
+
+#ifdef URING_SUPPORTED
+
+#include "sys.h"
+#include "trace.h"
+
+#define URING_ENTRIES 1024
+#define URING_FILES (1 << 14)
+#define URING_BUF_GROUP 0
+#define URING_BUF_COUNT 1024
+#define URING_BUF_SIZE (16 * 1024)
+
+/*
+ * Completions carry the connection pointer, with the operation in its low
+ * bits.
+ */
+enum uring_op {
+    URING_ACCEPT,
+    URING_RECV,
+    URING_SEND,
+    URING_CANCEL,
+    URING_CLOSE,
+    URING_ACCEPT_UNIX,
+    URING_PROBE,
+};
+
+#define URING_OP_MASK 7
+
+static_assert(_Alignof(struct conn) > URING_OP_MASK);
+
+static uint64_t uring_data(struct conn *conn, enum uring_op op)
+{
+    return (uintptr_t)conn | op;
+}
+
+/*
+ * Multishot receive landed in Linux 6.0 without a feature flag or opcode of
+ * its own, and older kernels fail it with `-EINVAL`. So a byte is received
+ * over a socket pair the way connections are read, up to the end of stream
+ * which ends the request.
+ */
+static int uring_probe_recv(struct reactor *reactor)
+{
+    int fds[2];
+    int err = 0;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds))
+        return -errno;
+
+    if (send(fds[0], "", 1, MSG_NOSIGNAL) != 1)
+        err = -errno;
+
+    close(fds[0]);
+
+    if (err) {
+        close(fds[1]);
+        return err;
+    }
+
+    struct io_uring_sqe *sqe = uring_sqe(&reactor->ring);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fds[1];
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = uring_data(NULL, URING_PROBE);
+
+    for (bool more = true; more;) {
+        struct io_uring_cqe *cqe = uring_peek(&reactor->ring);
+
+        if (!cqe) {
+            int ret = uring_submit(&reactor->ring, 1, -1);
+
+            if (ret < 0 && ret != -EINTR) {
+                err = ret;
+                break;
+            }
+            continue;
+        }
+
+        if (cqe->res < 0)
+            err = cqe->res == -EINVAL ? -EOPNOTSUPP : cqe->res;
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+            uring_buf_ring_recycle(&reactor->bufs,
+                                   cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+        more = cqe->flags & IORING_CQE_F_MORE;
+        uring_cqe_seen(&reactor->ring);
+    }
+
+    uring_buf_ring_publish(&reactor->bufs);
+    close(fds[1]);
+    return err;
+}
+
+int reactor_uring_init(struct reactor *reactor)
+{
+    int err = uring_init(&reactor->ring, URING_ENTRIES);
+
+    if (err)
+        return err;
+
+    if ((err = uring_register_files(&reactor->ring, URING_FILES)) ||
+        (err = uring_buf_ring_init(&reactor->ring, &reactor->bufs,
+                                   URING_BUF_GROUP, URING_BUF_COUNT,
+                                   URING_BUF_SIZE)))
+        goto error;
+
+    if ((err = uring_probe_recv(reactor)))
+        goto error_bufs;
+
+    return 0;
+
+error_bufs:
+    uring_buf_ring_destroy(&reactor->ring, &reactor->bufs);
+error:
+    uring_destroy(&reactor->ring);
+    return err;
+}
+
+/*
+ * Accepts straight into the registered file table, so connections never get
+ * a regular descriptor.
+ */
+static void uring_arm_accept(struct reactor *reactor, enum uring_op op)
+{
+    struct io_uring_sqe *sqe = uring_sqe(&reactor->ring);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = op == URING_ACCEPT_UNIX ? reactor->unix_fd : reactor->sock.fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->file_index = IORING_FILE_INDEX_ALLOC;
+    sqe->user_data = uring_data(NULL, op);
+}
+
+static void uring_arm_recv(struct reactor *reactor, struct conn *conn)
+{
+    struct io_uring_sqe *sqe = uring_sqe(&reactor->ring);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = uring_data(conn, URING_RECV);
+    conn->inflight++;
+}
+
+static void uring_send(struct reactor *reactor, struct conn *conn)
+{
+    struct io_uring_sqe *sqe = uring_sqe(&reactor->ring);
+
+    conn->send_msg = (struct msghdr){
+        .msg_iov = conn->send_iov,
+        .msg_iovlen = reply_iov(&conn->sending, conn->send_iov,
+                                ARRAY_SIZE(conn->send_iov), SIZE_MAX),
+    };
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uintptr_t)&conn->send_msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = uring_data(conn, URING_SEND);
+    conn->inflight++;
+}
+
+/*
+ * Cancels everything outstanding on the connection. It is freed by
+ * `uring_conn_release()` once the last completion referring to it arrives.
+ */
+static void uring_conn_close(struct reactor *reactor, struct conn *conn)
+{
+    if (conn->closing)
+        return;
+
+    conn->closing = true;
+
+    struct io_uring_sqe *sqe = uring_sqe(&reactor->ring);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = conn->fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD |
+                        IORING_ASYNC_CANCEL_FD_FIXED | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = uring_data(conn, URING_CANCEL);
+    conn->inflight++;
+}
+
+/*
+ * Keeps at most one send in flight, since `wbuf` may be reallocated while
+ * output is appended to it.
+ */
+static void uring_conn_flush(struct reactor *reactor, struct conn *conn)
+{
+    if (conn->closing || !reply_empty(&conn->sending))
+        return;
+
+    if (conn->repl && !conn->read_closed &&
+        repl_sender_fill(&reactor->server->repl, conn->repl, &conn->wbuf.buf,
+                         CONN_REPL_CHUNK) < 0) {
+        uring_conn_close(reactor, conn);
+        return;
+    }
+
+    if (reply_empty(&conn->wbuf)) {
+        if (conn->read_closed || conn->quit)
+            uring_conn_close(reactor, conn);
+        return;
+    }
+
+    struct reply sending = conn->sending;
+
+    conn->sending = conn->wbuf;
+    conn->wbuf = sending;
+    uring_send(reactor, conn);
+}
+
+static void uring_conn_release(struct reactor *reactor, struct conn *conn)
+{
+    if (!conn->closing || conn->inflight)
+        return;
+
+    struct io_uring_sqe *sqe = uring_sqe(&reactor->ring);
+
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = conn->fd + 1;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = uring_data(NULL, URING_CLOSE);
+
+    conn_free(conn);
+}
+
+/*
+ * Called once every reply has been sent. Requests held back by `max_inflight`
+ * are processed; input goes on being received meanwhile, so unlike with the
+ * event loop it is only execution that waits.
+ */
+static void uring_conn_resume(struct reactor *reactor, struct conn *conn)
+{
+    conn->unanswered = 0;
+
+    if (!conn->paused || conn->closing)
+        return;
+
+    conn->paused = false;
+
+    if (!conn_process(conn))
+        uring_conn_close(reactor, conn);
+}
+
+/*
+ * As `reactor_replicate()`. Links with a send in flight are topped up when it
+ * completes.
+ */
+static void uring_replicate(struct reactor *reactor)
+{
+    reactor_repl_update(reactor);
+
+    for (struct conn *conn = reactor->replicas; conn;
+         conn = conn->next_replica)
+        uring_conn_flush(reactor, conn);
+}
+
+/*
+ * Returns false if accepting has failed for good.
+ */
+static bool uring_accepted(struct reactor *reactor, int res)
+{
+    if (res < 0) {
+        reactor_accept_failed(reactor, -res);
+        return res != -EINVAL && res != -EBADF && res != -ENOTSOCK &&
+               res != -EOPNOTSUPP;
+    }
+
+    bool full = server_full(reactor->server);
+    struct conn *conn = full ? NULL : conn_create(reactor, res);
+
+    if (full)
+        counter_add(&reactor->rejected, 1);
+
+    if (!conn) {
+        struct io_uring_sqe *sqe = uring_sqe(&reactor->ring);
+
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = res + 1;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = uring_data(NULL, URING_CLOSE);
+        return true;
+    }
+
+    uring_arm_recv(reactor, conn);
+    return true;
+}
+
+static void uring_received(struct reactor *reactor, struct conn *conn,
+                           uint16_t bid, size_t len)
+{
+    char *data = uring_buf(&reactor->bufs, bid);
+    bool ok;
+
+    conn->queued = monotonic_ns();
+    trace_record_at(conn->queued, TRACE_READ, conn->id, len, NULL);
+
+    if (!buffer_len(&conn->rbuf)) {
+        /*
+         * Parse straight out of the provided buffer, keeping only a trailing
+         * partial request.
+         */
+        struct buffer rbuf = conn->rbuf;
+
+        conn->rbuf = (struct buffer){ .data = data, .end = len, .cap = len };
+        ok = conn_process(conn);
+
+        struct buffer rest = conn->rbuf;
+
+        conn->rbuf = rbuf;
+        ok = ok && !buffer_append(&conn->rbuf, buffer_head(&rest),
+                                  buffer_len(&rest));
+    } else {
+        ok = !buffer_append(&conn->rbuf, data, len) && conn_process(conn);
+    }
+
+    uring_buf_ring_recycle(&reactor->bufs, bid);
+
+    if (!ok)
+        uring_conn_close(reactor, conn);
+    else
+        uring_conn_flush(reactor, conn);
+}
+
+/*
+ * Returns negative, setting `errno`, if the server can no longer run.
+ */
+static int uring_complete(struct reactor *reactor, struct io_uring_cqe *cqe)
+{
+    struct conn *conn = (struct conn *)(uintptr_t)(cqe->user_data &
+                                                   ~(uint64_t)URING_OP_MASK);
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+
+    switch (cqe->user_data & URING_OP_MASK) {
+    case URING_ACCEPT:
+    case URING_ACCEPT_UNIX:
+        if (!uring_accepted(reactor, cqe->res)) {
+            errno = -cqe->res;
+            return -1;
+        }
+        if (!more && !server_stopping)
+            uring_arm_accept(reactor, cqe->user_data & URING_OP_MASK);
+        return 0;
+    case URING_CLOSE:
+    case URING_PROBE:
+        return 0;
+    case URING_RECV:
+        if (!more)
+            conn->inflight--;
+
+        if (cqe->res > 0) {
+            uring_received(reactor, conn, cqe->flags >> IORING_CQE_BUFFER_SHIFT,
+                           cqe->res);
+        } else if (!cqe->res) {
+            conn->read_closed = true;
+            uring_conn_flush(reactor, conn);
+        } else if (cqe->res != -ENOBUFS) {
+            uring_conn_close(reactor, conn);
+        }
+
+        if (!more && !conn->closing && !conn->read_closed)
+            uring_arm_recv(reactor, conn);
+        break;
+    case URING_SEND:
+        conn->inflight--;
+
+        if (cqe->res < 0) {
+            uring_conn_close(reactor, conn);
+        } else {
+            trace_record(TRACE_WRITE, conn->id, cqe->res);
+            reply_consume(&conn->sending, cqe->res);
+
+            if (!reply_empty(&conn->sending) && !conn->closing) {
+                uring_send(reactor, conn);
+            } else {
+                if (reply_empty(&conn->wbuf))
+                    uring_conn_resume(reactor, conn);
+                uring_conn_flush(reactor, conn);
+            }
+        }
+        break;
+    case URING_CANCEL:
+        conn->inflight--;
+        break;
+    }
+
+    uring_conn_release(reactor, conn);
+    return 0;
+}
+
+int reactor_run_uring(struct reactor *reactor)
+{
+    uring_arm_accept(reactor, URING_ACCEPT);
+    if (reactor->unix_fd >= 0)
+        uring_arm_accept(reactor, URING_ACCEPT_UNIX);
+
+    while (!server_stopping) {
+        int ret = uring_submit(&reactor->ring, 1,
+                               reactor->replicas ? SERVER_REPL_MS
+                                                 : SERVER_TICK_MS);
+
+        if (ret < 0 && ret != -ETIME && ret != -EINTR && ret != -EBUSY) {
+            errno = -ret;
+            return -1;
+        }
+
+        struct io_uring_cqe *cqe;
+
+        while ((cqe = uring_peek(&reactor->ring))) {
+            struct io_uring_cqe copy = *cqe;
+
+            uring_cqe_seen(&reactor->ring);
+
+            if (uring_complete(reactor, &copy))
+                return -1;
+        }
+
+        uring_buf_ring_publish(&reactor->bufs);
+        reactor_tick(reactor);
+        uring_replicate(reactor);
+    }
+
+    return 0;
+}
+
+void reactor_uring_destroy(struct reactor *reactor)
+{
+    uring_buf_ring_destroy(&reactor->ring, &reactor->bufs);
+    uring_destroy(&reactor->ring);
+}
+
+#endif
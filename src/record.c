@@ -0,0 +1,250 @@
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "record.h"
+#include "sys.h"
+
+/*
+ * A thread's entries not yet written out, the first `len` of `entries`.
+ * `lock` is only ever contended by `record_close()`.
+ */
+struct record_buffer {
+    struct record_buffer *next;
+    pthread_mutex_t lock;
+    size_t len;
+    struct record_entry entries[RECORD_BUFFER_ENTRIES];
+};
+
+static _Atomic uint64_t record_generations;
+static _Thread_local struct record_buffer *record_current;
+static _Thread_local uint64_t record_current_generation;
+
+static int record_write(int fd, const void *data, size_t len)
+{
+    while (len) {
+        ssize_t n = write(fd, data, len);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        data = (const char *)data + n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int record_open(struct record *rec, const char *path)
+{
+    struct record_header header = {
+        .magic = RECORD_MAGIC,
+        .version = RECORD_VERSION,
+        .entry_size = sizeof(struct record_entry),
+        .started = time(NULL),
+    };
+
+    if ((rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        0644)) < 0)
+        return -1;
+
+    if (record_write(rec->fd, &header, sizeof(header))) {
+        int err = errno;
+
+        close(rec->fd);
+        errno = err;
+        return -1;
+    }
+
+    rec->started = monotonic_ns();
+    rec->generation = atomic_fetch_add(&record_generations, 1) + 1;
+    pthread_mutex_init(&rec->lock, NULL);
+    atomic_init(&rec->buffers, NULL);
+    atomic_init(&rec->written, 0);
+    atomic_init(&rec->dropped, 0);
+
+    return 0;
+}
+
+/*
+ * Writes out and empties `buf`, whose lock is held.
+ */
+static void record_flush(struct record *rec, struct record_buffer *buf)
+{
+    if (!buf->len)
+        return;
+
+    pthread_mutex_lock(&rec->lock);
+    int err = record_write(rec->fd, buf->entries,
+                           buf->len * sizeof(*buf->entries));
+    pthread_mutex_unlock(&rec->lock);
+
+    atomic_fetch_add(err ? &rec->dropped : &rec->written, buf->len);
+    buf->len = 0;
+}
+
+void record_close(struct record *rec)
+{
+    struct record_buffer *buf = atomic_load(&rec->buffers);
+
+    while (buf) {
+        struct record_buffer *next = buf->next;
+
+        pthread_mutex_lock(&buf->lock);
+        record_flush(rec, buf);
+        pthread_mutex_unlock(&buf->lock);
+
+        pthread_mutex_destroy(&buf->lock);
+        free(buf);
+        buf = next;
+    }
+
+    pthread_mutex_destroy(&rec->lock);
+    close(rec->fd);
+}
+
+/*
+ * Returns the calling thread's buffer, set up on its first request, or `NULL`
+ * if it could not be allocated.
+ */
+static struct record_buffer *record_buffer(struct record *rec)
+{
+    if (record_current && record_current_generation == rec->generation)
+        return record_current;
+
+    struct record_buffer *buf = malloc(sizeof(*buf));
+
+    if (!buf)
+        return NULL;
+
+    pthread_mutex_init(&buf->lock, NULL);
+    buf->len = 0;
+
+    buf->next = atomic_load(&rec->buffers);
+    while (!atomic_compare_exchange_weak(&rec->buffers, &buf->next, buf))
+        ;
+
+    record_current = buf;
+    record_current_generation = rec->generation;
+
+    return buf;
+}
+
+struct record_entry *record_reserve(struct record *rec, size_t count)
+{
+    struct record_buffer *buf = record_buffer(rec);
+
+    if (!buf) {
+        atomic_fetch_add(&rec->dropped, count);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&buf->lock);
+
+    if (RECORD_BUFFER_ENTRIES - buf->len < count)
+        record_flush(rec, buf);
+
+    struct record_entry *entries = &buf->entries[buf->len];
+
+    buf->len += count;
+    return entries;
+}
+
+void record_commit(struct record *rec)
+{
+    (void)rec;
+
+    pthread_mutex_unlock(&record_current->lock);
+}
+
+/*
+ * An entry with its place in the file, so entries arriving at once keep
+ * their order.
+ */
+struct record_sort {
+    struct record_entry entry;
+    size_t index;
+};
+
+static int record_sort_cmp(const void *a, const void *b)
+{
+    const struct record_sort *x = a;
+    const struct record_sort *y = b;
+
+    if (x->entry.ns != y->entry.ns)
+        return x->entry.ns < y->entry.ns ? -1 : 1;
+    if (x->entry.conn != y->entry.conn)
+        return x->entry.conn < y->entry.conn ? -1 : 1;
+
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/*
+ * A request's entries are buffered together, so arrive at once on one
+ * connection and stay together through the sort.
+ */
+struct record_entry *record_load(const char *path, size_t *count)
+{
+    struct record_header header;
+    struct record_entry *entries = NULL;
+    struct record_sort *sort = NULL;
+    FILE *file = fopen(path, "rb");
+    size_t len = 0, cap = 0;
+    int err = EINVAL;
+
+    if (!file)
+        return NULL;
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, RECORD_MAGIC, sizeof(header.magic)) ||
+        header.version != RECORD_VERSION ||
+        header.entry_size != sizeof(struct record_entry))
+        goto out;
+
+    while (true) {
+        if (len == cap) {
+            cap = max(cap * 2, (size_t)RECORD_BUFFER_ENTRIES);
+
+            struct record_sort *grown = realloc(sort, cap * sizeof(*sort));
+
+            if (!grown) {
+                err = ENOMEM;
+                goto out;
+            }
+            sort = grown;
+        }
+
+        if (fread(&sort[len].entry, sizeof(sort[len].entry), 1, file) != 1)
+            break;
+
+        sort[len].index = len;
+        len++;
+    }
+
+    if (ferror(file)) {
+        err = errno;
+        goto out;
+    }
+
+    qsort(sort, len, sizeof(*sort), record_sort_cmp);
+
+    if (!(entries = malloc(max(len, (size_t)1) * sizeof(*entries)))) {
+        err = ENOMEM;
+        goto out;
+    }
+
+    for (size_t i = 0; i < len; i++)
+        entries[i] = sort[i].entry;
+
+    *count = len;
+    err = 0;
+
+out:
+    free(sort);
+    fclose(file);
+    errno = err;
+    return entries;
+}
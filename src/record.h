@@ -0,0 +1,125 @@
+#ifndef MEMDB_RECORD_H_
+#define MEMDB_RECORD_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "common.h"
+
+/*
+ * Capture of the requests a server takes, for `replay` to play back against
+ * a server later.
+ *
+ * A recording keeps the shape of the traffic rather than its contents: when
+ * each request arrived, on which connection, what it did, and the hash and
+ * length of each key and the size of each value. A file is a
+ * `struct record_header` followed by `struct record_entry`s, in the byte
+ * order of the server that wrote it.
+ *
+ * Each thread executing commands appends to a buffer of its own, which is
+ * written out when full, and at the latest when the recording is closed. So
+ * entries come out ordered per thread, not overall, and readers sort them.
+ */
+
+#define RECORD_MAGIC "MEMDBREC"
+#define RECORD_VERSION 1
+#define RECORD_BUFFER_ENTRIES 512
+
+enum record_op {
+    RECORD_GET,
+    RECORD_SET,
+    RECORD_DEL,
+    RECORD_INCR,
+    RECORD_CMPXCHG,
+    RECORD_CAS,
+    RECORD_OTHER,
+    RECORD_OP_COUNT,
+};
+
+/*
+ * The request came over RESP, and the entry holds a further key of the
+ * request of the entry before it.
+ */
+#define RECORD_RESP 0x01
+#define RECORD_MORE 0x02
+
+struct record_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    int64_t started;
+};
+
+/*
+ * One key of a request, which came in `ns` after the recording started, the
+ * time it was read. A request on several keys has an entry per key, the first
+ * with `keys` set to how many, and the rest flagged `RECORD_MORE`, following
+ * it directly. Requests on no key, `RECORD_OTHER` ones, have one entry with
+ * `keys` zero.
+ */
+struct record_entry {
+    uint64_t ns;
+    uint32_t conn;
+    uint32_t key_hash;
+    uint32_t key_len;
+    uint32_t value_len;
+    uint16_t keys;
+    uint8_t op;
+    uint8_t flags;
+    uint32_t reserved;
+};
+
+struct record_buffer;
+
+/*
+ * An open recording. `written` counts entries written out, and `dropped`
+ * those lost to allocation or write failures. Buffers are told apart from
+ * those of other recordings by `generation`, as commands' statistics are.
+ */
+struct record {
+    int fd;
+    uint64_t started;
+    uint64_t generation;
+    pthread_mutex_t lock;
+    _Atomic(struct record_buffer *) buffers;
+    _Atomic uint64_t written;
+    _Atomic uint64_t dropped;
+};
+
+/*
+ * Creates or truncates the file at `path`, and writes its header. Returns
+ * non-zero on failure, setting `errno`.
+ */
+int record_open(struct record *rec, const char *path);
+
+/*
+ * Writes out what every thread has buffered and closes the file. No thread
+ * may be adding entries meanwhile.
+ */
+void record_close(struct record *rec);
+
+/*
+ * Makes room for the `count` entries of a request in the calling thread's
+ * buffer, at most `RECORD_BUFFER_ENTRIES`, and returns them to be filled in,
+ * or `NULL` if the buffer could not be allocated. Entries returned are added
+ * once the thread calls `record_commit()`, which it must before adding more.
+ */
+struct record_entry *record_reserve(struct record *rec, size_t count);
+void record_commit(struct record *rec);
+
+/*
+ * Nanoseconds since the recording started of `monotonic_ns()` time `ns`.
+ */
+static inline uint64_t record_ns(const struct record *rec, uint64_t ns)
+{
+    return ns > rec->started ? ns - rec->started : 0;
+}
+
+/*
+ * Reads the recording at `path`, returning its entries, to be freed by the
+ * caller, and their count in `*count`. Entries are sorted by arrival, those
+ * of a request kept together. Returns `NULL` on failure, setting `errno`, to
+ * `EINVAL` if the file is not a recording this version can read.
+ */
+struct record_entry *record_load(const char *path, size_t *count);
+
+#endif
@@ -0,0 +1,719 @@
+#include "repl.h"
+#include "sys.h"
+
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * A random stream id, never zero.
+ */
+static uint64_t repl_new_id()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    uint64_t x = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+    x ^= (uint64_t)getpid() << 40 ^ monotonic_ns();
+    x = (x ^ x >> 30) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ x >> 27) * 0x94d049bb133111ebull;
+    x ^= x >> 31;
+
+    return x ? x : 1;
+}
+
+int repl_init(struct repl *repl, struct db *db, size_t capacity)
+{
+    size_t size = REPL_MIN_BACKLOG;
+
+    while (size < capacity)
+        size *= 2;
+
+    repl->db = db;
+    pthread_mutex_init(&repl->lock, NULL);
+    repl->id = repl_new_id();
+    repl->log = NULL;
+    repl->capacity = size;
+    atomic_init(&repl->end, 0);
+    atomic_init(&repl->logging, false);
+    repl->senders = NULL;
+    repl->sender_count = 0;
+    atomic_init(&repl->skipped, 0);
+
+    repl->following = false;
+    repl->host = NULL;
+    repl->port = NULL;
+    atomic_init(&repl->stopping, false);
+    repl->link = REPL_LINK_DOWN;
+    repl->primary_id = 0;
+    repl->offset = 0;
+    repl->syncs = 0;
+
+    db->changed = repl_changed;
+    db->changed_arg = repl;
+
+    return 0;
+}
+
+void repl_destroy(struct repl *repl)
+{
+    if (repl->following) {
+        atomic_store(&repl->stopping, true);
+        pthread_join(repl->thread, NULL);
+    }
+
+    if (repl->db->changed_arg == repl)
+        repl->db->changed = NULL;
+
+    free(repl->host);
+    free(repl->log);
+    pthread_mutex_destroy(&repl->lock);
+}
+
+/*
+ * Appends to the backlog with `lock` held. Of anything longer than the
+ * backlog only the end is kept, the rest being lost to every replica anyway.
+ */
+static void repl_log_write(struct repl *repl, const void *src, size_t len)
+{
+    uint64_t end = atomic_load_explicit(&repl->end, memory_order_relaxed);
+
+    if (len > repl->capacity) {
+        src = (const char *)src + len - repl->capacity;
+        end += len - repl->capacity;
+        len = repl->capacity;
+    }
+
+    size_t pos = end & (repl->capacity - 1);
+    size_t first = min(len, repl->capacity - pos);
+
+    memcpy(repl->log + pos, src, first);
+    memcpy(repl->log, (const char *)src + first, len - first);
+
+    atomic_store_explicit(&repl->end, end + len, memory_order_release);
+}
+
+/*
+ * Remaining time to live of `val` in milliseconds, rounded up so a value
+ * about to expire does not become one that never does, or zero for none.
+ */
+static uint64_t repl_ttl_ms(const struct db_value *val)
+{
+    if (!val->expires)
+        return 0;
+
+    uint64_t now = monotonic_ns();
+
+    return val->expires > now ? (val->expires - now + 999999) / 1000000 : 1;
+}
+
+/*
+ * The request that recreates the change to `key`, or `false` if it cannot be
+ * sent.
+ */
+static bool repl_record(const struct db_key *key, const struct db_value *val,
+                        struct proto_header *hdr)
+{
+    if (key->len > PROTO_MAX_KEY || (val && val->len > PROTO_MAX_VALUE))
+        return false;
+
+    *hdr = (struct proto_header){
+        .magic = PROTO_REQUEST_MAGIC,
+        .opcode = val ? PROTO_SET : PROTO_DEL,
+        .key_len = key->len,
+        .val_len = val ? val->len : 0,
+        .extra = val ? repl_ttl_ms(val) : 0,
+    };
+
+    return true;
+}
+
+void repl_changed(const struct db_key *key, const struct db_value *val,
+                  void *arg)
+{
+    struct repl *repl = arg;
+    struct proto_header hdr;
+
+    if (!atomic_load_explicit(&repl->logging, memory_order_acquire))
+        return;
+
+    if (!repl_record(key, val, &hdr)) {
+        atomic_fetch_add(&repl->skipped, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&repl->lock);
+    repl_log_write(repl, &hdr, sizeof(hdr));
+    repl_log_write(repl, key->data, key->len);
+    if (val)
+        repl_log_write(repl, val->data, val->len);
+    pthread_mutex_unlock(&repl->lock);
+}
+
+int repl_sender_attach(struct repl *repl, struct repl_sender *sender,
+                       const struct proto_request *req, struct buffer *out)
+{
+    uint64_t id = 0;
+
+    if (repl->following)
+        return 1;
+
+    if (req->val_len == sizeof(id))
+        memcpy(&id, req->val, sizeof(id));
+
+    pthread_mutex_lock(&repl->lock);
+
+    if (!repl->log && !(repl->log = malloc(repl->capacity))) {
+        pthread_mutex_unlock(&repl->lock);
+        return 1;
+    }
+
+    uint64_t end = atomic_load_explicit(&repl->end, memory_order_relaxed);
+
+    /*
+     * From here on every change is logged; any made before is in the table
+     * by the time the walk gets to its shard.
+     */
+    atomic_store_explicit(&repl->logging, true, memory_order_release);
+
+    sender->walking = id != repl->id || req->extra > end ||
+                      end - req->extra > repl->capacity;
+    sender->offset = sender->walking ? end : req->extra;
+    sender->acked = 0;
+    sender->walk = (struct db_walk){0};
+
+    struct proto_response res = {
+        .opcode = PROTO_SYNC,
+        .status = PROTO_OK,
+        .id = req->id,
+        .extra = sender->offset,
+        .val = (const char *)&repl->id,
+        .val_len = sizeof(repl->id),
+    };
+
+    if (proto_write_response(out, &res)) {
+        pthread_mutex_unlock(&repl->lock);
+        return 1;
+    }
+
+    sender->next = repl->senders;
+    repl->senders = sender;
+    repl->sender_count++;
+
+    pthread_mutex_unlock(&repl->lock);
+
+    return 0;
+}
+
+void repl_sender_detach(struct repl *repl, struct repl_sender *sender)
+{
+    pthread_mutex_lock(&repl->lock);
+
+    for (struct repl_sender **at = &repl->senders; *at; at = &(*at)->next) {
+        if (*at == sender) {
+            *at = sender->next;
+            repl->sender_count--;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&repl->lock);
+}
+
+static int repl_send_key(const struct db_key *key, const struct db_value *val,
+                         void *arg)
+{
+    struct buffer *out = arg;
+    struct proto_header hdr;
+
+    if (!repl_record(key, val, &hdr))
+        return 0;
+
+    if (buffer_reserve(out, sizeof(hdr) + key->len + val->len))
+        return 1;
+
+    buffer_append(out, &hdr, sizeof(hdr));
+    buffer_append(out, key->data, key->len);
+    buffer_append(out, val->data, val->len);
+
+    return 0;
+}
+
+int repl_sender_fill(struct repl *repl, struct repl_sender *sender,
+                     struct buffer *out, size_t limit)
+{
+    bool walked = false;
+
+    /*
+     * Walked without `lock`, which is taken under the shard locks.
+     */
+    while (sender->walking && !walked) {
+        if (buffer_len(out) >= limit)
+            return 1;
+
+        int more = db_walk(repl->db, &sender->walk, REPL_WALK_BUCKETS,
+                           repl_send_key, out);
+
+        if (more < 0)
+            return -1;
+
+        if (!more) {
+            struct proto_request marker = {.opcode = PROTO_NOOP};
+
+            if (proto_write_request(out, &marker))
+                return -1;
+
+            walked = true;
+        }
+    }
+
+    pthread_mutex_lock(&repl->lock);
+
+    if (walked)
+        sender->walking = false;
+
+    uint64_t end = atomic_load_explicit(&repl->end, memory_order_relaxed);
+
+    if (end - sender->offset > repl->capacity) {
+        pthread_mutex_unlock(&repl->lock);
+        return -1;
+    }
+
+    size_t len = min(end - sender->offset,
+                     limit - min(limit, buffer_len(out)));
+
+    if (buffer_reserve(out, len)) {
+        pthread_mutex_unlock(&repl->lock);
+        return -1;
+    }
+
+    size_t pos = sender->offset & (repl->capacity - 1);
+    size_t first = min(len, repl->capacity - pos);
+
+    buffer_append(out, repl->log + pos, first);
+    buffer_append(out, repl->log, len - first);
+    sender->offset += len;
+
+    pthread_mutex_unlock(&repl->lock);
+
+    return sender->offset != end;
+}
+
+void repl_sender_ack(struct repl *repl, struct repl_sender *sender,
+                     const struct proto_request *req)
+{
+    pthread_mutex_lock(&repl->lock);
+    if (req->extra <= sender->offset)
+        sender->acked = req->extra;
+    pthread_mutex_unlock(&repl->lock);
+}
+
+int repl_handshake(struct repl *repl, struct buffer *out)
+{
+    pthread_mutex_lock(&repl->lock);
+
+    struct proto_request req = {
+        .opcode = PROTO_SYNC,
+        .extra = repl->offset,
+        .val = (const char *)&repl->primary_id,
+        .val_len = repl->primary_id ? sizeof(repl->primary_id) : 0,
+    };
+    int err = proto_write_request(out, &req);
+
+    if (!err)
+        repl->link = REPL_LINK_CONNECTED;
+
+    pthread_mutex_unlock(&repl->lock);
+
+    return err;
+}
+
+/*
+ * Sets the link's state, and where the stream continues.
+ */
+static void repl_set_link(struct repl *repl, enum repl_link link, uint64_t id,
+                          uint64_t offset)
+{
+    pthread_mutex_lock(&repl->lock);
+    repl->link = link;
+    repl->primary_id = id;
+    repl->offset = offset;
+    if (link == REPL_LINK_SYNCING)
+        repl->syncs++;
+    pthread_mutex_unlock(&repl->lock);
+}
+
+/*
+ * Applies one request of the snapshot or stream.
+ */
+static int repl_apply_request(struct repl *repl, const struct proto_request *req)
+{
+    struct db_key key;
+
+    db_key_init(&key, req->key, req->key_len);
+
+    switch (req->opcode) {
+    case PROTO_SET: {
+        uint64_t expires = 0;
+
+        if (req->extra &&
+            (__builtin_mul_overflow(req->extra, 1000000, &expires) ||
+             __builtin_add_overflow(expires, monotonic_ns(), &expires)))
+            expires = UINT64_MAX;
+
+        if (db_set(repl->db, &key, req->val, req->val_len, expires)) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        return 0;
+    }
+    case PROTO_DEL:
+        db_del(repl->db, &key);
+        return 0;
+    }
+
+    errno = EPROTO;
+    return -1;
+}
+
+ssize_t repl_apply(struct repl *repl, const char *buf, size_t len)
+{
+    size_t used = 0;
+
+    pthread_mutex_lock(&repl->lock);
+
+    enum repl_link link = repl->link;
+    uint64_t id = repl->primary_id;
+    uint64_t offset = repl->offset;
+
+    pthread_mutex_unlock(&repl->lock);
+
+    if (link == REPL_LINK_CONNECTED) {
+        struct proto_response res;
+        ssize_t n = proto_parse_response(buf, len, &res);
+
+        if (n <= 0)
+            goto out;
+
+        if (res.opcode != PROTO_SYNC || res.status != PROTO_OK ||
+            res.val_len != sizeof(id)) {
+            errno = EPROTO;
+            return -1;
+        }
+
+        uint64_t primary_id;
+
+        memcpy(&primary_id, res.val, sizeof(primary_id));
+        used += n;
+
+        /*
+         * Anything but the stream where this side left off starts with a
+         * snapshot, replacing the table. The snapshot only counts once
+         * complete.
+         */
+        if (primary_id == id && res.extra == offset) {
+            link = REPL_LINK_UP;
+        } else {
+            db_clear(repl->db);
+            link = REPL_LINK_SYNCING;
+            id = primary_id;
+            offset = res.extra;
+        }
+
+        repl_set_link(repl, link, id, offset);
+    }
+
+    while (used < len) {
+        struct proto_request req;
+        ssize_t n = proto_parse_request(buf + used, len - used, &req);
+
+        if (n < 0) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (!n)
+            break;
+
+        if (link == REPL_LINK_SYNCING && req.opcode == PROTO_NOOP) {
+            link = REPL_LINK_UP;
+        } else if (repl_apply_request(repl, &req)) {
+            return -1;
+        } else if (link == REPL_LINK_UP) {
+            offset += n;
+        }
+
+        used += n;
+    }
+
+    if (link == REPL_LINK_UP)
+        repl_set_link(repl, link, id, offset);
+
+out:
+    return used;
+}
+
+int repl_ack(struct repl *repl, struct buffer *out)
+{
+    pthread_mutex_lock(&repl->lock);
+
+    struct proto_request req = {
+        .opcode = PROTO_ACK,
+        .extra = repl->offset,
+    };
+    bool up = repl->link == REPL_LINK_UP;
+
+    pthread_mutex_unlock(&repl->lock);
+
+    return up ? proto_write_request(out, &req) : 0;
+}
+
+#define REPL_READ_SIZE (64 * 1024)
+
+/*
+ * Connects to the primary, returning the socket or negative on failure.
+ */
+static int repl_connect(struct repl *repl)
+{
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *addrs;
+    int fd = -1;
+
+    if (getaddrinfo(repl->host, repl->port, &hints, &addrs))
+        return -1;
+
+    /*
+     * Timeouts bound the connect, and let the thread send acknowledgements
+     * and notice it is stopping while the primary is quiet.
+     */
+    struct timeval send_timeout = { .tv_sec = REPL_RETRY_MS / 1000 };
+    struct timeval recv_timeout = { .tv_usec = REPL_ACK_MS * 1000 };
+
+    for (struct addrinfo *ai = addrs; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        if (!setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout,
+                        sizeof(send_timeout)) &&
+            !setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &recv_timeout,
+                        sizeof(recv_timeout)) &&
+            !setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1},
+                        sizeof(int)) &&
+            !connect(fd, ai->ai_addr, ai->ai_addrlen))
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(addrs);
+
+    return fd;
+}
+
+/*
+ * Writes out all of `out`. Returns non-zero on failure.
+ */
+static int repl_send(int fd, struct buffer *out)
+{
+    while (buffer_len(out)) {
+        ssize_t n = send(fd, buffer_head(out), buffer_len(out), MSG_NOSIGNAL);
+
+        if (n < 0 && errno != EINTR)
+            return -1;
+        if (n > 0)
+            buffer_consume(out, n);
+    }
+
+    return 0;
+}
+
+/*
+ * Follows the primary over `fd` until the link fails or the thread is
+ * stopped.
+ */
+static void repl_stream(struct repl *repl, int fd)
+{
+    struct buffer in, out;
+    uint64_t next_ack = 0;
+
+    buffer_init(&in);
+    buffer_init(&out);
+
+    if (repl_handshake(repl, &out) || repl_send(fd, &out))
+        goto out;
+
+    while (!atomic_load(&repl->stopping)) {
+        if (buffer_reserve(&in, REPL_READ_SIZE))
+            break;
+
+        ssize_t n = recv(fd, buffer_tail(&in), buffer_space(&in), 0);
+
+        if (!n || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                   errno != EINTR))
+            break;
+
+        if (n > 0) {
+            in.end += n;
+
+            ssize_t used = repl_apply(repl, buffer_head(&in), buffer_len(&in));
+
+            if (used < 0)
+                break;
+
+            buffer_consume(&in, used);
+
+            /*
+             * A request larger than the buffer needs room for the rest.
+             */
+            struct proto_header hdr;
+
+            if (buffer_len(&in) >= sizeof(hdr)) {
+                memcpy(&hdr, buffer_head(&in), sizeof(hdr));
+
+                size_t size = sizeof(hdr) + hdr.key_len + hdr.val_len;
+
+                if (size > buffer_len(&in) + buffer_space(&in) &&
+                    buffer_reserve(&in, size - buffer_len(&in)))
+                    break;
+            }
+        }
+
+        uint64_t now = monotonic_ns();
+
+        if (now >= next_ack) {
+            if (repl_ack(repl, &out) || repl_send(fd, &out))
+                break;
+            next_ack = now + REPL_ACK_MS * 1000000ull;
+        }
+    }
+
+out:
+    buffer_destroy(&in);
+    buffer_destroy(&out);
+}
+
+static void *repl_follow_main(void *arg)
+{
+    struct repl *repl = arg;
+
+    while (!atomic_load(&repl->stopping)) {
+        int fd = repl_connect(repl);
+
+        if (fd >= 0) {
+            repl_stream(repl, fd);
+            close(fd);
+        }
+
+        /*
+         * A snapshot cut short leaves the table partial, so the next link
+         * takes another.
+         */
+        pthread_mutex_lock(&repl->lock);
+        if (repl->link != REPL_LINK_UP)
+            repl->primary_id = 0;
+        repl->link = REPL_LINK_DOWN;
+        pthread_mutex_unlock(&repl->lock);
+
+        for (int i = 0; i < REPL_RETRY_MS / REPL_ACK_MS &&
+                        !atomic_load(&repl->stopping); i++)
+            nanosleep(&(struct timespec){ .tv_nsec = REPL_ACK_MS * 1000000 },
+                      NULL);
+    }
+
+    return NULL;
+}
+
+int repl_follow(struct repl *repl, const char *address)
+{
+    const char *colon = strrchr(address, ':');
+
+    if (!colon || colon == address || !colon[1]) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!(repl->host = strdup(address)))
+        return -1;
+
+    repl->host[colon - address] = '\0';
+    repl->port = repl->host + (colon - address) + 1;
+
+    /*
+     * Brackets around an IPv6 address are for the colon's sake only.
+     */
+    size_t host_len = colon - address;
+
+    if (host_len >= 2 && repl->host[0] == '[' &&
+        repl->host[host_len - 1] == ']') {
+        repl->host[host_len - 1] = '\0';
+        memmove(repl->host, repl->host + 1, host_len - 1);
+    }
+
+    repl->db->changed = NULL;
+    repl->following = true;
+
+    int err = pthread_create(&repl->thread, NULL, repl_follow_main, repl);
+
+    if (err) {
+        repl->following = false;
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+static const char *const repl_link_names[] = {
+    [REPL_LINK_DOWN] = "down",
+    [REPL_LINK_CONNECTED] = "connected",
+    [REPL_LINK_SYNCING] = "syncing",
+    [REPL_LINK_UP] = "up",
+};
+
+void repl_stats_print(struct repl *repl, FILE *out)
+{
+    pthread_mutex_lock(&repl->lock);
+
+    if (repl->following) {
+        fprintf(out, "role:replica\n");
+        fprintf(out, "primary_host:%s\n", repl->host);
+        fprintf(out, "primary_port:%s\n", repl->port);
+        fprintf(out, "primary_link:%s\n", repl_link_names[repl->link]);
+        fprintf(out, "repl_id:%016" PRIx64 "\n", repl->primary_id);
+        fprintf(out, "repl_offset:%" PRIu64 "\n", repl->offset);
+        fprintf(out, "repl_syncs:%zu\n", repl->syncs);
+    } else {
+        uint64_t end = atomic_load_explicit(&repl->end, memory_order_relaxed);
+        size_t i = 0;
+
+        fprintf(out, "role:primary\n");
+        fprintf(out, "repl_id:%016" PRIx64 "\n", repl->id);
+        fprintf(out, "repl_offset:%" PRIu64 "\n", end);
+        fprintf(out, "repl_backlog_size:%zu\n", repl->capacity);
+        fprintf(out, "repl_backlog_start:%" PRIu64 "\n",
+                end - min(end, (uint64_t)repl->capacity));
+        fprintf(out, "repl_skipped:%zu\n", atomic_load(&repl->skipped));
+        fprintf(out, "replicas:%zu\n", repl->sender_count);
+
+        for (struct repl_sender *s = repl->senders; s; s = s->next, i++)
+            fprintf(out,
+                    "replica%zu:state=%s,offset=%" PRIu64 ",acked=%" PRIu64
+                    ",lag=%" PRIu64 "\n",
+                    i, s->walking ? "syncing" : "streaming", s->offset,
+                    s->acked, end - s->acked);
+    }
+
+    pthread_mutex_unlock(&repl->lock);
+}
@@ -0,0 +1,188 @@
+#ifndef MEMDB_REPL_H_
+#define MEMDB_REPL_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include "common.h"
+#include "buffer.h"
+#include "db.h"
+#include "protocol.h"
+
+/*
+ * Asynchronous replication to read replicas.
+ *
+ * A primary records every change to its keys as one endless stream of binary
+ * protocol requests, a `SET` of the key's value with its remaining time to
+ * live, or a `DEL`, and keeps the tail of it in a ring, the backlog. Bytes of
+ * the stream are numbered by their offset from its start, and the stream by a
+ * random id, so a replica reconnecting can say where it left off. If the
+ * backlog still reaches back that far the primary resumes from there;
+ * otherwise it first walks the table sending every key, then the stream from
+ * where it stood when the walk began. A change made during the walk may so
+ * be applied twice, to the same effect.
+ *
+ * Changes are logged under their key's shard lock, so the stream orders the
+ * changes to a key as they were made. Logging starts with the first replica,
+ * and costs nothing until then.
+ *
+ * A replica follows its primary from a thread of its own, applying the
+ * stream to its table, acknowledging the offset applied every
+ * `REPL_ACK_MS`, and reconnecting every `REPL_RETRY_MS` while the link is
+ * down. Replicas do not log, so cannot be followed in turn.
+ */
+
+#define REPL_BACKLOG_SIZE (16 << 20)
+#define REPL_MIN_BACKLOG (64 * 1024)
+#define REPL_ACK_MS 100
+#define REPL_RETRY_MS 1000
+
+/*
+ * Buckets walked per `db_walk()` call while sending a snapshot.
+ */
+#define REPL_WALK_BUCKETS 64
+
+/*
+ * A replica's link, on the primary. `offset` is the next byte of the stream
+ * to send, and `acked` the offset the replica last acknowledged. While
+ * `walking`, a snapshot is being sent from `walk`, and `offset` is where the
+ * stream picks up after it. Owned by whichever thread is servicing the
+ * link, but `offset`, `acked` and `walking` are only written under
+ * `repl::lock`, for `INFO`.
+ */
+struct repl_sender {
+    struct repl_sender *next;
+    uint64_t offset;
+    uint64_t acked;
+    bool walking;
+    struct db_walk walk;
+};
+
+enum repl_link {
+    REPL_LINK_DOWN,
+    REPL_LINK_CONNECTED,
+    REPL_LINK_SYNCING,
+    REPL_LINK_UP,
+};
+
+struct repl {
+    struct db *db;
+    pthread_mutex_t lock;
+
+    /*
+     * Primary side. `log` holds the stream from `end` less `capacity`, a
+     * power of two, up to `end`, and is allocated by the first replica to
+     * attach, which sets `logging`. `end` only changes under `lock`, but may
+     * be read without it.
+     */
+    uint64_t id;
+    char *log;
+    size_t capacity;
+    _Atomic uint64_t end;
+    atomic_bool logging;
+    struct repl_sender *senders;
+    size_t sender_count;
+
+    /*
+     * Changes to keys or values too long for the binary protocol, which
+     * replicas do not get.
+     */
+    atomic_size_t skipped;
+
+    /*
+     * Replica side, if `following` the primary at `host`, `port`. `link`,
+     * `primary_id`, `offset` and `syncs` are written by the thread following
+     * it, under `lock`. `offset` is the next byte of the stream to apply.
+     * A link dropped before its snapshot is complete clears `primary_id`,
+     * so the next one takes another.
+     */
+    bool following;
+    char *host;
+    char *port;
+    pthread_t thread;
+    atomic_bool stopping;
+    enum repl_link link;
+    uint64_t primary_id;
+    uint64_t offset;
+    size_t syncs;
+};
+
+/*
+ * Sets up replication of `db` with a backlog of `capacity` bytes, rounded up
+ * to a power of two, and hooks the table's changes. Returns non-zero on
+ * failure.
+ */
+int repl_init(struct repl *repl, struct db *db, size_t capacity);
+
+/*
+ * Stops following any primary. Senders must have been detached.
+ */
+void repl_destroy(struct repl *repl);
+
+/*
+ * Turns this side into a replica of the primary at `address`, `host:port`,
+ * starting the thread that follows it. The table stops being logged. Returns
+ * non-zero on failure, setting `errno`.
+ */
+int repl_follow(struct repl *repl, const char *address);
+
+/*
+ * Logs a change to `key`, as `db::changed`.
+ */
+void repl_changed(const struct db_key *key, const struct db_value *val,
+                  void *arg);
+
+/*
+ * Offset of the end of the stream, which only grows.
+ */
+static inline uint64_t repl_end(struct repl *repl)
+{
+    return atomic_load_explicit(&repl->end, memory_order_acquire);
+}
+
+/*
+ * Attaches `sender` for the `SYNC` request `req`, appending the response to
+ * `out`. The stream resumes where the replica left off if the backlog still
+ * holds it, and is otherwise preceded by a snapshot. Returns non-zero on
+ * allocation failure, or if this side is a replica itself, having appended
+ * nothing.
+ */
+int repl_sender_attach(struct repl *repl, struct repl_sender *sender,
+                       const struct proto_request *req, struct buffer *out);
+void repl_sender_detach(struct repl *repl, struct repl_sender *sender);
+
+/*
+ * Appends what is next for the replica to `out` until it holds `limit`
+ * bytes or there is nothing more: the snapshot, a `NOOP` ending it, then the
+ * stream. Returns positive if there is more, zero if there is not, and
+ * negative on allocation failure or if the replica fell so far behind that
+ * the backlog no longer has what it needs, in which case the link must be
+ * dropped.
+ */
+int repl_sender_fill(struct repl *repl, struct repl_sender *sender,
+                     struct buffer *out, size_t limit);
+
+/*
+ * Records an `ACK` from the replica.
+ */
+void repl_sender_ack(struct repl *repl, struct repl_sender *sender,
+                     const struct proto_request *req);
+
+/*
+ * Replica side, for the thread following the primary. `repl_handshake()`
+ * appends the `SYNC` request to start a link. `repl_apply()` applies what
+ * the primary sent from the front of `buf`, returning how many bytes it
+ * consumed, or negative if the link must be dropped, on a malformed or
+ * failed request, setting `errno`. `repl_ack()` appends an `ACK` of the
+ * offset applied, if the link is up.
+ */
+int repl_handshake(struct repl *repl, struct buffer *out);
+ssize_t repl_apply(struct repl *repl, const char *buf, size_t len);
+int repl_ack(struct repl *repl, struct buffer *out);
+
+/*
+ * Appends the replication section of `INFO` to `out`.
+ */
+void repl_stats_print(struct repl *repl, FILE *out);
+
+#endif
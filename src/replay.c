@@ -0,0 +1,1194 @@
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "histogram.h"
+#include "memdb.h"
+#include "protocol.h"
+#include "record.h"
+#include "resp.h"
+#include "sys.h"
+
+/*
+ * Plays a recording made with `mem-db-server --record` back against a server.
+ *
+ * Requests go out when they arrived in the recording, sped up or slowed down
+ * by `speed`, each on the connection its recorded one maps to, and are timed
+ * from when they were due rather than sent. So a server falling behind shows
+ * in the latencies instead of slowing the replay down, as long as the
+ * connections' pipelines have room. At a speed of zero requests go out as
+ * fast as the pipelines allow, timed from when they are sent.
+ *
+ * Keys are named after their recorded hash and padded to their recorded
+ * length, so the same keys come back as often, in the same order; values are
+ * filler of the recorded size.
+ */
+
+#define REPLAY_POLL_MS 100
+#define REPLAY_DRAIN_NS 5000000000ull
+
+/*
+ * Requests kept in flight while prefilling, and the size of values prefilled
+ * for keys never set in the recording.
+ */
+#define REPLAY_PREFILL_PIPELINE 256
+#define REPLAY_VALUE_SIZE 100
+
+/*
+ * `protocol` is `MEMDB_RESP`, zero for binary, or negative to speak on each
+ * connection what its first request came over.
+ */
+struct replay_config {
+    const char *path;
+    const char *host;
+    const char *port;
+    int protocol;
+    long threads;
+    long connections;
+    long pipeline;
+    double speed;
+    bool prefill;
+    long value_size;
+};
+
+const char version[] = "1.0.0";
+const char usage[] =
+    "Usage: mem-db-replay [options] <recording>\n"
+    "\n"
+    "Plays requests recorded with mem-db-server --record back against a\n"
+    "server, and reports throughput and latency.\n"
+    "\n"
+    " -H, --host <hostname>         Server hostname. (Default: 127.0.0.1)\n"
+    " -p, --port <port>             Server port. (Default: 11111)\n"
+    " -P, --protocol <name>         'binary', 'resp', or 'recorded' for what\n"
+    "                               each connection's first request came\n"
+    "                               over. (Default: recorded)\n"
+    " -t, --threads <count>         Client threads. (Default: 4)\n"
+    " -c, --connections <count>     Connections the recorded ones are spread\n"
+    "                               over. (Default: as many as recorded, up\n"
+    "                               to 50)\n"
+    " -d, --pipeline <depth>        Requests in flight per connection, past\n"
+    "                               which requests due wait. (Default: 64)\n"
+    " -x, --speed <factor>          Replay this many times as fast as\n"
+    "                               recorded, or 0 for as fast as possible.\n"
+    "                               (Default: 1)\n"
+    " -f, --prefill                 First set the keys the recording reads\n"
+    "                               before setting them.\n"
+    " -s, --value-size <bytes>      Size of values prefilled for keys the\n"
+    "                               recording never sets. (Default: 100)\n"
+    " -h, --help                    Display this help message.\n"
+    " -v, --version                 Display versioning information.";
+
+static const char *const replay_op_names[RECORD_OP_COUNT] = {
+    [RECORD_GET] = "GET",         [RECORD_SET] = "SET",
+    [RECORD_DEL] = "DEL",         [RECORD_INCR] = "INCR",
+    [RECORD_CMPXCHG] = "CMPXCHG", [RECORD_CAS] = "CAS",
+    [RECORD_OTHER] = "OTHER",
+};
+
+/*
+ * A request in flight, and when it was due.
+ */
+struct replay_slot {
+    uint8_t op;
+    uint64_t due;
+};
+
+/*
+ * A connection, with the requests it is to send, by the index of their first
+ * entry, `next` being the next to go. Those in flight are in a ring of
+ * `depth` from `head`, in the order the library calls them back.
+ */
+struct replay_conn {
+    struct memdb_conn conn;
+    struct replay_thread *thread;
+    bool resp;
+    size_t *requests;
+    size_t count;
+    size_t next;
+    struct replay_slot *slots;
+    size_t depth;
+    size_t head;
+    size_t inflight;
+};
+
+struct replay_stats {
+    struct histogram latency[RECORD_OP_COUNT];
+    uint64_t misses;
+    uint64_t errors;
+    uint64_t lag;
+};
+
+/*
+ * Shared by the threads. `start` is when the first request is due, set with
+ * `go` once every thread is connected. `value` is filler as long as any value
+ * in the recording, and `key_cap` the length of its longest key. `requests`
+ * holds those of every connection, each its own `count` of them in turn.
+ */
+struct replay {
+    const struct replay_config *cfg;
+    const struct record_entry *entries;
+    size_t entry_count;
+    size_t *requests;
+    uint64_t first_ns;
+    char *value;
+    size_t key_cap;
+    atomic_size_t ready;
+    atomic_bool go;
+    atomic_bool failed;
+    uint64_t start;
+};
+
+/*
+ * `lag` is how late the latest request went out.
+ */
+struct replay_thread {
+    struct replay *replay;
+    pthread_t thread;
+    struct replay_conn *conns;
+    struct pollfd *fds;
+    struct replay_slot *slots;
+    size_t conn_count;
+    char *key;
+    struct buffer scratch;
+    struct buffer command;
+    struct replay_stats stats;
+    uint64_t now;
+    uint64_t stopped;
+    int err;
+};
+
+static void replay_config_init(struct replay_config *cfg)
+{
+    cfg->path = NULL;
+    cfg->host = "127.0.0.1";
+    cfg->port = "11111";
+    cfg->protocol = -1;
+    cfg->threads = 4;
+    cfg->connections = 50;
+    cfg->pipeline = 64;
+    cfg->speed = 1;
+    cfg->prefill = false;
+    cfg->value_size = REPLAY_VALUE_SIZE;
+}
+
+/*
+ * Writes the name of the key of `entry` to `name`, the hash in hex repeated
+ * to the key's length, returning the length.
+ */
+static size_t replay_key_name(char *name, const struct record_entry *entry)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < entry->key_len; i++)
+        name[i] = digits[entry->key_hash >> (28 - 4 * (i % 8)) & 0xf];
+
+    return entry->key_len;
+}
+
+/*
+ * Entries the request starting at `first` spans.
+ */
+static size_t replay_span(const struct record_entry *first)
+{
+    return max((size_t)first->keys, (size_t)1);
+}
+
+/*
+ * Encodes the request starting at `first` as a RESP command to `out`.
+ * Returns non-zero on allocation failure.
+ */
+static int replay_encode_resp(struct replay_thread *t, struct buffer *out,
+                              const struct record_entry *first)
+{
+    static const char *const names[2][RECORD_OP_COUNT] = {
+        { "GET", "SET", "DEL", "INCR", "CMPXCHG", "CAS", "PING" },
+        { "MGET", "MSET", "DEL", "MINCRBY", "CMPXCHG", "CAS", "PING" },
+    };
+    const char *value = t->replay->value;
+    size_t keys = first->keys;
+    bool multi = keys > 1;
+    size_t per_key = 1;
+
+    if (first->op == RECORD_SET || (first->op == RECORD_INCR && multi))
+        per_key = 2;
+    else if (first->op == RECORD_CMPXCHG || first->op == RECORD_CAS)
+        per_key = 3;
+
+    size_t argc = 1 + keys * per_key;
+    const char *name = names[multi][first->op];
+
+    if (resp_array(out, argc) || resp_bulk(out, name, strlen(name)))
+        return 1;
+
+    for (size_t i = 0; i < keys; i++) {
+        const struct record_entry *entry = &first[i];
+        size_t len = replay_key_name(t->key, entry);
+
+        if (resp_bulk(out, t->key, len))
+            return 1;
+
+        switch (first->op) {
+        case RECORD_SET:
+            if (resp_bulk(out, value, entry->value_len))
+                return 1;
+            break;
+        case RECORD_INCR:
+            if (multi && resp_bulk(out, "1", 1))
+                return 1;
+            break;
+        case RECORD_CMPXCHG:
+            if (resp_bulk(out, "0", 1) || resp_bulk(out, "1", 1))
+                return 1;
+            break;
+        case RECORD_CAS:
+            if (resp_bulk(out, "0", 1) ||
+                resp_bulk(out, value, entry->value_len))
+                return 1;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Packs the keys of a multi-key request, with a value each for `MSET` and a
+ * delta of one for `MINCR`, into `scratch`.
+ */
+static int replay_encode_items(struct replay_thread *t,
+                               const struct record_entry *first)
+{
+    static const int64_t one = 1;
+    struct buffer *out = &t->scratch;
+
+    buffer_consume(out, buffer_len(out));
+
+    for (size_t i = 0; i < first->keys; i++) {
+        struct proto_item item = {
+            .key = t->key,
+            .key_len = replay_key_name(t->key, &first[i]),
+        };
+
+        if (first->op == RECORD_SET) {
+            item.val = t->replay->value;
+            item.val_len = first[i].value_len;
+        } else if (first->op == RECORD_INCR) {
+            item.val = (const char *)&one;
+            item.val_len = sizeof(one);
+        }
+
+        if (proto_write_item(out, &item, true, item.val != NULL))
+            return 1;
+    }
+
+    return 0;
+}
+
+static void replay_done(struct memdb_conn *mc, const struct memdb_reply *reply,
+                        void *arg);
+
+/*
+ * Queues the request starting at `first` on `conn`. Returns non-zero on
+ * failure.
+ */
+static int replay_send(struct replay_thread *t, struct replay_conn *conn,
+                       const struct record_entry *first)
+{
+    static const uint8_t multi_opcodes[RECORD_OP_COUNT] = {
+        [RECORD_GET] = PROTO_MGET, [RECORD_SET] = PROTO_MSET,
+        [RECORD_DEL] = PROTO_MDEL, [RECORD_INCR] = PROTO_MINCR,
+    };
+    static const uint8_t opcodes[RECORD_OP_COUNT] = {
+        [RECORD_GET] = PROTO_GET,         [RECORD_SET] = PROTO_SET,
+        [RECORD_DEL] = PROTO_DEL,         [RECORD_INCR] = PROTO_INCR,
+        [RECORD_CMPXCHG] = PROTO_CMPXCHG, [RECORD_CAS] = PROTO_CAS,
+        [RECORD_OTHER] = PROTO_NOOP,
+    };
+    static const int64_t one = 1;
+
+    if (conn->resp) {
+        struct buffer *out = &t->command;
+
+        buffer_consume(out, buffer_len(out));
+
+        return replay_encode_resp(t, out, first) ||
+               memdb_command_raw(&conn->conn, buffer_head(out),
+                                 buffer_len(out), replay_done, conn);
+    }
+
+    struct proto_request req = { .opcode = opcodes[first->op] };
+
+    if (first->keys > 1 && multi_opcodes[first->op]) {
+        if (replay_encode_items(t, first))
+            return 1;
+
+        req.opcode = multi_opcodes[first->op];
+        req.val = buffer_head(&t->scratch);
+        req.val_len = buffer_len(&t->scratch);
+
+        return memdb_request(&conn->conn, &req, replay_done, conn);
+    }
+
+    if (first->keys) {
+        req.key = t->key;
+        req.key_len = replay_key_name(t->key, first);
+    }
+
+    switch (first->op) {
+    case RECORD_SET:
+    case RECORD_CAS:
+        req.val = t->replay->value;
+        req.val_len = first->value_len;
+        break;
+    case RECORD_INCR:
+        req.extra = 1;
+        break;
+    case RECORD_CMPXCHG:
+        req.val = (const char *)&one;
+        req.val_len = sizeof(one);
+        break;
+    }
+
+    return memdb_request(&conn->conn, &req, replay_done, conn);
+}
+
+/*
+ * Takes the reply to the oldest request in flight on the connection.
+ */
+static void replay_done(struct memdb_conn *mc, const struct memdb_reply *reply,
+                        void *arg)
+{
+    struct replay_conn *conn = arg;
+    struct replay_thread *t = conn->thread;
+    struct replay_slot slot = conn->slots[conn->head];
+    bool error, miss;
+
+    (void)mc;
+
+    conn->head = (conn->head + 1) % conn->depth;
+    conn->inflight--;
+
+    if (reply->status == MEMDB_CLOSED)
+        return;
+
+    /*
+     * Compare and swaps are replayed with made up expectations, so failing
+     * them is no error.
+     */
+    if (conn->resp) {
+        error = reply->val[0] == '-';
+        miss = reply->val_len == 5 && !memcmp(reply->val, "$-1\r\n", 5);
+    } else {
+        error = reply->status != PROTO_OK &&
+                reply->status != PROTO_NOT_FOUND &&
+                reply->status != PROTO_CONFLICT;
+        miss = reply->status == PROTO_NOT_FOUND;
+    }
+
+    histogram_record(&t->stats.latency[slot.op],
+                     t->now - min(slot.due, t->now));
+    t->stats.errors += error;
+    t->stats.misses += miss && slot.op == RECORD_GET;
+}
+
+/*
+ * When the request starting at `first` is due, given it is sent no earlier
+ * than `now`.
+ */
+static uint64_t replay_due(const struct replay *r,
+                           const struct record_entry *first, uint64_t now)
+{
+    if (!r->cfg->speed)
+        return now;
+
+    return r->start + (first->ns - r->first_ns) / r->cfg->speed;
+}
+
+/*
+ * Sends what is due on every connection of the thread, as pipelines allow,
+ * until every request is sent and answered. Returns non-zero on failure,
+ * setting `errno`.
+ */
+static int replay_drive(struct replay_thread *t)
+{
+    struct replay *r = t->replay;
+    uint64_t drain_until = 0;
+
+    while (true) {
+        uint64_t now = monotonic_ns();
+        uint64_t next_due = UINT64_MAX;
+        size_t inflight = 0;
+        bool remaining = false;
+
+        for (size_t i = 0; i < t->conn_count; i++) {
+            struct replay_conn *conn = &t->conns[i];
+
+            while (conn->next < conn->count && conn->inflight < conn->depth) {
+                const struct record_entry *first =
+                    &r->entries[conn->requests[conn->next]];
+                uint64_t due = replay_due(r, first, now);
+
+                if (due > now) {
+                    next_due = min(next_due, due);
+                    break;
+                }
+
+                if (replay_send(t, conn, first))
+                    return -1;
+
+                size_t slot = (conn->head + conn->inflight++) % conn->depth;
+
+                conn->slots[slot] = (struct replay_slot){ first->op, due };
+                conn->next++;
+                t->stats.lag = now - due;
+            }
+
+            t->fds[i] = (struct pollfd){
+                .fd = memdb_fd(&conn->conn),
+                .events = memdb_events(&conn->conn),
+            };
+            inflight += conn->inflight;
+            remaining |= conn->next < conn->count;
+        }
+
+        if (!inflight && !remaining)
+            break;
+
+        if (!remaining) {
+            if (!drain_until)
+                drain_until = now + REPLAY_DRAIN_NS;
+            else if (now >= drain_until) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        }
+
+        /*
+         * Waits no longer than until the next request is due, spinning when
+         * that is under a millisecond away.
+         */
+        int timeout = REPLAY_POLL_MS;
+
+        if (next_due != UINT64_MAX)
+            timeout = min((next_due - now) / 1000000, (uint64_t)timeout);
+
+        if (poll(t->fds, t->conn_count, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        t->now = monotonic_ns();
+
+        for (size_t i = 0; i < t->conn_count; i++) {
+            if (t->fds[i].revents &&
+                memdb_process(&t->conns[i].conn, t->fds[i].revents))
+                return -1;
+        }
+    }
+
+    t->stopped = monotonic_ns();
+
+    return 0;
+}
+
+static void replay_pinged(struct memdb_conn *mc,
+                          const struct memdb_reply *reply, void *arg)
+{
+    (void)mc;
+    (void)reply;
+    (void)arg;
+}
+
+/*
+ * Connects every connection of the thread, waiting for each to answer a
+ * ping. Returns non-zero on failure, setting `errno`.
+ */
+static int replay_connect(struct replay_thread *t)
+{
+    const struct replay_config *cfg = t->replay->cfg;
+    const char *ping = "PING";
+    size_t ping_len = 4;
+
+    for (size_t i = 0; i < t->conn_count; i++) {
+        struct replay_conn *conn = &t->conns[i];
+
+        if (memdb_connect(&conn->conn, cfg->host, cfg->port))
+            return -1;
+
+        if (conn->resp ? memdb_command(&conn->conn, 1, &ping, &ping_len,
+                                       replay_pinged, NULL)
+                       : memdb_request(&conn->conn,
+                                       &(struct proto_request){
+                                           .opcode = PROTO_NOOP },
+                                       replay_pinged, NULL))
+            return -1;
+    }
+
+    for (size_t i = 0; i < t->conn_count; i++) {
+        if (memdb_wait(&t->conns[i].conn, REPLAY_DRAIN_NS / 1000000))
+            return -1;
+    }
+
+    return 0;
+}
+
+static void *replay_thread_main(void *arg)
+{
+    struct replay_thread *t = arg;
+    struct replay *r = t->replay;
+    int err = 0;
+
+    if (replay_connect(t)) {
+        err = errno;
+        atomic_store(&r->failed, true);
+    }
+
+    atomic_fetch_add(&r->ready, 1);
+
+    while (!atomic_load(&r->go))
+        nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+
+    if (!err && !atomic_load(&r->failed) && replay_drive(t))
+        err = errno;
+
+    t->err = err;
+
+    return NULL;
+}
+
+static int replay_id_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Numbers recorded connections from zero in order of their ids, setting
+ * `*count` to how many there are. Returns the ids, or `NULL` on allocation
+ * failure.
+ */
+static uint32_t *replay_conn_ids(const struct replay *r, size_t *count)
+{
+    uint32_t *ids = malloc(max(r->entry_count, (size_t)1) * sizeof(*ids));
+    size_t len = 0;
+
+    if (!ids)
+        return NULL;
+
+    for (size_t i = 0; i < r->entry_count; i++)
+        ids[i] = r->entries[i].conn;
+
+    qsort(ids, r->entry_count, sizeof(*ids), replay_id_cmp);
+
+    for (size_t i = 0; i < r->entry_count; i++) {
+        if (!len || ids[len - 1] != ids[i])
+            ids[len++] = ids[i];
+    }
+
+    *count = len;
+    return ids;
+}
+
+static size_t replay_conn_index(const uint32_t *ids, size_t count, uint32_t id)
+{
+    size_t lo = 0, hi = count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (ids[mid] < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static int replay_thread_init(struct replay_thread *t, struct replay *r,
+                              size_t conn_count)
+{
+    size_t depth = r->cfg->pipeline;
+
+    t->replay = r;
+    t->conn_count = 0;
+    t->stopped = 0;
+    t->err = 0;
+    t->stats.misses = 0;
+    t->stats.errors = 0;
+    t->stats.lag = 0;
+    buffer_init(&t->scratch);
+    buffer_init(&t->command);
+
+    for (int i = 0; i < RECORD_OP_COUNT; i++)
+        histogram_init(&t->stats.latency[i]);
+
+    /*
+     * The slots of every connection share one allocation.
+     */
+    if (!(t->key = malloc(r->key_cap)))
+        return -1;
+
+    if (!(t->conns = calloc(conn_count, sizeof(*t->conns))))
+        goto error_conns;
+
+    if (!(t->fds = calloc(conn_count, sizeof(*t->fds))))
+        goto error_fds;
+
+    if (!(t->slots = calloc(conn_count * depth, sizeof(*t->slots))))
+        goto error_slots;
+
+    while (t->conn_count < conn_count) {
+        struct replay_conn *conn = &t->conns[t->conn_count];
+
+        memdb_init(&conn->conn, 0);
+        conn->thread = t;
+        conn->depth = depth;
+        conn->slots = t->slots + t->conn_count++ * depth;
+    }
+
+    return 0;
+
+error_slots:
+    free(t->fds);
+error_fds:
+    free(t->conns);
+error_conns:
+    free(t->key);
+    return -1;
+}
+
+static void replay_thread_destroy(struct replay_thread *t)
+{
+    for (size_t i = 0; i < t->conn_count; i++)
+        memdb_destroy(&t->conns[i].conn);
+
+    buffer_destroy(&t->scratch);
+    buffer_destroy(&t->command);
+    free(t->conns);
+    free(t->fds);
+    free(t->slots);
+    free(t->key);
+}
+
+/*
+ * Hands each request to the connection its recorded one maps to, recorded
+ * connections being spread over `count` in turn. Connection `i` belongs to
+ * thread `i % thread_count`, as its `i / thread_count`th.
+ */
+static int replay_assign(struct replay *r, struct replay_thread *threads,
+                         size_t thread_count, size_t count)
+{
+    const struct replay_config *cfg = r->cfg;
+    size_t id_count, total = 0;
+    uint32_t *ids = replay_conn_ids(r, &id_count);
+
+    if (!ids)
+        return -1;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < r->entry_count;
+             i += replay_span(&r->entries[i])) {
+            const struct record_entry *first = &r->entries[i];
+            size_t index =
+                replay_conn_index(ids, id_count, first->conn) % count;
+            struct replay_conn *conn =
+                &threads[index % thread_count].conns[index / thread_count];
+
+            if (!pass) {
+                total++;
+                if (!conn->count++)
+                    conn->resp = cfg->protocol < 0
+                                     ? first->flags & RECORD_RESP
+                                     : cfg->protocol == MEMDB_RESP;
+                continue;
+            }
+
+            conn->requests[conn->next++] = i;
+        }
+
+        if (!pass && !(r->requests = malloc(max(total, (size_t)1) *
+                                            sizeof(*r->requests)))) {
+            free(ids);
+            return -1;
+        }
+
+        for (size_t j = 0, offset = 0; !pass && j < count; j++) {
+            struct replay_conn *conn =
+                &threads[j % thread_count].conns[j / thread_count];
+
+            conn->requests = r->requests + offset;
+            offset += conn->count;
+        }
+    }
+
+    for (size_t j = 0; j < count; j++) {
+        struct replay_conn *conn =
+            &threads[j % thread_count].conns[j / thread_count];
+
+        conn->next = 0;
+        conn->conn.flags = conn->resp ? MEMDB_RESP : 0;
+    }
+
+    free(ids);
+    return 0;
+}
+
+struct replay_prefill {
+    uint32_t key_hash;
+    uint32_t key_len;
+    uint32_t value_len;
+    uint8_t op;
+    size_t index;
+};
+
+static int replay_prefill_cmp(const void *a, const void *b)
+{
+    const struct replay_prefill *x = a;
+    const struct replay_prefill *y = b;
+
+    if (x->key_hash != y->key_hash)
+        return x->key_hash < y->key_hash ? -1 : 1;
+    if (x->key_len != y->key_len)
+        return x->key_len < y->key_len ? -1 : 1;
+
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+static void replay_prefilled(struct memdb_conn *mc,
+                             const struct memdb_reply *reply, void *arg)
+{
+    bool *failed = arg;
+    bool error = mc->flags & MEMDB_RESP ? reply->val[0] == '-'
+                                        : reply->status != PROTO_OK;
+
+    if (reply->status == MEMDB_CLOSED || error)
+        *failed = true;
+}
+
+/*
+ * Sets each key the recording first reads, deletes or swaps, to a value of
+ * the size it is first set to later, if ever, so those requests find it as
+ * they did when recorded. Returns non-zero on failure, setting `errno`.
+ */
+static int replay_prefill(struct replay *r, bool resp, size_t *prefilled)
+{
+    const struct replay_config *cfg = r->cfg;
+    struct replay_prefill *keys =
+        malloc(max(r->entry_count, (size_t)1) * sizeof(*keys));
+    char *name = malloc(r->key_cap);
+    struct memdb_conn conn;
+    size_t len = 0;
+    bool failed = false;
+    int ret = -1;
+
+    memdb_init(&conn, resp ? MEMDB_RESP : 0);
+    *prefilled = 0;
+
+    if (!keys || !name) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    for (size_t i = 0; i < r->entry_count; i++) {
+        const struct record_entry *entry = &r->entries[i];
+        const struct record_entry *first = entry;
+
+        while (first->flags & RECORD_MORE && first > r->entries)
+            first--;
+
+        if (first->op != RECORD_OTHER)
+            keys[len++] = (struct replay_prefill){
+                .key_hash = entry->key_hash,
+                .key_len = entry->key_len,
+                .value_len = entry->value_len,
+                .op = first->op,
+                .index = i,
+            };
+    }
+
+    qsort(keys, len, sizeof(*keys), replay_prefill_cmp);
+
+    if (memdb_connect(&conn, cfg->host, cfg->port))
+        goto out;
+
+    for (size_t i = 0, end; i < len; i = end) {
+        uint8_t op = keys[i].op;
+        size_t value_len = cfg->value_size;
+        bool set = false;
+
+        for (end = i; end < len && keys[end].key_hash == keys[i].key_hash &&
+                      keys[end].key_len == keys[i].key_len;
+             end++) {
+            if (!set && keys[end].op == RECORD_SET) {
+                value_len = keys[end].value_len;
+                set = true;
+            }
+        }
+
+        if (op != RECORD_GET && op != RECORD_DEL && op != RECORD_CAS)
+            continue;
+
+        struct record_entry entry = { .key_hash = keys[i].key_hash,
+                                      .key_len = keys[i].key_len };
+        size_t name_len = replay_key_name(name, &entry);
+
+        if (resp) {
+            const char *argv[] = { "SET", name, r->value };
+            size_t lens[] = { 3, name_len, value_len };
+
+            if (memdb_command(&conn, 3, argv, lens, replay_prefilled,
+                              &failed))
+                goto out;
+        } else if (memdb_set(&conn, name, name_len, r->value, value_len, 0,
+                             replay_prefilled, &failed)) {
+            goto out;
+        }
+
+        ++*prefilled;
+
+        while (memdb_pending(&conn) >= REPLAY_PREFILL_PIPELINE) {
+            struct pollfd pfd = { memdb_fd(&conn), memdb_events(&conn), 0 };
+
+            if (poll(&pfd, 1, REPLAY_POLL_MS) < 0 && errno != EINTR)
+                goto out;
+            if (pfd.revents && memdb_process(&conn, pfd.revents))
+                goto out;
+        }
+    }
+
+    if (memdb_wait(&conn, REPLAY_DRAIN_NS / 1000000))
+        goto out;
+
+    if (failed)
+        errno = EIO;
+    else
+        ret = 0;
+
+out:
+    memdb_destroy(&conn);
+    free(keys);
+    free(name);
+    return ret;
+}
+
+/*
+ * Prints a latency in microseconds.
+ */
+static void replay_print_us(FILE *out, uint64_t ns)
+{
+    fprintf(out, " %9.1f", ns / 1000.0);
+}
+
+static void replay_print_latency(FILE *out, const char *name,
+                                 const struct histogram *h, double seconds)
+{
+    uint64_t count = histogram_count(h);
+
+    fprintf(out, "%-7s %12" PRIu64 " %12.0f", name, count, count / seconds);
+    replay_print_us(out, histogram_mean(h));
+    replay_print_us(out, histogram_percentile(h, 50));
+    replay_print_us(out, histogram_percentile(h, 99));
+    replay_print_us(out, histogram_percentile(h, 99.9));
+    replay_print_us(out, histogram_max(h));
+    fprintf(out, "\n");
+}
+
+static void replay_report(const struct replay *r, size_t requests,
+                          size_t recorded_conns, size_t connections,
+                          size_t threads, const struct replay_stats *stats,
+                          uint64_t elapsed_ns, FILE *out)
+{
+    const struct replay_config *cfg = r->cfg;
+    double recorded = r->entry_count
+                          ? (r->entries[r->entry_count - 1].ns - r->first_ns) /
+                                1e9
+                          : 0;
+    double seconds = elapsed_ns / 1e9;
+    struct histogram all;
+    char speed[32] = "as fast as possible";
+
+    histogram_init(&all);
+    for (int i = 0; i < RECORD_OP_COUNT; i++)
+        histogram_merge(&all, &stats->latency[i]);
+
+    if (cfg->speed)
+        snprintf(speed, sizeof(speed), "at %.2fx", cfg->speed);
+
+    fprintf(out,
+            "%zu requests on %zu connections recorded over %.2f s, "
+            "replayed %s\n",
+            requests, recorded_conns, recorded, speed);
+    fprintf(out, "%s protocol, %zu threads, %zu connections, pipeline %ld\n",
+            cfg->protocol < 0    ? "recorded"
+            : cfg->protocol      ? "RESP"
+                                 : "binary",
+            threads, connections, cfg->pipeline);
+    fprintf(out,
+            "%" PRIu64 " requests in %.2f s, %.0f requests/s, %" PRIu64
+            " GET misses, %" PRIu64 " errors, last sent %.1f ms late\n\n",
+            histogram_count(&all), seconds, histogram_count(&all) / seconds,
+            stats->misses, stats->errors, stats->lag / 1e6);
+    fprintf(out, "%-7s %12s %12s %9s %9s %9s %9s %9s\n", "op", "requests",
+            "requests/s", "mean us", "p50 us", "p99 us", "p99.9 us",
+            "max us");
+
+    for (int i = 0; i < RECORD_OP_COUNT; i++) {
+        if (histogram_count(&stats->latency[i]))
+            replay_print_latency(out, replay_op_names[i], &stats->latency[i],
+                                 seconds);
+    }
+
+    replay_print_latency(out, "all", &all, seconds);
+}
+
+/*
+ * Runs the replay, printing a report to `out`. Returns non-zero on failure,
+ * setting `errno`.
+ */
+static int replay_run(const struct replay_config *cfg, FILE *out)
+{
+    struct replay r = { .cfg = cfg };
+    struct replay_thread *threads = NULL;
+    size_t requests = 0, value_cap = cfg->value_size, id_count = 0;
+    size_t connections, thread_count, initialized = 0, started = 0;
+    int err = 0;
+
+    if (!(r.entries = record_load(cfg->path, &r.entry_count)))
+        return -1;
+
+    r.first_ns = r.entry_count ? r.entries[0].ns : 0;
+    r.key_cap = 1;
+
+    for (size_t i = 0; i < r.entry_count; i++) {
+        requests += !(r.entries[i].flags & RECORD_MORE);
+        r.key_cap = max(r.key_cap, (size_t)r.entries[i].key_len);
+        value_cap = max(value_cap, (size_t)r.entries[i].value_len);
+    }
+
+    uint32_t *ids = replay_conn_ids(&r, &id_count);
+    bool counted = ids;
+
+    free(ids);
+    connections = max(min((size_t)cfg->connections, id_count), (size_t)1);
+    thread_count = min((size_t)cfg->threads, connections);
+
+    if (!counted || !(r.value = malloc(value_cap + 1)) ||
+        !(threads = calloc(thread_count, sizeof(*threads)))) {
+        err = ENOMEM;
+        goto out;
+    }
+
+    memset(r.value, 'x', value_cap);
+    atomic_init(&r.ready, 0);
+    atomic_init(&r.go, false);
+    atomic_init(&r.failed, false);
+
+    for (; initialized < thread_count; initialized++) {
+        size_t conns = connections / thread_count +
+                       (initialized < connections % thread_count);
+
+        if (replay_thread_init(&threads[initialized], &r, conns)) {
+            err = ENOMEM;
+            goto out;
+        }
+    }
+
+    if (replay_assign(&r, threads, thread_count, connections)) {
+        err = ENOMEM;
+        goto out;
+    }
+
+    if (cfg->prefill) {
+        size_t prefilled;
+
+        if (replay_prefill(&r, threads[0].conns[0].resp, &prefilled)) {
+            err = errno;
+            goto out;
+        }
+
+        fprintf(out, "Prefilled %zu keys\n", prefilled);
+    }
+
+    for (; started < thread_count; started++) {
+        if ((err = pthread_create(&threads[started].thread, NULL,
+                                  replay_thread_main, &threads[started])))
+            break;
+    }
+
+    if (err)
+        atomic_store(&r.failed, true);
+
+    while (atomic_load(&r.ready) < started)
+        nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+
+    r.start = monotonic_ns();
+    atomic_store(&r.go, true);
+
+    struct replay_stats stats = { 0 };
+    uint64_t stopped = r.start;
+
+    for (int i = 0; i < RECORD_OP_COUNT; i++)
+        histogram_init(&stats.latency[i]);
+
+    for (size_t i = 0; i < started; i++) {
+        struct replay_thread *t = &threads[i];
+
+        pthread_join(t->thread, NULL);
+
+        if (t->err && !err)
+            err = t->err;
+
+        for (int j = 0; j < RECORD_OP_COUNT; j++)
+            histogram_merge(&stats.latency[j], &t->stats.latency[j]);
+
+        stats.misses += t->stats.misses;
+        stats.errors += t->stats.errors;
+        stats.lag = max(stats.lag, t->stats.lag);
+        stopped = max(stopped, t->stopped);
+    }
+
+    if (!err)
+        replay_report(&r, requests, id_count, connections, thread_count,
+                      &stats, max(stopped - r.start, (uint64_t)1), out);
+
+out:
+    for (size_t i = 0; i < initialized; i++)
+        replay_thread_destroy(&threads[i]);
+
+    free(threads);
+    free(r.requests);
+    free(r.value);
+    free((void *)r.entries);
+
+    errno = err;
+    return err ? -1 : 0;
+}
+
+enum option_id {
+    OPTION_HOST = 'H',
+    OPTION_PORT = 'p',
+    OPTION_PROTOCOL = 'P',
+    OPTION_THREADS = 't',
+    OPTION_CONNECTIONS = 'c',
+    OPTION_PIPELINE = 'd',
+    OPTION_SPEED = 'x',
+    OPTION_PREFILL = 'f',
+    OPTION_VALUE_SIZE = 's',
+    OPTION_HELP = 'h',
+    OPTION_VERSION = 'v',
+};
+
+const struct option longopts[] = {
+    {       "host", required_argument, NULL,        OPTION_HOST},
+    {       "port", required_argument, NULL,        OPTION_PORT},
+    {   "protocol", required_argument, NULL,    OPTION_PROTOCOL},
+    {    "threads", required_argument, NULL,     OPTION_THREADS},
+    {"connections", required_argument, NULL, OPTION_CONNECTIONS},
+    {   "pipeline", required_argument, NULL,    OPTION_PIPELINE},
+    {      "speed", required_argument, NULL,       OPTION_SPEED},
+    {    "prefill",       no_argument, NULL,     OPTION_PREFILL},
+    { "value-size", required_argument, NULL,  OPTION_VALUE_SIZE},
+    {       "help",       no_argument, NULL,        OPTION_HELP},
+    {    "version",       no_argument, NULL,     OPTION_VERSION},
+    {            0,                 0,    0,                  0}
+};
+
+/*
+ * Parses the argument of option `opt` as a number of at least `min`.
+ */
+static long getlong(int opt, const char *arg, long min)
+{
+    char *end;
+    long n = strtol(arg, &end, 10);
+
+    if (!*arg || *end || n < min)
+        fatal("Invalid argument for option '-%c': '%s'\n", opt, arg);
+
+    return n;
+}
+
+static void replay_config_parse(struct replay_config *cfg, int argc,
+                                char **argv)
+{
+    char *end;
+    int opt;
+
+    opterr = false;
+    while ((opt = getopt_long(argc, argv, ":H:p:P:t:c:d:x:fs:hv", longopts,
+                              NULL)) != -1) {
+        switch (opt) {
+        case OPTION_HOST:
+            cfg->host = optarg;
+            break;
+        case OPTION_PORT:
+            getlong(opt, optarg, 1);
+            cfg->port = optarg;
+            break;
+        case OPTION_PROTOCOL:
+            if (!strcmp(optarg, "recorded"))
+                cfg->protocol = -1;
+            else if (!strcmp(optarg, "binary"))
+                cfg->protocol = 0;
+            else if (!strcmp(optarg, "resp"))
+                cfg->protocol = MEMDB_RESP;
+            else
+                fatal("Invalid protocol: '%s'\n", optarg);
+            break;
+        case OPTION_THREADS:
+            cfg->threads = getlong(opt, optarg, 1);
+            break;
+        case OPTION_CONNECTIONS:
+            cfg->connections = getlong(opt, optarg, 1);
+            break;
+        case OPTION_PIPELINE:
+            cfg->pipeline = getlong(opt, optarg, 1);
+            break;
+        case OPTION_SPEED:
+            cfg->speed = strtod(optarg, &end);
+            if (!*optarg || *end || !(cfg->speed >= 0 && cfg->speed < 1e6))
+                fatal("Invalid speed: '%s'\n", optarg);
+            break;
+        case OPTION_PREFILL:
+            cfg->prefill = true;
+            break;
+        case OPTION_VALUE_SIZE:
+            cfg->value_size = getlong(opt, optarg, 0);
+            break;
+        case OPTION_VERSION:
+            printf("%s\n", version);
+            exit(0);
+        case OPTION_HELP:
+            printf("%s\n", usage);
+            exit(0);
+        case ':':
+            fatal("Expected argument for option: '%s'\n", argv[optind - 1]);
+        case '?':
+            fatal("Unknown option: '%s'\n%s\n", argv[optind - 1], usage);
+        }
+    }
+
+    if (optind + 1 != argc)
+        fatal("Expected one recording.\n%s\n", usage);
+
+    cfg->path = argv[optind];
+}
+
+int main(int argc, char **argv)
+{
+    struct replay_config cfg;
+
+    replay_config_init(&cfg);
+    replay_config_parse(&cfg, argc, argv);
+
+    if (replay_run(&cfg, stdout))
+        fatal("Replay of %s failed: %s\n", cfg.path, strerror(errno));
+}
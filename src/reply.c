@@ -0,0 +1,229 @@
+#include "reply.h"
+
+void reply_init(struct reply *out)
+{
+    buffer_init(&out->buf);
+    out->consumed = 0;
+    out->refs = NULL;
+    out->ref_start = 0;
+    out->ref_end = 0;
+    out->ref_cap = 0;
+    out->ref_sent = 0;
+}
+
+void reply_destroy(struct reply *out)
+{
+    for (size_t i = out->ref_start; i < out->ref_end; i++)
+        db_value_put(out->refs[i].val);
+
+    free(out->refs);
+    buffer_destroy(&out->buf);
+    reply_init(out);
+}
+
+/*
+ * Ensures room for `count` more references at `ref_end`.
+ */
+static int reply_reserve_refs(struct reply *out, size_t count)
+{
+    size_t len = out->ref_end - out->ref_start;
+
+    if (out->ref_cap - out->ref_end >= count)
+        return 0;
+
+    if (out->ref_start && out->ref_cap - len >= count) {
+        memmove(out->refs, out->refs + out->ref_start,
+                len * sizeof(*out->refs));
+        out->ref_start = 0;
+        out->ref_end = len;
+        return 0;
+    }
+
+    size_t cap = max(out->ref_cap * 2, len + count);
+    struct reply_ref *refs = realloc(out->refs, cap * sizeof(*refs));
+
+    if (!refs)
+        return 1;
+
+    out->refs = refs;
+    out->ref_cap = cap;
+
+    return 0;
+}
+
+int reply_value(struct reply *out, const struct db_value *val)
+{
+    if (val->len < REPLY_REF_MIN)
+        return buffer_append(&out->buf, val->data, val->len);
+
+    if (reply_reserve_refs(out, 1))
+        return 1;
+
+    out->refs[out->ref_end++] = (struct reply_ref){
+        .offset = out->consumed + buffer_len(&out->buf),
+        .val = db_value_get(val),
+    };
+
+    return 0;
+}
+
+size_t reply_spliced(const struct reply *out, size_t offset)
+{
+    uint64_t pos = out->consumed + offset;
+    size_t len = 0;
+
+    for (size_t i = out->ref_end; i > out->ref_start; i--) {
+        if (out->refs[i - 1].offset <= pos)
+            break;
+
+        len += out->refs[i - 1].val->len;
+    }
+
+    return len;
+}
+
+struct db_value *reply_front(const struct reply *out)
+{
+    if (out->ref_start == out->ref_end ||
+        out->refs[out->ref_start].offset != out->consumed)
+        return NULL;
+
+    return out->refs[out->ref_start].val;
+}
+
+/*
+ * Stream position at which the pending bytes of `buf` run into the next
+ * reference, or end.
+ */
+static uint64_t reply_run_end(const struct reply *out, size_t ref)
+{
+    if (ref < out->ref_end)
+        return out->refs[ref].offset;
+
+    return out->consumed + buffer_len(&out->buf);
+}
+
+size_t reply_iov(const struct reply *out, struct iovec *iov, size_t count,
+                 size_t alone)
+{
+    uint64_t pos = out->consumed;
+    size_t sent = out->ref_sent;
+    size_t ref = out->ref_start;
+    size_t n = 0;
+
+    while (n < count) {
+        if (ref < out->ref_end && out->refs[ref].offset == pos) {
+            struct db_value *val = out->refs[ref].val;
+            bool large = val->len >= alone;
+
+            if (large && n)
+                break;
+
+            iov[n++] = (struct iovec){
+                .iov_base = val->data + sent,
+                .iov_len = val->len - sent,
+            };
+            sent = 0;
+            ref++;
+
+            if (large)
+                break;
+            continue;
+        }
+
+        uint64_t end = reply_run_end(out, ref);
+
+        if (end == pos)
+            break;
+
+        iov[n++] = (struct iovec){
+            .iov_base = buffer_head(&out->buf) + (pos - out->consumed),
+            .iov_len = end - pos,
+        };
+        pos = end;
+    }
+
+    return n;
+}
+
+void reply_consume(struct reply *out, size_t size)
+{
+    while (size) {
+        struct db_value *val = reply_front(out);
+
+        if (!val) {
+            size_t run = reply_run_end(out, out->ref_start) - out->consumed;
+            size_t len = min(size, run);
+
+            buffer_consume(&out->buf, len);
+            out->consumed += len;
+            size -= len;
+            continue;
+        }
+
+        size_t len = min(size, val->len - out->ref_sent);
+
+        out->ref_sent += len;
+        size -= len;
+
+        if (out->ref_sent == val->len) {
+            db_value_put(val);
+            out->ref_sent = 0;
+
+            if (++out->ref_start == out->ref_end) {
+                out->ref_start = 0;
+                out->ref_end = 0;
+            }
+        }
+    }
+}
+
+void reply_truncate(struct reply *out, size_t offset)
+{
+    uint64_t pos = out->consumed + offset;
+
+    while (out->ref_end > out->ref_start &&
+           out->refs[out->ref_end - 1].offset >= pos)
+        db_value_put(out->refs[--out->ref_end].val);
+
+    out->buf.end = out->buf.start + offset;
+}
+
+int reply_move(struct reply *dest, struct reply *src)
+{
+    if (reply_empty(dest)) {
+        struct reply tmp = *dest;
+
+        *dest = *src;
+        *src = tmp;
+        return 0;
+    }
+
+    size_t count = src->ref_end - src->ref_start;
+
+    /*
+     * A reference partly written cannot be carried over on its own.
+     */
+    assert(!src->ref_sent);
+
+    if (reply_reserve_refs(dest, count) ||
+        buffer_reserve(&dest->buf, buffer_len(&src->buf)))
+        return 1;
+
+    uint64_t base = dest->consumed + buffer_len(&dest->buf);
+
+    for (size_t i = src->ref_start; i < src->ref_end; i++) {
+        dest->refs[dest->ref_end++] = (struct reply_ref){
+            .offset = base + (src->refs[i].offset - src->consumed),
+            .val = src->refs[i].val,
+        };
+    }
+
+    buffer_append(&dest->buf, buffer_head(&src->buf), buffer_len(&src->buf));
+    src->consumed += buffer_len(&src->buf);
+    buffer_consume(&src->buf, buffer_len(&src->buf));
+    src->ref_start = 0;
+    src->ref_end = 0;
+
+    return 0;
+}
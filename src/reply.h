@@ -0,0 +1,94 @@
+#ifndef MEMDB_REPLY_H_
+#define MEMDB_REPLY_H_
+
+#include <sys/uio.h>
+#include "common.h"
+#include "buffer.h"
+#include "db.h"
+
+/*
+ * Values at least this long are referenced by replies rather than copied.
+ */
+#define REPLY_REF_MIN 4096
+
+/*
+ * A stored value spliced into a reply, before the byte of `buf` at stream
+ * position `offset`.
+ */
+struct reply_ref {
+    uint64_t offset;
+    struct db_value *val;
+};
+
+/*
+ * Output for a connection: encoded bytes in `buf`, interleaved with large
+ * values sent straight from the table, each holding a reference so an
+ * overwrite cannot free it mid-send. Positions count bytes of `buf` from the
+ * start of the stream, so they survive `buf` being compacted.
+ */
+struct reply {
+    struct buffer buf;
+    uint64_t consumed;
+
+    /*
+     * Queue of references, of which the first has `ref_sent` bytes written.
+     */
+    struct reply_ref *refs;
+    size_t ref_start;
+    size_t ref_end;
+    size_t ref_cap;
+    size_t ref_sent;
+};
+
+void reply_init(struct reply *out);
+void reply_destroy(struct reply *out);
+
+static inline bool reply_empty(const struct reply *out)
+{
+    return !buffer_len(&out->buf) && out->ref_start == out->ref_end;
+}
+
+/*
+ * Appends `val`, by reference if it is long enough to be worth it, or a copy
+ * otherwise. Safe to call from `db_read()` callbacks. Returns non-zero on
+ * allocation failure.
+ */
+int reply_value(struct reply *out, const struct db_value *val);
+
+/*
+ * Value bytes appended by reference since `offset` in `buf`, for headers
+ * that give the length of what follows them.
+ */
+size_t reply_spliced(const struct reply *out, size_t offset);
+
+/*
+ * Fills `iov` with up to `count` pending segments, in order, returning how
+ * many. Referenced values of at least `alone` bytes are never combined with
+ * other segments, so they can be written with different flags.
+ */
+size_t reply_iov(const struct reply *out, struct iovec *iov, size_t count,
+                 size_t alone);
+
+/*
+ * The value the next pending byte belongs to, or `NULL` if it is in `buf`.
+ */
+struct db_value *reply_front(const struct reply *out);
+
+/*
+ * Marks `size` pending bytes as written, dropping finished references.
+ */
+void reply_consume(struct reply *out, size_t size);
+
+/*
+ * Cuts `buf` back to its first `offset` bytes, dropping the references to
+ * values spliced in after them.
+ */
+void reply_truncate(struct reply *out, size_t offset);
+
+/*
+ * Moves everything pending in `src` to the end of `dest`. Returns non-zero on
+ * allocation failure, leaving both unchanged.
+ */
+int reply_move(struct reply *dest, struct reply *src);
+
+#endif
@@ -0,0 +1,296 @@
+#include <ctype.h>
+#include <inttypes.h>
+
+#include "resp.h"
+
+/*
+ * Longest `*<n>\r\n` or `$<len>\r\n` line accepted.
+ */
+#define RESP_MAX_HEADER 32
+
+/*
+ * Deepest nesting of arrays accepted in a reply.
+ */
+#define RESP_MAX_DEPTH 8
+
+void resp_parser_init(struct resp_parser *parser)
+{
+    parser->pos = 0;
+    parser->argc = -1;
+    parser->argn = 0;
+    parser->cap = 0;
+    parser->args = NULL;
+}
+
+void resp_parser_destroy(struct resp_parser *parser)
+{
+    free(parser->args);
+}
+
+static int resp_push_arg(struct resp_parser *parser, size_t offset,
+                         size_t len)
+{
+    if (parser->argn == parser->cap) {
+        size_t cap = parser->cap ? 2 * parser->cap : 8;
+        struct resp_arg *args =
+            realloc(parser->args, cap * sizeof(*parser->args));
+
+        if (!args)
+            return 1;
+
+        parser->args = args;
+        parser->cap = cap;
+    }
+
+    parser->args[parser->argn++] = (struct resp_arg){ offset, len };
+    return 0;
+}
+
+/*
+ * Parses a `<prefix><integer>\r\n` line. Returns its length, zero if it is
+ * incomplete, or negative if it is malformed.
+ */
+static ssize_t resp_parse_header(const char *buf, size_t len, char prefix,
+                                 int64_t *value)
+{
+    const char *end = memchr(buf, '\n', min(len, (size_t)RESP_MAX_HEADER));
+
+    if (!end)
+        return len < RESP_MAX_HEADER ? 0 : -1;
+
+    if (buf[0] != prefix || end - buf < 3 || end[-1] != '\r')
+        return -1;
+
+    const char *p = buf + 1;
+    bool negative = *p == '-';
+    int64_t n = 0;
+
+    if (negative)
+        p++;
+
+    if (p == end - 1)
+        return -1;
+
+    for (; p < end - 1; p++) {
+        if (*p < '0' || *p > '9' || n > INT64_MAX / 10 - 1)
+            return -1;
+        n = n * 10 + (*p - '0');
+    }
+
+    *value = negative ? -n : n;
+    return end - buf + 1;
+}
+
+static ssize_t resp_parse_inline(struct resp_parser *parser, const char *buf,
+                                 size_t len)
+{
+    const char *end = memchr(buf, '\n', min(len, (size_t)RESP_MAX_INLINE));
+
+    if (!end)
+        return len < RESP_MAX_INLINE ? 0 : -1;
+
+    for (const char *p = buf; p < end;) {
+        while (p < end && isspace((unsigned char)*p))
+            p++;
+
+        const char *word = p;
+
+        while (p < end && !isspace((unsigned char)*p))
+            p++;
+
+        if (p > word && resp_push_arg(parser, word - buf, p - word))
+            return -1;
+    }
+
+    return end - buf + 1;
+}
+
+ssize_t resp_parse(struct resp_parser *parser, const char *buf, size_t len)
+{
+    if (!len)
+        return 0;
+
+    if (parser->argc < 0) {
+        parser->argn = 0;
+
+        /*
+         * Inline commands are bounded by `RESP_MAX_INLINE`, so are simply
+         * rescanned until their line is complete.
+         */
+        if (buf[0] != '*')
+            return resp_parse_inline(parser, buf, len);
+
+        int64_t argc;
+        ssize_t n = resp_parse_header(buf, len, '*', &argc);
+
+        if (n <= 0)
+            return n;
+        if (argc > RESP_MAX_ARGS)
+            return -1;
+
+        parser->pos = n;
+        parser->argc = max(argc, (int64_t)0);
+    }
+
+    while (parser->argn < (size_t)parser->argc) {
+        int64_t bulk;
+        ssize_t n = resp_parse_header(buf + parser->pos, len - parser->pos,
+                                      '$', &bulk);
+
+        if (n <= 0)
+            return n;
+        if (bulk < 0 || bulk > RESP_MAX_BULK)
+            return -1;
+
+        size_t offset = parser->pos + n;
+
+        if (len - offset < (size_t)bulk + 2)
+            return 0;
+
+        if (buf[offset + bulk] != '\r' || buf[offset + bulk + 1] != '\n')
+            return -1;
+
+        if (resp_push_arg(parser, offset, bulk))
+            return -1;
+
+        parser->pos = offset + bulk + 2;
+    }
+
+    size_t size = parser->pos;
+
+    parser->pos = 0;
+    parser->argc = -1;
+    return size;
+}
+
+static ssize_t resp_reply_size_at(const char *buf, size_t len, int depth)
+{
+    int64_t value;
+    ssize_t n;
+
+    if (!len)
+        return 0;
+
+    switch (buf[0]) {
+    case '+':
+    case '-':
+    case ':': {
+        const char *end = memchr(buf, '\n', len);
+
+        return end ? end - buf + 1 : 0;
+    }
+    case '$':
+        if ((n = resp_parse_header(buf, len, '$', &value)) <= 0 || value < 0)
+            return n;
+        if (value > RESP_MAX_BULK)
+            return -1;
+
+        if (len - n < (size_t)value + 2)
+            return 0;
+
+        return memcmp(buf + n + value, "\r\n", 2) ? -1 : n + value + 2;
+    case '*': {
+        if ((n = resp_parse_header(buf, len, '*', &value)) <= 0 || value < 0)
+            return n;
+        if (value > RESP_MAX_ARGS || depth == RESP_MAX_DEPTH)
+            return -1;
+
+        size_t size = n;
+
+        for (int64_t i = 0; i < value; i++) {
+            if ((n = resp_reply_size_at(buf + size, len - size, depth + 1)) <=
+                0)
+                return n;
+            size += n;
+        }
+
+        return size;
+    }
+    default:
+        return -1;
+    }
+}
+
+ssize_t resp_reply_size(const char *buf, size_t len)
+{
+    return resp_reply_size_at(buf, len, 0);
+}
+
+int resp_simple(struct buffer *out, const char *str)
+{
+    size_t len = strlen(str);
+
+    if (buffer_reserve(out, len + 3))
+        return 1;
+
+    char *tail = buffer_tail(out);
+
+    tail[0] = '+';
+    memcpy(tail + 1, str, len);
+    memcpy(tail + 1 + len, "\r\n", 2);
+    out->end += len + 3;
+
+    return 0;
+}
+
+int resp_error(struct buffer *out, const char *str)
+{
+    size_t len = strlen(str);
+
+    if (buffer_reserve(out, len + 3))
+        return 1;
+
+    char *tail = buffer_tail(out);
+
+    tail[0] = '-';
+    memcpy(tail + 1, str, len);
+    memcpy(tail + 1 + len, "\r\n", 2);
+    out->end += len + 3;
+
+    return 0;
+}
+
+/*
+ * Appends `<prefix><value>\r\n`.
+ */
+static int resp_header(struct buffer *out, char prefix, int64_t value)
+{
+    if (buffer_reserve(out, RESP_MAX_HEADER))
+        return 1;
+
+    out->end += sprintf(buffer_tail(out), "%c%" PRId64 "\r\n", prefix, value);
+    return 0;
+}
+
+int resp_integer(struct buffer *out, int64_t value)
+{
+    return resp_header(out, ':', value);
+}
+
+int resp_bulk_header(struct buffer *out, size_t len)
+{
+    return resp_header(out, '$', len);
+}
+
+int resp_bulk(struct buffer *out, const void *data, size_t len)
+{
+    if (buffer_reserve(out, RESP_MAX_HEADER + len + 2) ||
+        resp_header(out, '$', len))
+        return 1;
+
+    memcpy(buffer_tail(out), data, len);
+    memcpy(buffer_tail(out) + len, "\r\n", 2);
+    out->end += len + 2;
+
+    return 0;
+}
+
+int resp_null(struct buffer *out)
+{
+    return buffer_append(out, "$-1\r\n", 5);
+}
+
+int resp_array(struct buffer *out, size_t len)
+{
+    return resp_header(out, '*', len);
+}
@@ -0,0 +1,79 @@
+#ifndef MEMDB_RESP_H_
+#define MEMDB_RESP_H_
+
+#include "common.h"
+#include "buffer.h"
+
+/*
+ * RESP2, the Redis serialization protocol, so existing Redis clients and load
+ * generators can drive the server.
+ *
+ * Commands arrive as arrays of bulk strings, `*<n>\r\n` followed by n of
+ * `$<len>\r\n<bytes>\r\n`, or as inline commands, one line of whitespace
+ * separated words. Replies are simple strings (`+`), errors (`-`), integers
+ * (`:`), bulk strings (`$`, with `$-1` for null) and arrays (`*`).
+ */
+
+#define RESP_MAX_ARGS (1 << 20)
+#define RESP_MAX_BULK (64 << 20)
+#define RESP_MAX_INLINE (64 * 1024)
+
+/*
+ * Argument of the command being parsed, as an offset from the start of its
+ * frame, so it stays valid when the input buffer is moved or reallocated.
+ */
+struct resp_arg {
+    size_t offset;
+    size_t len;
+};
+
+/*
+ * Incremental parser. A frame arriving in pieces is resumed where the last
+ * call stopped rather than rescanned, so large values cost one pass.
+ */
+struct resp_parser {
+    size_t pos;   /* Bytes of the current frame parsed. */
+    ssize_t argc; /* Arguments announced, or -1 between frames. */
+    size_t argn;
+    size_t cap;
+    struct resp_arg *args;
+};
+
+void resp_parser_init(struct resp_parser *parser);
+void resp_parser_destroy(struct resp_parser *parser);
+
+/*
+ * Parses a command from the front of `buf`, which must start with the same
+ * bytes as on the last call until a command is returned. Returns its size,
+ * zero if `buf` holds only part of it, or negative if it is malformed or the
+ * arguments could not be allocated. On success `parser->argn` arguments are
+ * in `parser->args`, valid until the next call. An empty command has no
+ * arguments.
+ */
+ssize_t resp_parse(struct resp_parser *parser, const char *buf, size_t len);
+
+/*
+ * Client side. Measures the reply at the front of `buf`, nested arrays
+ * included, without decoding it. Returns its size, zero if `buf` holds only
+ * part of it, or negative if it is malformed.
+ */
+ssize_t resp_reply_size(const char *buf, size_t len);
+
+/*
+ * Reply encoders. Each appends to `out`, returning non-zero on allocation
+ * failure.
+ */
+int resp_simple(struct buffer *out, const char *str);
+int resp_error(struct buffer *out, const char *str);
+int resp_integer(struct buffer *out, int64_t value);
+int resp_bulk(struct buffer *out, const void *data, size_t len);
+
+/*
+ * Begins a bulk string of `len` bytes, which the caller appends followed by
+ * `\r\n`.
+ */
+int resp_bulk_header(struct buffer *out, size_t len);
+int resp_null(struct buffer *out);
+int resp_array(struct buffer *out, size_t len);
+
+#endif
@@ -1,40 +1,103 @@
 #include <stdio.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/event.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <getopt.h>
 #include <ctype.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <linux/errqueue.h>
+#endif
 
 #include "common.h"
 #include "sys.h"
 #include "thread_pool.h"
 #include "malloc.h"
+#include "buffer.h"
+#include "event_loop.h"
+#include "uring.h"
+#include "db.h"
+#include "protocol.h"
+#include "command.h"
+#include "repl.h"
+#include "reply.h"
+#include "resp.h"
+#include "spsc_ring.h"
+#include "shm.h"
+#include "trace.h"
+#include "server.h"
 
-#define SERVER_BACKLOG 128
+/*
+ * FreeBSD only balances connections over sockets sharing a port with
+ * `SO_REUSEPORT_LB`; elsewhere `SO_REUSEPORT` does.
+ */
+#ifdef SO_REUSEPORT_LB
+#define SERVER_REUSEPORT SO_REUSEPORT_LB
+#else
+#define SERVER_REUSEPORT SO_REUSEPORT
+#endif
 #define SERVER_DEFAULT_PORT 11111
 
 /*
- * Socket wrapper for server. TCP, supporting IPv6 and IPv4.
- *
- * Note: Database protocol itself need-not be TCP specific, though depends on
- * an equivalent streaming protocol, such as unix sockets.
+ * Shards swept for expired keys each tick, so a full pass over the keyspace
+ * takes `DB_SHARDS / SERVER_EXPIRE_SHARDS` ticks.
  */
-struct server_socket {
-    /*
-     * Open socket's file descriptor.
-     */
-    int fd;
+#define SERVER_EXPIRE_SHARDS 4
 
-    /*
-     * Bound port in host byte order. Opposed to `addr.sin6_port`
-     * in network byte order.
-     */
-    uint16_t port;
+/*
+ * Worker threads kept with the `io_uring` backend, which only run expiry.
+ */
+#define SERVER_URING_THREADS 1L
 
-    struct sockaddr_in6 addr;
-};
+/*
+ * Default admission limits; see `server_config`.
+ */
+#define SERVER_MAX_CLIENTS 10000
+#define SERVER_MAX_WAIT_MS 100
+#define CONN_MAX_INFLIGHT 1024
+
+/*
+ * Slots in each queue between a pair of reactors in thread-per-core mode.
+ */
+#define REACTOR_RING_SIZE 4096
+
+/*
+ * Input read per pass over a connection with `max_inflight` set, past which
+ * the rest is left for the next, after what was read is processed.
+ */
+#define CONN_READ_AHEAD (256 * 1024)
+
+/*
+ * Buffer blocks each reactor keeps for reuse by its connections.
+ */
+#define REACTOR_POOL_SIZE 256
+
+/*
+ * Values at least this long are sent with `MSG_ZEROCOPY` where available.
+ * Below it, pinning the pages and reaping the completion cost more than the
+ * copy saves.
+ */
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define CONN_ZEROCOPY
+#define CONN_ZEROCOPY_MIN (64 * 1024)
+#endif
+
+/*
+ * How long the reactor polls shared memory channels between looks at its
+ * descriptors.
+ */
+#define REACTOR_SPIN_NS (20 * 1000)
 
 /*
  * Initialize a IPv4 socket address. `port` must be in host byte order. If
@@ -43,7 +106,9 @@ struct server_socket {
 void sockaddr_in_init(struct sockaddr_in *addr, in_port_t port,
                       struct in_addr *sin_addr)
 {
+#ifdef SIN6_LEN
     addr->sin_len = sizeof(*addr);
+#endif
     addr->sin_family = AF_INET;
     addr->sin_port = htons(port);
     addr->sin_addr.s_addr = sin_addr ? sin_addr->s_addr : htonl(INADDR_ANY);
@@ -57,7 +122,9 @@ void sockaddr_in_init(struct sockaddr_in *addr, in_port_t port,
 void sockaddr_in6_init(struct sockaddr_in6 *addr, in_port_t port,
                        struct in6_addr *sin6_addr)
 {
+#ifdef SIN6_LEN
     addr->sin6_len = sizeof(*addr);
+#endif
     addr->sin6_family = AF_INET6;
     addr->sin6_port = htons(port);
     addr->sin6_flowinfo = 0;
@@ -66,12 +133,21 @@ void sockaddr_in6_init(struct sockaddr_in6 *addr, in_port_t port,
 }
 
 /*
- * Argument `port` must be in host byte order. Uses IPv6 with socket option
- * `IPV6_V6ONLY` off, thus using IPv4-mapped address, and making it impossible
- * to bind with an IPv4 socket.
+ * Sets `O_NONBLOCK` and `FD_CLOEXEC`. Returns negative on failure.
  */
+int fd_set_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) ||
+        fcntl(fd, F_SETFD, FD_CLOEXEC))
+        return -1;
+
+    return 0;
+}
+
 int server_socket_init(struct server_socket *sock, in_port_t port,
-                       size_t backlog)
+                       size_t backlog, bool reuse_port)
 {
     sock->port = port;
     sockaddr_in6_init(&sock->addr, sock->port, NULL);
@@ -82,8 +158,13 @@ int server_socket_init(struct server_socket *sock, in_port_t port,
     /*
      * Set `IPV6_V6ONLY` explicitly for cross-platform compatibility.
      */
-    if (setsockopt(sock->fd, IPPROTO_IPV6, IPV6_V6ONLY, &(int){ 1 },
+    if (setsockopt(sock->fd, IPPROTO_IPV6, IPV6_V6ONLY, &(int){ 0 },
                    sizeof(int)) ||
+        setsockopt(sock->fd, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 },
+                   sizeof(int)) ||
+        (reuse_port && setsockopt(sock->fd, SOL_SOCKET, SERVER_REUSEPORT,
+                                  &(int){ 1 }, sizeof(int))) ||
+        fd_set_nonblock(sock->fd) ||
         bind(sock->fd, (struct sockaddr *)&sock->addr, sizeof(sock->addr)) ||
         listen(sock->fd, backlog)) {
         close(sock->fd);
@@ -93,6 +174,61 @@ int server_socket_init(struct server_socket *sock, in_port_t port,
     return 0;
 }
 
+/*
+ * Binds a non-blocking listening socket at `path`, replacing a socket left
+ * there by an earlier run but refusing to remove any other kind of file.
+ * Unless `mode` is negative, the socket is created with exactly those
+ * permissions. Returns the descriptor, or negative on failure.
+ */
+int unix_socket_init(const char *path, long mode, size_t backlog)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    strcpy(addr.sun_path, path);
+
+    if (!lstat(path, &st)) {
+        if (!S_ISSOCK(st.st_mode)) {
+            errno = EEXIST;
+            return -1;
+        }
+
+        unlink(path);
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    /*
+     * `bind()` creates the file subject to the umask, so narrowing it is the
+     * only way to never expose the socket with looser permissions. Called
+     * before any other thread is started.
+     */
+    mode_t umask_prev = mode < 0 ? 0 : umask(~mode & 0777);
+    int err = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+
+    if (mode >= 0)
+        umask(umask_prev);
+
+    if (err || fd_set_nonblock(fd) || listen(fd, backlog)) {
+        int saved = errno;
+
+        if (!err)
+            unlink(path);
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+
+    return fd;
+}
+
 /*
  * Returns negative value on invalid port. Ignores leading and trailing
  * whitespace. `str` must be null temrinated.
@@ -117,20 +253,90 @@ int parse_port(const char *str)
     return *str || port >= 1 << 16 || port <= 0 ? -1 : port;
 }
 
-struct server_config {
-    uint16_t port;
-};
+/*
+ * Returns negative value on anything but a non-negative decimal integer below
+ * `limit`. `str` must be null terminated.
+ */
+long parse_count(const char *str, long limit)
+{
+    char *end;
+
+    errno = 0;
+    long value = strtol(str, &end, 10);
+
+    return errno || end == str || *end || value < 0 || value >= limit ? -1
+                                                                      : value;
+}
 
 const char version[] = "1.0.0";
 const char usage[] =
     "Usage: mem-db-server [options]\n"
     "\n"
     " -p, --port <port>            Server port. (Default: 11111).\n"
+    " -t, --threads <count>        Worker threads, 0 to serve requests on the\n"
+    "                              event loop thread. (Default: core count).\n"
+    " -b, --io-backend <name>      'epoll' or 'kqueue' (platform default), or\n"
+    "                              'io_uring', which serves requests on the\n"
+    "                              ring thread and falls back to the default\n"
+    "                              if the kernel lacks support.\n"
+    " -r, --reactors <count>       Thread per core: run count event loops,\n"
+    "                              each with its own listening socket and\n"
+    "                              share of the keyspace, and no worker\n"
+    "                              threads. 0 for one event loop feeding the\n"
+    "                              worker threads. (Default: 0).\n"
+    " -P, --protocol <name>        'binary', 'resp' (Redis RESP2), or 'auto'\n"
+    "                              to detect per connection. (Default: auto).\n"
+    " -u, --unix-socket <path>     Also listen on a Unix domain socket at\n"
+    "                              path, replacing a stale socket there.\n"
+    "                              With requests served on the event loop\n"
+    "                              thread, binary protocol clients there may\n"
+    "                              move to a shared memory channel.\n"
+    " -m, --unix-perm <mode>       Octal permissions of the Unix domain\n"
+    "                              socket. (Default: per umask).\n"
+    " -c, --max-clients <count>    Connections at once, past which new ones\n"
+    "                              are closed. 0 for no limit.\n"
+    "                              (Default: 10000).\n"
+    " -i, --max-inflight <count>   Requests per connection whose replies are\n"
+    "                              not yet written, past which its input is\n"
+    "                              left unread. 0 for no limit.\n"
+    "                              (Default: 1024).\n"
+    " -w, --max-wait <ms>          Time a connection may wait for a worker\n"
+    "                              thread before its requests are answered\n"
+    "                              as busy. 0 for no limit. (Default: 100).\n"
+    " -R, --replica-of <host:port> Replicate the primary at host:port,\n"
+    "                              serving reads only.\n"
+    " -B, --repl-backlog <bytes>   Changes kept for replicas to resume from\n"
+    "                              after a dropped link, rounded up to a\n"
+    "                              power of two. (Default: 16 MiB).\n"
+    " -M, --metrics-port <port>    Serves the INFO statistics as plain text\n"
+    "                              over HTTP on port. (Default: off).\n"
+    " -s, --slowlog-us <us>        Requests taking this long or longer,\n"
+    "                              waiting included, go to the slowlog.\n"
+    "                              (Default: 10000).\n"
+    " -S, --slowlog-len <count>    Slow requests kept. 0 to keep none.\n"
+    "                              (Default: 128).\n"
+    " -o, --record <path>          Record the requests taken to path, for\n"
+    "                              bin/replay to play back. (Default: off).\n"
     " -h, --help                   Display this help message.\n"
     " -v, --version                Display versioning information.";
 
 enum option_id {
     OPTION_PORT = 'p',
+    OPTION_THREADS = 't',
+    OPTION_IO_BACKEND = 'b',
+    OPTION_PROTOCOL = 'P',
+    OPTION_REACTORS = 'r',
+    OPTION_UNIX_SOCKET = 'u',
+    OPTION_UNIX_PERM = 'm',
+    OPTION_MAX_CLIENTS = 'c',
+    OPTION_MAX_INFLIGHT = 'i',
+    OPTION_MAX_WAIT = 'w',
+    OPTION_REPLICA_OF = 'R',
+    OPTION_REPL_BACKLOG = 'B',
+    OPTION_METRICS_PORT = 'M',
+    OPTION_SLOWLOG_US = 's',
+    OPTION_SLOWLOG_LEN = 'S',
+    OPTION_RECORD = 'o',
     OPTION_HELP = 'h',
     OPTION_VERSION = 'v',
 };
@@ -138,6 +344,36 @@ enum option_id {
 const struct option longopts[] = {
     {   "port", required_argument, NULL,    OPTION_PORT},
     {      "p", required_argument, NULL,    OPTION_PORT},
+    {"threads", required_argument, NULL, OPTION_THREADS},
+    {      "t", required_argument, NULL, OPTION_THREADS},
+    {"io-backend", required_argument, NULL, OPTION_IO_BACKEND},
+    {      "b", required_argument, NULL, OPTION_IO_BACKEND},
+    {"protocol", required_argument, NULL, OPTION_PROTOCOL},
+    {"reactors", required_argument, NULL, OPTION_REACTORS},
+    {      "r", required_argument, NULL, OPTION_REACTORS},
+    {      "P", required_argument, NULL, OPTION_PROTOCOL},
+    {"unix-socket", required_argument, NULL, OPTION_UNIX_SOCKET},
+    {      "u", required_argument, NULL, OPTION_UNIX_SOCKET},
+    {"unix-perm", required_argument, NULL, OPTION_UNIX_PERM},
+    {      "m", required_argument, NULL, OPTION_UNIX_PERM},
+    {"max-clients", required_argument, NULL, OPTION_MAX_CLIENTS},
+    {      "c", required_argument, NULL, OPTION_MAX_CLIENTS},
+    {"max-inflight", required_argument, NULL, OPTION_MAX_INFLIGHT},
+    {      "i", required_argument, NULL, OPTION_MAX_INFLIGHT},
+    {"max-wait", required_argument, NULL, OPTION_MAX_WAIT},
+    {      "w", required_argument, NULL, OPTION_MAX_WAIT},
+    {"replica-of", required_argument, NULL, OPTION_REPLICA_OF},
+    {      "R", required_argument, NULL, OPTION_REPLICA_OF},
+    {"repl-backlog", required_argument, NULL, OPTION_REPL_BACKLOG},
+    {      "B", required_argument, NULL, OPTION_REPL_BACKLOG},
+    {"metrics-port", required_argument, NULL, OPTION_METRICS_PORT},
+    {      "M", required_argument, NULL, OPTION_METRICS_PORT},
+    {"slowlog-us", required_argument, NULL, OPTION_SLOWLOG_US},
+    {      "s", required_argument, NULL, OPTION_SLOWLOG_US},
+    {"slowlog-len", required_argument, NULL, OPTION_SLOWLOG_LEN},
+    {      "S", required_argument, NULL, OPTION_SLOWLOG_LEN},
+    {"record", required_argument, NULL, OPTION_RECORD},
+    {      "o", required_argument, NULL, OPTION_RECORD},
     {"version",       no_argument, NULL, OPTION_VERSION},
     {      "v",       no_argument, NULL, OPTION_VERSION},
     {   "help",       no_argument, NULL,    OPTION_HELP},
@@ -156,16 +392,121 @@ void server_config_init(struct server_config *config, int argc,
     int opt;
     int longindex;
 
+    config->port = 0;
+    config->threads = -1;
+    config->reactors = 0;
+    config->backend = SERVER_BACKEND_EVENT_LOOP;
+    config->protocol = SERVER_PROTOCOL_AUTO;
+    config->unix_path = NULL;
+    config->unix_mode = -1;
+    config->max_clients = SERVER_MAX_CLIENTS;
+    config->max_inflight = CONN_MAX_INFLIGHT;
+    config->max_wait_ms = SERVER_MAX_WAIT_MS;
+    config->replica_of = NULL;
+    config->repl_backlog = REPL_BACKLOG_SIZE;
+    config->metrics_port = 0;
+    config->slowlog_us = SLOWLOG_THRESHOLD_US;
+    config->slowlog_len = SLOWLOG_LEN;
+    config->record_path = NULL;
+
     opterr = false;
     optind = 1;
     while ((opt = server_getopt(argc, argv, &longindex)) != -1) {
         switch (opt) {
-        case OPTION_PORT:
+        case OPTION_PORT: {
             int port = parse_port(optarg);
             if (port < 0)
                 fatal("Invalid port: '%s'\n", optarg);
             config->port = port;
             break;
+        }
+        case OPTION_THREADS:
+            if ((config->threads = parse_count(optarg, 1 << 12)) < 0)
+                fatal("Invalid thread count: '%s'\n", optarg);
+            break;
+        case OPTION_IO_BACKEND:
+            if (!strcmp(optarg, event_loop_backend()))
+                config->backend = SERVER_BACKEND_EVENT_LOOP;
+            else if (!strcmp(optarg, "io_uring"))
+                config->backend = SERVER_BACKEND_URING;
+            else
+                fatal("Invalid I/O backend: '%s'\n", optarg);
+            break;
+        case OPTION_REACTORS:
+            if ((config->reactors = parse_count(optarg, DB_SHARDS + 1)) < 0)
+                fatal("Invalid reactor count: '%s' (at most %d)\n", optarg,
+                      DB_SHARDS);
+            break;
+        case OPTION_PROTOCOL:
+            if (!strcmp(optarg, "auto"))
+                config->protocol = SERVER_PROTOCOL_AUTO;
+            else if (!strcmp(optarg, "binary"))
+                config->protocol = SERVER_PROTOCOL_BINARY;
+            else if (!strcmp(optarg, "resp"))
+                config->protocol = SERVER_PROTOCOL_RESP;
+            else
+                fatal("Invalid protocol: '%s'\n", optarg);
+            break;
+        case OPTION_UNIX_SOCKET:
+            if (!*optarg || strlen(optarg) >=
+                                sizeof(((struct sockaddr_un *)0)->sun_path))
+                fatal("Invalid Unix socket path: '%s'\n", optarg);
+            config->unix_path = optarg;
+            break;
+        case OPTION_UNIX_PERM: {
+            char *end;
+
+            errno = 0;
+            config->unix_mode = strtol(optarg, &end, 8);
+            if (errno || end == optarg || *end || config->unix_mode < 0 ||
+                config->unix_mode > 0777)
+                fatal("Invalid Unix socket permissions: '%s'\n", optarg);
+            break;
+        }
+        case OPTION_MAX_CLIENTS:
+            if ((config->max_clients = parse_count(optarg, 1 << 30)) < 0)
+                fatal("Invalid client limit: '%s'\n", optarg);
+            break;
+        case OPTION_MAX_INFLIGHT:
+            if ((config->max_inflight = parse_count(optarg, 1 << 30)) < 0)
+                fatal("Invalid in-flight request limit: '%s'\n", optarg);
+            break;
+        case OPTION_MAX_WAIT:
+            if ((config->max_wait_ms = parse_count(optarg, 1 << 30)) < 0)
+                fatal("Invalid wait limit: '%s'\n", optarg);
+            break;
+        case OPTION_REPLICA_OF: {
+            const char *colon = strrchr(optarg, ':');
+
+            if (!colon || colon == optarg || parse_port(colon + 1) < 0)
+                fatal("Invalid primary address: '%s'\n", optarg);
+            config->replica_of = optarg;
+            break;
+        }
+        case OPTION_REPL_BACKLOG:
+            if ((config->repl_backlog = parse_count(optarg, 1 << 30)) < 0)
+                fatal("Invalid replication backlog size: '%s'\n", optarg);
+            break;
+        case OPTION_METRICS_PORT: {
+            int port = parse_port(optarg);
+            if (port < 0)
+                fatal("Invalid metrics port: '%s'\n", optarg);
+            config->metrics_port = port;
+            break;
+        }
+        case OPTION_SLOWLOG_US:
+            if ((config->slowlog_us = parse_count(optarg, 1L << 32)) < 0)
+                fatal("Invalid slowlog threshold: '%s'\n", optarg);
+            break;
+        case OPTION_SLOWLOG_LEN:
+            if ((config->slowlog_len = parse_count(optarg, 1 << 20)) < 0)
+                fatal("Invalid slowlog length: '%s'\n", optarg);
+            break;
+        case OPTION_RECORD:
+            if (!*optarg)
+                fatal("Invalid record path: '%s'\n", optarg);
+            config->record_path = optarg;
+            break;
         case OPTION_VERSION:
             printf("%s\n", version);
             exit(0);
@@ -184,182 +525,1982 @@ void server_config_init(struct server_config *config, int argc,
 
     if (!config->port)
         config->port = SERVER_DEFAULT_PORT;
+
+    if (config->unix_mode >= 0 && !config->unix_path)
+        fatal("Unix socket permissions given without a path.\n");
+
+    if (config->reactors)
+        config->threads = 0;
+    else if (config->threads < 0)
+        config->threads = max(core_count(), (ssize_t)1);
+}
+
+volatile sig_atomic_t server_stopping;
+
+static void server_signal(int sig)
+{
+    (void)sig;
+
+    server_stopping = 1;
 }
 
 /*
- * kqueue (2) documentation:
- *
- * FreeBSD: https://www.freebsd.org/cgi/man.cgi?query=kevent&apropos=0&sektion=
- * 0&manpath=FreeBSD+9.0-RELEASE&arch=default&format=html
- *
- * MacOS: https://developer.apple.com/library/archive/documentation/System/Conc
- * eptual/ManPages_iPhoneOS/man2/kqueue.2.html
+ * Returns true if the connection may take no more requests until output is
+ * written.
  */
+static bool conn_blocked(struct conn *conn)
+{
+    long limit = conn->server->config->max_inflight;
+
+    return limit && conn->unanswered >= (size_t)limit;
+}
+
+bool conn_hold_input(struct conn *conn, size_t len)
+{
+    if (!conn->server->config->max_inflight ||
+        (!conn_blocked(conn) && len < CONN_READ_AHEAD &&
+         (!conn->backlog || buffer_len(&conn->rbuf) < CONN_READ_AHEAD)))
+        return false;
+
+    conn->paused = true;
+    return true;
+}
 
 /*
- * `EV_SET` wrapper.
+ * Reads until the socket is drained. Returns negative on error, zero on end of
+ * stream, and positive otherwise.
  */
-void kevent_set(struct kevent *event, uintptr_t ident, int16_t filter,
-                uint16_t flags, uint32_t fflags, intptr_t data, void *udata)
+static int conn_read(struct conn *conn)
+{
+    if (conn_hold_input(conn, 0))
+        return 1;
+
+    if (conn->pool && !conn->rbuf.data &&
+        buffer_pool_get(conn->pool, &conn->rbuf))
+        return -1;
+
+#ifdef SHM_SUPPORTED
+    if (conn->shm)
+        return conn_shm_read(conn);
+#endif
+
+    size_t len = 0;
+
+    while (true) {
+        if (conn_hold_input(conn, len))
+            return 1;
+
+        if (buffer_reserve(&conn->rbuf, CONN_READ_SIZE))
+            return -1;
+
+        size_t space = buffer_space(&conn->rbuf);
+        ssize_t n = read(conn->fd, buffer_tail(&conn->rbuf), space);
+
+        if (n > 0) {
+            /*
+             * Even a short read goes on to the one returning `EAGAIN`: an end
+             * of stream that arrived with the data raises no further edge.
+             */
+            conn->rbuf.end += n;
+            len += n;
+        } else if (!n) {
+            return 0;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 1;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+static bool conn_holding(struct conn *conn)
 {
-    EV_SET(event, ident, filter, flags, fflags, data, udata);
+    return conn->held_start != conn->held_end;
 }
 
 /*
- * Tracks and describes events and changes for `kqueue`, including arbitrary
- * 'list' allocations.
+ * Ensures room to hold one more value. Returns non-zero on allocation failure.
  */
-struct kqueue_table {
-    /*
-     * `kqueue` psuedo file descriptor.
-     */
-    int kq;
+static int conn_held_reserve(struct conn *conn)
+{
+    size_t len = conn->held_end - conn->held_start;
 
-    /*
-     * Process ID associated with the `kqueue`. This will be the one that
-     * spawned the descriptor. Use this field when using shared mem mapping.
-     */
-    pid_t pid;
+    if (conn->held_end < conn->held_cap)
+        return 0;
+
+    if (conn->held_start) {
+        memmove(conn->held, conn->held + conn->held_start,
+                len * sizeof(*conn->held));
+        conn->held_start = 0;
+        conn->held_end = len;
+        return 0;
+    }
+
+    size_t cap = max(conn->held_cap * 2, (size_t)8);
+    struct conn_held *held = realloc(conn->held, cap * sizeof(*held));
+
+    if (!held)
+        return 1;
 
-    int nchanges;
-    int nevents;
-    struct kevent *changelist;
-    struct kevent *eventlist;
+    conn->held = held;
+    conn->held_cap = cap;
 
+    return 0;
+}
+
+#ifdef CONN_ZEROCOPY
+
+/*
+ * Drops values held by sends up to and including number `done`.
+ */
+static void conn_release(struct conn *conn, uint32_t done)
+{
+    while (conn_holding(conn) &&
+           (int32_t)(done - conn->held[conn->held_start].seq) >= 0)
+        db_value_put(conn->held[conn->held_start++].val);
+
+    if (!conn_holding(conn)) {
+        conn->held_start = 0;
+        conn->held_end = 0;
+    }
+}
+
+/*
+ * Reads zero copy completions off the socket's error queue.
+ */
+static void conn_reap_zerocopy(struct conn *conn)
+{
+    while (conn_holding(conn)) {
+        union {
+            char data[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                                 sizeof(struct sockaddr_in6))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr msg = {
+            .msg_control = control.data,
+            .msg_controllen = sizeof(control.data),
+        };
+
+        if (recvmsg(conn->fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err err;
+
+            if (!(cmsg->cmsg_level == SOL_IP &&
+                  cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 &&
+                  cmsg->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+
+            if (err.ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+                conn_release(conn, err.ee_data);
+        }
+    }
+}
+
+#else
+
+static void conn_reap_zerocopy(struct conn *conn)
+{
+}
+
+#endif
+
+/*
+ * Releases everything held, for a connection that will not be read again.
+ */
+static void conn_release_all(struct conn *conn)
+{
+    for (size_t i = conn->held_start; i < conn->held_end; i++)
+        db_value_put(conn->held[i].val);
+
+    free(conn->held);
+    conn->held = NULL;
+    conn->held_start = 0;
+    conn->held_end = 0;
+    conn->held_cap = 0;
+}
+
+/*
+ * Writes until the output is empty or the socket is full, gathering encoded
+ * bytes and referenced values into one `sendmsg()` where possible. Large
+ * values go on their own, with `MSG_ZEROCOPY` where the socket allows it.
+ * Returns false on error.
+ */
+static bool conn_flush(struct conn *conn)
+{
+    struct reply *out = &conn->wbuf;
+    size_t alone = SIZE_MAX;
+    bool copy = false;
+
+#ifdef SHM_SUPPORTED
+    if (conn->shm)
+        return conn_shm_flush(conn);
+#endif
+
+#ifdef CONN_ZEROCOPY
+    if (conn->zerocopy)
+        alone = CONN_ZEROCOPY_MIN;
+#endif
+
+    size_t written = 0;
+
+    while (!reply_empty(out)) {
+        struct iovec iov[CONN_IOV_MAX];
+        struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = reply_iov(out, iov, ARRAY_SIZE(iov), alone),
+        };
+        struct db_value *val = reply_front(out);
+        bool zerocopy = !copy && val && val->len >= alone &&
+                        !conn_held_reserve(conn);
+        int flags = MSG_NOSIGNAL;
+
+#ifdef CONN_ZEROCOPY
+        if (zerocopy)
+            flags |= MSG_ZEROCOPY;
+#endif
+
+        ssize_t n = sendmsg(conn->fd, &msg, flags);
+
+        if (n >= 0) {
+            if (zerocopy) {
+                conn->held[conn->held_end++] = (struct conn_held){
+                    .seq = conn->zc_next++,
+                    .val = db_value_get(val),
+                };
+            }
+
+            reply_consume(out, n);
+            written += n;
+        } else if (errno == ENOBUFS && zerocopy) {
+            /*
+             * Out of memory to pin pages with, so copy for now.
+             */
+            copy = true;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+
+    if (written)
+        trace_record(TRACE_WRITE, conn->id, written);
+
+    return true;
+}
+
+static bool server_per_core(struct server *server)
+{
+    return server->config->reactors;
+}
+
+/*
+ * Reactor owning the shard that holds `key` in thread-per-core mode.
+ */
+static struct reactor *reactor_owner(struct server *server,
+                                     const struct db_key *key)
+{
+    return &server->reactors[db_shard_index(key) % server->reactor_count];
+}
+
+static void reactor_notify(struct reactor *reactor)
+{
     /*
-     * Fields `changelist_cap` and `eventlist_cap` are struct internals for
-     * tracking array allocations.
+     * Pairs with the fence in `reactor_run()`: either the peer sees the
+     * message before sleeping, or this sees it asleep.
      */
-    size_t changelist_cap;
-    size_t eventlist_cap;
-};
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load_explicit(&reactor->sleeping, memory_order_relaxed) &&
+        !atomic_exchange(&reactor->woken, true)) {
+        uint64_t one = 1;
 
-int kqueue_table_init(struct kqueue_table *kt)
+        while (write(reactor->wake_write_fd, &one, sizeof(one)) < 0 &&
+               errno == EINTR)
+            ;
+    }
+}
+
+/*
+ * Queues `msg` for `to`, holding it back while earlier messages for `to` are
+ * still waiting for room, so messages between two reactors stay in order.
+ */
+static void reactor_send(struct reactor *from, struct reactor *to,
+                         struct reactor_msg *msg)
 {
-    int kq = kqueue();
-    if (kq < 0)
-        return kq;
+    struct reactor_backlog *backlog = &from->peers[to->id].backlog;
 
-    kt->kq = kq;
-    kt->pid = getpid();
-    kt->nchanges = 0;
-    kt->nevents = 0;
-    kt->changelist = NULL;
-    kt->eventlist = NULL;
-    kt->changelist_cap = 0;
-    kt->changelist_cap = 0;
+    if (!backlog->head && spsc_ring_push(&to->peers[from->id].inbox, msg)) {
+        reactor_notify(to);
+        return;
+    }
 
-    return 0;
+    msg->next = NULL;
+    if (backlog->tail)
+        backlog->tail->next = msg;
+    else
+        backlog->head = msg;
+    backlog->tail = msg;
 }
 
 /*
- * Adds to change list. Returns negative on failure. May reallocate changelist.
+ * Appends a message to the connection's replies.
  */
-int kqueue_table_change(struct kqueue_table *kt, uintptr_t ident,
-                        int16_t filter, uint16_t flags, uint32_t fflags,
-                        intptr_t data, void *udata)
+static void conn_pend(struct conn *conn, struct reactor_msg *msg)
 {
-    if (kt->changelist_cap == kt->nchanges) {
-        kt->changelist_cap = max(kt->changelist_cap * 3 / 2, 2);
-        kt->changelist = realloc(kt->changelist,
-                                 kt->changelist_cap * sizeof(*kt->changelist));
-        if (!kt->changelist)
-            return ENOMEM;
-    }
+    msg->next_pending = NULL;
 
-    kevent_set(kt->changelist + kt->nchanges++, ident, filter, flags, fflags,
-               data, udata);
-    return 0;
+    if (conn->pending_tail)
+        conn->pending_tail->next_pending = msg;
+    else
+        conn->pending = msg;
+    conn->pending_tail = msg;
+}
+
+static struct reactor_msg *reactor_msg_create(struct conn *conn,
+                                              const char *frame, size_t len)
+{
+    struct reactor_msg *msg = malloc(sizeof(*msg) + len);
+
+    if (!msg)
+        return NULL;
+
+    msg->conn = conn;
+    msg->protocol = conn->protocol;
+    msg->done = false;
+    msg->failed = false;
+    reply_init(&msg->reply);
+    msg->len = len;
+    if (len)
+        memcpy(msg->frame, frame, len);
+
+    return msg;
+}
+
+static void reactor_msg_free(struct reactor_msg *msg)
+{
+    reply_destroy(&msg->reply);
+    free(msg);
 }
 
 /*
- * Passes data to `kevent()` system call. Specify `nevents` for the max number
- * of events to return at once. The list will be alloated inside of the
- * `kqueue_table` struct. Specify timeout, or `NULL` for infinite wait. Put
- * zero'd `timespec` to exact a poll.
+ * What to do with a request in thread-per-core mode.
+ */
+enum conn_route {
+    ROUTE_LOCAL,
+    ROUTE_FORWARDED,
+    ROUTE_BLOCKED,
+    ROUTE_FAILED,
+};
+
+/*
+ * Forwards the request in `frame` to the owner of `key`, if another reactor.
+ * Requests not confined to one key, with `key` `NULL`, wait until no
+ * forwarded request is outstanding, so they see the effects of everything
+ * sent before them. Requests for one key need not wait, since any earlier
+ * request for the same key went the same way, and queues between reactors
+ * keep their order.
  */
-int kqueue_table_commit(struct kqueue_table *kt, int nevents,
-                        struct timespec *timeout)
+static enum conn_route conn_route(struct conn *conn, const struct db_key *key,
+                                  const char *frame, size_t len)
 {
-    kt->nevents = kevent(kt->kq, kt->changelist, kt->nchanges, kt->eventlist,
-                         nevents, timeout);
-    return kt->nevents;
+    struct server *server = conn->server;
+
+    if (!server_per_core(server))
+        return ROUTE_LOCAL;
+
+    if (!key)
+        return conn->inflight ? ROUTE_BLOCKED : ROUTE_LOCAL;
+
+    struct reactor *owner = reactor_owner(server, key);
+
+    if (owner == conn->reactor)
+        return ROUTE_LOCAL;
+
+    struct reactor_msg *msg = reactor_msg_create(conn, frame, len);
+
+    if (!msg)
+        return ROUTE_FAILED;
+
+    msg->origin = (struct command_origin){
+        .conn = conn->id,
+        .len = len,
+        .queued = conn->queued,
+    };
+    trace_record(TRACE_FORWARD, conn->id, len);
+    conn_pend(conn, msg);
+    conn->inflight++;
+    reactor_send(conn->reactor, owner, msg);
+
+    return ROUTE_FORWARDED;
 }
 
 /*
- * TODO: Look into de-registering events on `kqueue_table` destruction.
+ * Where the reply to a request executed here goes: straight to `wbuf`, or
+ * behind replies still being served elsewhere. Returns `NULL` on allocation
+ * failure.
  */
-void kqueue_table_destroy(struct kqueue_table *kt)
+static struct reply *conn_output(struct conn *conn)
 {
-    free(kt->changelist);
-    free(kt->eventlist);
+    if (!conn->pending)
+        return &conn->wbuf;
+
+    struct reactor_msg *msg = reactor_msg_create(conn, NULL, 0);
+
+    if (!msg)
+        return NULL;
+
+    msg->done = true;
+    conn_pend(conn, msg);
+
+    return &msg->reply;
 }
 
-int server_loop(struct server_config *cfg)
+/*
+ * Moves replies that are ready, up to the first still outstanding, to
+ * `wbuf`. Returns false if one could not be produced.
+ */
+static bool conn_drain(struct conn *conn)
 {
-    int err;
-    struct kqueue_table *ktable;
-    struct thread_pool *threads;
+    struct reactor_msg *msg;
 
-    void *const mem = malloc(sizeof(*ktable) + sizeof(*threads));
+    while ((msg = conn->pending) && msg->done) {
+        if (msg->failed)
+            return false;
 
-    if (!mem)
-        return -1;
+        if (reply_move(&conn->wbuf, &msg->reply))
+            return false;
 
-    ktable = mem;
-    threads = mem + sizeof(*ktable);
+        if (!(conn->pending = msg->next_pending))
+            conn->pending_tail = NULL;
 
-    if ((err = thread_pool_init(threads, 0)) ||
-        (err = kqueue_table_init(ktable)))
-        goto error;
+        reactor_msg_free(msg);
+    }
 
-    free(mem);
-    return 0;
-error:
-    free(mem);
-    return -1;
+    return true;
 }
 
-int main(int argc, char **argv)
+/*
+ * Makes the connection a replication link for the `SYNC` request `req`, or
+ * answers it with an error if this server is a replica itself. Returns false
+ * if the reply could not be allocated.
+ */
+static bool conn_repl_attach(struct conn *conn, const struct proto_request *req)
 {
-    struct server_config config;
-    struct server_socket sock;
-    struct kqueue_table ktable;
-    struct thread_pool tpool;
+    struct repl *repl = &conn->server->repl;
+    struct reply *out = conn_output(conn);
 
-    if (!thread_pool_init(&tpool, core_count()))
-        fatal("thread_pool_init");
+    if (!out)
+        return false;
 
-    if (!kqueue_table_init(&ktable))
-        fatal("kqueue_table_init");
+    if (repl->following)
+        return !proto_write_response(&out->buf, &(struct proto_response){
+                                                    .opcode = req->opcode,
+                                                    .status = PROTO_EINVAL,
+                                                    .id = req->id,
+                                                });
 
-    if (!server_socket_init(&sock, config->port, SERVER_BACKLOG))
-        fatal("server_socket_init");
+    struct repl_sender *sender = malloc(sizeof(*sender));
 
-    while (true) {
+    if (!sender || repl_sender_attach(repl, sender, req, &out->buf)) {
+        free(sender);
+        return false;
     }
 
-    // void *const mem = malloc(sizeof(*ktable) + sizeof(*threads));
+    conn->repl = sender;
+    atomic_fetch_add(&conn->reactor->repl_attached, 1);
+
+    return true;
+}
+
+/*
+ * Tops up the output of a replication link from the stream once replies ahead
+ * of it are written, and writes it. Returns false if the link must be
+ * dropped, having fallen behind the backlog.
+ */
+static bool conn_replicate(struct conn *conn)
+{
+    struct repl_sender *sender = conn->repl;
+
+    if (!sender || conn->pending || conn->read_closed)
+        return true;
 
-    // struct server_config *const config = xmalloc(sizeof(*config));
-    // server_config_init(config, argc, argv);
+    int more = repl_sender_fill(&conn->server->repl, sender,
+                                &conn->wbuf.buf, CONN_REPL_CHUNK);
+
+    if (more < 0 || !conn_flush(conn))
+        return false;
+
+    /*
+     * Output left queued brings the connection back once the socket takes
+     * more; otherwise the reactor has to.
+     */
+    atomic_store(&conn->repl_more, more && reply_empty(&conn->wbuf));
 
-    // if (server_loop(config))
-    //     fatal_errno();
+    return true;
+}
 
-    // int err;
-    // struct kqueue_table *ktable;
-    // struct thread_pool *threads;
+/*
+ * Stamps the request just parsed, of `len` bytes, as taken up to run now.
+ */
+static struct command_origin conn_origin(struct conn *conn, size_t len)
+{
+    struct command_origin origin = {
+        .conn = conn->id,
+        .len = len,
+        .queued = conn->queued,
+        .started = monotonic_ns(),
+    };
 
-    // void *const mem = malloc(sizeof(*ktable) + sizeof(*threads));
+    trace_record_at(origin.started, TRACE_PARSE, conn->id, len, NULL);
 
-    // if (!mem)
-    //     return -1;
+    return origin;
+}
 
-    // ktable = mem;
-    // threads = mem + sizeof(*ktable);
+/*
+ * Consumes complete binary requests from `rbuf`, appending replies to `wbuf`.
+ * Requests are parsed in place, so a pipelined batch costs one pass over the
+ * buffer. Returns false if the connection must be dropped, on a malformed
+ * request or a reply that could not be allocated.
+ */
+static bool conn_process_binary(struct conn *conn)
+{
+    struct proto_request req;
 
-    // if ((err = thread_pool_init(threads, 0)) ||
-    //     (err = kqueue_table_init(ktable)))
-    //     goto error;
+    while (true) {
+        if (conn_blocked(conn)) {
+            conn->backlog = buffer_len(&conn->rbuf);
+            conn->paused = true;
+            return true;
+        }
+
+        const char *frame = buffer_head(&conn->rbuf);
+        ssize_t n = proto_parse_request(frame, buffer_len(&conn->rbuf), &req);
+
+        if (n < 0)
+            return false;
+        if (!n) {
+            conn->backlog = false;
+            return true;
+        }
+
+        if (conn->repl) {
+            if (req.opcode != PROTO_ACK)
+                return false;
+
+            repl_sender_ack(&conn->server->repl, conn->repl, &req);
+            buffer_consume(&conn->rbuf, n);
+            continue;
+        }
+
+        if (conn->shedding) {
+            struct reply *out = conn_output(conn);
+
+            if (!out || proto_write_response(&out->buf,
+                                             &(struct proto_response){
+                                                 .opcode = req.opcode,
+                                                 .status = PROTO_EBUSY,
+                                                 .id = req.id,
+                                             }))
+                return false;
+
+            buffer_consume(&conn->rbuf, n);
+            conn->unanswered++;
+            continue;
+        }
+
+#ifdef SHM_SUPPORTED
+        if (req.opcode == PROTO_ATTACH) {
+            if (conn_shm_allowed(conn, n)) {
+                if (!conn_shm_attach(conn, &req))
+                    return false;
+            } else {
+                struct reply *out = conn_output(conn);
+
+                if (!out || proto_write_response(&out->buf,
+                                                 &(struct proto_response){
+                                                     .opcode = req.opcode,
+                                                     .status = PROTO_EINVAL,
+                                                     .id = req.id,
+                                                 }))
+                    return false;
+            }
+
+            buffer_consume(&conn->rbuf, n);
+            conn->unanswered++;
+            continue;
+        }
+#endif
+
+        if (req.opcode == PROTO_SYNC) {
+            if (!conn_repl_attach(conn, &req))
+                return false;
+
+            buffer_consume(&conn->rbuf, n);
+            conn->unanswered++;
+            continue;
+        }
+
+        struct command_origin origin = conn_origin(conn, n);
+        struct db_key key;
+        bool single = command_binary_key(&req, &key);
+
+        switch (conn_route(conn, single ? &key : NULL, frame, n)) {
+        case ROUTE_LOCAL: {
+            struct reply *out = conn_output(conn);
+
+            if (!out ||
+                command_binary(&conn->server->commands, &req, &origin, out))
+                return false;
+            break;
+        }
+        case ROUTE_FORWARDED:
+            break;
+        case ROUTE_BLOCKED:
+            return true;
+        case ROUTE_FAILED:
+            return false;
+        }
+
+        buffer_consume(&conn->rbuf, n);
+        conn->unanswered++;
+    }
+}
+
+/*
+ * As `conn_process_binary()`, for RESP. A malformed request is answered with
+ * an error before the connection is closed, as Redis does.
+ */
+static bool conn_process_resp(struct conn *conn)
+{
+    while (true) {
+        if (conn_blocked(conn)) {
+            conn->backlog = buffer_len(&conn->rbuf);
+            conn->paused = true;
+            return true;
+        }
+
+        const char *frame = buffer_head(&conn->rbuf);
+        ssize_t n = resp_parse(&conn->resp, frame, buffer_len(&conn->rbuf));
+
+        if (!n) {
+            conn->backlog = false;
+            return true;
+        }
+
+        if (n < 0) {
+            struct reply *out = conn_output(conn);
+
+            conn->quit = true;
+            buffer_consume(&conn->rbuf, buffer_len(&conn->rbuf));
+            return out && !resp_error(&out->buf, "ERR Protocol error");
+        }
+
+        if (conn->shedding) {
+            struct reply *out = conn_output(conn);
+
+            buffer_consume(&conn->rbuf, n);
+            conn->unanswered++;
+
+            if (!out ||
+                resp_error(&out->buf, "BUSY server is overloaded, try again"))
+                return false;
+            continue;
+        }
+
+        struct command_origin origin = conn_origin(conn, n);
+        struct db_key key;
+        bool single = command_resp_key(frame, &conn->resp, &key);
+        int ret = 0;
+
+        switch (conn_route(conn, single ? &key : NULL, frame, n)) {
+        case ROUTE_LOCAL: {
+            struct reply *out = conn_output(conn);
+
+            if (!out)
+                return false;
+
+            ret = command_resp(&conn->server->commands, frame, &conn->resp,
+                               &origin, out);
+            break;
+        }
+        case ROUTE_FORWARDED:
+            break;
+        case ROUTE_BLOCKED:
+            return true;
+        case ROUTE_FAILED:
+            return false;
+        }
+
+        buffer_consume(&conn->rbuf, n);
+        conn->unanswered++;
+
+        if (ret < 0)
+            return false;
+
+        if (ret > 0) {
+            conn->quit = true;
+            buffer_consume(&conn->rbuf, buffer_len(&conn->rbuf));
+            return true;
+        }
+    }
+}
+
+bool conn_process(struct conn *conn)
+{
+    if (conn->quit) {
+        buffer_consume(&conn->rbuf, buffer_len(&conn->rbuf));
+        return true;
+    }
+
+    if (conn->protocol == SERVER_PROTOCOL_AUTO) {
+        if (!buffer_len(&conn->rbuf))
+            return true;
+
+        conn->protocol = (uint8_t)buffer_head(&conn->rbuf)[0] ==
+                                 PROTO_REQUEST_MAGIC
+                             ? SERVER_PROTOCOL_BINARY
+                             : SERVER_PROTOCOL_RESP;
+    }
+
+    if (conn->protocol == SERVER_PROTOCOL_BINARY)
+        return conn_process_binary(conn);
+
+    return conn_process_resp(conn);
+}
+
+static void conn_shut(struct conn *conn)
+{
+#ifdef SHM_SUPPORTED
+    if (conn->shm)
+        conn_shm_shut(conn);
+#endif
+
+    event_loop_del(&conn->reactor->loop, conn->fd);
+    close(conn->fd);
+    conn->fd = -1;
+}
+
+void conn_close(struct conn *conn)
+{
+    struct reactor *reactor = conn->reactor;
+
+    trace_record(TRACE_CLOSE, conn->id, 0);
+
+    if (!conn_holding(conn))
+        conn_shut(conn);
+    atomic_store(&conn->state, CONN_CLOSED);
+
+    conn->next_closed = atomic_load(&reactor->closed);
+    while (!atomic_compare_exchange_weak(&reactor->closed, &conn->next_closed,
+                                         conn))
+        ;
+}
+
+/*
+ * Processes buffered input and writes what output it can. Returns false if
+ * the connection was closed.
+ */
+static bool conn_advance(struct conn *conn)
+{
+    /*
+     * Replies to requests that arrived before end of stream are still
+     * written, after which the connection is closed.
+     */
+    if ((conn->pool && !conn->wbuf.buf.data &&
+         buffer_pool_get(conn->pool, &conn->wbuf.buf)) ||
+        !conn_process(conn) || !conn_drain(conn) || !conn_replicate(conn) ||
+        !conn_flush(conn) ||
+        ((conn->read_closed || conn->quit) && !conn->pending &&
+         reply_empty(&conn->wbuf))) {
+        conn_close(conn);
+        return false;
+    }
+
+    if (!conn->pending && reply_empty(&conn->wbuf))
+        conn->unanswered = 0;
+
+    /*
+     * Idle connections hold no buffers.
+     */
+    if (conn->pool) {
+        buffer_pool_put(conn->pool, &conn->rbuf);
+        buffer_pool_put(conn->pool, &conn->wbuf.buf);
+    }
+
+    return true;
+}
+
+static void *conn_service(void *arg)
+{
+    struct conn *conn = arg;
+
+    while (true) {
+        conn->paused = false;
+        trace_record(TRACE_SERVICE, conn->id, 0);
+
+        if (conn_holding(conn))
+            conn_reap_zerocopy(conn);
+
+        size_t buffered = buffer_len(&conn->rbuf);
+        int status = conn_read(conn);
+
+        if (buffer_len(&conn->rbuf) > buffered)
+            trace_record(TRACE_READ, conn->id,
+                         buffer_len(&conn->rbuf) - buffered);
+
+        if (!status)
+            conn->read_closed = true;
+
+        if (status < 0) {
+            conn_close(conn);
+            return NULL;
+        }
+
+        if (!conn_advance(conn))
+            return NULL;
+
+        conn->shedding = false;
+
+        /*
+         * Input held back behind replies now written is taken up at once.
+         * Behind forwarded requests, it is once they come back.
+         */
+        if (conn->paused && !conn_blocked(conn) && !conn->pending)
+            continue;
+
+        int state = CONN_SCHEDULED;
+
+        if (atomic_compare_exchange_strong(&conn->state, &state, CONN_IDLE))
+            return NULL;
+
+        /*
+         * Rescheduled while in service, so input is waiting now.
+         */
+        atomic_store(&conn->state, CONN_SCHEDULED);
+        conn->queued = monotonic_ns();
+    }
+}
+
+/*
+ * Runs in place of `conn_service()` when the connection waited longer than
+ * `max_wait_ms` for a worker: what it has buffered and can read is answered
+ * as busy rather than executed, so clients back off instead of queuing more.
+ */
+static void conn_shed(void *arg)
+{
+    struct conn *conn = arg;
+
+    conn->shedding = true;
+    conn_service(conn);
+}
+
+static uint64_t conn_deadline(struct conn *conn)
+{
+    long max_wait_ms = conn->server->config->max_wait_ms;
+
+    return max_wait_ms ? monotonic_ns() + max_wait_ms * 1000000 : 0;
+}
+
+void conn_schedule(struct conn *conn)
+{
+    struct server *server = conn->server;
+    int state = atomic_load(&conn->state);
+
+    while (true) {
+        switch (state) {
+        case CONN_IDLE:
+            if (!atomic_compare_exchange_weak(&conn->state, &state,
+                                              CONN_SCHEDULED))
+                continue;
+
+            conn->queued = monotonic_ns();
+            trace_record_at(conn->queued, TRACE_SCHEDULE, conn->id, 0, NULL);
+
+            if (!server->config->threads ||
+                thread_pool_submit(&server->pool,
+                                   &(struct thread_pool_job){
+                                       .routine = conn_service,
+                                       .cancel = conn_shed,
+                                       .arg = conn,
+                                       .priority = THREAD_POOL_INTERACTIVE,
+                                       .deadline = conn_deadline(conn),
+                                   }))
+                conn_service(conn);
+
+            return;
+        case CONN_SCHEDULED:
+            if (!atomic_compare_exchange_weak(&conn->state, &state,
+                                              CONN_RESCHEDULE))
+                continue;
+            return;
+        default:
+            return;
+        }
+    }
+}
+
+void conn_free(struct conn *conn)
+{
+    struct reactor *reactor = conn->reactor;
+
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        reactor->conns = conn->next;
+
+    if (conn->next)
+        conn->next->prev = conn->prev;
+
+    reactor->conn_count--;
+    atomic_fetch_sub(&conn->server->clients, 1);
+
+    if (conn->repl) {
+        struct conn **at = &reactor->replicas;
+
+        while (*at && *at != conn)
+            at = &(*at)->next_replica;
+        if (*at)
+            *at = conn->next_replica;
+
+        repl_sender_detach(&conn->server->repl, conn->repl);
+        free(conn->repl);
+    }
+
+    while (conn->pending) {
+        struct reactor_msg *msg = conn->pending;
+
+        conn->pending = msg->next_pending;
+        reactor_msg_free(msg);
+    }
+
+    if (conn->pool) {
+        buffer_pool_put(conn->pool, &conn->rbuf);
+        buffer_pool_put(conn->pool, &conn->wbuf.buf);
+    }
+
+#ifdef SHM_SUPPORTED
+    if (conn->shm)
+        conn_shm_free(conn);
+#endif
+
+    conn_release_all(conn);
+    buffer_destroy(&conn->rbuf);
+    reply_destroy(&conn->wbuf);
+    reply_destroy(&conn->sending);
+    resp_parser_destroy(&conn->resp);
+    free(conn);
+}
+
+/*
+ * Handles an event on a connection closed with values held for zero copy
+ * sends, closing it once they are released, and freeing it if it has been
+ * reaped already.
+ */
+static void conn_linger(struct conn *conn)
+{
+    if (conn->fd < 0)
+        return;
+
+    conn_reap_zerocopy(conn);
+
+    if (conn_holding(conn))
+        return;
+
+    conn_shut(conn);
+
+    if (conn->closing && !conn->inflight)
+        conn_free(conn);
+}
+
+static void conn_handle(struct reactor *reactor, struct event_handler *handler,
+                        unsigned int events)
+{
+    struct conn *conn = container_of(handler, struct conn, handler);
+
+    (void)reactor;
+
+    if (atomic_load(&conn->state) == CONN_CLOSED) {
+        conn_linger(conn);
+        return;
+    }
+
+    /*
+     * Registration failed, so the connection was never scheduled.
+     */
+    if (events == EVENT_ERROR) {
+        atomic_store(&conn->state, CONN_SCHEDULED);
+        conn_close(conn);
+        return;
+    }
+
+#ifdef SHM_SUPPORTED
+    if (conn->shm)
+        conn->shm->sock_event = true;
+#endif
+
+    conn_schedule(conn);
+}
+
+struct conn *conn_create(struct reactor *reactor, int fd)
+{
+    struct conn *conn = malloc(sizeof(*conn));
+
+    if (!conn)
+        return NULL;
+
+    conn->handler.fn = conn_handle;
+    conn->server = reactor->server;
+    conn->reactor = reactor;
+    conn->fd = fd;
+    atomic_init(&conn->state, CONN_IDLE);
+    conn->id = counter_get(&reactor->accepted) * conn->server->reactor_count +
+               reactor->id;
+    conn->queued = 0;
+    buffer_init(&conn->rbuf);
+    reply_init(&conn->wbuf);
+    conn->pool = reactor->server->config->threads ? NULL : &reactor->pool;
+    conn->protocol = reactor->server->config->protocol;
+    resp_parser_init(&conn->resp);
+    conn->quit = false;
+    conn->local = false;
+    conn->shm = NULL;
+    conn->zerocopy = false;
+    conn->zc_next = 0;
+    conn->held = NULL;
+    conn->held_start = 0;
+    conn->held_end = 0;
+    conn->held_cap = 0;
+    reply_init(&conn->sending);
+    conn->read_closed = false;
+    conn->inflight = 0;
+    conn->closing = false;
+    conn->pending = NULL;
+    conn->pending_tail = NULL;
+    conn->unanswered = 0;
+    conn->backlog = false;
+    conn->paused = false;
+    conn->shedding = false;
+    atomic_init(&conn->repl, NULL);
+    atomic_init(&conn->repl_more, false);
+    conn->next_replica = NULL;
+
+    conn->prev = NULL;
+    conn->next = reactor->conns;
+    if (conn->next)
+        conn->next->prev = conn;
+    reactor->conns = conn;
+    reactor->conn_count++;
+    counter_add(&reactor->accepted, 1);
+    atomic_fetch_add(&conn->server->clients, 1);
+    trace_record(TRACE_ACCEPT, conn->id, 0);
+
+    return conn;
+}
+
+/*
+ * Frees connections closed since the last call. Only called between waits, so
+ * no event still in hand can refer to them. Connections with forwarded
+ * requests outstanding are freed when the last comes back, and those still
+ * open for zero copy sends once `conn_linger()` closes them.
+ */
+static void reactor_reap(struct reactor *reactor)
+{
+    struct conn *conn = atomic_exchange(&reactor->closed, NULL);
+
+    while (conn) {
+        struct conn *next = conn->next_closed;
+
+        if (conn->inflight || conn->fd >= 0)
+            conn->closing = true;
+        else
+            conn_free(conn);
+
+        conn = next;
+    }
+}
+
+/*
+ * Executes a request forwarded by a peer, and sends it back.
+ */
+static void reactor_serve(struct reactor *reactor, struct reactor_msg *msg)
+{
+    struct command_ctx *ctx = &reactor->server->commands;
+
+    msg->origin.started = monotonic_ns();
+    trace_record_at(msg->origin.started, TRACE_SERVICE, msg->origin.conn, 0,
+                    NULL);
+
+    if (msg->protocol == SERVER_PROTOCOL_BINARY) {
+        struct proto_request req;
+
+        proto_parse_request(msg->frame, msg->len, &req);
+        msg->failed = command_binary(ctx, &req, &msg->origin, &msg->reply);
+    } else {
+        resp_parse(&reactor->resp, msg->frame, msg->len);
+        msg->failed = command_resp(ctx, msg->frame, &reactor->resp,
+                                   &msg->origin, &msg->reply) < 0;
+    }
+
+    reactor_send(reactor, msg->conn->reactor, msg);
+}
+
+/*
+ * Takes back a request this reactor forwarded, writing out its reply and any
+ * behind it, and resuming input held back until it was served.
+ */
+static void reactor_complete(struct reactor *reactor, struct reactor_msg *msg)
+{
+    struct conn *conn = msg->conn;
+
+    (void)reactor;
+
+    msg->done = true;
+    conn->inflight--;
+
+    if (atomic_load(&conn->state) == CONN_CLOSED) {
+        if (conn->closing && !conn->inflight && conn->fd < 0)
+            conn_free(conn);
+        return;
+    }
+
+    /*
+     * Input held back behind the replies is read again.
+     */
+    if (conn_advance(conn) && conn->paused && !conn->pending)
+        conn_schedule(conn);
+}
+
+/*
+ * Handles messages from peers, and retries sending those that found a peer's
+ * queue full. Returns true if anything is left to do.
+ */
+static bool reactor_poll(struct reactor *reactor)
+{
+    struct server *server = reactor->server;
+    bool busy = false;
+
+    for (size_t i = 0; i < server->reactor_count; i++) {
+        struct spsc_ring *inbox = &reactor->peers[i].inbox;
+        struct reactor_msg *msg;
+
+        /*
+         * Bounded, so a busy peer cannot starve the event loop.
+         */
+        for (size_t n = 0; n < REACTOR_RING_SIZE; n++) {
+            if (!(msg = spsc_ring_pop(inbox)))
+                break;
+
+            if (msg->conn->reactor == reactor)
+                reactor_complete(reactor, msg);
+            else
+                reactor_serve(reactor, msg);
+        }
+
+        busy |= !spsc_ring_empty(inbox);
+    }
+
+    for (size_t i = 0; i < server->reactor_count; i++) {
+        struct reactor_backlog *backlog = &reactor->peers[i].backlog;
+        struct reactor *peer = &server->reactors[i];
+        bool sent = false;
+
+        while (backlog->head &&
+               spsc_ring_push(&peer->peers[reactor->id].inbox,
+                              backlog->head)) {
+            if (!(backlog->head = backlog->head->next))
+                backlog->tail = NULL;
+            sent = true;
+        }
+
+        if (sent)
+            reactor_notify(peer);
+
+        busy |= backlog->head != NULL;
+    }
+
+    return busy;
+}
+
+static void reactor_wake(struct reactor *reactor,
+                         struct event_handler *handler, unsigned int events)
+{
+    uint64_t value;
+
+    (void)handler;
+    (void)events;
+
+    while (read(reactor->wake_fd, &value, sizeof(value)) > 0 ||
+           errno == EINTR)
+        ;
+}
+
+static void *reactor_expire(void *arg)
+{
+    struct reactor *reactor = arg;
+    size_t stride = reactor->server->reactor_count;
+
+    for (size_t i = 0; i < SERVER_EXPIRE_SHARDS; i++) {
+        db_expire_shard(&reactor->server->db, reactor->expire_shard);
+
+        reactor->expire_shard += stride;
+        if (reactor->expire_shard >= DB_SHARDS)
+            reactor->expire_shard = reactor->id;
+    }
+
+    atomic_store(&reactor->expiring, false);
+    return NULL;
+}
+
+void reactor_tick(struct reactor *reactor)
+{
+    struct server *server = reactor->server;
+    uint64_t now = monotonic_ns();
+
+    if (now < reactor->next_tick)
+        return;
+
+    reactor->next_tick = now + SERVER_TICK_MS * 1000000;
+
+    if (atomic_exchange(&reactor->expiring, true))
+        return;
+
+    if (!server->config->threads ||
+        thread_pool_submit(&server->pool,
+                           &(struct thread_pool_job){
+                               .routine = reactor_expire,
+                               .arg = reactor,
+                               .priority = THREAD_POOL_BACKGROUND,
+                           }))
+        reactor_expire(reactor);
+}
+
+bool reactor_repl_update(struct reactor *reactor)
+{
+    size_t attached = atomic_load(&reactor->repl_attached);
+
+    if (attached != reactor->repl_seen) {
+        reactor->repl_seen = attached;
+        reactor->replicas = NULL;
+
+        for (struct conn *conn = reactor->conns; conn; conn = conn->next) {
+            if (conn->repl) {
+                conn->next_replica = reactor->replicas;
+                reactor->replicas = conn;
+            }
+        }
+    }
+
+    uint64_t end = repl_end(&reactor->server->repl);
+    bool moved = end != reactor->repl_end;
+
+    reactor->repl_end = end;
+
+    return moved;
+}
+
+/*
+ * Services the replication links with more to send than their output took,
+ * and every link once the stream has moved.
+ */
+static void reactor_replicate(struct reactor *reactor)
+{
+    bool moved = reactor_repl_update(reactor);
+
+    for (struct conn *conn = reactor->replicas; conn;
+         conn = conn->next_replica) {
+        if (atomic_exchange(&conn->repl_more, false) || moved)
+            conn_schedule(conn);
+    }
+}
+
+static int accept_nonblock(int fd)
+{
+#ifdef SOCK_NONBLOCK
+    return accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int conn_fd = accept(fd, NULL, NULL);
+
+    if (conn_fd >= 0 && fd_set_nonblock(conn_fd)) {
+        close(conn_fd);
+        return -1;
+    }
+
+    return conn_fd;
+#endif
+}
+
+bool server_full(struct server *server)
+{
+    long limit = server->config->max_clients;
+
+    return limit && atomic_load(&server->clients) >= (size_t)limit;
+}
+
+void reactor_accept_failed(struct reactor *reactor, int err)
+{
+    counter_add(&reactor->accept_errors, 1);
+
+    if (err != EMFILE && err != ENFILE && err != ENOBUFS && err != ENOMEM)
+        fprintf(stderr, "accept: %s\n", strerror(err));
+}
+
+static void reactor_accept(struct reactor *reactor,
+                           struct event_handler *handler, unsigned int events)
+{
+    int listen_fd = handler == &reactor->unix_listener ? reactor->unix_fd
+                                                       : reactor->sock.fd;
+
+    (void)events;
+
+    while (true) {
+        int fd = accept_nonblock(listen_fd);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                reactor_accept_failed(reactor, errno);
+
+            return;
+        }
+
+        if (server_full(reactor->server)) {
+            counter_add(&reactor->rejected, 1);
+            close(fd);
+            continue;
+        }
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int));
+
+        struct conn *conn = conn_create(reactor, fd);
+
+        if (!conn) {
+            close(fd);
+            continue;
+        }
+
+        conn->local = handler == &reactor->unix_listener;
+
+#ifdef CONN_ZEROCOPY
+        conn->zerocopy = !setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &(int){ 1 },
+                                     sizeof(int));
+#endif
+
+        if (event_loop_add(&reactor->loop, fd, &conn->handler)) {
+            close(fd);
+            conn_free(conn);
+        }
+    }
+}
+
+/*
+ * Sets up the peer queues and wakeup descriptor of a thread-per-core reactor.
+ * Returns negative on failure.
+ */
+static int reactor_queues_init(struct reactor *reactor)
+{
+    size_t count = reactor->server->reactor_count;
+    struct reactor_peer *peers;
+    size_t i = 0;
+
+    peers = aligned_alloc(_Alignof(struct reactor_peer),
+                          count * sizeof(*peers));
+    if (!peers)
+        goto error_peers;
+
+    for (; i < count; i++) {
+        if (spsc_ring_init(&peers[i].inbox, REACTOR_RING_SIZE))
+            goto error_rings;
+        peers[i].backlog = (struct reactor_backlog){ NULL, NULL };
+    }
+
+#ifdef __linux__
+    reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    reactor->wake_write_fd = reactor->wake_fd;
+
+    if (reactor->wake_fd < 0)
+        goto error_rings;
+#else
+    int fds[2];
+
+    if (pipe(fds))
+        goto error_rings;
+
+    reactor->wake_fd = fds[0];
+    reactor->wake_write_fd = fds[1];
+
+    if (fd_set_nonblock(fds[0]) || fd_set_nonblock(fds[1]))
+        goto error_wake;
+#endif
+
+    if (event_loop_add(&reactor->loop, reactor->wake_fd, &reactor->waker))
+        goto error_wake;
+
+    reactor->peers = peers;
+    return 0;
+
+error_wake:
+    close(reactor->wake_fd);
+    if (reactor->wake_write_fd != reactor->wake_fd)
+        close(reactor->wake_write_fd);
+error_rings:
+    while (i--)
+        spsc_ring_destroy(&peers[i].inbox);
+    free(peers);
+error_peers:
+    errno = ENOMEM;
+    return -1;
+}
+
+/*
+ * Returns negative on failure.
+ */
+static int reactor_init(struct reactor *reactor, struct server *server,
+                        size_t id)
+{
+    struct server_config *config = server->config;
+
+    reactor->server = server;
+    reactor->id = id;
+    reactor->listener.fn = reactor_accept;
+    reactor->unix_fd = -1;
+    reactor->unix_listener.fn = reactor_accept;
+    reactor->spinning = NULL;
+    reactor->conns = NULL;
+    reactor->conn_count = 0;
+    atomic_init(&reactor->accepted, 0);
+    atomic_init(&reactor->rejected, 0);
+    atomic_init(&reactor->accept_errors, 0);
+    reactor->replicas = NULL;
+    atomic_init(&reactor->repl_attached, 0);
+    reactor->repl_seen = 0;
+    reactor->repl_end = 0;
+    atomic_init(&reactor->closed, NULL);
+    reactor->next_tick = 0;
+    reactor->expire_shard = id;
+    atomic_init(&reactor->expiring, false);
+    reactor->peers = NULL;
+    resp_parser_init(&reactor->resp);
+    reactor->wake_fd = -1;
+    reactor->wake_write_fd = -1;
+    reactor->waker.fn = reactor_wake;
+    atomic_init(&reactor->sleeping, false);
+    atomic_init(&reactor->woken, false);
+
+    if (buffer_pool_init(&reactor->pool, CONN_READ_SIZE, REACTOR_POOL_SIZE))
+        return -1;
+
+    if (server_socket_init(&reactor->sock, config->port, SERVER_BACKLOG,
+                           server_per_core(server)))
+        goto error_pool;
+
+    if (config->unix_path && !id &&
+        (reactor->unix_fd = unix_socket_init(config->unix_path,
+                                             config->unix_mode,
+                                             SERVER_BACKLOG)) < 0)
+        goto error_sock;
+
+    if (config->backend == SERVER_BACKEND_URING) {
+#ifdef URING_SUPPORTED
+        int err = reactor_uring_init(reactor);
+#else
+        int err = -EOPNOTSUPP;
+#endif
+
+        if (err) {
+            fprintf(stderr, "io_uring unavailable (%s), using %s\n",
+                    strerror(-err), event_loop_backend());
+            config->backend = SERVER_BACKEND_EVENT_LOOP;
+        }
+    }
+
+    if (config->backend == SERVER_BACKEND_EVENT_LOOP) {
+        if (event_loop_init(&reactor->loop, SERVER_MAX_EVENTS))
+            goto error_loop;
+
+        if (event_loop_add(&reactor->loop, reactor->sock.fd,
+                           &reactor->listener) ||
+            (reactor->unix_fd >= 0 &&
+             event_loop_add(&reactor->loop, reactor->unix_fd,
+                            &reactor->unix_listener)) ||
+            (server_per_core(server) && reactor_queues_init(reactor))) {
+            event_loop_destroy(&reactor->loop);
+            goto error_loop;
+        }
+    }
+
+    return 0;
+
+error_loop:
+    if (reactor->unix_fd >= 0) {
+        close(reactor->unix_fd);
+        unlink(config->unix_path);
+    }
+error_sock:
+    close(reactor->sock.fd);
+error_pool:
+    buffer_pool_destroy(&reactor->pool);
+    return -1;
+}
+
+/*
+ * Must only be called once no thread runs any reactor.
+ */
+static void reactor_destroy(struct reactor *reactor)
+{
+    bool uring = reactor->server->config->backend == SERVER_BACKEND_URING;
+
+    close(reactor->sock.fd);
+
+    if (reactor->unix_fd >= 0) {
+        close(reactor->unix_fd);
+        unlink(reactor->server->config->unix_path);
+    }
+
+#ifdef URING_SUPPORTED
+    if (uring)
+        reactor_uring_destroy(reactor);
+#endif
+
+    reactor_reap(reactor);
+
+    /*
+     * Every message is on the pending list of the connection that sent it,
+     * so freeing connections frees any still queued between reactors.
+     */
+    while (reactor->conns) {
+        struct conn *conn = reactor->conns;
+
+        if (!uring && conn->fd >= 0)
+            close(conn->fd);
+        conn_free(conn);
+    }
+
+    buffer_pool_destroy(&reactor->pool);
+
+    if (!uring)
+        event_loop_destroy(&reactor->loop);
+
+    if (reactor->peers) {
+        for (size_t i = 0; i < reactor->server->reactor_count; i++)
+            spsc_ring_destroy(&reactor->peers[i].inbox);
+
+        free(reactor->peers);
+        close(reactor->wake_fd);
+        if (reactor->wake_write_fd != reactor->wake_fd)
+            close(reactor->wake_write_fd);
+    }
+
+    resp_parser_destroy(&reactor->resp);
+}
+
+/*
+ * Writes the server's own sections of `INFO`.
+ */
+static void server_stats_print(FILE *out, void *arg)
+{
+    struct server *server = arg;
+    struct server_config *config = server->config;
+    uint64_t accepted = 0, rejected = 0, accept_errors = 0;
+
+    fprintf(out,
+            "# Server\n"
+            "version:%s\n"
+            "io_backend:%s\n"
+            "reactors:%zu\n"
+            "worker_threads:%zu\n"
+            "uptime_s:%" PRIu64 "\n",
+            version,
+            config->backend == SERVER_BACKEND_URING ? "io_uring"
+                                                    : event_loop_backend(),
+            server->reactor_count, server->pool.thread_count,
+            (monotonic_ns() - server->started) / 1000000000);
+
+    if (config->record_path)
+        fprintf(out,
+                "record_path:%s\n"
+                "record_written:%" PRIu64 "\n"
+                "record_dropped:%" PRIu64 "\n",
+                config->record_path, atomic_load(&server->record.written),
+                atomic_load(&server->record.dropped));
+
+    for (size_t i = 0; i < server->reactor_count; i++) {
+        accepted += counter_get(&server->reactors[i].accepted);
+        rejected += counter_get(&server->reactors[i].rejected);
+        accept_errors += counter_get(&server->reactors[i].accept_errors);
+    }
+
+    fprintf(out,
+            "\n# Clients\n"
+            "connected_clients:%zu\n"
+            "max_clients:%ld\n"
+            "total_connections:%" PRIu64 "\n"
+            "rejected_connections:%" PRIu64 "\n"
+            "accept_errors:%" PRIu64 "\n",
+            atomic_load(&server->clients), config->max_clients, accepted,
+            rejected, accept_errors);
+
+    if (server->reactor_count > 1) {
+        for (size_t i = 0; i < server->reactor_count; i++)
+            fprintf(out, "reactor%zu:total_connections=%" PRIu64 "\n", i,
+                    counter_get(&server->reactors[i].accepted));
+    }
+}
+
+int server_init(struct server *server, struct server_config *config)
+{
+    size_t i = 0;
+
+    server->config = config;
+    server->reactor_count = max(config->reactors, 1L);
+    atomic_init(&server->clients, 0);
+
+    if (config->reactors && config->backend == SERVER_BACKEND_URING) {
+        fprintf(stderr, "io_uring is not supported with reactors, using %s\n",
+                event_loop_backend());
+        config->backend = SERVER_BACKEND_EVENT_LOOP;
+    }
+
+    if (!(server->reactors =
+              calloc(server->reactor_count, sizeof(*server->reactors)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (; i < server->reactor_count; i++) {
+        if (reactor_init(&server->reactors[i], server, i))
+            goto error_reactors;
+    }
+
+    /*
+     * The `io_uring` backend serves requests on the ring thread.
+     */
+    long threads = config->backend == SERVER_BACKEND_URING
+                       ? min(config->threads, SERVER_URING_THREADS)
+                       : config->threads;
+
+    if (thread_pool_init(&server->pool, threads)) {
+        errno = ENOMEM;
+        goto error_reactors;
+    }
+
+    if (db_init(&server->db)) {
+        errno = ENOMEM;
+        goto error_db;
+    }
+
+    if (repl_init(&server->repl, &server->db, config->repl_backlog)) {
+        errno = ENOMEM;
+        goto error_repl;
+    }
+
+    if (slowlog_init(&server->slowlog, config->slowlog_len,
+                     config->slowlog_us * 1000)) {
+        errno = ENOMEM;
+        goto error_slowlog;
+    }
+
+    if (config->record_path &&
+        record_open(&server->record, config->record_path))
+        goto error_record;
+
+    command_ctx_init(&server->commands);
+    server->commands.db = &server->db;
+    server->commands.pool = &server->pool;
+    server->commands.repl = &server->repl;
+    server->commands.readonly = config->replica_of;
+    server->commands.slowlog = &server->slowlog;
+    if (config->record_path)
+        server->commands.record = &server->record;
+    server->commands.stats = server_stats_print;
+    server->commands.stats_arg = server;
+
+    if (metrics_init(server))
+        goto error_metrics;
+
+    if (config->replica_of && repl_follow(&server->repl, config->replica_of))
+        goto error_follow;
+
+    server->started = monotonic_ns();
+    return 0;
+
+error_follow:
+    metrics_destroy(server);
+error_metrics:
+    command_ctx_destroy(&server->commands);
+    if (config->record_path)
+        record_close(&server->record);
+error_record:
+    slowlog_destroy(&server->slowlog);
+error_slowlog:
+    repl_destroy(&server->repl);
+error_repl:
+    db_destroy(&server->db);
+error_db:
+    thread_pool_destroy(&server->pool);
+error_reactors:
+    while (i--)
+        reactor_destroy(&server->reactors[i]);
+    free(server->reactors);
+    return -1;
+}
+
+/*
+ * Returns true if no message is waiting to be handled or sent.
+ */
+static bool reactor_idle(struct reactor *reactor)
+{
+    for (size_t i = 0; i < reactor->server->reactor_count; i++) {
+        struct reactor_peer *peer = &reactor->peers[i];
+
+        if (!spsc_ring_empty(&peer->inbox) || peer->backlog.head)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Runs the reactor until `SIGINT` or `SIGTERM`. Returns negative on failure.
+ */
+static int reactor_run(struct reactor *reactor)
+{
+    bool per_core = server_per_core(reactor->server);
+
+#ifdef URING_SUPPORTED
+    if (reactor->server->config->backend == SERVER_BACKEND_URING)
+        return reactor_run_uring(reactor);
+#endif
+
+    while (!server_stopping) {
+        int timeout = SERVER_TICK_MS;
+
+        reactor_reap(reactor);
+        reactor_tick(reactor);
+        reactor_replicate(reactor);
+
+        if (reactor->replicas)
+            timeout = SERVER_REPL_MS;
+
+#ifdef SHM_SUPPORTED
+        /*
+         * Busy channels are served without a system call, only leaving
+         * the loop every `REACTOR_SPIN_NS` to look at descriptors.
+         */
+        if (reactor->spinning) {
+            uint64_t until = monotonic_ns() + REACTOR_SPIN_NS;
+
+            while (reactor_spin(reactor) && monotonic_ns() < until)
+                ;
+
+            if (reactor->spinning)
+                timeout = 0;
+        }
+#endif
+
+        if (per_core) {
+            reactor_poll(reactor);
+
+            /*
+             * Pairs with the fence in `reactor_notify()`.
+             */
+            atomic_store_explicit(&reactor->sleeping, true,
+                                  memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+
+            if (!reactor_idle(reactor))
+                timeout = 0;
+        }
+
+        int n = event_loop_wait(&reactor->loop, timeout);
+
+        if (per_core) {
+            atomic_store(&reactor->sleeping, false);
+            atomic_store(&reactor->woken, false);
+        }
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct event_handler *handler = reactor->loop.ready[i].data;
+            handler->fn(reactor, handler, reactor->loop.ready[i].events);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Binds the calling thread to one core per reactor, where supported.
+ */
+static void reactor_pin(struct reactor *reactor)
+{
+#ifdef __linux__
+    ssize_t cores = core_count();
+    cpu_set_t set;
+
+    if (cores <= 0)
+        return;
+
+    CPU_ZERO(&set);
+    CPU_SET(reactor->id % cores, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+static void *reactor_main(void *arg)
+{
+    struct reactor *reactor = arg;
+
+    reactor_pin(reactor);
+
+    if (reactor_run(reactor)) {
+        fprintf(stderr, "reactor %zu: %s\n", reactor->id, strerror(errno));
+        server_stopping = 1;
+    }
+
+    return NULL;
+}
+
+/*
+ * Runs the server until `SIGINT` or `SIGTERM`, the first reactor on the
+ * calling thread. Returns negative on failure.
+ */
+int server_run(struct server *server)
+{
+    struct sigaction action = { .sa_handler = server_signal };
+    sigset_t mask, old_mask;
+    size_t started = 1;
+    int ret = 0;
+
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /*
+     * Signals are left to the calling thread, whose wait they interrupt.
+     */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    for (; started < server->reactor_count; started++) {
+        struct reactor *reactor = &server->reactors[started];
+
+        if ((errno = pthread_create(&reactor->thread, NULL, reactor_main,
+                                    reactor))) {
+            ret = -1;
+            break;
+        }
+    }
+
+    bool metrics = !ret && server->metrics.fd >= 0;
+
+    if (metrics && metrics_start(server)) {
+        metrics = false;
+        ret = -1;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (!ret) {
+        if (server_per_core(server))
+            reactor_pin(&server->reactors[0]);
+
+        ret = reactor_run(&server->reactors[0]);
+    }
+
+    int err = errno;
+
+    server_stopping = 1;
+
+    for (size_t i = 1; i < started; i++)
+        pthread_join(server->reactors[i].thread, NULL);
+
+    if (metrics)
+        metrics_stop(server);
+
+    errno = err;
+    return ret;
+}
+
+void server_destroy(struct server *server)
+{
+    /*
+     * Drains queued work first, so no connection is in service below.
+     */
+    thread_pool_destroy(&server->pool);
+    command_ctx_destroy(&server->commands);
+
+    if (server->config->record_path)
+        record_close(&server->record);
+
+    metrics_destroy(server);
+
+    for (size_t i = 0; i < server->reactor_count; i++)
+        reactor_destroy(&server->reactors[i]);
+
+    free(server->reactors);
+    slowlog_destroy(&server->slowlog);
+    repl_destroy(&server->repl);
+    db_destroy(&server->db);
+}
+
+int main(int argc, char **argv)
+{
+    struct server_config config;
+    struct server server;
+
+    server_config_init(&config, argc, argv);
+
+    if (server_init(&server, &config))
+        fatal("server_init: %s\n", strerror(errno));
+
+    /*
+     * The `io_uring` backend serves requests on the ring thread rather than
+     * the worker threads.
+     */
+    bool uring = config.backend == SERVER_BACKEND_URING;
+    char threads[48];
+
+    snprintf(threads, sizeof(threads), "%ld %s",
+             config.reactors ? config.reactors : config.threads,
+             config.reactors ? "reactors" : "worker threads");
+    fprintf(stderr, "Listening on port %d%s%s (%s, %s)\n", config.port,
+            config.unix_path ? " and " : "",
+            config.unix_path ? config.unix_path : "",
+            uring ? "io_uring" : event_loop_backend(),
+            uring ? "requests served on the ring thread" : threads);
+
+    if (config.metrics_port)
+        fprintf(stderr, "Serving metrics on port %d\n", config.metrics_port);
+
+    if (config.replica_of)
+        fprintf(stderr, "Replicating %s\n", config.replica_of);
+
+    if (config.record_path)
+        fprintf(stderr, "Recording requests to %s\n", config.record_path);
+
+    if (server_run(&server))
+        fatal("server_run: %s\n", strerror(errno));
+
+    server_destroy(&server);
+    return 0;
 }
@@ -0,0 +1,639 @@
+#ifndef MEMDB_SERVER_H_
+#define MEMDB_SERVER_H_
+
+/*
+ * Internals shared by the server's modules: `server.c`, with the connections
+ * and readiness driven reactors, `conn_shm.c`, `reactor_uring.c` and
+ * `metrics.c`.
+ */
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "common.h"
+#include "buffer.h"
+#include "command.h"
+#include "event_loop.h"
+#include "reply.h"
+#include "resp.h"
+#include "shm.h"
+#include "spsc_ring.h"
+#include "uring.h"
+
+#define SERVER_BACKLOG 128
+
+/*
+ * Events handled per `event_loop_wait()`, and the longest the loop sleeps
+ * before checking for shutdown and reaping closed connections.
+ */
+#define SERVER_MAX_EVENTS 256
+#define SERVER_TICK_MS 100
+
+/*
+ * Minimum free space offered to each `read()` of a connection, and the size of
+ * the blocks connection buffers start out with.
+ */
+#define CONN_READ_SIZE (16 * 1024)
+
+/*
+ * Replication stream queued on a link at once. A reactor with links looks for
+ * changes to send every `SERVER_REPL_MS`, besides whenever it wakes anyway.
+ */
+#define CONN_REPL_CHUNK (256 * 1024)
+#define SERVER_REPL_MS 1
+
+/*
+ * Reply segments gathered per send.
+ */
+#define CONN_IOV_MAX 64
+
+/*
+ * Socket wrapper for server. TCP, supporting IPv6 and IPv4.
+ *
+ * Note: Database protocol itself need-not be TCP specific, though depends on
+ * an equivalent streaming protocol, such as unix sockets.
+ */
+struct server_socket {
+    /*
+     * Open socket's file descriptor.
+     */
+    int fd;
+
+    /*
+     * Bound port in host byte order. Opposed to `addr.sin6_port`
+     * in network byte order.
+     */
+    uint16_t port;
+
+    struct sockaddr_in6 addr;
+};
+
+/*
+ * How the server does socket I/O. The readiness backend is `epoll` or
+ * `kqueue`, whichever `event_loop.h` compiled in.
+ */
+enum server_backend {
+    SERVER_BACKEND_EVENT_LOOP,
+    SERVER_BACKEND_URING,
+};
+
+/*
+ * Protocol spoken on connections. With `SERVER_PROTOCOL_AUTO` each connection
+ * is binary if its first byte is `PROTO_REQUEST_MAGIC`, and RESP otherwise.
+ */
+enum server_protocol {
+    SERVER_PROTOCOL_AUTO,
+    SERVER_PROTOCOL_BINARY,
+    SERVER_PROTOCOL_RESP,
+};
+
+struct server_config {
+    uint16_t port;
+    enum server_backend backend;
+    enum server_protocol protocol;
+
+    /*
+     * Worker threads. Zero runs requests on the event loop thread.
+     */
+    long threads;
+
+    /*
+     * Reactor threads in thread-per-core mode, or zero for one event loop
+     * feeding the worker threads.
+     */
+    long reactors;
+
+    /*
+     * Path of an additional Unix domain socket listener, or `NULL`, and its
+     * permission bits, negative to leave them to the umask.
+     */
+    const char *unix_path;
+    long unix_mode;
+
+    /*
+     * Admission control, zero meaning no limit for each. Connections past
+     * `max_clients` are closed as soon as accepted. A connection with
+     * `max_inflight` requests whose replies are not yet written has further
+     * input left unread until they are. With worker threads, one that waited
+     * `max_wait_ms` for a worker has what it has sent answered as busy
+     * rather than executed.
+     */
+    long max_clients;
+    long max_inflight;
+    long max_wait_ms;
+
+    /*
+     * `host:port` of the primary to replicate, making this server a read
+     * only replica, or `NULL`. Otherwise, bytes of changes kept for replicas
+     * to catch up from after a dropped link.
+     */
+    const char *replica_of;
+    long repl_backlog;
+
+    /*
+     * Port serving statistics over HTTP, or zero for none.
+     */
+    uint16_t metrics_port;
+
+    /*
+     * Requests taking `slowlog_us` or longer from being queued to their
+     * reply being ready are logged, the last `slowlog_len` of them kept.
+     */
+    long slowlog_us;
+    long slowlog_len;
+
+    /*
+     * Path requests are recorded to, for `replay`, or `NULL`.
+     */
+    const char *record_path;
+};
+
+struct server;
+struct reactor;
+
+/*
+ * Anything registered with a reactor's event loop. `fn` is called on the
+ * reactor thread with the events reported for the handler.
+ */
+struct event_handler {
+    void (*fn)(struct reactor *reactor, struct event_handler *handler,
+               unsigned int events);
+};
+
+/*
+ * A connection is serviced by at most one thread at a time. The loop thread
+ * moves an idle connection to `CONN_SCHEDULED` and queues `conn_service()`;
+ * events arriving meanwhile move it to `CONN_RESCHEDULE`, which makes the
+ * servicing thread go around again instead of going idle. Edge triggered
+ * events are therefore never lost, and never handled twice concurrently.
+ */
+enum conn_state {
+    CONN_IDLE,
+    CONN_SCHEDULED,
+    CONN_RESCHEDULE,
+    CONN_CLOSED,
+};
+
+/*
+ * A value sent with `MSG_ZEROCOPY`, held until the kernel reports the send
+ * numbered `seq` done with it.
+ */
+struct conn_held {
+    uint32_t seq;
+    struct db_value *val;
+};
+
+struct conn {
+    struct event_handler handler;
+    struct server *server;
+    struct reactor *reactor;
+    int fd;
+    atomic_int state;
+
+    /*
+     * Numbers the connection in the trace and slowlog. `queued` is when its
+     * input last began waiting to be processed, set by whichever thread
+     * queues it for service.
+     */
+    uint32_t id;
+    uint64_t queued;
+
+    /*
+     * Owned by whichever thread is servicing the connection. Buffers come
+     * from `pool` and go back to it while empty, if the connection is only
+     * serviced by the reactor thread.
+     */
+    struct buffer rbuf;
+    struct reply wbuf;
+    struct buffer_pool *pool;
+    enum server_protocol protocol;
+    struct resp_parser resp;
+
+    /*
+     * Set once the client has sent `QUIT` or a malformed request. Further
+     * input is discarded, and the connection closed once output is written.
+     */
+    bool quit;
+
+    /*
+     * Requests taken from `rbuf` since output was last all written. Reaching
+     * `max_inflight` holds back the rest of the input, setting `backlog` if
+     * some is buffered, and `paused` so the servicing thread comes back for
+     * it once output is written. `shedding` is set while requests are being
+     * answered as busy.
+     */
+    size_t unanswered;
+    bool backlog;
+    bool paused;
+    bool shedding;
+
+    /*
+     * Set if accepted on the Unix domain socket, where the client may move
+     * the connection to the shared memory channel `shm`.
+     */
+    bool local;
+    struct conn_shm *shm;
+
+    /*
+     * Set if the socket accepted `SO_ZEROCOPY`. Values sent with it are
+     * `held` until the kernel is done with them, in order of the number it
+     * gives each send, `zc_next` being the next. A connection closed with
+     * values held keeps its descriptor, and is closed by `conn_linger()`.
+     */
+    bool zerocopy;
+    uint32_t zc_next;
+    struct conn_held *held;
+    size_t held_start;
+    size_t held_end;
+    size_t held_cap;
+
+    /*
+     * `io_uring` backend only. `fd` is a direct descriptor index, and
+     * `sending` holds output owned by the in-flight send, described by
+     * `send_msg`.
+     */
+    struct reply sending;
+#ifdef URING_SUPPORTED
+    struct msghdr send_msg;
+    struct iovec send_iov[CONN_IOV_MAX];
+#endif
+    bool read_closed;
+
+    /*
+     * Counts `io_uring` operations, or requests forwarded to other reactors,
+     * whose completions will still refer to the connection. A closed
+     * connection is marked `closing` and freed once the count drops to zero.
+     */
+    unsigned int inflight;
+    bool closing;
+
+    /*
+     * Thread-per-core mode only. Replies not yet written, in request order,
+     * starting with one still being served by another reactor.
+     */
+    struct reactor_msg *pending;
+    struct reactor_msg *pending_tail;
+
+    /*
+     * Set by `SYNC`, which makes the connection a replication link: nothing
+     * but `ACK`s is taken from it after, and output is topped up from the
+     * stream as it drains. Set by the servicing thread, but also read by the
+     * reactor thread looking for links. `repl_more` is set when output has
+     * drained with more of the stream to send, for the reactor to come back
+     * for it. `next_replica` links `reactor::replicas`.
+     */
+    _Atomic(struct repl_sender *) repl;
+    atomic_bool repl_more;
+    struct conn *next_replica;
+
+    /*
+     * Links in `reactor::conns`, owned by the reactor thread.
+     */
+    struct conn *prev;
+    struct conn *next;
+
+    /*
+     * Link in `reactor::closed`.
+     */
+    struct conn *next_closed;
+};
+
+#ifdef SHM_SUPPORTED
+
+/*
+ * A connection's shared memory channel. Only connections served on the
+ * reactor thread get one, so nothing here is shared with other threads but
+ * the rings. While `spinning`, the reactor polls the rings between waits;
+ * once nothing has moved for `CONN_SHM_SPIN_NS` it parks on them, leaving the
+ * client to wake it through `wake_fd`. `sock_event` is set by events on the
+ * socket, which only the client going away should raise.
+ */
+struct conn_shm {
+    struct conn *conn;
+    struct shm_channel ch;
+    struct shm_port requests;
+    struct shm_port responses;
+    int wake_fd;
+    struct event_handler waker;
+    bool sock_event;
+    uint64_t active;
+    bool spinning;
+    struct conn_shm *prev;
+    struct conn_shm *next;
+};
+
+#endif
+
+/*
+ * A request forwarded in thread-per-core mode to the reactor owning its key,
+ * which executes it and sends it back with `reply` filled in. Requests served
+ * locally while earlier ones are away are also queued as messages, already
+ * `done`, so replies are written in request order. Only the sending reactor
+ * touches `done`, once the message is back.
+ */
+struct reactor_msg {
+    struct reactor_msg *next;
+    struct reactor_msg *next_pending;
+    struct conn *conn;
+    enum server_protocol protocol;
+    bool done;
+    bool failed;
+    struct command_origin origin;
+    struct reply reply;
+    size_t len;
+    char frame[];
+};
+
+/*
+ * Messages for one peer that found its queue full, in send order.
+ */
+struct reactor_backlog {
+    struct reactor_msg *head;
+    struct reactor_msg *tail;
+};
+
+/*
+ * A reactor's queues with one peer: `inbox` carries messages from the peer,
+ * and `backlog` holds those for the peer that found its inbox full.
+ */
+struct reactor_peer {
+    struct spsc_ring inbox;
+    struct reactor_backlog backlog;
+};
+
+/*
+ * An event loop, its listening socket, and the connections accepted on it.
+ *
+ * By default the server runs one reactor, which hands connections to the
+ * worker threads. In thread-per-core mode it runs one per core, each serving
+ * its own connections inline and owning the shards whose index is its `id`
+ * modulo the reactor count. Requests for a single key are executed by the
+ * key's owner, so in the common case a shard is only touched by one core;
+ * requests spanning keys run where they arrive, under the shard locks.
+ */
+struct reactor {
+    struct server *server;
+    size_t id;
+    pthread_t thread;
+    struct server_socket sock;
+    struct event_handler listener;
+
+    /*
+     * Unix domain socket listener, on the first reactor only, or -1.
+     */
+    int unix_fd;
+    struct event_handler unix_listener;
+
+    struct event_loop loop;
+    struct buffer_pool pool;
+
+    /*
+     * Shared memory channels being polled. Reactor thread only.
+     */
+    struct conn_shm *spinning;
+
+    /*
+     * Open connections. Reactor thread only.
+     */
+    struct conn *conns;
+    size_t conn_count;
+
+    /*
+     * Connections accepted, those closed at once for `max_clients`, and
+     * accepts that failed. Written by the reactor thread only, read by
+     * statistics.
+     */
+    _Atomic uint64_t accepted;
+    _Atomic uint64_t rejected;
+    _Atomic uint64_t accept_errors;
+
+    /*
+     * Replication links among `conns`. Reactor thread only, but rebuilt when
+     * `repl_attached`, counting links made by any thread, is past
+     * `repl_seen`. `repl_end` is where the stream ended when they were last
+     * looked at.
+     */
+    struct conn *replicas;
+    atomic_size_t repl_attached;
+    size_t repl_seen;
+    uint64_t repl_end;
+
+    /*
+     * Connections closed by any thread, waiting for the reactor thread to
+     * free them once none of its events can refer to them.
+     */
+    _Atomic(struct conn *) closed;
+
+    /*
+     * Expiry sweep state. `expiring` is set while a sweep is queued or
+     * running; `expire_shard` is the next shard to sweep.
+     */
+    uint64_t next_tick;
+    size_t expire_shard;
+    atomic_bool expiring;
+
+    /*
+     * Thread-per-core mode only. `peers[i]` holds the queues with reactor
+     * `i`. Peers write to `wake_fd` to interrupt a wait while `sleeping` is
+     * set; `woken` keeps that to one write per wait.
+     */
+    struct reactor_peer *peers;
+    struct resp_parser resp;
+    int wake_fd;
+    int wake_write_fd;
+    struct event_handler waker;
+    atomic_bool sleeping;
+    atomic_bool woken;
+
+#ifdef URING_SUPPORTED
+    struct uring ring;
+    struct uring_buf_ring bufs;
+#endif
+};
+
+struct server {
+    struct server_config *config;
+    struct thread_pool pool;
+    struct db db;
+    struct repl repl;
+    struct command_ctx commands;
+    struct reactor *reactors;
+    size_t reactor_count;
+
+    /*
+     * Open connections across reactors, for `max_clients`.
+     */
+    atomic_size_t clients;
+
+    uint64_t started;
+    struct slowlog slowlog;
+    struct record record;
+
+    /*
+     * Listener of the metrics endpoint, and the thread serving it, if
+     * `metrics_port` is set.
+     */
+    struct server_socket metrics;
+    pthread_t metrics_thread;
+};
+
+/*
+ * Set by a signal, or a reactor failing, to stop every thread of the server.
+ */
+extern volatile sig_atomic_t server_stopping;
+
+/*
+ * Argument `port` must be in host byte order. Uses IPv6 with socket option
+ * `IPV6_V6ONLY` off, thus using IPv4-mapped address, and making it impossible
+ * to bind with an IPv4 socket. The socket is non-blocking. With `reuse_port`,
+ * any number of sockets may bind the port, and the kernel spreads incoming
+ * connections over them.
+ */
+int server_socket_init(struct server_socket *sock, in_port_t port,
+                       size_t backlog, bool reuse_port);
+
+/*
+ * Returns true, setting `paused`, if the rest of the input is to be left
+ * unread for now, `len` bytes having been read in this pass. Left there, it
+ * pushes back on the client.
+ */
+bool conn_hold_input(struct conn *conn, size_t len);
+
+/*
+ * Consumes complete requests from `rbuf`, appending replies to `wbuf`.
+ * Returns false if the connection must be dropped.
+ */
+bool conn_process(struct conn *conn);
+
+/*
+ * Deregisters and closes the connection, and hands it to the reactor thread
+ * to be freed. Must be called by the servicing thread.
+ *
+ * The kernel goes on reading values sent with `MSG_ZEROCOPY` after `close()`,
+ * with no way left to learn when it is done, so while any are held the
+ * descriptor stays open for `conn_linger()`.
+ */
+void conn_close(struct conn *conn);
+
+/*
+ * Queues the connection for service, unless it is being serviced already, in
+ * which case the servicing thread goes around again.
+ */
+void conn_schedule(struct conn *conn);
+
+/*
+ * Returns `NULL` on allocation failure.
+ */
+struct conn *conn_create(struct reactor *reactor, int fd);
+
+void conn_free(struct conn *conn);
+
+/*
+ * Returns true if another connection would go over `max_clients`.
+ */
+bool server_full(struct server *server);
+
+/*
+ * Counts an accept that failed with `err`, which is logged unless it is a
+ * lack of descriptors or memory: those pass, and would flood the log while
+ * they last.
+ */
+void reactor_accept_failed(struct reactor *reactor, int err);
+
+/*
+ * Periodic work, called by the reactor thread between waits. Expired keys
+ * that are never looked up again are swept on the background lane, so
+ * sweeping never delays requests queued behind it, or in thread-per-core
+ * mode by each reactor over the shards it owns.
+ */
+void reactor_tick(struct reactor *reactor);
+
+/*
+ * Brings `replicas` up to date with the links made since the last call.
+ * Returns true if the stream has moved since.
+ */
+bool reactor_repl_update(struct reactor *reactor);
+
+#ifdef SHM_SUPPORTED
+
+/*
+ * As `conn_read()`, from the request ring. The socket is only looked at after
+ * an event on it: anything but the end of stream there is a protocol error.
+ */
+int conn_shm_read(struct conn *conn);
+
+/*
+ * As `conn_flush()`, to the response ring.
+ */
+bool conn_shm_flush(struct conn *conn);
+
+/*
+ * Whether the `ATTACH` request of `len` bytes at the front of `rbuf` can be
+ * granted: on a Unix domain socket, served on the reactor thread by the
+ * readiness backend, with nothing else in flight either way.
+ */
+bool conn_shm_allowed(struct conn *conn, size_t len);
+
+/*
+ * Answers `ATTACH` with a new channel, passing its descriptors over the
+ * socket, and moves the connection onto it. Returns false if the connection
+ * must be dropped.
+ */
+bool conn_shm_attach(struct conn *conn, const struct proto_request *req);
+
+/*
+ * Wakes a client asleep on a ring to find the socket closed, and stops
+ * polling the channel.
+ */
+void conn_shm_shut(struct conn *conn);
+void conn_shm_free(struct conn *conn);
+
+/*
+ * Services channels with requests waiting, or room for replies held back, and
+ * parks those that have been idle for long enough. Returns true if any are
+ * still spinning.
+ */
+bool reactor_spin(struct reactor *reactor);
+
+#endif
+
+#ifdef URING_SUPPORTED
+
+/*
+ * Sets up the reactor's ring. Returns a negated `errno` value on failure.
+ */
+int reactor_uring_init(struct reactor *reactor);
+
+/*
+ * Completion driven loop. Submissions queued while handling a batch of
+ * completions go out with the wait for the next, so a busy ring makes one
+ * system call per batch rather than several per request.
+ */
+int reactor_run_uring(struct reactor *reactor);
+
+/*
+ * Tearing down the ring cancels its operations and closes every direct
+ * descriptor, so buffers are no longer referenced by the kernel.
+ */
+void reactor_uring_destroy(struct reactor *reactor);
+
+#endif
+
+/*
+ * Binds the metrics port, if `metrics_port` is set, so a port in use fails
+ * startup. Returns negative on failure.
+ */
+int metrics_init(struct server *server);
+
+/*
+ * Serves the metrics endpoint on a thread of its own until the server stops.
+ * Returns negative on failure, setting `errno`.
+ */
+int metrics_start(struct server *server);
+void metrics_stop(struct server *server);
+void metrics_destroy(struct server *server);
+
+#endif
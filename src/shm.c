@@ -0,0 +1,484 @@
+#include "shm.h"
+
+#ifdef SHM_SUPPORTED
+
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "protocol.h"
+#include "sys.h"
+
+/*
+ * How long a client spins for room before sleeping, and the longest it sleeps
+ * before checking that the server is still there.
+ */
+#define SHM_SEND_SPIN_NS 20000
+#define SHM_WAIT_NS 100000000
+
+static_assert(2 * sizeof(struct shm_ring) <= SHM_HEADER_SIZE);
+
+static size_t shm_capacity(size_t capacity)
+{
+    size_t size = SHM_MIN_CAPACITY;
+
+    while (size < capacity && size < SHM_MAX_CAPACITY)
+        size <<= 1;
+
+    return size;
+}
+
+/*
+ * Maps the header page and both rings of `ch->size` bytes of `ch->fd`.
+ */
+static int shm_channel_map(struct shm_channel *ch)
+{
+    void *base = mmap(NULL, ch->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      ch->fd, 0);
+
+    if (base == MAP_FAILED)
+        return 1;
+
+    ch->base = base;
+    ch->capacity = (ch->size - SHM_HEADER_SIZE) / 2;
+    ch->requests = (struct shm_ring *)ch->base;
+    ch->responses = ch->requests + 1;
+
+    return 0;
+}
+
+int shm_channel_create(struct shm_channel *ch, size_t capacity)
+{
+    ch->size = SHM_HEADER_SIZE + 2 * shm_capacity(capacity);
+
+    if ((ch->fd = memfd_create("mem-db", MFD_CLOEXEC | MFD_ALLOW_SEALING)) <
+        0)
+        return 1;
+
+    if (ftruncate(ch->fd, ch->size) ||
+        fcntl(ch->fd, F_ADD_SEALS,
+              F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) ||
+        shm_channel_map(ch)) {
+        int err = errno;
+
+        close(ch->fd);
+        errno = err;
+        return 1;
+    }
+
+    /*
+     * A fresh file reads as zeros, which is two empty rings with nobody
+     * waiting.
+     */
+    return 0;
+}
+
+int shm_channel_open(struct shm_channel *ch, int fd)
+{
+    const int seals = F_SEAL_SHRINK | F_SEAL_GROW;
+    struct stat st;
+    int err = EINVAL;
+
+    ch->fd = fd;
+
+    if (fstat(fd, &st)) {
+        err = errno;
+        goto error;
+    }
+
+    size_t capacity = st.st_size > SHM_HEADER_SIZE
+                          ? (st.st_size - SHM_HEADER_SIZE) / 2
+                          : 0;
+
+    ch->size = st.st_size;
+
+    /*
+     * The seals keep the size fixed for as long as the mapping is used.
+     */
+    if ((fcntl(fd, F_GET_SEALS) & seals) != seals ||
+        shm_capacity(capacity) != capacity ||
+        ch->size != SHM_HEADER_SIZE + 2 * capacity)
+        goto error;
+
+    if (shm_channel_map(ch)) {
+        err = errno;
+        goto error;
+    }
+
+    return 0;
+
+error:
+    close(fd);
+    errno = err;
+    return 1;
+}
+
+void shm_channel_destroy(struct shm_channel *ch)
+{
+    munmap(ch->base, ch->size);
+    close(ch->fd);
+}
+
+void shm_port_init(struct shm_port *port, struct shm_channel *ch,
+                   struct shm_ring *ring)
+{
+    port->ring = ring;
+    port->data = ch->base + SHM_HEADER_SIZE;
+    if (ring == ch->responses)
+        port->data += ch->capacity;
+    port->mask = ch->capacity - 1;
+    port->pos = 0;
+    port->cache = 0;
+}
+
+/*
+ * Copies between `buf` and the ring at `pos`, in up to two pieces around the
+ * end.
+ */
+static void shm_copy(struct shm_port *port, uint32_t pos, void *buf,
+                     size_t len, bool in)
+{
+    size_t offset = pos & port->mask;
+    size_t first = min(len, port->mask + 1 - offset);
+    char *ring = port->data;
+
+    if (in) {
+        memcpy(ring + offset, buf, first);
+        memcpy(ring, (char *)buf + first, len - first);
+    } else {
+        memcpy(buf, ring + offset, first);
+        memcpy((char *)buf + first, ring, len - first);
+    }
+}
+
+static size_t shm_port_writable(struct shm_port *port)
+{
+    return port->mask + 1 - (port->pos - port->cache);
+}
+
+static size_t shm_port_readable(struct shm_port *port)
+{
+    return port->cache - port->pos;
+}
+
+/*
+ * Reloads the peer's index, keeping the cached one if the new one is out of
+ * range. Returns false if it is.
+ */
+static bool shm_port_sync(struct shm_port *port, bool producer)
+{
+    struct shm_ring *ring = port->ring;
+    uint32_t index = atomic_load_explicit(producer ? &ring->head : &ring->tail,
+                                          memory_order_acquire);
+
+    if ((uint32_t)(producer ? port->pos - index : index - port->pos) >
+        port->mask + 1)
+        return false;
+
+    port->cache = index;
+    return true;
+}
+
+size_t shm_ring_writable(struct shm_port *port)
+{
+    return shm_port_sync(port, true) ? shm_port_writable(port) : SIZE_MAX;
+}
+
+size_t shm_ring_readable(struct shm_port *port)
+{
+    return shm_port_sync(port, false) ? shm_port_readable(port) : SIZE_MAX;
+}
+
+ssize_t shm_ring_write(struct shm_port *port, const void *src, size_t len)
+{
+    if (shm_port_writable(port) < len && !shm_port_sync(port, true)) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    len = min(len, shm_port_writable(port));
+
+    if (!len)
+        return 0;
+
+    shm_copy(port, port->pos, (void *)src, len, true);
+    port->pos += len;
+    atomic_store_explicit(&port->ring->tail, port->pos, memory_order_release);
+
+    return len;
+}
+
+ssize_t shm_ring_read(struct shm_port *port, void *dest, size_t len)
+{
+    if (shm_port_readable(port) < len && !shm_port_sync(port, false)) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    len = min(len, shm_port_readable(port));
+
+    if (!len)
+        return 0;
+
+    shm_copy(port, port->pos, dest, len, false);
+    port->pos += len;
+    atomic_store_explicit(&port->ring->head, port->pos, memory_order_release);
+
+    return len;
+}
+
+/*
+ * The fences pair between parking and notifying: either the parked side sees
+ * the index moved when it checks again, or the other side sees it parked.
+ */
+bool shm_ring_park_consumer(struct shm_port *port)
+{
+    atomic_store_explicit(&port->ring->consumer_waiting, 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (shm_port_sync(port, false) && !shm_port_readable(port))
+        return true;
+
+    atomic_store_explicit(&port->ring->consumer_waiting, 0,
+                          memory_order_relaxed);
+    return false;
+}
+
+bool shm_ring_park_producer(struct shm_port *port)
+{
+    atomic_store_explicit(&port->ring->producer_waiting, 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (shm_port_sync(port, true) && !shm_port_writable(port))
+        return true;
+
+    atomic_store_explicit(&port->ring->producer_waiting, 0,
+                          memory_order_relaxed);
+    return false;
+}
+
+bool shm_ring_notify_consumer(struct shm_port *port)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+
+    return atomic_load_explicit(&port->ring->consumer_waiting,
+                                memory_order_relaxed) &&
+           atomic_exchange(&port->ring->consumer_waiting, 0);
+}
+
+bool shm_ring_notify_producer(struct shm_port *port)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+
+    return atomic_load_explicit(&port->ring->producer_waiting,
+                                memory_order_relaxed) &&
+           atomic_exchange(&port->ring->producer_waiting, 0);
+}
+
+/*
+ * Not `FUTEX_PRIVATE_FLAG`: the word is shared between processes.
+ */
+int shm_futex_wait(atomic_uint *word, unsigned int expected,
+                   uint64_t timeout_ns)
+{
+    struct timespec timeout = {
+        .tv_sec = timeout_ns / 1000000000,
+        .tv_nsec = timeout_ns % 1000000000,
+    };
+
+    return syscall(SYS_futex, word, FUTEX_WAIT, expected, &timeout, NULL, 0) <
+           0;
+}
+
+void shm_futex_wake(atomic_uint *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+/*
+ * Receives the response to `ATTACH`, with the channel and `eventfd`
+ * descriptors passed alongside it.
+ */
+static int shm_client_recv_attach(int sock, struct proto_header *hdr,
+                                  int fds[2])
+{
+    union {
+        char data[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = hdr, .iov_len = sizeof(*hdr) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.data,
+        .msg_controllen = sizeof(control.data),
+    };
+    ssize_t n;
+
+    while ((n = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC)) < 0 &&
+           errno == EINTR)
+        ;
+
+    if (n < 0)
+        return 1;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int)))
+            memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+    }
+
+    if (n != sizeof(*hdr) || hdr->magic != PROTO_RESPONSE_MAGIC ||
+        hdr->opcode != PROTO_ATTACH || hdr->key_len != PROTO_OK ||
+        fds[0] < 0) {
+        if (fds[0] >= 0) {
+            close(fds[0]);
+            close(fds[1]);
+        }
+
+        errno = n != sizeof(*hdr) ? EPIPE : EPROTONOSUPPORT;
+        return 1;
+    }
+
+    return 0;
+}
+
+int shm_client_attach(struct shm_client *client, int sock, size_t capacity)
+{
+    struct proto_header hdr = {
+        .magic = PROTO_REQUEST_MAGIC,
+        .opcode = PROTO_ATTACH,
+        .extra = capacity,
+    };
+    int fds[2] = { -1, -1 };
+
+    if (send(sock, &hdr, sizeof(hdr), MSG_NOSIGNAL) != sizeof(hdr) ||
+        shm_client_recv_attach(sock, &hdr, fds))
+        return 1;
+
+    if (shm_channel_open(&client->ch, fds[0])) {
+        close(fds[1]);
+        return 1;
+    }
+
+    shm_port_init(&client->requests, &client->ch, client->ch.requests);
+    shm_port_init(&client->responses, &client->ch, client->ch.responses);
+    client->wake_fd = fds[1];
+    client->sock = sock;
+
+    return 0;
+}
+
+void shm_client_destroy(struct shm_client *client)
+{
+    shm_channel_destroy(&client->ch);
+    close(client->wake_fd);
+    close(client->sock);
+}
+
+static void shm_client_wake(struct shm_client *client)
+{
+    uint64_t one = 1;
+
+    while (write(client->wake_fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+/*
+ * Returns false if the server has closed the socket, or sent anything on it,
+ * which it only does when giving up on the channel.
+ */
+static bool shm_client_alive(struct shm_client *client)
+{
+    struct pollfd pfd = { .fd = client->sock, .events = POLLIN };
+
+    return !poll(&pfd, 1, 0);
+}
+
+/*
+ * Sleeps on `word` while it holds `expected` and the server is alive. Returns
+ * non-zero if it is not.
+ */
+static int shm_client_sleep(struct shm_client *client, atomic_uint *word,
+                            unsigned int expected)
+{
+    if (shm_futex_wait(word, expected, SHM_WAIT_NS) && errno == ETIMEDOUT &&
+        !shm_client_alive(client)) {
+        errno = EPIPE;
+        return 1;
+    }
+
+    return 0;
+}
+
+int shm_client_send(struct shm_client *client, const void *src, size_t len)
+{
+    struct shm_port *port = &client->requests;
+    uint64_t spin_until = 0;
+
+    while (len) {
+        ssize_t n = shm_ring_write(port, src, len);
+
+        if (n < 0)
+            return 1;
+
+        if (n) {
+            if (shm_ring_notify_consumer(port))
+                shm_client_wake(client);
+
+            src = (const char *)src + n;
+            len -= n;
+            spin_until = 0;
+            continue;
+        }
+
+        if (!spin_until)
+            spin_until = monotonic_ns() + SHM_SEND_SPIN_NS;
+
+        if (monotonic_ns() < spin_until || !shm_ring_park_producer(port))
+            continue;
+
+        if (shm_client_sleep(client, &port->ring->head, port->cache))
+            return 1;
+    }
+
+    return 0;
+}
+
+ssize_t shm_client_recv(struct shm_client *client, void *dest, size_t len,
+                        uint64_t spin_ns)
+{
+    struct shm_port *port = &client->responses;
+    uint64_t spin_until = 0;
+
+    while (true) {
+        ssize_t n = shm_ring_read(port, dest, len);
+
+        if (n) {
+            if (n > 0 && shm_ring_notify_producer(port))
+                shm_client_wake(client);
+
+            return n;
+        }
+
+        if (!spin_until)
+            spin_until = monotonic_ns() + spin_ns;
+
+        if (monotonic_ns() < spin_until || !shm_ring_park_consumer(port))
+            continue;
+
+        if (shm_client_sleep(client, &port->ring->tail, port->pos))
+            return -1;
+    }
+}
+
+#endif
@@ -0,0 +1,172 @@
+#ifndef MEMDB_SHM_H_
+#define MEMDB_SHM_H_
+
+#include <stdatomic.h>
+#include <sys/types.h>
+#include "common.h"
+
+#if defined(__linux__)
+#define SHM_SUPPORTED
+#endif
+
+#ifdef SHM_SUPPORTED
+
+/*
+ * Shared memory transport for clients on the same host.
+ *
+ * A channel is a `memfd` holding two single producer, single consumer byte
+ * rings: requests from the client and responses from the server, carrying the
+ * same byte stream as the binary protocol would over a socket. Once both
+ * sides have it mapped, a request and its response cross without a system
+ * call as long as neither side sleeps.
+ *
+ * A side about to sleep on a ring sets the ring's waiting flag for it and
+ * checks the ring once more; the other side, after moving its index, clears
+ * the flag and wakes it. How depends on the sleeper: the client waits on a
+ * futex on the index it is waiting for, the server in its event loop on an
+ * `eventfd` the client writes.
+ */
+
+/*
+ * Size of the header page ahead of the ring data, and the least capacity.
+ */
+#define SHM_HEADER_SIZE 4096
+#define SHM_MIN_CAPACITY 4096
+#define SHM_MAX_CAPACITY (64 << 20)
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "Shared atomics must be lock-free.");
+
+/*
+ * Indices are free running, and wrap.
+ */
+struct shm_ring {
+    _Alignas(64) atomic_uint head;
+    atomic_uint producer_waiting;
+
+    _Alignas(64) atomic_uint tail;
+    atomic_uint consumer_waiting;
+};
+
+/*
+ * One side's handle on a ring. The side's own index is kept here and only
+ * ever published, and the other side's is checked against the capacity when
+ * loaded, so a peer scribbling over the shared header cannot make this side
+ * read or write outside the ring.
+ */
+struct shm_port {
+    struct shm_ring *ring;
+    char *data;
+    uint32_t mask;
+    uint32_t pos;
+    uint32_t cache;
+};
+
+struct shm_channel {
+    int fd;
+    char *base;
+    size_t size;
+    size_t capacity;
+    struct shm_ring *requests;
+    struct shm_ring *responses;
+};
+
+/*
+ * Creates a channel with rings of `capacity` bytes, rounded up to a power of
+ * two and clamped to the limits above. The file is sealed against resizing,
+ * so a client cannot truncate it under the server. Returns non-zero on
+ * failure, setting `errno`.
+ */
+int shm_channel_create(struct shm_channel *ch, size_t capacity);
+
+/*
+ * Maps a channel received from the server, taking ownership of `fd`. Returns
+ * non-zero on failure, setting `errno`.
+ */
+int shm_channel_open(struct shm_channel *ch, int fd);
+void shm_channel_destroy(struct shm_channel *ch);
+
+void shm_port_init(struct shm_port *port, struct shm_channel *ch,
+                   struct shm_ring *ring);
+
+/*
+ * Producer only. Copies up to `len` bytes in, returning how many, or
+ * negative if the peer has corrupted the ring.
+ */
+ssize_t shm_ring_write(struct shm_port *port, const void *src, size_t len);
+
+/*
+ * Consumer only. Copies up to `len` bytes out, returning how many, or
+ * negative if the peer has corrupted the ring.
+ */
+ssize_t shm_ring_read(struct shm_port *port, void *dest, size_t len);
+
+/*
+ * Reloads the peer's index, returning the bytes ready to read, or room to
+ * write. An index the peer has corrupted reads as `SIZE_MAX`, so the next
+ * read or write reports it.
+ */
+size_t shm_ring_readable(struct shm_port *port);
+size_t shm_ring_writable(struct shm_port *port);
+
+/*
+ * Announce that this side is going to sleep until the ring has data, or room.
+ * Returns false, withdrawing the announcement, if it already does and the
+ * caller should not sleep.
+ */
+bool shm_ring_park_consumer(struct shm_port *port);
+bool shm_ring_park_producer(struct shm_port *port);
+
+/*
+ * Called after writing, or reading. Returns true if the peer had announced it
+ * was going to sleep and must be woken.
+ */
+bool shm_ring_notify_consumer(struct shm_port *port);
+bool shm_ring_notify_producer(struct shm_port *port);
+
+/*
+ * Sleeps while `*word` equals `expected`, for at most `timeout_ns`, across
+ * processes. Returns non-zero on a timeout or interruption, setting `errno`.
+ */
+int shm_futex_wait(atomic_uint *word, unsigned int expected,
+                   uint64_t timeout_ns);
+void shm_futex_wake(atomic_uint *word);
+
+/*
+ * Client side of a channel: the rings, the server's `eventfd`, and the socket
+ * the channel was set up over, which stays open for as long as the channel is
+ * used, so either side learns of the other going away.
+ */
+struct shm_client {
+    struct shm_channel ch;
+    struct shm_port requests;
+    struct shm_port responses;
+    int wake_fd;
+    int sock;
+};
+
+/*
+ * Asks the server on the Unix domain socket `sock` for a channel with rings of
+ * `capacity` bytes, zero for the server's default. Must be the first request
+ * on the connection. On success `client` owns `sock`. Returns non-zero on
+ * failure, setting `errno`.
+ */
+int shm_client_attach(struct shm_client *client, int sock, size_t capacity);
+void shm_client_destroy(struct shm_client *client);
+
+/*
+ * Writes all of `len` bytes, waiting for room as needed. Returns non-zero on
+ * failure, setting `errno`.
+ */
+int shm_client_send(struct shm_client *client, const void *src, size_t len);
+
+/*
+ * Reads between one and `len` bytes, spinning for `spin_ns` and then sleeping
+ * until there is any. Returns how many, or negative on failure, setting
+ * `errno` to `EPIPE` if the server has gone away.
+ */
+ssize_t shm_client_recv(struct shm_client *client, void *dest, size_t len,
+                        uint64_t spin_ns);
+
+#endif
+
+#endif
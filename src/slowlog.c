@@ -0,0 +1,77 @@
+#include <time.h>
+
+#include "slowlog.h"
+
+int slowlog_init(struct slowlog *log, size_t capacity, uint64_t threshold_ns)
+{
+    log->entries = NULL;
+
+    if (capacity && !(log->entries = malloc(capacity * sizeof(*log->entries))))
+        return 1;
+
+    pthread_mutex_init(&log->lock, NULL);
+    log->threshold_ns = threshold_ns;
+    log->capacity = capacity;
+    log->added = 0;
+    log->len = 0;
+
+    return 0;
+}
+
+void slowlog_destroy(struct slowlog *log)
+{
+    pthread_mutex_destroy(&log->lock);
+    free(log->entries);
+}
+
+void slowlog_add(struct slowlog *log, const struct slowlog_entry *entry)
+{
+    if (!log->capacity)
+        return;
+
+    pthread_mutex_lock(&log->lock);
+
+    struct slowlog_entry *dest = &log->entries[log->added % log->capacity];
+
+    *dest = *entry;
+    dest->id = log->added++;
+    dest->time = time(NULL);
+    log->len = min(log->len + 1, log->capacity);
+
+    pthread_mutex_unlock(&log->lock);
+}
+
+size_t slowlog_get(struct slowlog *log, struct slowlog_entry *dest,
+                   size_t count)
+{
+    pthread_mutex_lock(&log->lock);
+
+    count = min(count, log->len);
+
+    for (size_t i = 0; i < count; i++)
+        dest[i] = log->entries[(log->added - 1 - i) % log->capacity];
+
+    pthread_mutex_unlock(&log->lock);
+
+    return count;
+}
+
+size_t slowlog_len(struct slowlog *log)
+{
+    pthread_mutex_lock(&log->lock);
+    size_t len = log->len;
+    pthread_mutex_unlock(&log->lock);
+
+    return len;
+}
+
+/*
+ * Ids go on from where they were, so entries seen before are not mistaken for
+ * new ones.
+ */
+void slowlog_reset(struct slowlog *log)
+{
+    pthread_mutex_lock(&log->lock);
+    log->len = 0;
+    pthread_mutex_unlock(&log->lock);
+}
@@ -0,0 +1,75 @@
+#ifndef MEMDB_SLOWLOG_H_
+#define MEMDB_SLOWLOG_H_
+
+#include <pthread.h>
+#include "common.h"
+
+#define SLOWLOG_LEN 128
+#define SLOWLOG_THRESHOLD_US 10000
+#define SLOWLOG_NAME_LEN 16
+#define SLOWLOG_KEY_LEN 32
+
+/*
+ * A request that took `threshold_ns` or longer from being queued to its reply
+ * being ready. `wait_ns` of it went to waiting: for a worker, behind requests
+ * before it in its connection's input, or forwarded to the reactor owning its
+ * key. The rest, `exec_ns`, went to executing it.
+ *
+ * `key` holds up to `SLOWLOG_KEY_LEN` bytes of the first argument, which is
+ * `key_len` long, and `size` is that of the whole request. `conn` and `thread`
+ * are numbered as in the trace.
+ */
+struct slowlog_entry {
+    uint64_t id;
+    int64_t time;
+    uint64_t wait_ns;
+    uint64_t exec_ns;
+    size_t size;
+    size_t key_len;
+    uint32_t conn;
+    uint32_t thread;
+    char name[SLOWLOG_NAME_LEN];
+    char key[SLOWLOG_KEY_LEN];
+};
+
+/*
+ * The last `capacity` slow requests, none if zero. Slow requests are rare, so
+ * are added under `lock`; the rest only read `threshold_ns`. `added` counts
+ * requests ever added, the latest at `entries[(added - 1) % capacity]`.
+ */
+struct slowlog {
+    pthread_mutex_t lock;
+    uint64_t threshold_ns;
+    size_t capacity;
+    struct slowlog_entry *entries;
+    uint64_t added;
+    size_t len;
+};
+
+/*
+ * Returns non-zero on allocation failure.
+ */
+int slowlog_init(struct slowlog *log, size_t capacity, uint64_t threshold_ns);
+void slowlog_destroy(struct slowlog *log);
+
+static inline bool slowlog_slow(const struct slowlog *log, uint64_t ns)
+{
+    return log->capacity && ns >= log->threshold_ns;
+}
+
+/*
+ * Adds a copy of `entry`, setting its `id` and `time`, and dropping the oldest
+ * if full.
+ */
+void slowlog_add(struct slowlog *log, const struct slowlog_entry *entry);
+
+/*
+ * Copies up to `count` entries to `dest`, newest first. Returns how many.
+ */
+size_t slowlog_get(struct slowlog *log, struct slowlog_entry *dest,
+                   size_t count);
+
+size_t slowlog_len(struct slowlog *log);
+void slowlog_reset(struct slowlog *log);
+
+#endif
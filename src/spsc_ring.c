@@ -0,0 +1,25 @@
+#include "spsc_ring.h"
+
+int spsc_ring_init(struct spsc_ring *ring, size_t capacity)
+{
+    size_t size = 1;
+
+    while (size < capacity)
+        size <<= 1;
+
+    if (!(ring->slots = malloc(size * sizeof(*ring->slots))))
+        return 1;
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->tail_cache = 0;
+    ring->head_cache = 0;
+    ring->mask = size - 1;
+
+    return 0;
+}
+
+void spsc_ring_destroy(struct spsc_ring *ring)
+{
+    free(ring->slots);
+}
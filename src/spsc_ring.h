@@ -0,0 +1,85 @@
+#ifndef MEMDB_SPSC_RING_H_
+#define MEMDB_SPSC_RING_H_
+
+#include <stdatomic.h>
+#include "common.h"
+
+/*
+ * Bounded lock-free queue of pointers between exactly one producer thread and
+ * one consumer thread.
+ *
+ * Each side owns one index and keeps a cached copy of the other's, only
+ * reloading it when the ring looks full or empty, so in steady state neither
+ * side touches the other's cache line more than once per wrap.
+ */
+struct spsc_ring {
+    _Alignas(64) atomic_size_t head;
+    size_t tail_cache;
+
+    _Alignas(64) atomic_size_t tail;
+    size_t head_cache;
+
+    _Alignas(64) size_t mask;
+    void **slots;
+};
+
+/*
+ * `capacity` is rounded up to a power of two. Returns non-zero on allocation
+ * failure.
+ */
+int spsc_ring_init(struct spsc_ring *ring, size_t capacity);
+void spsc_ring_destroy(struct spsc_ring *ring);
+
+/*
+ * Producer only. Returns false if the ring is full.
+ */
+static inline bool spsc_ring_push(struct spsc_ring *ring, void *item)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if (tail - ring->head_cache > ring->mask) {
+        ring->head_cache =
+            atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        if (tail - ring->head_cache > ring->mask)
+            return false;
+    }
+
+    ring->slots[tail & ring->mask] = item;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    return true;
+}
+
+/*
+ * Consumer only. Returns `NULL` if the ring is empty.
+ */
+static inline void *spsc_ring_pop(struct spsc_ring *ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head == ring->tail_cache) {
+        ring->tail_cache =
+            atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+        if (head == ring->tail_cache)
+            return NULL;
+    }
+
+    void *item = ring->slots[head & ring->mask];
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    return item;
+}
+
+/*
+ * Consumer only.
+ */
+static inline bool spsc_ring_empty(struct spsc_ring *ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_relaxed) ==
+           atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+#endif
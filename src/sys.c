@@ -1,4 +1,5 @@
 #include <unistd.h>
+#include <time.h>
 #include "sys.h"
 
 ssize_t page_size()
@@ -10,3 +11,10 @@ ssize_t core_count()
 {
     return sysconf(_SC_NPROCESSORS_ONLN);
 }
+
+uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
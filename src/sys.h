@@ -2,6 +2,7 @@
 #define MEMDB_SYS_H_
 
 #include <stdlib.h>
+#include <stdint.h>
 
 /*
  * Returns negative on failure.
@@ -13,4 +14,9 @@ ssize_t page_size();
  */
 ssize_t core_count();
 
+/*
+ * Current `CLOCK_MONOTONIC` time in nanoseconds.
+ */
+uint64_t monotonic_ns();
+
 #endif
@@ -1,58 +1,138 @@
+#include <stdatomic.h>
+#include <inttypes.h>
+
 #include "thread_pool.h"
+#include "malloc.h"
+#include "sys.h"
+
+/*
+ * Picks the lane to dequeue from, or returns `NULL` if every lane is empty.
+ * Must hold `tp->mutex`.
+ */
+static struct thread_pool_lane *thread_pool_pick(struct thread_pool *tp)
+{
+    struct thread_pool_lane *pick = NULL;
+
+    for (int i = 0; i < THREAD_POOL_PRIORITY_COUNT; i++) {
+        struct thread_pool_lane *lane = &tp->lanes[i];
+
+        if (!lane->head)
+            continue;
+
+        if (!pick) {
+            pick = lane;
+        } else if (lane->skipped >= THREAD_POOL_STARVATION_LIMIT) {
+            pick = lane;
+            break;
+        }
+    }
+
+    for (int i = 0; i < THREAD_POOL_PRIORITY_COUNT; i++) {
+        struct thread_pool_lane *lane = &tp->lanes[i];
+
+        if (lane == pick)
+            lane->skipped = 0;
+        else if (lane->head)
+            lane->skipped++;
+    }
+
+    return pick;
+}
 
 /*
  * Loop run by worker threads.
  */
 static void *thread_pool_loop(void *arg)
 {
-    struct thread_pool *tp = arg;
+    struct thread_pool_worker *worker = arg;
+    struct thread_pool *tp = worker->tp;
+    uint64_t idle_start = monotonic_ns();
 
     while (true) {
+        struct thread_pool_lane *lane;
+
         pthread_mutex_lock(&tp->mutex);
 
-        while (!tp->head && !tp->stop)
+        while (!(lane = thread_pool_pick(tp)) && !tp->stop) {
+            counter_add(&worker->parks, 1);
             pthread_cond_wait(&tp->event, &tp->mutex);
+        }
 
-        if (tp->stop && !tp->head) {
+        if (!lane) {
             pthread_mutex_unlock(&tp->mutex);
             pthread_exit(NULL);
         }
 
-        struct thread_pool_job *job = tp->head;
+        struct thread_pool_job *job = lane->head;
 
-        if (tp->tail == job) {
-            tp->tail = NULL;
-            tp->head = NULL;
+        if (lane->tail == job) {
+            lane->tail = NULL;
+            lane->head = NULL;
         } else {
-            tp->head = job->next;
+            lane->head = job->next;
         }
 
+        atomic_fetch_sub_explicit(&lane->length, 1, memory_order_relaxed);
+
         pthread_mutex_unlock(&tp->mutex);
 
-        job->routine(job->arg);
-        free(job);
+        uint64_t start = monotonic_ns();
+
+        counter_add(&worker->idle_ns, start - idle_start);
+        histogram_record(&worker->queue_wait, start - job->submitted);
+
+        if (job->deadline && start > job->deadline) {
+            if (job->cancel)
+                job->cancel(job->arg);
+            counter_add(&worker->cancelled, 1);
+        } else {
+            job->routine(job->arg);
+            counter_add(&worker->jobs, 1);
+        }
+
+        tagged_free(MALLOC_TAG_JOB, job);
+
+        idle_start = monotonic_ns();
+        counter_add(&worker->busy_ns, idle_start - start);
     }
 }
 
 int thread_pool_init(struct thread_pool *tp, size_t thread_count)
 {
-    tp->threads = malloc(thread_count * sizeof(*tp->threads));
+    tp->workers = aligned_alloc(_Alignof(struct thread_pool_worker),
+                                max(thread_count, (size_t)1) *
+                                    sizeof(*tp->workers));
 
-    if (!tp->threads)
+    if (!tp->workers)
         return 1;
 
     tp->thread_count = thread_count;
-    tp->head = NULL;
-    tp->tail = NULL;
     tp->stop = false;
 
+    for (int i = 0; i < THREAD_POOL_PRIORITY_COUNT; i++) {
+        tp->lanes[i].head = NULL;
+        tp->lanes[i].tail = NULL;
+        atomic_init(&tp->lanes[i].length, 0);
+        tp->lanes[i].skipped = 0;
+    }
+
     pthread_mutex_init(&tp->mutex, NULL);
     pthread_cond_init(&tp->event, NULL);
 
     pthread_mutex_lock(&tp->mutex);
 
     for (int i = 0; i < thread_count; i++) {
-        pthread_create(&tp->threads[i], NULL, thread_pool_loop, tp);
+        struct thread_pool_worker *worker = &tp->workers[i];
+
+        worker->tp = tp;
+        atomic_init(&worker->jobs, 0);
+        atomic_init(&worker->cancelled, 0);
+        atomic_init(&worker->busy_ns, 0);
+        atomic_init(&worker->idle_ns, 0);
+        atomic_init(&worker->parks, 0);
+        histogram_init(&worker->queue_wait);
+
+        pthread_create(&worker->thread, NULL, thread_pool_loop, worker);
     }
 
     pthread_mutex_unlock(&tp->mutex);
@@ -68,19 +148,21 @@ int thread_pool_destroy(struct thread_pool *tp)
     pthread_mutex_unlock(&tp->mutex);
 
     for (int i = 0; i < tp->thread_count; i++) {
-        pthread_join(tp->threads[i], NULL);
+        pthread_join(tp->workers[i].thread, NULL);
     }
 
-    struct thread_pool_job *job = tp->head;
-    struct thread_pool_job *next;
+    for (int i = 0; i < THREAD_POOL_PRIORITY_COUNT; i++) {
+        struct thread_pool_job *job = tp->lanes[i].head;
+        struct thread_pool_job *next;
 
-    while (job) {
-        next = job->next;
-        free(job);
-        job = next;
+        while (job) {
+            next = job->next;
+            tagged_free(MALLOC_TAG_JOB, job);
+            job = next;
+        }
     }
 
-    free(tp->threads);
+    free(tp->workers);
 
     pthread_mutex_destroy(&tp->mutex);
     pthread_cond_destroy(&tp->event);
@@ -88,28 +170,267 @@ int thread_pool_destroy(struct thread_pool *tp)
     return 0;
 }
 
-int thread_pool_run(struct thread_pool *tp, void *(*routine)(), void *arg)
+int thread_pool_submit(struct thread_pool *tp,
+                       const struct thread_pool_job *template)
 {
-    struct thread_pool_job *job = malloc(sizeof(*job));
+    if (template->priority >= THREAD_POOL_PRIORITY_COUNT)
+        return 1;
+
+    struct thread_pool_job *job = tagged_malloc(MALLOC_TAG_JOB, sizeof(*job));
 
     if (!job)
         return 1;
 
-    job->routine = routine;
-    job->arg = arg;
+    *job = *template;
+    job->next = NULL;
+    job->submitted = monotonic_ns();
 
     pthread_mutex_lock(&tp->mutex);
 
-    if (tp->tail) {
-        tp->tail->next = job;
-        tp->tail = job;
+    struct thread_pool_lane *lane = &tp->lanes[job->priority];
+
+    if (lane->tail) {
+        lane->tail->next = job;
+        lane->tail = job;
     } else {
-        tp->head = job;
-        tp->tail = job;
+        lane->head = job;
+        lane->tail = job;
     }
 
+    atomic_fetch_add_explicit(&lane->length, 1, memory_order_relaxed);
+
     pthread_cond_signal(&tp->event);
     pthread_mutex_unlock(&tp->mutex);
 
     return 0;
 }
+
+void thread_pool_stats(struct thread_pool *tp, struct thread_pool_stats *stats)
+{
+    stats->thread_count = tp->thread_count;
+    stats->jobs = 0;
+    stats->cancelled = 0;
+    stats->busy_ns = 0;
+    stats->idle_ns = 0;
+    stats->parks = 0;
+    histogram_init(&stats->queue_wait);
+
+    for (int i = 0; i < THREAD_POOL_PRIORITY_COUNT; i++)
+        stats->queued[i] = atomic_load_explicit(&tp->lanes[i].length,
+                                                memory_order_relaxed);
+
+    for (size_t i = 0; i < tp->thread_count; i++) {
+        struct thread_pool_worker *worker = &tp->workers[i];
+
+        stats->jobs += counter_get(&worker->jobs);
+        stats->cancelled += counter_get(&worker->cancelled);
+        stats->busy_ns += counter_get(&worker->busy_ns);
+        stats->idle_ns += counter_get(&worker->idle_ns);
+        stats->parks += counter_get(&worker->parks);
+        histogram_merge(&stats->queue_wait, &worker->queue_wait);
+    }
+}
+
+static const char *const thread_pool_lane_names[] = {
+    [THREAD_POOL_INTERACTIVE] = "interactive",
+    [THREAD_POOL_NORMAL] = "normal",
+    [THREAD_POOL_BACKGROUND] = "background",
+};
+
+/*
+ * Busy time as a percentage of busy plus idle time.
+ */
+static double utilization(uint64_t busy_ns, uint64_t idle_ns)
+{
+    return busy_ns + idle_ns ? 100.0 * busy_ns / (busy_ns + idle_ns) : 0;
+}
+
+void thread_pool_stats_print(struct thread_pool *tp, FILE *out)
+{
+    struct thread_pool_stats *stats = malloc(sizeof(*stats));
+
+    if (!stats)
+        return;
+
+    thread_pool_stats(tp, stats);
+
+    fprintf(out, "pool_threads:%zu\n", stats->thread_count);
+
+    for (int i = 0; i < THREAD_POOL_PRIORITY_COUNT; i++)
+        fprintf(out, "pool_queued_%s:%zu\n", thread_pool_lane_names[i],
+                stats->queued[i]);
+
+    fprintf(out, "pool_jobs:%" PRIu64 "\n", stats->jobs);
+    fprintf(out, "pool_cancelled:%" PRIu64 "\n", stats->cancelled);
+    fprintf(out, "pool_parks:%" PRIu64 "\n", stats->parks);
+    fprintf(out, "pool_utilization:%.2f\n",
+            utilization(stats->busy_ns, stats->idle_ns));
+    fprintf(out, "pool_queue_wait_mean_ns:%" PRIu64 "\n",
+            histogram_mean(&stats->queue_wait));
+    fprintf(out, "pool_queue_wait_p50_ns:%" PRIu64 "\n",
+            histogram_percentile(&stats->queue_wait, 50));
+    fprintf(out, "pool_queue_wait_p99_ns:%" PRIu64 "\n",
+            histogram_percentile(&stats->queue_wait, 99));
+    fprintf(out, "pool_queue_wait_p999_ns:%" PRIu64 "\n",
+            histogram_percentile(&stats->queue_wait, 99.9));
+    fprintf(out, "pool_queue_wait_max_ns:%" PRIu64 "\n",
+            histogram_max(&stats->queue_wait));
+
+    for (size_t i = 0; i < tp->thread_count; i++) {
+        struct thread_pool_worker *worker = &tp->workers[i];
+
+        fprintf(out,
+                "pool_worker_%zu:jobs=%" PRIu64 ",cancelled=%" PRIu64
+                ",parks=%" PRIu64 ",busy_ns=%" PRIu64 ",idle_ns=%" PRIu64
+                ",utilization=%.2f\n",
+                i, counter_get(&worker->jobs), counter_get(&worker->cancelled),
+                counter_get(&worker->parks), counter_get(&worker->busy_ns),
+                counter_get(&worker->idle_ns),
+                utilization(counter_get(&worker->busy_ns),
+                            counter_get(&worker->idle_ns)));
+    }
+
+    free(stats);
+}
+
+int thread_pool_run(struct thread_pool *tp, void *(*routine)(), void *arg)
+{
+    return thread_pool_submit(tp, &(struct thread_pool_job){
+                                      .routine = routine,
+                                      .arg = arg,
+                                      .priority = THREAD_POOL_NORMAL,
+                                  });
+}
+
+/*
+ * Shared state of one `thread_pool_parallel_for()` call. Helper jobs may be
+ * dequeued long after every range has completed, so the state is reference
+ * counted rather than living on the caller's stack.
+ */
+struct parallel_for {
+    void (*fn)(void *arg, size_t lo, size_t hi);
+    void *arg;
+    size_t begin;
+    size_t end;
+    size_t grain;
+    size_t chunks;
+
+    atomic_size_t next;
+    atomic_size_t refs;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t done_cond;
+    size_t done;
+};
+
+static void parallel_for_release(struct parallel_for *pf)
+{
+    if (atomic_fetch_sub(&pf->refs, 1) != 1)
+        return;
+
+    pthread_mutex_destroy(&pf->mutex);
+    pthread_cond_destroy(&pf->done_cond);
+    tagged_free(MALLOC_TAG_JOB, pf);
+}
+
+/*
+ * Claims and runs ranges until none are left.
+ */
+static void parallel_for_work(struct parallel_for *pf)
+{
+    size_t ran = 0;
+    size_t chunk;
+
+    while ((chunk = atomic_fetch_add(&pf->next, 1)) < pf->chunks) {
+        size_t lo = pf->begin + chunk * pf->grain;
+        size_t hi = min(lo + pf->grain, pf->end);
+
+        pf->fn(pf->arg, lo, hi);
+        ran++;
+    }
+
+    if (!ran)
+        return;
+
+    pthread_mutex_lock(&pf->mutex);
+    pf->done += ran;
+    if (pf->done == pf->chunks)
+        pthread_cond_broadcast(&pf->done_cond);
+    pthread_mutex_unlock(&pf->mutex);
+}
+
+static void *parallel_for_helper(void *arg)
+{
+    parallel_for_work(arg);
+    parallel_for_release(arg);
+    return NULL;
+}
+
+static void parallel_for_cancel(void *arg)
+{
+    parallel_for_release(arg);
+}
+
+int thread_pool_parallel_for(struct thread_pool *tp, size_t begin, size_t end,
+                             size_t grain,
+                             void (*fn)(void *arg, size_t lo, size_t hi),
+                             void *arg)
+{
+    if (begin >= end)
+        return 0;
+
+    if (!grain)
+        grain = 1;
+
+    size_t chunks = (end - begin + grain - 1) / grain;
+
+    if (chunks == 1 || !tp || !tp->thread_count) {
+        for (size_t lo = begin; lo < end; lo += grain)
+            fn(arg, lo, min(lo + grain, end));
+        return 0;
+    }
+
+    struct parallel_for *pf = tagged_malloc(MALLOC_TAG_JOB, sizeof(*pf));
+
+    if (!pf)
+        return 1;
+
+    pf->fn = fn;
+    pf->arg = arg;
+    pf->begin = begin;
+    pf->end = end;
+    pf->grain = grain;
+    pf->chunks = chunks;
+    pf->done = 0;
+    atomic_init(&pf->next, 0);
+    atomic_init(&pf->refs, 1);
+    pthread_mutex_init(&pf->mutex, NULL);
+    pthread_cond_init(&pf->done_cond, NULL);
+
+    size_t helpers = min(tp->thread_count, chunks - 1);
+
+    for (size_t i = 0; i < helpers; i++) {
+        atomic_fetch_add(&pf->refs, 1);
+
+        if (thread_pool_submit(tp, &(struct thread_pool_job){
+                                       .routine = parallel_for_helper,
+                                       .arg = pf,
+                                       .cancel = parallel_for_cancel,
+                                       .priority = THREAD_POOL_NORMAL,
+                                   })) {
+            atomic_fetch_sub(&pf->refs, 1);
+            break;
+        }
+    }
+
+    parallel_for_work(pf);
+
+    pthread_mutex_lock(&pf->mutex);
+    while (pf->done != pf->chunks)
+        pthread_cond_wait(&pf->done_cond, &pf->mutex);
+    pthread_mutex_unlock(&pf->mutex);
+
+    parallel_for_release(pf);
+
+    return 0;
+}
@@ -2,7 +2,9 @@
 #define MEMDB_THREAD_POOL_H_
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include "common.h"
+#include "histogram.h"
 
 // #define WORK_QUEUE_WAIT 0x1
 // #define WORK_QUEUE_DESTROY 0x2
@@ -164,24 +166,140 @@
 //     return error;
 // }
 
+/*
+ * Priority lanes, highest first. Workers always drain the highest non-empty
+ * lane, except when a lower lane has been passed over
+ * `THREAD_POOL_STARVATION_LIMIT` times in a row, in which case its head job is
+ * run next.
+ */
+enum thread_pool_priority {
+    THREAD_POOL_INTERACTIVE,
+    THREAD_POOL_NORMAL,
+    THREAD_POOL_BACKGROUND,
+    THREAD_POOL_PRIORITY_COUNT,
+};
+
+#define THREAD_POOL_STARVATION_LIMIT 16
+
+struct thread_pool_lane {
+    struct thread_pool_job *head;
+    struct thread_pool_job *tail;
+
+    /*
+     * Written under `thread_pool::mutex`, read without it for statistics.
+     */
+    atomic_size_t length;
+
+    /*
+     * Consecutive dequeues that skipped over this lane while it held work.
+     */
+    size_t skipped;
+};
+
+/*
+ * Per-worker counters. Each is written only by its worker, with relaxed
+ * atomics, and read by `thread_pool_stats()` without locking. Workers share a
+ * single queue, so there is nothing to steal; `parks` counts waits on
+ * `thread_pool::event` for want of work.
+ */
+struct thread_pool_worker {
+    _Alignas(64) pthread_t thread;
+    struct thread_pool *tp;
+
+    _Atomic uint64_t jobs;
+    _Atomic uint64_t cancelled;
+    _Atomic uint64_t busy_ns;
+    _Atomic uint64_t idle_ns;
+    _Atomic uint64_t parks;
+
+    /*
+     * Nanoseconds from `thread_pool_submit()` to the job being dequeued,
+     * including jobs that are cancelled.
+     */
+    struct histogram queue_wait;
+};
+
 struct thread_pool {
     bool stop;
     pthread_cond_t event;
     pthread_mutex_t mutex;
-    pthread_t *threads;
+    struct thread_pool_worker *workers;
     size_t thread_count;
-    struct thread_pool_job *head;
-    struct thread_pool_job *tail;
+    struct thread_pool_lane lanes[THREAD_POOL_PRIORITY_COUNT];
 };
 
 struct thread_pool_job {
     struct thread_pool_job *next;
     void *(*routine)(void *);
     void *arg;
+
+    /*
+     * Called in place of `routine` when the job is dequeued after `deadline`.
+     * May be `NULL`, in which case the job is dropped silently.
+     */
+    void (*cancel)(void *);
+
+    enum thread_pool_priority priority;
+
+    /*
+     * Set by `thread_pool_submit()`, in `monotonic_ns()` time.
+     */
+    uint64_t submitted;
+
+    /*
+     * Absolute `CLOCK_MONOTONIC` time in nanoseconds (see `monotonic_ns()`),
+     * or zero for no deadline.
+     */
+    uint64_t deadline;
 };
 
 int thread_pool_init(struct thread_pool *tp, size_t thread_count);
 int thread_pool_destroy(struct thread_pool *tp);
+
+/*
+ * Runs `routine(arg)` on the `THREAD_POOL_NORMAL` lane with no deadline.
+ */
 int thread_pool_run(struct thread_pool *tp, void *(*routine)(), void *arg);
 
+/*
+ * Queues a copy of `template`; its `next` field is ignored. Returns non-zero on
+ * failure.
+ */
+int thread_pool_submit(struct thread_pool *tp,
+                       const struct thread_pool_job *template);
+
+/*
+ * Aggregate of all workers' counters plus current queue depths.
+ */
+struct thread_pool_stats {
+    size_t thread_count;
+    size_t queued[THREAD_POOL_PRIORITY_COUNT];
+    uint64_t jobs;
+    uint64_t cancelled;
+    uint64_t busy_ns;
+    uint64_t idle_ns;
+    uint64_t parks;
+    struct histogram queue_wait;
+};
+
+void thread_pool_stats(struct thread_pool *tp, struct thread_pool_stats *stats);
+
+/*
+ * Writes aggregate and per-worker statistics as `name:value` lines.
+ */
+void thread_pool_stats_print(struct thread_pool *tp, FILE *out);
+
+/*
+ * Calls `fn(arg, lo, hi)` over disjoint ranges covering [`begin`, `end`), each
+ * at most `grain` items long, spread over the pool's workers. The calling
+ * thread claims ranges as well and returns once all ranges have completed, so
+ * it may be called from a worker thread, and degrades to a serial loop when
+ * workers are busy or the pool is empty. `fn` must be thread safe. Returns
+ * non-zero on allocation failure, in which case nothing has been run.
+ */
+int thread_pool_parallel_for(struct thread_pool *tp, size_t begin, size_t end,
+                             size_t grain,
+                             void (*fn)(void *arg, size_t lo, size_t hi),
+                             void *arg);
+
 #endif
@@ -0,0 +1,131 @@
+#include <inttypes.h>
+
+#include "trace.h"
+
+_Thread_local struct trace_ring *trace_local;
+
+static _Atomic(struct trace_ring *) trace_rings;
+static atomic_uint trace_threads;
+
+static const char *const trace_point_names[TRACE_POINT_COUNT] = {
+    [TRACE_ACCEPT] = "accept",   [TRACE_SCHEDULE] = "schedule",
+    [TRACE_SERVICE] = "service", [TRACE_READ] = "read",
+    [TRACE_PARSE] = "parse",     [TRACE_FORWARD] = "forward",
+    [TRACE_EXECUTE] = "execute", [TRACE_WRITE] = "write",
+    [TRACE_CLOSE] = "close",
+};
+
+struct trace_ring *trace_ring_create(void)
+{
+    struct trace_ring *ring = malloc(sizeof(*ring));
+
+    if (!ring)
+        return NULL;
+
+    ring->thread = atomic_fetch_add(&trace_threads, 1);
+    atomic_init(&ring->head, 0);
+
+    ring->next = atomic_load(&trace_rings);
+    while (!atomic_compare_exchange_weak(&trace_rings, &ring->next, ring))
+        ;
+
+    trace_local = ring;
+
+    return ring;
+}
+
+uint32_t trace_thread(void)
+{
+    struct trace_ring *ring = trace_ring_get();
+
+    return ring ? ring->thread : UINT32_MAX;
+}
+
+struct trace_copy {
+    struct trace_event event;
+    uint32_t thread;
+};
+
+static int trace_copy_cmp(const void *a, const void *b)
+{
+    uint64_t ns_a = ((const struct trace_copy *)a)->event.ns;
+    uint64_t ns_b = ((const struct trace_copy *)b)->event.ns;
+
+    return (ns_a > ns_b) - (ns_a < ns_b);
+}
+
+/*
+ * Copies up to the last `count` events of `ring` to `dest`, returning how
+ * many. An event is kept only if the head shows it was not being overwritten
+ * while it was copied.
+ */
+static size_t trace_ring_copy(struct trace_ring *ring, struct trace_copy *dest,
+                              size_t count)
+{
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t first = head - min(head, (uint64_t)count);
+
+    for (uint64_t i = first; i < head; i++) {
+        dest[i - first].event = ring->events[i % TRACE_RING_SIZE];
+        dest[i - first].thread = ring->thread;
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+
+    uint64_t now = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t valid = now > TRACE_RING_SIZE ? now - TRACE_RING_SIZE + 1 : 0;
+
+    if (valid <= first)
+        return head - first;
+    if (valid >= head)
+        return 0;
+
+    memmove(dest, dest + (valid - first), (head - valid) * sizeof(*dest));
+
+    return head - valid;
+}
+
+int trace_dump(FILE *out, size_t count)
+{
+    struct trace_ring *head = atomic_load(&trace_rings);
+    size_t rings = 0, len = 0;
+
+    count = min(count, (size_t)TRACE_RING_SIZE);
+
+    /*
+     * Rings only ever join the front of the list, so walking it from the
+     * same head again meets the same rings.
+     */
+    for (struct trace_ring *ring = head; ring; ring = ring->next)
+        rings++;
+
+    struct trace_copy *copies = malloc(max(rings * count, (size_t)1) *
+                                       sizeof(*copies));
+
+    if (!copies)
+        return -1;
+
+    for (struct trace_ring *ring = head; ring; ring = ring->next)
+        len += trace_ring_copy(ring, copies + len, count);
+
+    qsort(copies, len, sizeof(*copies), trace_copy_cmp);
+
+    for (size_t i = len - min(len, count); i < len; i++) {
+        const struct trace_event *event = &copies[i].event;
+
+        const char *point = event->point < TRACE_POINT_COUNT
+                                ? trace_point_names[event->point]
+                                : "unknown";
+
+        fprintf(out, "%" PRIu64 " %" PRIu32 " %" PRIu32 " %s %" PRIu64,
+                event->ns, copies[i].thread, event->conn, point,
+                event->value);
+        if (event->name)
+            fprintf(out, " %s", event->name);
+        fputc('\n', out);
+    }
+
+    free(copies);
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+#ifndef MEMDB_TRACE_H_
+#define MEMDB_TRACE_H_
+
+#include <stdatomic.h>
+#include "common.h"
+#include "sys.h"
+
+/*
+ * Always-on record of what each thread did to requests lately, to tell where
+ * the time of a slow one went: waiting for a worker, in the table, or on I/O.
+ *
+ * Each thread records into a ring of its own, set up on its first event and
+ * kept after it exits, overwriting its oldest events without locking or
+ * waiting. Dumps copy the rings while they are written, dropping events
+ * overwritten meanwhile.
+ */
+
+#define TRACE_RING_SIZE 4096
+
+enum trace_point {
+    TRACE_ACCEPT,
+    TRACE_SCHEDULE,
+    TRACE_SERVICE,
+    TRACE_READ,
+    TRACE_PARSE,
+    TRACE_FORWARD,
+    TRACE_EXECUTE,
+    TRACE_WRITE,
+    TRACE_CLOSE,
+    TRACE_POINT_COUNT,
+};
+
+/*
+ * What `value` holds depends on the point: bytes for `TRACE_READ`,
+ * `TRACE_PARSE` and `TRACE_WRITE`, and for `TRACE_EXECUTE`, stamped when the
+ * command is done, nanoseconds it ran. `name` is that of the command, or
+ * `NULL`, and must be static.
+ */
+struct trace_event {
+    uint64_t ns;
+    uint64_t value;
+    const char *name;
+    uint32_t conn;
+    uint32_t point;
+};
+
+struct trace_ring {
+    struct trace_ring *next;
+    uint32_t thread;
+    _Atomic uint64_t head;
+    struct trace_event events[TRACE_RING_SIZE];
+};
+
+extern _Thread_local struct trace_ring *trace_local;
+
+/*
+ * Sets up the calling thread's ring. Returns `NULL` if it could not be
+ * allocated.
+ */
+struct trace_ring *trace_ring_create(void);
+
+static inline struct trace_ring *trace_ring_get(void)
+{
+    return trace_local ? trace_local : trace_ring_create();
+}
+
+/*
+ * Numbers threads from zero in the order of their first event, or returns
+ * `UINT32_MAX` if the thread has no ring.
+ */
+uint32_t trace_thread(void);
+
+static inline void trace_record_at(uint64_t ns, enum trace_point point,
+                                   uint32_t conn, uint64_t value,
+                                   const char *name)
+{
+    struct trace_ring *ring = trace_ring_get();
+
+    if (!ring)
+        return;
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    ring->events[head % TRACE_RING_SIZE] = (struct trace_event){
+        .ns = ns,
+        .value = value,
+        .name = name,
+        .conn = conn,
+        .point = point,
+    };
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static inline void trace_record(enum trace_point point, uint32_t conn,
+                                uint64_t value)
+{
+    trace_record_at(monotonic_ns(), point, conn, value, NULL);
+}
+
+/*
+ * Writes the last `count` events across threads, oldest first, one per line
+ * as `ns thread conn point value [name]`. Returns non-zero on allocation
+ * failure.
+ */
+int trace_dump(FILE *out, size_t count);
+
+#endif
@@ -0,0 +1,302 @@
+#include "uring.h"
+
+#ifdef URING_SUPPORTED
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+                              unsigned int min_complete, unsigned int flags,
+                              void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+                                 unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Setup flags newer than the features we depend on are tried first and
+ * dropped if the kernel rejects them.
+ */
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    const unsigned int optional =
+        IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+        IORING_SETUP_SINGLE_ISSUER;
+
+    memset(p, 0, sizeof(*p));
+    p->flags = IORING_SETUP_CQSIZE | optional;
+    p->cq_entries = entries * 4;
+
+    int fd = sys_io_uring_setup(entries, p);
+
+    if (fd < 0 && errno == EINVAL) {
+        memset(p, 0, sizeof(*p));
+        p->flags = IORING_SETUP_CQSIZE;
+        p->cq_entries = entries * 4;
+        fd = sys_io_uring_setup(entries, p);
+    }
+
+    return fd < 0 ? -errno : fd;
+}
+
+int uring_init(struct uring *ring, unsigned int entries)
+{
+    struct io_uring_params p;
+    int fd = uring_setup(entries, &p);
+
+    if (fd < 0)
+        return fd;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = fd;
+    ring->features = p.features;
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_ring_size = max(ring->sq_ring_size, ring->cq_ring_size);
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+    if (ring->sq_ring == MAP_FAILED)
+        goto error;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            goto error_cq;
+        }
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if (ring->sqes == MAP_FAILED)
+        goto error_sqes;
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+
+    ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    ring->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+
+    ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /*
+     * Submission slots map one to one onto entries, so the indirection array
+     * is filled once.
+     */
+    for (unsigned int i = 0; i < p.sq_entries; i++)
+        ring->sq_array[i] = i;
+
+    return 0;
+
+error_sqes:
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+error_cq:
+    munmap(ring->sq_ring, ring->sq_ring_size);
+error:;
+    int err = -errno;
+    close(fd);
+    return err;
+}
+
+void uring_destroy(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *ring)
+{
+    while (ring->sqe_tail - load_acquire(ring->sq_head) >= ring->sq_entries)
+        uring_submit(ring, 0, -1);
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqe_tail++;
+
+    return sqe;
+}
+
+int uring_submit(struct uring *ring, unsigned int wait_nr, int timeout_ms)
+{
+    unsigned int to_submit = ring->sqe_tail - *ring->sq_tail;
+    unsigned int flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = { 0 };
+    void *argp = NULL;
+    size_t argsz = 0;
+
+    store_release(ring->sq_tail, ring->sqe_tail);
+
+    if (wait_nr && timeout_ms >= 0 &&
+        (ring->features & IORING_FEAT_EXT_ARG)) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        argp = &arg;
+        argsz = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    ring->enters++;
+
+    int ret = sys_io_uring_enter(ring->fd, to_submit, wait_nr, flags, argp,
+                                 argsz);
+
+    return ret < 0 ? -errno : ret;
+}
+
+struct io_uring_cqe *uring_peek(struct uring *ring)
+{
+    unsigned int head = *ring->cq_head;
+
+    if (head == load_acquire(ring->cq_tail))
+        return NULL;
+
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+    ring->completions++;
+    store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+bool uring_probe(struct uring *ring, int op)
+{
+    size_t size = sizeof(struct io_uring_probe) +
+                  256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+
+    if (!probe)
+        return false;
+
+    bool supported =
+        !sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) &&
+        op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+
+    free(probe);
+    return supported;
+}
+
+int uring_register_files(struct uring *ring, unsigned int count)
+{
+    struct io_uring_rsrc_register reg = {
+        .nr = count,
+        .flags = IORING_RSRC_REGISTER_SPARSE,
+    };
+
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_FILES2, &reg,
+                              sizeof(reg)))
+        return -errno;
+
+    return 0;
+}
+
+int uring_buf_ring_init(struct uring *ring, struct uring_buf_ring *br,
+                        uint16_t bgid, unsigned int entries, size_t buf_size)
+{
+    br->ring_size = entries * sizeof(struct io_uring_buf);
+    br->ring = mmap(NULL, br->ring_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (br->ring == MAP_FAILED)
+        return -errno;
+
+    br->bufs = malloc(entries * buf_size);
+
+    if (!br->bufs) {
+        munmap(br->ring, br->ring_size);
+        return -ENOMEM;
+    }
+
+    br->buf_size = buf_size;
+    br->entries = entries;
+    br->bgid = bgid;
+    br->tail = 0;
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t)(uintptr_t)br->ring,
+        .ring_entries = entries,
+        .bgid = bgid,
+    };
+
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+        int err = -errno;
+        free(br->bufs);
+        munmap(br->ring, br->ring_size);
+        return err;
+    }
+
+    for (unsigned int i = 0; i < entries; i++)
+        uring_buf_ring_recycle(br, i);
+
+    uring_buf_ring_publish(br);
+
+    return 0;
+}
+
+void uring_buf_ring_destroy(struct uring *ring, struct uring_buf_ring *br)
+{
+    struct io_uring_buf_reg reg = { .bgid = br->bgid };
+
+    sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(br->ring, br->ring_size);
+    free(br->bufs);
+}
+
+void uring_buf_ring_recycle(struct uring_buf_ring *br, uint16_t bid)
+{
+    struct io_uring_buf *buf = &br->ring->bufs[br->tail & (br->entries - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)uring_buf(br, bid);
+    buf->len = br->buf_size;
+    buf->bid = bid;
+    br->tail++;
+}
+
+void uring_buf_ring_publish(struct uring_buf_ring *br)
+{
+    store_release(&br->ring->tail, br->tail);
+}
+
+#endif
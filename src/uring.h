@@ -0,0 +1,128 @@
+#ifndef MEMDB_URING_H_
+#define MEMDB_URING_H_
+
+#include "common.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define URING_SUPPORTED
+#endif
+
+#ifdef URING_SUPPORTED
+
+#include <linux/io_uring.h>
+
+/*
+ * Minimal `io_uring` wrapper over the raw system calls, covering what the
+ * server needs without depending on liburing. A `struct uring` belongs to one
+ * thread: nothing here is synchronized beyond what the kernel protocol needs.
+ */
+struct uring {
+    int fd;
+    unsigned int features;
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+
+    /*
+     * Tail of entries handed out by `uring_sqe()`, published to the kernel by
+     * `uring_submit()`.
+     */
+    unsigned int sqe_tail;
+
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    /*
+     * Calls to `io_uring_enter()` and completions reaped, for statistics.
+     */
+    uint64_t enters;
+    uint64_t completions;
+};
+
+/*
+ * Provided buffer ring: `entries` buffers of `buf_size` bytes, which the
+ * kernel picks from for `IOSQE_BUFFER_SELECT` reads and returns by id in the
+ * completion flags.
+ */
+struct uring_buf_ring {
+    struct io_uring_buf_ring *ring;
+    char *bufs;
+    size_t ring_size;
+    size_t buf_size;
+    unsigned int entries;
+    uint16_t bgid;
+    uint16_t tail;
+};
+
+/*
+ * Returns a negative errno value on failure.
+ */
+int uring_init(struct uring *ring, unsigned int entries);
+void uring_destroy(struct uring *ring);
+
+/*
+ * Returns a zeroed submission entry, submitting queued entries first if the
+ * queue is full. Never returns `NULL`.
+ */
+struct io_uring_sqe *uring_sqe(struct uring *ring);
+
+/*
+ * Submits queued entries and waits for at least `wait_nr` completions, or
+ * until `timeout_ms` passes if non-negative. Returns a negative errno value on
+ * failure, including `-ETIME` and `-EINTR`.
+ */
+int uring_submit(struct uring *ring, unsigned int wait_nr, int timeout_ms);
+
+/*
+ * Returns the next completion, or `NULL`. Each must be released with
+ * `uring_cqe_seen()` before the next is peeked.
+ */
+struct io_uring_cqe *uring_peek(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+/*
+ * Returns true if the kernel supports opcode `op`.
+ */
+bool uring_probe(struct uring *ring, int op);
+
+/*
+ * Registers a sparse table of `count` direct descriptors, to be filled by
+ * `IORING_FILE_INDEX_ALLOC` accepts.
+ */
+int uring_register_files(struct uring *ring, unsigned int count);
+
+/*
+ * `entries` must be a power of two. Returns a negative errno value on
+ * failure, notably `-EINVAL` on kernels without provided buffer rings.
+ */
+int uring_buf_ring_init(struct uring *ring, struct uring_buf_ring *br,
+                        uint16_t bgid, unsigned int entries, size_t buf_size);
+void uring_buf_ring_destroy(struct uring *ring, struct uring_buf_ring *br);
+
+static inline char *uring_buf(struct uring_buf_ring *br, uint16_t bid)
+{
+    return br->bufs + (size_t)bid * br->buf_size;
+}
+
+/*
+ * Hands buffer `bid` back to the kernel. Recycled buffers become visible on
+ * the next `uring_buf_ring_publish()`, so a batch costs one release store.
+ */
+void uring_buf_ring_recycle(struct uring_buf_ring *br, uint16_t bid);
+void uring_buf_ring_publish(struct uring_buf_ring *br);
+
+#endif
+
+#endif
@@ -0,0 +1,97 @@
+#include "../src/bench.c"
+#include "../src/memdb.c"
+#include "../src/resp.c"
+#include "../src/histogram.c"
+#include "../src/protocol.c"
+#include "../src/buffer.c"
+#include "../src/malloc.c"
+#include "../src/sys.c"
+
+#include <stdio.h>
+
+void test_random()
+{
+    uint64_t a = 7, b = 7;
+
+    /*
+     * Seeded alike, generators agree.
+     */
+    for (int i = 0; i < 100; i++)
+        assert(bench_random(&a) == bench_random(&b));
+
+    for (int i = 0; i < 100000; i++) {
+        double u = bench_uniform(&a);
+
+        assert(u >= 0 && u < 1);
+    }
+}
+
+void test_zipf()
+{
+    struct bench_zipf z;
+    uint64_t rng = 1;
+    static size_t counts[1000];
+
+    bench_zipf_init(&z, 1000, 0.99);
+
+    for (int i = 0; i < 1000000; i++) {
+        uint64_t rank = bench_zipf_next(&z, &rng);
+
+        assert(rank < 1000);
+        counts[rank]++;
+    }
+
+    /*
+     * Rank 0 is drawn about 1 / zeta(1000, 0.99) of the time, near 13%, and
+     * each rank about twice as often as the one twice as far down.
+     */
+    assert(counts[0] > 120000 && counts[0] < 140000);
+    assert(counts[0] > counts[1] && counts[1] > counts[2]);
+    assert(counts[9] > 1.8 * counts[19] && counts[9] < 2.2 * counts[19]);
+
+    size_t head = 0;
+
+    for (int i = 0; i < 10; i++)
+        head += counts[i];
+
+    assert(head > 350000);
+
+    /*
+     * A keyspace of one only has the one key.
+     */
+    bench_zipf_init(&z, 1, 0.5);
+    for (int i = 0; i < 1000; i++)
+        assert(!bench_zipf_next(&z, &rng));
+}
+
+void test_pick()
+{
+    struct bench_config cfg;
+    struct bench_shared shared = { .cfg = &cfg };
+    struct bench_thread t = { .shared = &shared, .rng = 3 };
+    size_t ops[BENCH_OP_COUNT] = {0};
+
+    bench_config_init(&cfg);
+    cfg.mix[BENCH_GET] = 1;
+    cfg.mix[BENCH_SET] = 0;
+    cfg.mix[BENCH_MGET] = 3;
+    cfg.keys = 10;
+
+    for (int i = 0; i < 100000; i++) {
+        ops[bench_pick_op(&t)]++;
+        assert(bench_pick_key(&t) < 10);
+    }
+
+    assert(!ops[BENCH_SET]);
+    assert(ops[BENCH_MGET] > 2.8 * ops[BENCH_GET]);
+    assert(ops[BENCH_MGET] < 3.2 * ops[BENCH_GET]);
+}
+
+int main()
+{
+    test_random();
+    test_zipf();
+    test_pick();
+
+    printf("Success\n");
+}
@@ -0,0 +1,134 @@
+#include "../src/bulk.c"
+#include "../src/memdb.c"
+#include "../src/resp.c"
+#include "../src/protocol.c"
+#include "../src/buffer.c"
+#include "../src/malloc.c"
+#include "../src/sys.c"
+
+#include <stdio.h>
+
+static void init(struct bulk *b, struct bulk_config *cfg)
+{
+    *b = (struct bulk){ .cfg = cfg };
+    memdb_init(&b->conn, MEMDB_RESP);
+    buffer_init(&b->in);
+    buffer_init(&b->batch);
+    buffer_init(&b->command);
+    resp_parser_init(&b->parser);
+}
+
+static void destroy(struct bulk *b)
+{
+    memdb_destroy(&b->conn);
+    buffer_destroy(&b->in);
+    buffer_destroy(&b->batch);
+    buffer_destroy(&b->command);
+    resp_parser_destroy(&b->parser);
+}
+
+/*
+ * Feeds `input` a byte at a time, then ends it.
+ */
+static int feed(struct bulk *b, const char *input)
+{
+    int (*fn)(struct bulk *) = b->cfg->kv ? bulk_kv_input : bulk_command_input;
+
+    for (const char *c = input; *c; c++) {
+        assert(!buffer_append(&b->in, c, 1));
+        if (fn(b))
+            return -1;
+    }
+
+    b->eof = true;
+    return fn(b);
+}
+
+static void assert_out(struct bulk *b, const char *expected)
+{
+    struct buffer *out = &b->conn.out;
+
+    assert(buffer_len(out) == strlen(expected));
+    assert(!memcmp(buffer_head(out), expected, strlen(expected)));
+}
+
+void test_commands()
+{
+    struct bulk_config cfg = { .kv = false };
+    struct bulk b;
+
+    /*
+     * Commands are forwarded as they are, blank lines dropped, and a last
+     * inline command ended.
+     */
+    init(&b, &cfg);
+    assert(!feed(&b, "SET a 1\n\n*2\r\n$3\r\nGET\r\n$1\r\na\r\nPING"));
+    assert_out(&b, "SET a 1\n*2\r\n$3\r\nGET\r\n$1\r\na\r\nPING\n");
+    assert(b.sent == 3);
+    destroy(&b);
+
+    init(&b, &cfg);
+    assert(feed(&b, "SET a 1\n*2\r\n$3\r\nGET\r\n") && errno == EINVAL);
+    assert(b.sent == 1);
+    destroy(&b);
+}
+
+void test_kv()
+{
+    struct bulk_config cfg = { .kv = true };
+    struct bulk b;
+
+    init(&b, &cfg);
+    assert(!feed(&b, "a 1\r\n\nb\tx y\nc "));
+    assert_out(&b, "*7\r\n$4\r\nMSET\r\n$1\r\na\r\n$1\r\n1\r\n$1\r\nb\r\n"
+                   "$3\r\nx y\r\n$1\r\nc\r\n$0\r\n\r\n");
+    assert(b.sent == 1 && b.keys == 3);
+    destroy(&b);
+
+    /*
+     * Batches are cut at `BULK_BATCH_KEYS`.
+     */
+    char line[32];
+
+    init(&b, &cfg);
+    for (int i = 0; i < BULK_BATCH_KEYS * 2 + 1; i++) {
+        int len = sprintf(line, "k%d v\n", i);
+
+        assert(!buffer_append(&b.in, line, len));
+    }
+
+    b.eof = true;
+    assert(!bulk_kv_input(&b));
+    assert(b.sent == 3 && b.keys == BULK_BATCH_KEYS * 2 + 1);
+    destroy(&b);
+
+    init(&b, &cfg);
+    assert(feed(&b, "a 1\nnovalue\n") && errno == EINVAL);
+    destroy(&b);
+}
+
+void test_count_lines()
+{
+    FILE *file = tmpfile();
+    int fd = fileno(file);
+
+    assert(!bulk_count_lines(fd));
+    assert(write(fd, "a 1\nb 2\nc", 9) == 9);
+    assert(!bulk_count_lines(fd));
+    assert(!lseek(fd, 0, SEEK_SET));
+    assert(bulk_count_lines(fd) == 3);
+    assert(lseek(fd, 4, SEEK_SET) == 4);
+    assert(bulk_count_lines(fd) == 2);
+    assert(lseek(fd, 0, SEEK_CUR) == 4);
+
+    fclose(file);
+}
+
+int main()
+{
+    test_commands();
+    test_kv();
+    test_count_lines();
+
+    printf("Success\n");
+}
@@ -0,0 +1,556 @@
+#include "../src/db.c"
+#include "../src/hash_table.c"
+#include "../src/thread_pool.c"
+#include "../src/histogram.c"
+#include "../src/buffer.c"
+#include "../src/malloc.c"
+#include "../src/sys.c"
+
+#include <stdio.h>
+
+static void key(struct db_key *k, const char *str)
+{
+    db_key_init(k, str, strlen(str));
+}
+
+void test_get_set_del()
+{
+    struct db db;
+    struct db_key k;
+    struct buffer out;
+
+    assert(!db_init(&db));
+    buffer_init(&out);
+    key(&k, "a");
+
+    assert(!db_get(&db, &k, &out));
+    assert(!db_set(&db, &k, "one", 3, 0));
+    assert(!db_set(&db, &k, "two", 3, 0));
+    assert(db_get(&db, &k, &out) > 0);
+    assert(buffer_len(&out) == 3 && !memcmp(buffer_head(&out), "two", 3));
+    assert(db_size(&db) == 1);
+
+    assert(db_del(&db, &k));
+    assert(!db_del(&db, &k));
+    assert(!db_size(&db));
+
+    buffer_destroy(&out);
+    db_destroy(&db);
+}
+
+void test_expiry()
+{
+    struct db db;
+    struct db_key k;
+    struct buffer out;
+
+    assert(!db_init(&db));
+    buffer_init(&out);
+    key(&k, "a");
+
+    assert(!db_set(&db, &k, "v", 1, monotonic_ns() - 1));
+    assert(!db_get(&db, &k, &out));
+    assert(!db_size(&db));
+
+    assert(!db_expire(&db, &k, 1));
+    assert(!db_set(&db, &k, "v", 1, 0));
+    assert(db_expire(&db, &k, monotonic_ns() - 1));
+    assert(!db_del(&db, &k));
+
+    for (int i = 0; i < 100; i++) {
+        char str[16];
+
+        key(&k, (sprintf(str, "k%d", i), str));
+        assert(!db_set(&db, &k, "v", 1, i % 2 ? monotonic_ns() - 1 : 0));
+    }
+
+    size_t removed = 0;
+
+    for (size_t i = 0; i < DB_SHARDS; i++)
+        removed += db_expire_shard(&db, i);
+
+    assert(removed == 50);
+    assert(db_size(&db) == 50);
+
+    buffer_destroy(&out);
+    db_destroy(&db);
+}
+
+void test_incr()
+{
+    struct db db;
+    struct db_key k;
+    int64_t result;
+
+    assert(!db_init(&db));
+    key(&k, "n");
+
+    assert(!db_incr(&db, &k, 1, &result) && result == 1);
+    assert(!db_incr(&db, &k, -5, &result) && result == -4);
+
+    assert(!db_set(&db, &k, "9223372036854775807", 19, 0));
+    assert(db_incr(&db, &k, 1, &result) == EINVAL);
+
+    assert(!db_set(&db, &k, "12a", 3, 0));
+    assert(db_incr(&db, &k, 1, &result) == EINVAL);
+
+    db_destroy(&db);
+}
+
+void test_counter()
+{
+    struct db db;
+    struct db_key k;
+    struct db_value *val, *held;
+    int64_t result;
+    struct buffer out;
+
+    assert(!db_init(&db));
+    buffer_init(&out);
+    key(&k, "c");
+
+    /*
+     * The first update converts the value, later ones rewrite it in place.
+     */
+    assert(!db_set(&db, &k, "-5", 2, 0));
+    assert(!db_incr(&db, &k, 3, &result) && result == -2);
+    assert(!db_get_many(&db, &k, 1, &held));
+    assert(held->counter);
+    db_value_put(held);
+    val = held;
+
+    assert(!db_incr(&db, &k, INT64_MIN + 2, &result) && result == INT64_MIN);
+    assert(db_get(&db, &k, &out) > 0 && buffer_len(&out) == 20);
+    assert(!memcmp(buffer_head(&out), "-9223372036854775808", 20));
+    assert(!db_get_many(&db, &k, 1, &held) && held == val);
+
+    /*
+     * A reply holding the value gets to keep it as it was.
+     */
+    assert(!db_incr(&db, &k, INT64_MAX, &result) && result == -1);
+    assert(held->len == 20);
+    db_value_put(held);
+
+    assert(!db_get_many(&db, &k, 1, &held) && held != val);
+    assert(held->len == 2 && !memcmp(held->data, "-1", 2));
+    db_value_put(held);
+
+    assert(!db_cmpxchg(&db, &k, 0, 7, &result) && result == -1);
+    assert(!db_cmpxchg(&db, &k, -1, 7, &result) && result == -1);
+    assert(!db_incr(&db, &k, 0, &result) && result == 7);
+
+    key(&k, "missing");
+    assert(!db_cmpxchg(&db, &k, 0, 9, &result) && !result);
+    assert(!db_incr(&db, &k, 0, &result) && result == 9);
+
+    assert(!db_set(&db, &k, "x", 1, 0));
+    assert(db_cmpxchg(&db, &k, 0, 1, &result) == EINVAL);
+
+    /*
+     * Expiry survives updates.
+     */
+    key(&k, "e");
+    assert(!db_set(&db, &k, "1", 1, monotonic_ns() + 1000000000));
+    assert(!db_incr(&db, &k, 1, &result));
+    assert(!db_incr(&db, &k, 1, &result) && result == 3);
+    assert(!db_get_many(&db, &k, 1, &held) && held->expires);
+    db_value_put(held);
+
+    buffer_destroy(&out);
+    db_destroy(&db);
+}
+
+void test_version()
+{
+    struct db db;
+    struct db_key k;
+    struct buffer out;
+    struct db_value *held;
+    uint64_t v1, v2, v3, version;
+    int64_t result;
+
+    assert(!db_init(&db));
+    buffer_init(&out);
+    key(&k, "k");
+
+    assert(!db_read(&db, &k, NULL, NULL, &version) && !version);
+
+    /*
+     * Version zero creates the key only if missing.
+     */
+    assert(!db_cas(&db, &k, "a", 1, 0, &v1) && v1);
+    assert(db_cas(&db, &k, "b", 1, 0, &version) == ESTALE);
+    assert(version == v1);
+
+    assert(!db_set(&db, &k, "c", 1, 0));
+    assert(db_read(&db, &k, db_get_value, &out, &v2) > 0 && v2 > v1);
+    assert(db_cas(&db, &k, "d", 1, v1, &version) == ESTALE);
+    assert(version == v2);
+
+    assert(db_expire(&db, &k, monotonic_ns() + 1000000000));
+    assert(!db_cas(&db, &k, "e", 1, v2, &v3) && v3 > v2);
+
+    buffer_consume(&out, buffer_len(&out));
+    assert(db_read(&db, &k, db_get_value, &out, &version) > 0);
+    assert(version == v3 && *buffer_head(&out) == 'e');
+    assert(!db_get_many(&db, &k, 1, &held) && held->expires);
+    db_value_put(held);
+
+    /*
+     * Counters updated in place still move on.
+     */
+    assert(!db_set(&db, &k, "1", 1, 0));
+    assert(!db_incr(&db, &k, 1, &result));
+    assert(db_read(&db, &k, db_get_value, &out, &v1) > 0);
+    assert(!db_incr(&db, &k, 1, &result));
+    assert(db_read(&db, &k, db_get_value, &out, &v2) > 0 && v2 > v1);
+
+    /*
+     * Nor does deleting and setting again give an old version back.
+     */
+    assert(db_del(&db, &k));
+    assert(!db_cas(&db, &k, "f", 1, 0, &v3) && v3 > v2);
+
+    buffer_destroy(&out);
+    db_destroy(&db);
+}
+
+void test_incr_many()
+{
+    struct db db;
+    struct db_key keys[4];
+    int64_t nums[4] = { 1, 2, 3, INT64_MAX };
+    int errs[4];
+
+    assert(!db_init(&db));
+
+    key(&keys[0], "a");
+    key(&keys[1], "b");
+    key(&keys[2], "a");
+    key(&keys[3], "b");
+    assert(!db_set(&db, &keys[1], "10", 2, 0));
+
+    assert(!db_incr_many(&db, keys, nums, 4, nums, errs));
+    assert(!errs[0] && nums[0] == 1);
+    assert(!errs[1] && nums[1] == 12);
+    assert(!errs[2] && nums[2] == 4);
+    assert(errs[3] == EINVAL);
+
+    db_destroy(&db);
+}
+
+void test_many()
+{
+    struct db db;
+    struct db_key keys[200];
+    struct db_value *vals[200];
+    char names[200][16];
+    size_t deleted;
+
+    assert(!db_init(&db));
+
+    for (int i = 0; i < 200; i++) {
+        key(&keys[i], (sprintf(names[i], "k%d", i % 150), names[i]));
+        vals[i] = db_value_create(names[i], strlen(names[i]) + 1);
+        vals[i]->expires = i == 153 ? monotonic_ns() - 1 : 0;
+    }
+
+    /*
+     * A key given twice ends up with its last value.
+     */
+    vals[160]->data[0] = 'x';
+    assert(!db_set_many(&db, keys, 200, vals));
+    assert(db_size(&db) == 150);
+
+    assert(!db_get_many(&db, keys, 200, vals));
+
+    for (int i = 0; i < 200; i++) {
+        if (i % 150 == 3) {
+            assert(!vals[i]);
+            continue;
+        }
+
+        assert(vals[i] && vals[i]->len == strlen(names[i]) + 1);
+        assert(vals[i]->data[0] == (i % 150 == 10 ? 'x' : 'k'));
+        db_value_put(vals[i]);
+    }
+
+    assert(!db_del_many(&db, keys, 200, &deleted));
+    assert(deleted == 149);
+    assert(!db_size(&db));
+
+    assert(!db_get_many(&db, keys, 0, vals));
+    assert(!db_del_many(&db, keys, 0, &deleted) && !deleted);
+
+    db_destroy(&db);
+}
+
+static int count_key(const struct db_key *key, void *arg)
+{
+    (void)key;
+
+    ++*(size_t *)arg;
+    return 0;
+}
+
+void test_scan()
+{
+    struct db db;
+    struct db_key k;
+    size_t seen = 0;
+    uint64_t cursor = 0;
+
+    assert(!db_init(&db));
+
+    for (int i = 0; i < 1000; i++) {
+        char str[16];
+
+        key(&k, (sprintf(str, "k%d", i), str));
+        assert(!db_set(&db, &k, "v", 1, 0));
+    }
+
+    do {
+        cursor = db_scan(&db, cursor, 7, count_key, &seen);
+    } while (cursor);
+
+    assert(seen == 1000);
+
+    db_destroy(&db);
+}
+
+struct walk_state {
+    size_t seen;
+    bool stop;
+    bool found[1000];
+};
+
+/*
+ * Marks the first thousand keys seen, stopping the walk once partway through.
+ */
+static int walk_key(const struct db_key *key, const struct db_value *val,
+                    void *arg)
+{
+    struct walk_state *state = arg;
+    char str[16] = {0};
+    int i;
+
+    assert(val->len == 1 && key->len < sizeof(str));
+    memcpy(str, key->data, key->len);
+    assert(sscanf(str, "k%d", &i) == 1);
+
+    if (i < 1000)
+        state->found[i] = true;
+
+    if (++state->seen == 500 && state->stop) {
+        state->stop = false;
+        return 1;
+    }
+
+    return 0;
+}
+
+struct change {
+    size_t count;
+    bool deleted;
+};
+
+static void record_change(const struct db_key *key, const struct db_value *val,
+                          void *arg)
+{
+    struct change *change = arg;
+
+    (void)key;
+
+    change->count++;
+    change->deleted = !val;
+}
+
+void test_walk()
+{
+    struct db db;
+    struct db_key k;
+    struct db_walk walk = {0};
+    struct walk_state state = {.stop = true};
+    int more;
+    char str[16];
+
+    assert(!db_init(&db));
+
+    for (int i = 0; i < 1000; i++) {
+        key(&k, (sprintf(str, "k%d", i), str));
+        assert(!db_set(&db, &k, "v", 1, 0));
+    }
+
+    /*
+     * Stopped by the callback, then resumed after every shard has grown:
+     * each key there throughout is still seen.
+     */
+    assert(db_walk(&db, &walk, SIZE_MAX, walk_key, &state) < 0);
+
+    for (int i = 1000; i < 5000; i++) {
+        key(&k, (sprintf(str, "k%d", i), str));
+        assert(!db_set(&db, &k, "v", 1, 0));
+    }
+
+    while ((more = db_walk(&db, &walk, 7, walk_key, &state)) > 0)
+        ;
+
+    assert(!more);
+
+    for (int i = 0; i < 1000; i++)
+        assert(state.found[i]);
+
+    struct change change = {0};
+
+    db.changed = record_change;
+    db.changed_arg = &change;
+
+    int64_t sum;
+
+    assert(!db_set(&db, &k, "w", 1, 0));
+    assert(change.count == 1 && !change.deleted);
+    assert(db_incr(&db, &k, 1, &sum) == EINVAL && change.count == 1);
+    assert(db_del(&db, &k));
+    assert(change.count == 2 && change.deleted);
+    assert(!db_del(&db, &k) && change.count == 2);
+    assert(!db_incr(&db, &k, 1, &sum) && !db_incr(&db, &k, 1, &sum));
+    assert(change.count == 4 && !change.deleted);
+
+    /*
+     * Clearing is not reported.
+     */
+    db_clear(&db);
+    assert(!db_size(&db) && change.count == 4);
+
+    db_destroy(&db);
+}
+
+void test_reserve()
+{
+    struct db db;
+    struct db_key k;
+    char name[16];
+
+    assert(!db_init(&db));
+    assert(!db_reserve(&db, 100000));
+
+    size_t bucket_counts[DB_SHARDS];
+
+    for (size_t i = 0; i < DB_SHARDS; i++)
+        bucket_counts[i] = db.shards[i].table->bucket_count;
+
+    for (int i = 0; i < 100000; i++) {
+        key(&k, (sprintf(name, "k%d", i), name));
+        assert(!db_set(&db, &k, "v", 1, 0));
+    }
+
+    /*
+     * No shard had to grow.
+     */
+    for (size_t i = 0; i < DB_SHARDS; i++)
+        assert(db.shards[i].table->bucket_count == bucket_counts[i]);
+
+    assert(db_size(&db) == 100000);
+    db_destroy(&db);
+}
+
+struct int_keys {
+    size_t seen;
+    bool found[3];
+};
+
+static int int_key(const struct db_key *key, void *arg)
+{
+    struct int_keys *keys = arg;
+    const char *names[] = { "0", "-12", "9223372036854775807" };
+
+    assert(!key->data[key->len]);
+
+    for (int i = 0; i < 3; i++)
+        if (!strcmp(key->data, names[i]))
+            keys->found[i] = true;
+
+    keys->seen++;
+    return 0;
+}
+
+void test_int_keys()
+{
+    struct db db;
+    struct db_key k;
+    struct buffer out;
+    struct int_keys keys = { 0 };
+    int64_t sum;
+
+    assert(!db_init(&db));
+    buffer_init(&out);
+
+    /*
+     * Integers written the one way each has go to the integer tables, and
+     * anything else stays a string.
+     */
+    const char *ints[] = { "0", "-12", "9223372036854775807" };
+    const char *strs[] = { "00", "-0", "+1", "012", "9223372036854775808",
+                           "1a", "-", "" };
+
+    for (int i = 0; i < 3; i++) {
+        key(&k, ints[i]);
+        assert(!db_set(&db, &k, ints[i], strlen(ints[i]), 0));
+    }
+
+    for (int i = 0; i < 8; i++) {
+        key(&k, strs[i]);
+        assert(!db_set(&db, &k, "s", 1, 0));
+    }
+
+    size_t in_ints = 0;
+
+    for (size_t i = 0; i < DB_SHARDS; i++)
+        in_ints += db.shards[i].ints->entry_count;
+
+    assert(in_ints == 3 && db_size(&db) == 11);
+
+    key(&k, "-12");
+    assert(db_get(&db, &k, &out) > 0);
+    assert(buffer_len(&out) == 3 && !memcmp(buffer_head(&out), "-12", 3));
+    assert(!db_incr(&db, &k, 2, &sum) && sum == -10);
+
+    key(&k, "0");
+    assert(db_del(&db, &k) && !db_del(&db, &k));
+    assert(!db_set(&db, &k, "v", 1, 0));
+
+    /*
+     * Integer keys come back written out.
+     */
+    uint64_t cursor = 0;
+
+    do {
+        cursor = db_scan(&db, cursor, 5, int_key, &keys);
+    } while (cursor);
+
+    assert(keys.seen == 11);
+    assert(keys.found[0] && keys.found[1] && keys.found[2]);
+
+    db_clear(&db);
+    assert(!db_size(&db));
+
+    buffer_destroy(&out);
+    db_destroy(&db);
+}
+
+int main()
+{
+    test_get_set_del();
+    test_expiry();
+    test_incr();
+    test_counter();
+    test_version();
+    test_incr_many();
+    test_many();
+    test_scan();
+    test_walk();
+    test_reserve();
+    test_int_keys();
+
+    printf("Success\n");
+}
@@ -0,0 +1,215 @@
+#include "../src/event_loop_epoll.c"
+#include "../src/event_loop_kqueue.c"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static void pair_init(int fds[2])
+{
+    assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+    for (int i = 0; i < 2; i++)
+        assert(!fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK));
+}
+
+static void drain(int fd)
+{
+    char buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+
+    assert(errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * Returns the events reported for `data` by one wait, or 0 if none.
+ */
+static unsigned int wait_for(struct event_loop *loop, void *data)
+{
+    unsigned int events = 0;
+    int n = event_loop_wait(loop, 100);
+
+    assert(n >= 0);
+
+    for (int i = 0; i < n; i++)
+        if (loop->ready[i].data == data)
+            events |= loop->ready[i].events;
+
+    return events;
+}
+
+void test_add_modify_remove()
+{
+    struct event_loop loop;
+    int fds[2], a, b;
+
+    assert(!event_loop_init(&loop, 8));
+    pair_init(fds);
+
+    /*
+     * Registered for both directions: writable at once, readable on data.
+     */
+    assert(!event_loop_add(&loop, fds[0], &a));
+    assert(wait_for(&loop, &a) == EVENT_WRITE);
+
+    assert(write(fds[1], "x", 1) == 1);
+    assert(wait_for(&loop, &a) & EVENT_READ);
+    drain(fds[0]);
+
+    /*
+     * Registering again after removal reports the new data.
+     */
+    assert(!event_loop_del(&loop, fds[0]));
+    assert(!event_loop_add(&loop, fds[0], &b));
+    assert(write(fds[1], "x", 1) == 1);
+
+    unsigned int events = 0;
+    int n = event_loop_wait(&loop, 100);
+
+    for (int i = 0; i < n; i++) {
+        assert(loop.ready[i].data == &b);
+        events |= loop.ready[i].events;
+    }
+
+    assert(events & EVENT_READ);
+    drain(fds[0]);
+
+    /*
+     * Removed descriptors report nothing further.
+     */
+    assert(!event_loop_del(&loop, fds[0]));
+    assert(write(fds[1], "x", 1) == 1);
+    assert(!event_loop_wait(&loop, 10));
+
+    close(fds[0]);
+    close(fds[1]);
+    event_loop_destroy(&loop);
+}
+
+void test_edge_triggered()
+{
+    struct event_loop loop;
+    int fds[2], a;
+
+    assert(!event_loop_init(&loop, 8));
+    pair_init(fds);
+    assert(!event_loop_add(&loop, fds[0], &a));
+    assert(wait_for(&loop, &a) == EVENT_WRITE);
+
+    /*
+     * One event per edge: data left unread is not reported again.
+     */
+    assert(write(fds[1], "xy", 2) == 2);
+    assert(wait_for(&loop, &a) & EVENT_READ);
+    assert(!wait_for(&loop, &a));
+
+    /*
+     * New data is a new edge.
+     */
+    assert(write(fds[1], "z", 1) == 1);
+    assert(wait_for(&loop, &a) & EVENT_READ);
+    drain(fds[0]);
+    assert(!wait_for(&loop, &a));
+
+    /*
+     * Hang up is reported as readable, found through `read()`.
+     */
+    close(fds[1]);
+    assert(wait_for(&loop, &a) & EVENT_READ);
+
+    char c;
+
+    assert(!read(fds[0], &c, 1));
+    close(fds[0]);
+    event_loop_destroy(&loop);
+}
+
+#define BATCH 40
+
+void test_batched_add()
+{
+    struct event_loop loop;
+    int fds[BATCH][2];
+    int seen[BATCH] = { 0 };
+    int bad[3];
+
+    assert(!event_loop_init(&loop, 4));
+
+    /*
+     * More registrations than a wait returns events, and more than the first
+     * allocation of the change list, all submitted by the next wait.
+     */
+    for (int i = 0; i < BATCH; i++) {
+        pair_init(fds[i]);
+        assert(!event_loop_add(&loop, fds[i][0], &fds[i]));
+    }
+
+    for (int total = 0; total < BATCH;) {
+        int n = event_loop_wait(&loop, 100);
+
+        assert(n > 0 && n <= 4);
+        total += n;
+
+        for (int i = 0; i < n; i++) {
+            int index = (int (*)[2])loop.ready[i].data - fds;
+
+            assert(index >= 0 && index < BATCH);
+            assert(loop.ready[i].events == EVENT_WRITE);
+            seen[index]++;
+        }
+    }
+
+    for (int i = 0; i < BATCH; i++)
+        assert(seen[i] == 1);
+
+    /*
+     * Failed registrations are reported to their owners as errors, even when
+     * there are more than fit in one wait.
+     */
+    event_loop_destroy(&loop);
+    assert(!event_loop_init(&loop, 2));
+
+    for (int i = 0; i < 3; i++)
+        assert(!event_loop_add(&loop, -1, &bad[i]));
+
+    memset(seen, 0, sizeof(seen));
+
+    for (int total = 0; total < 3;) {
+        int n = event_loop_wait(&loop, 100);
+
+        assert(n > 0 && n <= 2);
+        total += n;
+
+        for (int i = 0; i < n; i++) {
+            int index = (int *)loop.ready[i].data - bad;
+
+            assert(index >= 0 && index < 3);
+            assert(loop.ready[i].events == EVENT_ERROR);
+            seen[index]++;
+        }
+    }
+
+    for (int i = 0; i < 3; i++)
+        assert(seen[i] == 1);
+
+    assert(!event_loop_wait(&loop, 10));
+
+    for (int i = 0; i < BATCH; i++) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+
+    event_loop_destroy(&loop);
+}
+
+int main()
+{
+    test_add_modify_remove();
+    test_edge_triggered();
+    test_batched_add();
+
+    printf("Success\n");
+}
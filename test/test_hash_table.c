@@ -1,8 +1,36 @@
+#define thread_pool_parallel_for test_parallel_for
 #include "../src/hash_table.c"
+#undef thread_pool_parallel_for
+#include "../src/thread_pool.c"
+#include "../src/histogram.c"
+#include "../src/malloc.c"
+#include "../src/sys.c"
 
 #include <string.h>
 #include <stdio.h>
 
+/*
+ * The table's calls into the pool go through here, which fails the next
+ * `parallel_for_failures` of them once `parallel_for_passes` have gone
+ * through, as if the pool could not take the work.
+ */
+int parallel_for_passes;
+int parallel_for_failures;
+
+int test_parallel_for(struct thread_pool *tp, size_t begin, size_t end,
+                      size_t grain, void (*fn)(void *arg, size_t lo, size_t hi),
+                      void *arg)
+{
+    if (parallel_for_passes) {
+        parallel_for_passes--;
+    } else if (parallel_for_failures) {
+        parallel_for_failures--;
+        return 1;
+    }
+
+    return thread_pool_parallel_for(tp, begin, end, grain, fn, arg);
+}
+
 const char hello_world[] = "Hello world!";
 const char hello_world_hex[] = "48656c6c6f20776f726c6421";
 const char hello_world_bin[] =
@@ -82,6 +110,211 @@ void test_murmur_hash_x86_32()
     }
 }
 
+struct hash_table_interface int_interface = {
+    .hash_fn = hash_table_int_hash,
+    .key_cmp = hash_table_int_cmp,
+};
+
+#define KEY(i) hash_table_int_key(i)
+
+struct hash_table *int_table(size_t count)
+{
+    struct hash_table *table = hash_table_create(&int_interface);
+
+    assert(table);
+
+    for (size_t i = 1; i <= count; i++)
+        assert(!hash_table_insert(table, KEY(i), KEY(i * 2)));
+
+    assert(table->entry_count == count);
+    return table;
+}
+
+void assert_table(struct hash_table *table, size_t count, bool odd_only)
+{
+    for (size_t i = 1; i <= count; i++) {
+        struct hash_table_entry *entry = hash_table_get(table, KEY(i));
+
+        if (odd_only && !(i & 1)) {
+            assert(!entry);
+        } else {
+            assert(entry);
+            assert(entry->val.u64 == i * 2);
+        }
+    }
+}
+
+void test_hash_table_ops()
+{
+    struct hash_table *table = int_table(1000);
+
+    assert_table(table, 1000, false);
+    assert(!hash_table_get(table, KEY(1001)));
+
+    assert(!hash_table_insert(table, KEY(7), KEY(14)));
+    assert(table->entry_count == 1000);
+
+    for (size_t i = 2; i <= 1000; i += 2)
+        assert(hash_table_rm(table, KEY(i)) == 1);
+
+    assert(hash_table_rm(table, KEY(2)) == 0);
+    assert(table->entry_count == 500);
+    assert_table(table, 1000, true);
+
+    /*
+     * Zero and negative keys are keys like any other, though zero is `NULL`,
+     * and so are zero values.
+     */
+    assert(!hash_table_insert(table, KEY(0), KEY(1)));
+    assert(!hash_table_insert(table, KEY(-1), KEY(2)));
+    assert(hash_table_get(table, KEY(0))->val.u64 == 1);
+    assert(!hash_table_insert(table, KEY(0), KEY(0)));
+    assert(!hash_table_get(table, KEY(0))->val.u64);
+    assert(hash_table_key_int(hash_table_get(table, KEY(-1))->key) == -1);
+    assert(hash_table_rm(table, KEY(0)) && hash_table_rm(table, KEY(-1)));
+    assert(!hash_table_get(table, KEY(0)));
+    assert(table->entry_count == 500);
+
+    assert(!hash_table_rehash(table, 17));
+    assert_table(table, 1000, true);
+
+    struct hash_table_stats stats = { 0 };
+
+    hash_table_stats(table, &stats);
+    assert(stats.entries == 500 && stats.buckets == 17);
+    assert(stats.used_buckets == 17 && stats.longest_chain >= 500 / 17);
+    assert(stats.rehashes == table->rehashes && stats.rehashes > 1);
+
+    /*
+     * Reserved room is filled without rehashing, and never shrinks.
+     */
+    assert(!hash_table_reserve(table, 5000));
+    size_t bucket_count = table->bucket_count;
+
+    assert(bucket_count > 5000);
+    assert_table(table, 1000, true);
+
+    for (size_t i = 1001; i <= 5000; i++)
+        assert(!hash_table_insert(table, KEY(i), KEY(i * 2)));
+
+    assert(table->bucket_count == bucket_count);
+    assert(!hash_table_reserve(table, 100));
+    assert(table->bucket_count == bucket_count);
+
+    hash_table_destroy(table);
+}
+
+bool dup_fails;
+
+void *val_dup(struct hash_table *table, const void *val)
+{
+    (void)table;
+
+    return dup_fails ? NULL : strdup(val);
+}
+
+void val_free(struct hash_table *table, void *val)
+{
+    (void)table;
+
+    free(val);
+}
+
+struct hash_table_interface dup_interface = {
+    .hash_fn = hash_table_int_hash,
+    .key_cmp = hash_table_int_cmp,
+    .val_dup = val_dup,
+    .free_val = val_free,
+};
+
+void test_hash_table_put_failure()
+{
+    struct hash_table *table = hash_table_create(&dup_interface);
+
+    assert(table);
+    assert(hash_table_put(table, KEY(1), "one"));
+
+    /*
+     * A value that fails to duplicate neither replaces nor adds an entry.
+     */
+    dup_fails = true;
+    assert(!hash_table_put(table, KEY(1), "uno"));
+    assert(!hash_table_put(table, KEY(2), "two"));
+    dup_fails = false;
+
+    assert(table->entry_count == 1);
+    assert(!strcmp(hash_table_get(table, KEY(1))->val.buf, "one"));
+    assert(!hash_table_get(table, KEY(2)));
+
+    assert(hash_table_put(table, KEY(1), "uno"));
+    assert(!strcmp(hash_table_get(table, KEY(1))->val.buf, "uno"));
+
+    hash_table_destroy(table);
+}
+
+bool is_even(struct hash_table *table, struct hash_table_entry *entry,
+             void *arg)
+{
+    (void)table;
+    (void)arg;
+
+    return !((uintptr_t)entry->key & 1);
+}
+
+void sum_values(struct hash_table *table, struct hash_table_entry *entry,
+                void *arg)
+{
+    (void)table;
+
+    atomic_fetch_add((atomic_size_t *)arg, entry->val.u64);
+}
+
+void test_hash_table_parallel()
+{
+    const size_t count = 100000;
+    struct thread_pool tp;
+    struct hash_table *table = int_table(count);
+    atomic_size_t sum;
+
+    thread_pool_init(&tp, 4);
+
+    assert(!hash_table_rehash_parallel(
+        table, 4 * HASH_TABLE_PARALLEL_MIN_BUCKETS + 3, &tp));
+    assert_table(table, count, false);
+
+    atomic_init(&sum, 0);
+    assert(!hash_table_foreach_parallel(table, &tp, sum_values, &sum));
+    assert(atomic_load(&sum) == count * (count + 1));
+
+    assert(hash_table_rm_matching(table, &tp, is_even, NULL) == count / 2);
+    assert(table->entry_count == count / 2);
+    assert_table(table, count, true);
+
+    assert(!hash_table_rehash_parallel(table, HASH_TABLE_PARALLEL_MIN_BUCKETS,
+                                       &tp));
+    assert_table(table, count, true);
+
+    /*
+     * Either pass is finished serially should the pool fail to take it.
+     */
+    parallel_for_passes = 1;
+    parallel_for_failures = 1;
+    assert(!hash_table_rehash_parallel(
+        table, 2 * HASH_TABLE_PARALLEL_MIN_BUCKETS + 1, &tp));
+    assert(!parallel_for_failures);
+    assert_table(table, count, true);
+
+    parallel_for_failures = 2;
+    assert(!hash_table_rehash_parallel(
+        table, 3 * HASH_TABLE_PARALLEL_MIN_BUCKETS + 5, &tp));
+    assert(!parallel_for_failures);
+    assert(table->entry_count == count / 2);
+    assert_table(table, count, true);
+
+    hash_table_destroy_parallel(table, &tp);
+    thread_pool_destroy(&tp);
+}
+
 int main()
 {
     test_rotl_32();
@@ -89,5 +322,8 @@ int main()
     test_bin();
     test_hex();
     test_murmur_hash_x86_32();
+    test_hash_table_ops();
+    test_hash_table_put_failure();
+    test_hash_table_parallel();
     printf("Success\n");
 }
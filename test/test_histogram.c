@@ -0,0 +1,54 @@
+#include "../src/histogram.c"
+
+#include <stdio.h>
+
+void test_bucket_index()
+{
+    for (uint64_t v = 0; v < HISTOGRAM_SUB_COUNT; v++)
+        assert(histogram_bucket_index(v) == v);
+
+    assert(histogram_bucket_index(UINT64_MAX) == HISTOGRAM_BUCKETS - 1);
+
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        uint64_t value = histogram_bucket_value(i);
+
+        assert(histogram_bucket_index(value) == i);
+        if (i)
+            assert(histogram_bucket_value(i - 1) < value);
+    }
+}
+
+void test_percentiles()
+{
+    struct histogram h, merged;
+
+    histogram_init(&h);
+    histogram_init(&merged);
+    assert(histogram_percentile(&h, 50) == 0);
+
+    for (uint64_t v = 1; v <= 1000; v++)
+        histogram_record(&h, v * 1000);
+
+    assert(histogram_count(&h) == 1000);
+    assert(histogram_max(&h) == 1000000);
+    assert(histogram_mean(&h) == 500500);
+
+    uint64_t p50 = histogram_percentile(&h, 50);
+    uint64_t p99 = histogram_percentile(&h, 99);
+
+    assert(p50 <= 500000 && p50 >= 500000 * 15 / 16);
+    assert(p99 <= 990000 && p99 >= 990000 * 15 / 16);
+    assert(histogram_percentile(&h, 100) <= 1000000);
+
+    histogram_merge(&merged, &h);
+    histogram_merge(&merged, &h);
+    assert(histogram_count(&merged) == 2000);
+    assert(histogram_percentile(&merged, 50) == p50);
+}
+
+int main()
+{
+    test_bucket_index();
+    test_percentiles();
+    printf("Success\n");
+}
@@ -0,0 +1,92 @@
+#include "../src/malloc.c"
+#include "../src/sys.c"
+
+#include <pthread.h>
+#include <stdio.h>
+
+#define TEST_BLOCKS 64
+#define TEST_BLOCK_SIZE 4096
+
+static void *free_blocks(void *arg)
+{
+    void **blocks = arg;
+
+    for (int i = 0; i < TEST_BLOCKS; i++)
+        tagged_free(MALLOC_TAG_BUFFER, blocks[i]);
+
+    return NULL;
+}
+
+void test_malloc_tags()
+{
+#ifdef MALLOC_TAGS
+    struct malloc_tag_stats stats;
+    void *blocks[TEST_BLOCKS];
+
+    for (int i = 0; i < TEST_BLOCKS; i++)
+        assert((blocks[i] = tagged_malloc(MALLOC_TAG_BUFFER,
+                                          TEST_BLOCK_SIZE)));
+
+    malloc_tag_stats(MALLOC_TAG_BUFFER, &stats);
+    assert(stats.count == TEST_BLOCKS);
+    assert(stats.bytes >= TEST_BLOCKS * TEST_BLOCK_SIZE);
+    assert(stats.peak >= stats.bytes);
+
+    malloc_tag_stats(MALLOC_TAG_KEY, &stats);
+    assert(!stats.count && !stats.bytes);
+
+    /*
+     * Blocks freed by another thread are taken off all the same, and the
+     * high-water mark stays.
+     */
+    pthread_t thread;
+
+    assert(!pthread_create(&thread, NULL, free_blocks, blocks));
+    assert(!pthread_join(thread, NULL));
+
+    malloc_tag_stats(MALLOC_TAG_BUFFER, &stats);
+    assert(!stats.count && !stats.bytes);
+    assert(stats.peak >= TEST_BLOCKS * TEST_BLOCK_SIZE);
+
+    /*
+     * Reallocations count the new block in place of the old.
+     */
+    char *p = tagged_calloc(MALLOC_TAG_VALUE, 1, 16);
+
+    assert(p && (p = tagged_realloc(MALLOC_TAG_VALUE, p, 1024)));
+    malloc_tag_stats(MALLOC_TAG_VALUE, &stats);
+    assert(stats.count == 1 && stats.bytes >= 1024);
+
+    tagged_free(MALLOC_TAG_VALUE, p);
+    tagged_free(MALLOC_TAG_VALUE, NULL);
+    malloc_tag_stats(MALLOC_TAG_VALUE, &stats);
+    assert(!stats.count && !stats.bytes);
+#endif
+}
+
+void test_malloc_stats_print()
+{
+    char *out = NULL;
+    size_t len = 0;
+    FILE *stream = open_memstream(&out, &len);
+
+    assert(stream);
+    malloc_stats_print(stream);
+    fclose(stream);
+
+    assert(strstr(out, "peak_rss:"));
+#ifdef MALLOC_TAGS
+    assert(strstr(out, "alloc_buffers:count=0,bytes=0,peak_bytes="));
+    assert(strstr(out, "tagged_memory:"));
+#endif
+
+    free(out);
+}
+
+int main()
+{
+    test_malloc_tags();
+    test_malloc_stats_print();
+
+    printf("Success\n");
+}
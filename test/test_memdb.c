@@ -0,0 +1,274 @@
+#include "../src/memdb.c"
+#include "../src/resp.c"
+#include "../src/protocol.c"
+#include "../src/buffer.c"
+#include "../src/malloc.c"
+#include "../src/sys.c"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+
+/*
+ * Listens on an ephemeral loopback port, written to `port`.
+ */
+static int listen_loopback(char *port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    assert(fd >= 0);
+    assert(!bind(fd, (struct sockaddr *)&addr, len));
+    assert(!listen(fd, 8));
+    assert(!getsockname(fd, (struct sockaddr *)&addr, &len));
+    sprintf(port, "%u", ntohs(addr.sin_port));
+
+    return fd;
+}
+
+/*
+ * Connects `conn`, flushing what it queued, and returns the server's end.
+ */
+static int connect_loopback(struct memdb_conn *conn, int lfd,
+                            const char *port)
+{
+    assert(!memdb_connect(conn, "127.0.0.1", port));
+
+    int fd = accept(lfd, NULL, NULL);
+
+    assert(fd >= 0);
+    assert(!memdb_process(conn, POLLOUT));
+    assert(!conn->connecting && !memdb_unsent(conn));
+
+    return fd;
+}
+
+/*
+ * Reads exactly `len` bytes the client sent.
+ */
+static void recv_all(int fd, char *buf, size_t len)
+{
+    for (ssize_t n; len; buf += n, len -= n)
+        assert((n = recv(fd, buf, len, 0)) > 0);
+}
+
+struct record {
+    int calls;
+    uint16_t status[8];
+    uint64_t extra[8];
+    char val[8][16];
+};
+
+static void record(struct memdb_conn *conn, const struct memdb_reply *reply,
+                   void *arg)
+{
+    struct record *r = arg;
+    int i = r->calls++;
+
+    r->status[i] = reply->status;
+    r->extra[i] = reply->extra;
+
+    if (reply->status != MEMDB_CLOSED) {
+        /*
+         * The value is read in place, from the receive buffer.
+         */
+        assert(reply->val >= conn->in.data + conn->in.start);
+        assert(reply->val + reply->val_len <= conn->in.data + conn->in.end);
+        memcpy(r->val[i], reply->val, reply->val_len);
+    }
+}
+
+void test_binary()
+{
+    char port[8];
+    int lfd = listen_loopback(port);
+    struct memdb_conn conn;
+    struct record r = { 0 };
+    char buf[256];
+
+    /*
+     * Requests queued before connecting go out pipelined, in one write.
+     */
+    memdb_init(&conn, 0);
+    assert(!memdb_set(&conn, "a", 1, "one", 3, 0, record, &r));
+    assert(!memdb_get(&conn, "a", 1, record, &r));
+    assert(!memdb_del(&conn, "b", 1, record, &r));
+    assert(memdb_pending(&conn) == 3);
+    assert(memdb_command_raw(&conn, "PING\n", 5, record, &r) &&
+           errno == EPROTONOSUPPORT);
+    assert(memdb_pending(&conn) == 3);
+
+    size_t sent = memdb_unsent(&conn);
+    int fd = connect_loopback(&conn, lfd, port);
+    struct proto_request reqs[3];
+    size_t pos = 0;
+
+    recv_all(fd, buf, sent);
+    for (int i = 0; i < 3; i++) {
+        ssize_t n = proto_parse_request(buf + pos, sent - pos, &reqs[i]);
+
+        assert(n > 0);
+        pos += n;
+    }
+
+    assert(reqs[0].opcode == PROTO_SET && reqs[1].opcode == PROTO_GET &&
+           reqs[2].opcode == PROTO_DEL);
+    assert(reqs[1].id == reqs[0].id + 1 && reqs[2].id == reqs[1].id + 1);
+
+    /*
+     * Replies are handed over in order as each is whole, however they are
+     * split.
+     */
+    struct buffer out;
+    struct proto_response res[] = {
+        { PROTO_SET, PROTO_OK, reqs[0].id, 7, NULL, 0 },
+        { PROTO_GET, PROTO_OK, reqs[1].id, 0, "one", 3 },
+        { PROTO_DEL, PROTO_NOT_FOUND, reqs[2].id, 0, NULL, 0 },
+    };
+
+    buffer_init(&out);
+    for (size_t i = 0; i < ARRAY_SIZE(res); i++)
+        assert(!proto_write_response(&out, &res[i]));
+
+    size_t half = PROTO_HEADER_SIZE + PROTO_HEADER_SIZE / 2;
+
+    assert(send(fd, buffer_head(&out), half, 0) == (ssize_t)half);
+    assert(!memdb_process(&conn, POLLIN));
+    assert(r.calls == 1 && r.status[0] == PROTO_OK && r.extra[0] == 7);
+
+    assert(send(fd, buffer_head(&out) + half, buffer_len(&out) - half, 0) ==
+           (ssize_t)(buffer_len(&out) - half));
+    assert(!memdb_wait(&conn, 1000));
+    assert(r.calls == 3 && !memdb_pending(&conn));
+    assert(!strcmp(r.val[1], "one"));
+    assert(r.status[2] == PROTO_NOT_FOUND);
+
+    /*
+     * A reply to some other request fails the connection.
+     */
+    assert(!memdb_get(&conn, "a", 1, record, &r));
+    assert(!memdb_process(&conn, POLLOUT));
+    recv_all(fd, buf, PROTO_HEADER_SIZE + 1);
+    buffer_consume(&out, buffer_len(&out));
+    assert(!proto_write_response(&out, &res[0]));
+    assert(send(fd, buffer_head(&out), buffer_len(&out), 0) > 0);
+    assert(memdb_wait(&conn, 1000) && errno == EPROTO);
+    assert(r.calls == 4 && r.status[3] == MEMDB_CLOSED);
+    assert(memdb_fd(&conn) < 0 && !memdb_events(&conn));
+    assert(memdb_get(&conn, "a", 1, record, &r) && errno == EPROTO);
+
+    buffer_destroy(&out);
+    memdb_destroy(&conn);
+    close(fd);
+    close(lfd);
+}
+
+void test_resp()
+{
+    char port[8];
+    int lfd = listen_loopback(port);
+    struct memdb_conn conn;
+    struct record r = { 0 };
+    const char *argv[] = { "GET", "a" };
+    size_t lens[] = { 3, 1 };
+    char buf[64];
+
+    memdb_init(&conn, MEMDB_RESP);
+    assert(memdb_get(&conn, "a", 1, record, &r) && errno == EPROTONOSUPPORT);
+    assert(!memdb_command(&conn, 2, argv, lens, record, &r));
+    assert(!memdb_command_raw(&conn, "PING\r\n", 6, record, &r));
+
+    int fd = connect_loopback(&conn, lfd, port);
+    const char *expected = "*2\r\n$3\r\nGET\r\n$1\r\na\r\nPING\r\n";
+
+    recv_all(fd, buf, strlen(expected));
+    assert(!memcmp(buf, expected, strlen(expected)));
+
+    /*
+     * Replies are handed over whole, undecoded.
+     */
+    assert(send(fd, "$3\r\none\r\n+PO", 12, 0) == 12);
+    assert(!memdb_process(&conn, POLLIN));
+    assert(r.calls == 1 && !strcmp(r.val[0], "$3\r\none\r\n"));
+
+    assert(send(fd, "NG\r\n", 4, 0) == 4);
+    assert(!memdb_wait(&conn, 1000));
+    assert(r.calls == 2 && !strcmp(r.val[1], "+PONG\r\n"));
+
+    /*
+     * The server closing fails what is outstanding.
+     */
+    assert(!memdb_command_raw(&conn, "PING\r\n", 6, record, &r));
+    close(fd);
+    assert(memdb_wait(&conn, 1000));
+    assert(r.calls == 3 && r.status[2] == MEMDB_CLOSED);
+
+    /*
+     * Timing out leaves the request outstanding.
+     */
+    fd = connect_loopback(&conn, lfd, port);
+    assert(!memdb_command_raw(&conn, "PING\r\n", 6, record, &r));
+    assert(memdb_wait(&conn, 10) && errno == ETIMEDOUT);
+    assert(memdb_pending(&conn) == 1);
+
+    memdb_destroy(&conn);
+    assert(r.calls == 4 && r.status[3] == MEMDB_CLOSED);
+
+    close(fd);
+    close(lfd);
+}
+
+void test_pool()
+{
+    char port[8];
+    int lfd = listen_loopback(port);
+    struct memdb_pool pool;
+    struct record r = { 0 };
+    int fds[3];
+
+    assert(!memdb_pool_init(&pool, "127.0.0.1", port, MEMDB_RESP, 3));
+    for (int i = 0; i < 3; i++)
+        assert((fds[i] = accept(lfd, NULL, NULL)) >= 0);
+
+    /*
+     * Requests are spread over the least loaded connections.
+     */
+    for (int i = 0; i < 6; i++) {
+        struct memdb_conn *conn = memdb_pool_get(&pool);
+
+        assert(conn && memdb_pending(conn) == (size_t)i / 3);
+        assert(!memdb_command_raw(conn, "PING\r\n", 6, record, &r));
+    }
+
+    for (int i = 0; i < 3; i++)
+        assert(send(fds[i], "+PONG\r\n+PONG\r\n", 14, 0) == 14);
+
+    assert(!memdb_pool_wait(&pool, 1000));
+    assert(r.calls == 6);
+
+    /*
+     * A connection that failed is reconnected when next handed out.
+     */
+    struct memdb_conn *conn = &pool.conns[0];
+
+    memdb_fail(conn, ECONNRESET);
+    assert(memdb_pool_get(&pool) == conn);
+    assert(memdb_fd(conn) >= 0 && !conn->err);
+
+    memdb_pool_destroy(&pool);
+    for (int i = 0; i < 3; i++)
+        close(fds[i]);
+    close(lfd);
+}
+
+int main()
+{
+    test_binary();
+    test_resp();
+    test_pool();
+
+    printf("Success\n");
+}
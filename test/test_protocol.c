@@ -0,0 +1,183 @@
+#include "../src/protocol.c"
+#include "../src/buffer.c"
+#include "../src/malloc.c"
+#include "../src/sys.c"
+
+#include <stdio.h>
+
+void test_request_roundtrip()
+{
+    struct buffer buf;
+    struct proto_request req;
+
+    buffer_init(&buf);
+
+    assert(!proto_write_request(&buf, &(struct proto_request){
+                                          .opcode = PROTO_SET,
+                                          .id = 7,
+                                          .extra = 42,
+                                          .key = "key",
+                                          .key_len = 3,
+                                          .val = "value",
+                                          .val_len = 5,
+                                      }));
+    assert(buffer_len(&buf) == PROTO_HEADER_SIZE + 8);
+
+    /* Every strict prefix is incomplete. */
+    for (size_t len = 0; len < buffer_len(&buf); len++)
+        assert(!proto_parse_request(buffer_head(&buf), len, &req));
+
+    assert(proto_parse_request(buffer_head(&buf), buffer_len(&buf), &req) ==
+           buffer_len(&buf));
+    assert(req.opcode == PROTO_SET);
+    assert(req.id == 7);
+    assert(req.extra == 42);
+    assert(req.key_len == 3 && !memcmp(req.key, "key", 3));
+    assert(req.val_len == 5 && !memcmp(req.val, "value", 5));
+
+    /* Views point into the buffer rather than copies. */
+    assert(req.key == buffer_head(&buf) + PROTO_HEADER_SIZE);
+
+    buffer_destroy(&buf);
+}
+
+void test_pipelined()
+{
+    struct buffer buf;
+    struct proto_request req;
+
+    buffer_init(&buf);
+
+    for (uint32_t id = 0; id < 100; id++) {
+        char key[16];
+        int len = sprintf(key, "k%u", id);
+
+        assert(!proto_write_request(&buf, &(struct proto_request){
+                                              .opcode = PROTO_GET,
+                                              .id = id,
+                                              .key = key,
+                                              .key_len = len,
+                                          }));
+    }
+
+    for (uint32_t id = 0; id < 100; id++) {
+        char key[16];
+        int len = sprintf(key, "k%u", id);
+        ssize_t n = proto_parse_request(buffer_head(&buf), buffer_len(&buf),
+                                        &req);
+
+        assert(n > 0 && n == PROTO_HEADER_SIZE + len);
+        assert(req.id == id);
+        assert(req.key_len == len && !memcmp(req.key, key, len));
+        buffer_consume(&buf, n);
+    }
+
+    assert(!buffer_len(&buf));
+    buffer_destroy(&buf);
+}
+
+void test_malformed()
+{
+    struct proto_header hdr = { .magic = PROTO_REQUEST_MAGIC };
+    struct proto_request req;
+
+    hdr.magic = PROTO_RESPONSE_MAGIC;
+    assert(proto_parse_request((char *)&hdr, sizeof(hdr), &req) < 0);
+
+    /* Bad magic is caught before the rest of the header arrives. */
+    assert(proto_parse_request((char *)&hdr, 1, &req) < 0);
+
+    hdr.magic = PROTO_REQUEST_MAGIC;
+    hdr.val_len = PROTO_MAX_VALUE + 1;
+    assert(proto_parse_request((char *)&hdr, sizeof(hdr), &req) < 0);
+}
+
+void test_response()
+{
+    struct buffer buf;
+    struct proto_response res;
+
+    buffer_init(&buf);
+
+    ssize_t offset = proto_begin_response(&buf, PROTO_GET, 9);
+
+    assert(offset == 0);
+    assert(!buffer_append(&buf, "hello", 5));
+    proto_end_response(&buf, offset, PROTO_OK, 3, 0);
+
+    assert(proto_parse_response(buffer_head(&buf), buffer_len(&buf), &res) ==
+           PROTO_HEADER_SIZE + 5);
+    assert(res.opcode == PROTO_GET);
+    assert(res.status == PROTO_OK);
+    assert(res.id == 9);
+    assert(res.extra == 3);
+    assert(res.val_len == 5 && !memcmp(res.val, "hello", 5));
+
+    buffer_destroy(&buf);
+}
+
+void test_items()
+{
+    struct buffer buf;
+    struct proto_item item;
+    size_t pos = 0;
+
+    buffer_init(&buf);
+
+    assert(!proto_write_item(&buf, &(struct proto_item){
+                                       .key = "a", .key_len = 1,
+                                       .val = "xyz", .val_len = 3 },
+                             true, true));
+    assert(!proto_write_item(&buf, &(struct proto_item){
+                                       .key = "bc", .key_len = 2,
+                                       .val = "", .val_len = 0 },
+                             true, true));
+
+    assert(proto_next_item(buffer_head(&buf), buffer_len(&buf), &pos,
+                           PROTO_MSET, true, &item) > 0);
+    assert(item.key_len == 1 && !memcmp(item.key, "a", 1));
+    assert(item.val_len == 3 && !memcmp(item.val, "xyz", 3));
+    assert(proto_next_item(buffer_head(&buf), buffer_len(&buf), &pos,
+                           PROTO_MSET, true, &item) > 0);
+    assert(item.key_len == 2 && item.val && !item.val_len);
+    assert(!proto_next_item(buffer_head(&buf), buffer_len(&buf), &pos,
+                            PROTO_MSET, true, &item));
+
+    /* The same bytes read as keys alone do not line up. */
+    int ret;
+
+    pos = 0;
+    while ((ret = proto_next_item(buffer_head(&buf), buffer_len(&buf), &pos,
+                                  PROTO_MGET, true, &item)) > 0)
+        ;
+    assert(ret < 0);
+
+    /* Response items: a missing value has no bytes after its length. */
+    buffer_consume(&buf, buffer_len(&buf));
+    assert(!proto_write_item(&buf, &(struct proto_item){ 0 }, false, true));
+    assert(!proto_write_item(&buf, &(struct proto_item){
+                                       .val = "v", .val_len = 1 },
+                             false, true));
+    assert(buffer_len(&buf) == 9);
+
+    pos = 0;
+    assert(proto_next_item(buffer_head(&buf), buffer_len(&buf), &pos,
+                           PROTO_MGET, false, &item) > 0);
+    assert(!item.val);
+    assert(proto_next_item(buffer_head(&buf), buffer_len(&buf), &pos,
+                           PROTO_MGET, false, &item) > 0);
+    assert(item.val_len == 1 && *item.val == 'v');
+
+    buffer_destroy(&buf);
+}
+
+int main()
+{
+    test_request_roundtrip();
+    test_pipelined();
+    test_malformed();
+    test_response();
+    test_items();
+
+    printf("Success\n");
+}
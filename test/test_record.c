@@ -0,0 +1,112 @@
+#include "../src/record.c"
+#include "../src/sys.c"
+
+#include <stdio.h>
+
+#define TEST_ENTRIES (RECORD_BUFFER_ENTRIES + 10)
+
+static struct record rec;
+
+static void add(uint64_t ns, uint32_t conn, uint16_t keys)
+{
+    size_t count = keys ? keys : 1;
+    struct record_entry *entries = record_reserve(&rec, count);
+
+    assert(entries);
+
+    for (size_t i = 0; i < count; i++)
+        entries[i] = (struct record_entry){
+            .ns = ns,
+            .conn = conn,
+            .key_hash = i,
+            .keys = i ? 0 : keys,
+            .op = keys ? RECORD_GET : RECORD_OTHER,
+            .flags = i ? RECORD_MORE : 0,
+        };
+
+    record_commit(&rec);
+}
+
+static void *add_late(void *arg)
+{
+    (void)arg;
+
+    /*
+     * Entries of another thread, arriving between those of the first.
+     */
+    for (int i = 0; i < 10; i++)
+        add(i * 2 + 1, 1, 1);
+
+    return NULL;
+}
+
+void test_record()
+{
+    char path[] = "/tmp/test_record_XXXXXX";
+    struct record_entry *entries;
+    size_t count;
+    int fd = mkstemp(path);
+
+    assert(fd >= 0);
+    close(fd);
+
+    assert(!record_open(&rec, path));
+
+    for (int i = 0; i < 10; i++)
+        add(i * 2, 0, i == 4 ? 3 : 1);
+
+    pthread_t thread;
+
+    assert(!pthread_create(&thread, NULL, add_late, NULL));
+    assert(!pthread_join(thread, NULL));
+
+    /*
+     * More than a buffer holds, written out on the way.
+     */
+    for (int i = 0; i < TEST_ENTRIES; i++)
+        add(100 + i, 2, 0);
+
+    assert(atomic_load(&rec.written) == RECORD_BUFFER_ENTRIES);
+    record_close(&rec);
+    assert(atomic_load(&rec.written) == 22 + TEST_ENTRIES);
+    assert(!atomic_load(&rec.dropped));
+
+    assert((entries = record_load(path, &count)));
+    assert(count == 22 + TEST_ENTRIES);
+
+    for (size_t i = 1; i < count; i++)
+        assert(entries[i - 1].ns <= entries[i].ns);
+
+    /*
+     * The keys of a request stay together, in order.
+     */
+    assert(entries[8].ns == 8 && entries[8].keys == 3);
+    assert(entries[9].ns == 8 && entries[9].flags & RECORD_MORE);
+    assert(entries[10].key_hash == 2 && entries[10].flags & RECORD_MORE);
+    assert(entries[11].ns == 9 && entries[11].conn == 1);
+    assert(entries[22].op == RECORD_OTHER && !entries[22].keys);
+
+    free(entries);
+
+    /*
+     * Files that are not recordings are refused.
+     */
+    FILE *file = fopen(path, "wb");
+
+    assert(file);
+    fputs("not a recording", file);
+    fclose(file);
+
+    errno = 0;
+    entries = record_load(path, &count);
+    assert(!entries && errno == EINVAL);
+
+    unlink(path);
+}
+
+int main()
+{
+    test_record();
+
+    printf("Success\n");
+}
@@ -0,0 +1,270 @@
+#include "../src/repl.c"
+#include "../src/db.c"
+#include "../src/hash_table.c"
+#include "../src/thread_pool.c"
+#include "../src/histogram.c"
+#include "../src/protocol.c"
+#include "../src/buffer.c"
+#include "../src/malloc.c"
+#include "../src/sys.c"
+
+#include <stdio.h>
+
+static void set(struct db *db, const char *key, const char *val)
+{
+    struct db_key k;
+
+    db_key_init(&k, key, strlen(key));
+    assert(!db_set(db, &k, val, strlen(val), 0));
+}
+
+/*
+ * Asserts that the key is in `arg`'s table with the same value.
+ */
+static int same_key(const struct db_key *key, const struct db_value *val,
+                    void *arg)
+{
+    struct db *other = arg;
+    struct buffer out;
+
+    buffer_init(&out);
+    assert(db_get(other, key, &out) > 0);
+    assert(buffer_len(&out) == val->len);
+    assert(!memcmp(buffer_head(&out), val->data, val->len));
+    buffer_destroy(&out);
+
+    return 0;
+}
+
+static void assert_same(struct db *a, struct db *b)
+{
+    struct db_walk walk = {0};
+
+    assert(db_size(a) == db_size(b));
+    while (db_walk(a, &walk, SIZE_MAX, same_key, b) > 0)
+        ;
+}
+
+static int get_expires(const struct db_value *val, void *arg)
+{
+    *(uint64_t *)arg = val->expires;
+    return 1;
+}
+
+/*
+ * Connects `sender` on the primary to the replica, as the replica's
+ * handshake would.
+ */
+static void attach(struct repl *primary, struct repl_sender *sender,
+                   struct repl *replica, struct buffer *link)
+{
+    struct buffer hs;
+    struct proto_request req;
+
+    buffer_init(&hs);
+    assert(!repl_handshake(replica, &hs));
+    assert(proto_parse_request(buffer_head(&hs), buffer_len(&hs), &req) > 0);
+    assert(req.opcode == PROTO_SYNC);
+    assert(!repl_sender_attach(primary, sender, &req, link));
+    buffer_destroy(&hs);
+}
+
+/*
+ * Moves up to `limit` bytes from the primary, applying them a few bytes at a
+ * time, so requests arrive in pieces. Returns what the fill did.
+ */
+static int pump(struct repl *primary, struct repl_sender *sender,
+                struct repl *replica, struct buffer *link, struct buffer *in,
+                size_t limit)
+{
+    int more = repl_sender_fill(primary, sender, link, limit);
+
+    assert(more >= 0);
+
+    while (buffer_len(link)) {
+        size_t n = min(buffer_len(link), (size_t)7);
+
+        assert(!buffer_append(in, buffer_head(link), n));
+        buffer_consume(link, n);
+
+        ssize_t used = repl_apply(replica, buffer_head(in), buffer_len(in));
+
+        assert(used >= 0);
+        buffer_consume(in, used);
+    }
+
+    return more;
+}
+
+void test_stream()
+{
+    struct db a, b;
+    struct repl primary, replica;
+    struct repl_sender sender;
+    struct buffer link, in;
+    char key[16];
+
+    assert(!db_init(&a) && !db_init(&b));
+    assert(!repl_init(&primary, &a, 0));
+    assert(!repl_init(&replica, &b, 0));
+    b.changed = NULL;
+    buffer_init(&link);
+    buffer_init(&in);
+
+    for (int i = 0; i < 1000; i++)
+        set(&a, (sprintf(key, "k%d", i), key), "value");
+
+    /*
+     * Nothing is logged before the first replica.
+     */
+    assert(!repl_end(&primary));
+
+    set(&b, "stale", "x");
+    attach(&primary, &sender, &replica, &link);
+    assert(sender.walking && !sender.offset);
+
+    /*
+     * Changes during the snapshot land either in it or in the stream after.
+     */
+    struct db_key k;
+    int64_t sum;
+    int step = 0;
+
+    db_key_init(&k, "n", 1);
+
+    while (pump(&primary, &sender, &replica, &link, &in, 4096) > 0) {
+        switch (step++) {
+        case 0:
+            set(&a, "k1", "changed");
+            break;
+        case 1:
+            db_key_init(&k, "k2", 2);
+            assert(db_del(&a, &k));
+            db_key_init(&k, "n", 1);
+            break;
+        case 2:
+            assert(!db_incr(&a, &k, 5, &sum));
+            break;
+        case 3:
+            assert(db_expire(&a, &k, monotonic_ns() + 60000000000ull));
+            break;
+        }
+    }
+
+    assert(step > 4 && repl_end(&primary));
+    assert(replica.link == REPL_LINK_UP);
+    assert(replica.primary_id == primary.id);
+    assert(replica.offset == repl_end(&primary));
+    assert_same(&a, &b);
+
+    /*
+     * The time to live is carried over.
+     */
+    uint64_t expires = 0;
+
+    assert(db_read(&b, &k, get_expires, &expires, NULL) > 0);
+    assert(expires > monotonic_ns() + 59000000000ull);
+
+    /*
+     * Acknowledged offsets reach the sender.
+     */
+    struct proto_request req;
+
+    assert(!repl_ack(&replica, &link));
+    assert(proto_parse_request(buffer_head(&link), buffer_len(&link), &req) >
+           0);
+    assert(req.opcode == PROTO_ACK);
+    repl_sender_ack(&primary, &sender, &req);
+    assert(sender.acked == repl_end(&primary));
+    buffer_consume(&link, buffer_len(&link));
+
+    /*
+     * Reconnecting within the backlog resumes the stream.
+     */
+    repl_sender_detach(&primary, &sender);
+    set(&a, "k3", "again");
+    attach(&primary, &sender, &replica, &link);
+    assert(!sender.walking && sender.offset == replica.offset);
+
+    while (pump(&primary, &sender, &replica, &link, &in, 4096) > 0)
+        ;
+
+    assert(replica.syncs == 1 && replica.offset == repl_end(&primary));
+    assert_same(&a, &b);
+
+    /*
+     * A sender falling further behind than the backlog is dropped, and the
+     * replica takes a new snapshot.
+     */
+    char big[1024];
+
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+
+    for (int i = 0; i < 100; i++)
+        set(&a, (sprintf(key, "big%d", i), key), big);
+
+    assert(repl_sender_fill(&primary, &sender, &link, SIZE_MAX) < 0);
+    repl_sender_detach(&primary, &sender);
+    buffer_consume(&link, buffer_len(&link));
+    assert(!primary.senders && !primary.sender_count);
+
+    attach(&primary, &sender, &replica, &link);
+    assert(sender.walking);
+
+    while (pump(&primary, &sender, &replica, &link, &in, 4096) > 0)
+        ;
+
+    assert(replica.syncs == 2 && replica.offset == repl_end(&primary));
+    assert_same(&a, &b);
+
+    repl_sender_detach(&primary, &sender);
+    buffer_destroy(&link);
+    buffer_destroy(&in);
+    repl_destroy(&primary);
+    repl_destroy(&replica);
+    db_destroy(&a);
+    db_destroy(&b);
+}
+
+void test_backlog()
+{
+    struct db db;
+    struct repl repl;
+
+    assert(!db_init(&db));
+    assert(!repl_init(&repl, &db, 100000));
+    assert(repl.capacity == 128 * 1024);
+
+    /*
+     * Of a write longer than the backlog only the end is kept.
+     */
+    char *data = malloc(repl.capacity + 10);
+
+    assert((repl.log = malloc(repl.capacity)));
+
+    for (size_t i = 0; i < repl.capacity + 10; i++)
+        data[i] = i % 251;
+
+    repl_log_write(&repl, data, 100);
+    repl_log_write(&repl, data, repl.capacity + 10);
+    assert(repl_end(&repl) == repl.capacity + 110);
+
+    for (size_t i = 0; i < repl.capacity; i++) {
+        size_t pos = (110 + i) & (repl.capacity - 1);
+
+        assert(repl.log[pos] == data[10 + i]);
+    }
+
+    free(data);
+    repl_destroy(&repl);
+    db_destroy(&db);
+}
+
+int main()
+{
+    test_stream();
+    test_backlog();
+
+    printf("Success\n");
+}
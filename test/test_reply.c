@@ -0,0 +1,236 @@
+#include "../src/reply.c"
+#include "../src/db.c"
+#include "../src/hash_table.c"
+#include "../src/thread_pool.c"
+#include "../src/histogram.c"
+#include "../src/buffer.c"
+#include "../src/malloc.c"
+#include "../src/sys.c"
+
+#include <stdio.h>
+
+/*
+ * Concatenates everything pending, as a writer would see it.
+ */
+static size_t flatten(const struct reply *out, char *dest)
+{
+    struct iovec iov[16];
+    size_t count = reply_iov(out, iov, ARRAY_SIZE(iov), SIZE_MAX);
+    size_t len = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        memcpy(dest + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+
+    return len;
+}
+
+void test_value()
+{
+    struct reply out;
+    struct db_value *small = db_value_create("abc", 3);
+    char *big_data = malloc(REPLY_REF_MIN);
+    static char flat[3 * REPLY_REF_MIN];
+
+    assert(small && big_data);
+    memset(big_data, 'x', REPLY_REF_MIN);
+
+    struct db_value *big = db_value_create(big_data, REPLY_REF_MIN);
+
+    assert(big);
+    reply_init(&out);
+
+    assert(!buffer_append(&out.buf, "<", 1));
+    assert(!reply_value(&out, small));
+    assert(!reply_value(&out, big));
+    assert(!buffer_append(&out.buf, ">", 1));
+    assert(!reply_value(&out, big));
+
+    /*
+     * Small values are copied, large ones referenced.
+     */
+    assert(buffer_len(&out.buf) == 5);
+    assert(atomic_load(&big->refs) == 3);
+    assert(reply_spliced(&out, 0) == 2 * REPLY_REF_MIN);
+    assert(reply_spliced(&out, 4) == REPLY_REF_MIN);
+
+    assert(flatten(&out, flat) == 5 + 2 * REPLY_REF_MIN);
+    assert(!memcmp(flat, "<abc", 4) && flat[4] == 'x');
+    assert(flat[4 + REPLY_REF_MIN] == '>');
+
+    struct iovec iov[4];
+
+    assert(reply_iov(&out, iov, ARRAY_SIZE(iov), SIZE_MAX) == 4);
+    assert(reply_iov(&out, iov, ARRAY_SIZE(iov), REPLY_REF_MIN) == 1);
+    assert(!reply_front(&out));
+
+    /*
+     * A partly written value resumes where it left off.
+     */
+    reply_consume(&out, 4 + 10);
+    assert(reply_front(&out) == big);
+    assert(reply_iov(&out, iov, ARRAY_SIZE(iov), REPLY_REF_MIN) == 1);
+    assert(iov[0].iov_len == REPLY_REF_MIN - 10);
+
+    reply_consume(&out, REPLY_REF_MIN - 10);
+    assert(atomic_load(&big->refs) == 2);
+    assert(!reply_front(&out));
+
+    reply_consume(&out, 1 + REPLY_REF_MIN);
+    assert(reply_empty(&out));
+    assert(atomic_load(&big->refs) == 1);
+
+    reply_destroy(&out);
+    db_value_put(small);
+    db_value_put(big);
+    free(big_data);
+}
+
+void test_move()
+{
+    struct reply a, b;
+    char *data = calloc(1, REPLY_REF_MIN);
+    struct db_value *val = db_value_create(data, REPLY_REF_MIN);
+    static char flat[2 * REPLY_REF_MIN];
+
+    reply_init(&a);
+    reply_init(&b);
+
+    assert(!buffer_append(&a.buf, "ab", 2));
+    reply_consume(&a, 1);
+    assert(!buffer_append(&b.buf, "c", 1));
+    assert(!reply_value(&b, val));
+    assert(!buffer_append(&b.buf, "d", 1));
+
+    assert(!reply_move(&a, &b));
+    assert(reply_empty(&b));
+    assert(flatten(&a, flat) == 3 + REPLY_REF_MIN);
+    assert(!memcmp(flat, "bc", 2) && flat[2 + REPLY_REF_MIN] == 'd');
+
+    /*
+     * Into an empty reply, the whole thing is taken over.
+     */
+    assert(!reply_move(&b, &a));
+    assert(reply_empty(&a));
+    assert(flatten(&b, flat) == 3 + REPLY_REF_MIN);
+
+    reply_destroy(&a);
+    reply_destroy(&b);
+    assert(atomic_load(&val->refs) == 1);
+    db_value_put(val);
+    free(data);
+}
+
+void test_truncate()
+{
+    struct reply out;
+    char *data = calloc(1, REPLY_REF_MIN);
+    struct db_value *val = db_value_create(data, REPLY_REF_MIN);
+
+    reply_init(&out);
+
+    assert(!buffer_append(&out.buf, "ab", 2));
+    assert(!reply_value(&out, val));
+    reply_consume(&out, 1);
+    assert(!buffer_append(&out.buf, "c", 1));
+    assert(!reply_value(&out, val));
+    assert(!reply_value(&out, val));
+    assert(atomic_load(&val->refs) == 4);
+
+    /*
+     * References spliced in after the cut go with it, earlier ones stay.
+     */
+    reply_truncate(&out, 2);
+    assert(atomic_load(&val->refs) == 2);
+    assert(buffer_len(&out.buf) == 2);
+    assert(reply_spliced(&out, 0) == REPLY_REF_MIN);
+
+    reply_destroy(&out);
+    assert(atomic_load(&val->refs) == 1);
+    db_value_put(val);
+    free(data);
+}
+
+static int get_value(const struct db_value *val, void *out)
+{
+    return reply_value(out, val) ? -1 : 1;
+}
+
+void test_overwrite()
+{
+    struct db db;
+    struct db_key k;
+    struct reply out;
+    char *data = malloc(REPLY_REF_MIN);
+    static char flat[REPLY_REF_MIN];
+
+    assert(!db_init(&db));
+    reply_init(&out);
+    db_key_init(&k, "k", 1);
+
+    memset(data, 'a', REPLY_REF_MIN);
+    assert(!db_set(&db, &k, data, REPLY_REF_MIN, 0));
+    assert(db_read(&db, &k, get_value, &out, NULL) > 0);
+
+    /*
+     * The reply keeps the old value alive past an overwrite and a delete.
+     */
+    memset(data, 'b', REPLY_REF_MIN);
+    assert(!db_set(&db, &k, data, REPLY_REF_MIN, 0));
+    assert(db_del(&db, &k));
+
+    assert(flatten(&out, flat) == REPLY_REF_MIN);
+    assert(flat[0] == 'a' && flat[REPLY_REF_MIN - 1] == 'a');
+
+    reply_destroy(&out);
+    db_destroy(&db);
+    free(data);
+}
+
+void test_pool()
+{
+    struct buffer_pool pool;
+    struct buffer buf;
+
+    assert(!buffer_pool_init(&pool, 64, 1));
+    buffer_init(&buf);
+
+    assert(!buffer_pool_get(&pool, &buf));
+    assert(buf.cap == 64);
+    char *block = buf.data;
+
+    /*
+     * Buffers holding anything are left alone.
+     */
+    assert(!buffer_append(&buf, "x", 1));
+    buffer_pool_put(&pool, &buf);
+    assert(buf.data == block);
+
+    buffer_consume(&buf, 1);
+    buffer_pool_put(&pool, &buf);
+    assert(!buf.data && pool.count == 1);
+
+    assert(!buffer_pool_get(&pool, &buf));
+    assert(buf.data == block && !pool.count);
+
+    /*
+     * Grown buffers are freed rather than cached.
+     */
+    assert(!buffer_reserve(&buf, 128));
+    buffer_pool_put(&pool, &buf);
+    assert(!buf.data && !pool.count);
+
+    buffer_pool_destroy(&pool);
+}
+
+int main()
+{
+    test_value();
+    test_move();
+    test_truncate();
+    test_overwrite();
+    test_pool();
+
+    printf("Success\n");
+}
@@ -0,0 +1,151 @@
+#include "../src/resp.c"
+#include "../src/buffer.c"
+#include "../src/malloc.c"
+#include "../src/sys.c"
+
+#include <stdio.h>
+
+static bool arg_equals(const struct resp_parser *parser, const char *buf,
+                       size_t i, const char *str)
+{
+    return parser->args[i].len == strlen(str) &&
+           !memcmp(buf + parser->args[i].offset, str, strlen(str));
+}
+
+void test_multibulk()
+{
+    const char *frame = "*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$4\r\nv\r\nl\r\n";
+    size_t len = strlen(frame);
+    struct resp_parser parser;
+
+    resp_parser_init(&parser);
+
+    /* Fed a byte at a time, the frame completes only at its last byte. */
+    for (size_t i = 1; i < len; i++)
+        assert(!resp_parse(&parser, frame, i));
+
+    assert(resp_parse(&parser, frame, len) == len);
+    assert(parser.argn == 3);
+    assert(arg_equals(&parser, frame, 0, "SET"));
+    assert(arg_equals(&parser, frame, 1, "key"));
+    assert(arg_equals(&parser, frame, 2, "v\r\nl"));
+
+    resp_parser_destroy(&parser);
+}
+
+void test_pipelined()
+{
+    const char *buf = "*1\r\n$4\r\nPING\r\n"
+                      "*2\r\n$3\r\nGET\r\n$1\r\nk\r\n"
+                      "PING hello\r\n"
+                      "*0\r\n";
+    size_t len = strlen(buf);
+    struct resp_parser parser;
+    ssize_t n;
+
+    resp_parser_init(&parser);
+
+    assert((n = resp_parse(&parser, buf, len)) == 14);
+    assert(parser.argn == 1 && arg_equals(&parser, buf, 0, "PING"));
+    buf += n, len -= n;
+
+    assert((n = resp_parse(&parser, buf, len)) == 20);
+    assert(parser.argn == 2 && arg_equals(&parser, buf, 1, "k"));
+    buf += n, len -= n;
+
+    assert((n = resp_parse(&parser, buf, len)) == 12);
+    assert(parser.argn == 2);
+    assert(arg_equals(&parser, buf, 0, "PING"));
+    assert(arg_equals(&parser, buf, 1, "hello"));
+    buf += n, len -= n;
+
+    assert((n = resp_parse(&parser, buf, len)) == 4);
+    assert(parser.argn == 0);
+
+    resp_parser_destroy(&parser);
+}
+
+void test_malformed()
+{
+    const char *bad[] = {
+        "*1\r\n:4\r\n",           /* Argument not a bulk string. */
+        "*1\r\n$2\r\nabcd\r\n",   /* Bulk longer than announced. */
+        "*x\r\n",                 /* Bad count. */
+        "*1\n",                   /* Bare newline. */
+        "*1\r\n$-1\r\n",          /* Null argument. */
+        "*1\r\n$99999999999\r\n", /* Oversized bulk. */
+    };
+
+    for (size_t i = 0; i < ARRAY_SIZE(bad); i++) {
+        struct resp_parser parser;
+
+        resp_parser_init(&parser);
+        assert(resp_parse(&parser, bad[i], strlen(bad[i])) < 0);
+        resp_parser_destroy(&parser);
+    }
+}
+
+void test_replies()
+{
+    struct buffer out;
+    const char *expected = "+OK\r\n-ERR x\r\n:-42\r\n$5\r\nhello\r\n$-1\r\n"
+                           "*2\r\n$0\r\n\r\n";
+
+    buffer_init(&out);
+
+    assert(!resp_simple(&out, "OK"));
+    assert(!resp_error(&out, "ERR x"));
+    assert(!resp_integer(&out, -42));
+    assert(!resp_bulk(&out, "hello", 5));
+    assert(!resp_null(&out));
+    assert(!resp_array(&out, 2));
+    assert(!resp_bulk(&out, "", 0));
+
+    assert(buffer_len(&out) == strlen(expected));
+    assert(!memcmp(buffer_head(&out), expected, strlen(expected)));
+
+    buffer_destroy(&out);
+}
+
+void test_reply_size()
+{
+    const char *replies[] = {
+        "+OK\r\n", "-ERR x\r\n", ":-42\r\n", "$5\r\nhello\r\n", "$-1\r\n",
+        "*-1\r\n", "*0\r\n", "*3\r\n$1\r\na\r\n$-1\r\n*1\r\n:1\r\n",
+    };
+
+    for (size_t i = 0; i < ARRAY_SIZE(replies); i++) {
+        size_t len = strlen(replies[i]);
+
+        /*
+         * Incomplete at every cut short of the whole reply.
+         */
+        for (size_t cut = 0; cut < len; cut++)
+            assert(!resp_reply_size(replies[i], cut));
+
+        assert(resp_reply_size(replies[i], len) == len);
+    }
+
+    assert(resp_reply_size("$1\r\nab\r\n", 9) < 0);
+    assert(resp_reply_size("?\r\n", 3) < 0);
+
+    /*
+     * Nesting is bounded.
+     */
+    const char *deep = "*1\r\n*1\r\n*1\r\n*1\r\n*1\r\n*1\r\n*1\r\n*1\r\n*1\r\n:1\r\n";
+
+    assert(resp_reply_size(deep, strlen(deep)) < 0);
+    assert(resp_reply_size(deep + 4, strlen(deep + 4)) ==
+           strlen(deep + 4));
+}
+
+int main()
+{
+    test_multibulk();
+    test_pipelined();
+    test_malformed();
+    test_replies();
+    test_reply_size();
+
+    printf("Success\n");
+}
@@ -0,0 +1,437 @@
+#define main server_main
+#include "../src/server.c"
+#undef main
+
+#include "../src/buffer.c"
+#include "../src/command.c"
+#include "../src/conn_shm.c"
+#include "../src/db.c"
+#include "../src/event_loop_epoll.c"
+#include "../src/event_loop_kqueue.c"
+#include "../src/hash_table.c"
+#include "../src/histogram.c"
+#include "../src/malloc.c"
+#include "../src/metrics.c"
+#include "../src/protocol.c"
+#include "../src/reactor_uring.c"
+#include "../src/record.c"
+#include "../src/repl.c"
+#include "../src/reply.c"
+#include "../src/resp.c"
+#include "../src/shm.c"
+#include "../src/slowlog.c"
+#include "../src/spsc_ring.c"
+#include "../src/sys.c"
+#include "../src/thread_pool.c"
+#include "../src/trace.c"
+#include "../src/uring.c"
+
+#include <arpa/inet.h>
+
+struct test_server {
+    struct server_config config;
+    struct server server;
+    pthread_t thread;
+    char **args;
+    atomic_bool ready;
+};
+
+/*
+ * Initializes the server on the thread that runs it, as `io_uring` rings
+ * may only be submitted to by the thread that created them.
+ */
+static void *test_server_main(void *arg)
+{
+    struct test_server *ts = arg;
+    int argc = 0;
+
+    while (ts->args[argc])
+        argc++;
+
+    server_config_init(&ts->config, argc, ts->args);
+    assert(!server_init(&ts->server, &ts->config));
+    atomic_store(&ts->ready, true);
+    assert(!server_run(&ts->server));
+
+    return NULL;
+}
+
+/*
+ * Returns a loopback port nothing listens on.
+ */
+static char *free_port()
+{
+    static char port[8];
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    assert(fd >= 0);
+    assert(!bind(fd, (struct sockaddr *)&addr, len));
+    assert(!getsockname(fd, (struct sockaddr *)&addr, &len));
+    close(fd);
+    sprintf(port, "%u", ntohs(addr.sin_port));
+
+    return port;
+}
+
+/*
+ * Starts a server configured by the `NULL` terminated `args`, which must
+ * outlive it, returning once it listens.
+ */
+static void test_server_start(struct test_server *ts, char **args)
+{
+    server_stopping = 0;
+    ts->args = args;
+    atomic_init(&ts->ready, false);
+    assert(!pthread_create(&ts->thread, NULL, test_server_main, ts));
+
+    while (!atomic_load(&ts->ready))
+        sched_yield();
+}
+
+static void test_server_stop(struct test_server *ts)
+{
+    server_stopping = 1;
+    assert(!pthread_join(ts->thread, NULL));
+    server_destroy(&ts->server);
+}
+
+static int connect_tcp(uint16_t port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    assert(fd >= 0);
+    assert(!connect(fd, (struct sockaddr *)&addr, sizeof(addr)));
+
+    return fd;
+}
+
+static int connect_unix(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    assert(fd >= 0);
+    strcpy(addr.sun_path, path);
+    assert(!connect(fd, (struct sockaddr *)&addr, sizeof(addr)));
+
+    return fd;
+}
+
+static void send_all(int fd, const char *buf, size_t len)
+{
+    for (ssize_t n; len; buf += n, len -= n)
+        assert((n = send(fd, buf, len, 0)) > 0);
+}
+
+/*
+ * Reads exactly `len` bytes and compares them with `expect`.
+ */
+static void expect_reply(int fd, const char *expect, size_t len)
+{
+    char *buf = malloc(len);
+    size_t got = 0;
+
+    assert(buf);
+
+    for (ssize_t n; got < len; got += n)
+        assert((n = recv(fd, buf + got, len - got, 0)) > 0);
+
+    assert(!memcmp(buf, expect, len));
+    free(buf);
+}
+
+#define SET_REQUEST "*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$5\r\nvalue\r\n"
+#define GET_REQUEST "*2\r\n$3\r\nGET\r\n$3\r\nkey\r\n"
+#define SET_REPLY "+OK\r\n"
+#define GET_REPLY "$5\r\nvalue\r\n"
+
+/*
+ * Pipelined requests are answered in order, with nothing extra.
+ */
+static void test_pipeline(int fd)
+{
+    static const char requests[] = SET_REQUEST GET_REQUEST GET_REQUEST;
+    static const char replies[] = SET_REPLY GET_REPLY GET_REPLY;
+
+    send_all(fd, requests, sizeof(requests) - 1);
+    expect_reply(fd, replies, sizeof(replies) - 1);
+}
+
+void test_uring()
+{
+    struct test_server ts;
+    char *args[] = { "server", "-p", free_port(), "-b", "io_uring", "-t",
+                     "2", "-P", "resp", NULL };
+
+    test_server_start(&ts, args);
+
+    if (ts.config.backend != SERVER_BACKEND_URING)
+        printf("io_uring unavailable, served by %s: ", event_loop_backend());
+
+    int fd = connect_tcp(ts.config.port);
+
+    test_pipeline(fd);
+
+    /*
+     * A value larger than one receive buffer arrives over several reads.
+     */
+    size_t size = 100003;
+    size_t len = size + 64;
+    char *req = malloc(len), *reply = malloc(len);
+
+    assert(req && reply);
+
+    int n = sprintf(req, "*3\r\n$3\r\nSET\r\n$3\r\nbig\r\n$%zu\r\n", size);
+
+    memset(req + n, 'x', size);
+    memcpy(req + n + size, "\r\n", 2);
+    send_all(fd, req, n + size + 2);
+    expect_reply(fd, SET_REPLY, sizeof(SET_REPLY) - 1);
+
+    send_all(fd, "*2\r\n$3\r\nGET\r\n$3\r\nbig\r\n", 22);
+    n = sprintf(reply, "$%zu\r\n", size);
+    memset(reply + n, 'x', size);
+    memcpy(reply + n + size, "\r\n", 2);
+    expect_reply(fd, reply, n + size + 2);
+
+    free(req);
+    free(reply);
+    close(fd);
+    test_server_stop(&ts);
+}
+
+void test_unix_socket()
+{
+    char path[] = "/tmp/test_server_XXXXXX";
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct test_server ts;
+    struct stat st;
+    int fd;
+
+    assert((fd = mkstemp(path)) >= 0);
+    close(fd);
+
+    /*
+     * Anything but a socket at the path is left alone.
+     */
+    errno = 0;
+    assert(unix_socket_init(path, -1, 1) < 0 && errno == EEXIST);
+    assert(!lstat(path, &st) && S_ISREG(st.st_mode));
+    unlink(path);
+
+    /*
+     * A socket left behind by a server that did not clean up is replaced.
+     */
+    strcpy(addr.sun_path, path);
+    assert((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0);
+    assert(!bind(fd, (struct sockaddr *)&addr, sizeof(addr)));
+    close(fd);
+
+    char *args[] = { "server", "-p", free_port(), "-u", path, "-m", "600",
+                     "-P", "resp", NULL };
+
+    test_server_start(&ts, args);
+    assert(!lstat(path, &st) && S_ISSOCK(st.st_mode));
+    assert((st.st_mode & 0777) == 0600);
+
+    fd = connect_unix(path);
+    test_pipeline(fd);
+    close(fd);
+
+    /*
+     * TCP is served alongside.
+     */
+    fd = connect_tcp(ts.config.port);
+    test_pipeline(fd);
+    close(fd);
+
+    test_server_stop(&ts);
+    assert(lstat(path, &st) && errno == ENOENT);
+}
+
+/*
+ * Connections past `max_clients` are closed as soon as accepted.
+ */
+void test_max_clients()
+{
+    struct test_server ts;
+    char *args[] = { "server", "-p", free_port(), "-c", "1", "-P", "resp",
+                     NULL };
+    char c;
+
+    test_server_start(&ts, args);
+
+    int fd = connect_tcp(ts.config.port);
+
+    test_pipeline(fd);
+
+    int rejected = connect_tcp(ts.config.port);
+
+    assert(recv(rejected, &c, 1, 0) <= 0);
+    assert(counter_get(&ts.server.reactors[0].rejected) == 1);
+    close(rejected);
+
+    /*
+     * Room is made once the first is closed, which the server finds out
+     * about shortly. Until then connections are accepted and closed, so one
+     * only counts once it has answered.
+     */
+    close(fd);
+
+    for (int tries = 0;; tries++) {
+        assert(tries < 100);
+        fd = connect_tcp(ts.config.port);
+
+        if (send(fd, GET_REQUEST, sizeof(GET_REQUEST) - 1, MSG_NOSIGNAL) > 0 &&
+            recv(fd, &c, 1, MSG_PEEK) > 0) {
+            expect_reply(fd, GET_REPLY, sizeof(GET_REPLY) - 1);
+            test_pipeline(fd);
+            break;
+        }
+
+        close(fd);
+        usleep(10000);
+    }
+
+    close(fd);
+    test_server_stop(&ts);
+}
+
+/*
+ * A client sending requests without reading replies is pushed back on once
+ * `max_inflight` of them are unanswered, and gets every reply in order once
+ * it reads.
+ */
+void test_max_inflight()
+{
+    static const char request[] = GET_REQUEST;
+    static const char reply[] = GET_REPLY;
+    const size_t req_len = sizeof(request) - 1, reply_len = sizeof(reply) - 1;
+    struct test_server ts;
+    char *args[] = { "server", "-p", free_port(), "-i", "4", "-t", "1", "-P",
+                     "resp", NULL };
+    char buf[4096];
+    size_t sent = 0, received = 0;
+    ssize_t n;
+
+    test_server_start(&ts, args);
+
+    int fd = connect_tcp(ts.config.port);
+
+    send_all(fd, SET_REQUEST, sizeof(SET_REQUEST) - 1);
+    expect_reply(fd, SET_REPLY, sizeof(SET_REPLY) - 1);
+
+    /*
+     * Without the limit the server would read on, buffering replies, and
+     * sends would not block this side of the bound.
+     */
+    while ((n = send(fd, request + sent % req_len, req_len - sent % req_len,
+                     MSG_DONTWAIT)) > 0) {
+        sent += n;
+        assert(sent < (size_t)256 << 20);
+    }
+
+    assert(errno == EAGAIN || errno == EWOULDBLOCK);
+
+    /*
+     * Finishes the request cut short, reading to make room.
+     */
+    while (sent % req_len) {
+        if ((n = send(fd, request + sent % req_len, req_len - sent % req_len,
+                      MSG_DONTWAIT)) > 0)
+            sent += n;
+
+        if ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+            received += n;
+    }
+
+    size_t count = sent / req_len;
+
+    for (size_t i = received; i < count * reply_len; i += n)
+        assert((n = recv(fd, buf, min(sizeof(buf), count * reply_len - i),
+                         0)) > 0);
+
+    /*
+     * Nothing is dropped or answered twice.
+     */
+    assert(recv(fd, buf, 1, MSG_DONTWAIT) < 0 && errno == EAGAIN);
+    test_pipeline(fd);
+
+    close(fd);
+    test_server_stop(&ts);
+}
+
+static atomic_int blocker;
+
+static void *block_worker(void *arg)
+{
+    (void)arg;
+
+    atomic_store(&blocker, 1);
+    while (atomic_load(&blocker) == 1)
+        usleep(1000);
+
+    return NULL;
+}
+
+/*
+ * Requests of a connection that waited past `max_wait_ms` for a worker are
+ * answered as busy rather than executed, and later ones served as usual.
+ */
+void test_shed()
+{
+    static const char busy[] = "-BUSY server is overloaded, try again\r\n";
+    struct test_server ts;
+    char *args[] = { "server", "-p", free_port(), "-t", "1", "-w", "1", "-P",
+                     "resp", NULL };
+
+    test_server_start(&ts, args);
+
+    /*
+     * The only worker is kept busy well past the wait limit.
+     */
+    atomic_store(&blocker, 0);
+    assert(!thread_pool_run(&ts.server.pool, block_worker, NULL));
+    while (!atomic_load(&blocker))
+        sched_yield();
+
+    int fd = connect_tcp(ts.config.port);
+
+    send_all(fd, SET_REQUEST GET_REQUEST, sizeof(SET_REQUEST GET_REQUEST) - 1);
+    usleep(20000);
+    atomic_store(&blocker, 2);
+
+    expect_reply(fd, busy, sizeof(busy) - 1);
+    expect_reply(fd, busy, sizeof(busy) - 1);
+
+    /*
+     * The SET was not executed.
+     */
+    send_all(fd, GET_REQUEST, sizeof(GET_REQUEST) - 1);
+    expect_reply(fd, "$-1\r\n", 5);
+    test_pipeline(fd);
+
+    close(fd);
+    test_server_stop(&ts);
+}
+
+int main()
+{
+    test_uring();
+    test_unix_socket();
+    test_max_clients();
+    test_max_inflight();
+    test_shed();
+
+    printf("Success\n");
+}
@@ -0,0 +1,174 @@
+#include "../src/shm.c"
+#include "../src/sys.c"
+
+#include <sched.h>
+#include <stdio.h>
+#include <sys/wait.h>
+
+#define STREAM (4 << 20)
+
+void test_channel()
+{
+    struct shm_channel server, client;
+
+    assert(!shm_channel_create(&server, 5000));
+    assert(server.capacity == 8192);
+    assert(server.size == SHM_HEADER_SIZE + 2 * 8192);
+
+    /*
+     * Sealed, so the client cannot truncate it under the server.
+     */
+    assert(ftruncate(server.fd, 0) && errno == EPERM);
+
+    assert(!shm_channel_open(&client, dup(server.fd)));
+    assert(client.capacity == server.capacity);
+
+    struct shm_port producer, consumer;
+    char out[8192], in[8192];
+
+    shm_port_init(&producer, &client, client.responses);
+    shm_port_init(&consumer, &server, server.responses);
+
+    for (size_t i = 0; i < sizeof(out); i++)
+        out[i] = i * 7;
+
+    /*
+     * Fill, drain part, and wrap around the end.
+     */
+    assert(shm_ring_write(&producer, out, sizeof(out)) == 8192);
+    assert(!shm_ring_write(&producer, out, 1));
+    assert(shm_ring_readable(&consumer) == 8192);
+    assert(shm_ring_read(&consumer, in, 3000) == 3000);
+    assert(!memcmp(in, out, 3000));
+    assert(shm_ring_writable(&producer) == 3000);
+    assert(shm_ring_write(&producer, out, 5000) == 3000);
+    assert(shm_ring_read(&consumer, in, sizeof(in)) == 8192);
+    assert(!memcmp(in, out + 3000, 5192));
+    assert(!memcmp(in + 5192, out, 3000));
+    assert(!shm_ring_read(&consumer, in, 1));
+
+    /*
+     * A scribbled index is reported, not followed.
+     */
+    atomic_store(&server.responses->tail, consumer.pos + 9000);
+    assert(shm_ring_readable(&consumer) == SIZE_MAX);
+    assert(shm_ring_read(&consumer, in, 1) < 0 && errno == EPROTO);
+
+    shm_channel_destroy(&client);
+    shm_channel_destroy(&server);
+}
+
+void test_park()
+{
+    struct shm_channel ch;
+    struct shm_port producer, consumer;
+    char byte = 'x';
+
+    assert(!shm_channel_create(&ch, 0));
+    shm_port_init(&producer, &ch, ch.requests);
+    shm_port_init(&consumer, &ch, ch.requests);
+
+    assert(!shm_ring_notify_consumer(&producer));
+    assert(shm_ring_park_consumer(&consumer));
+    assert(shm_ring_write(&producer, &byte, 1) == 1);
+    assert(shm_ring_notify_consumer(&producer));
+    assert(!shm_ring_notify_consumer(&producer));
+
+    /*
+     * Data already there withdraws the announcement.
+     */
+    assert(!shm_ring_park_consumer(&consumer));
+    assert(!shm_ring_notify_consumer(&producer));
+
+    shm_channel_destroy(&ch);
+}
+
+/*
+ * Streams a pattern from a child process through a ring of the least size,
+ * both sides sleeping on futexes when they run out.
+ */
+void test_processes()
+{
+    struct shm_channel ch;
+
+    assert(!shm_channel_create(&ch, 0));
+
+    pid_t pid = fork();
+
+    assert(pid >= 0);
+
+    if (!pid) {
+        struct shm_port producer;
+        char chunk[1000];
+        size_t sent = 0;
+
+        shm_port_init(&producer, &ch, ch.requests);
+
+        while (sent < STREAM) {
+            size_t len = min(sizeof(chunk), (size_t)STREAM - sent);
+
+            for (size_t i = 0; i < len; i++)
+                chunk[i] = (sent + i) % 251;
+
+            for (size_t done = 0; done < len;) {
+                ssize_t n = shm_ring_write(&producer, chunk + done,
+                                           len - done);
+
+                if (n > 0) {
+                    done += n;
+                    if (shm_ring_notify_consumer(&producer))
+                        shm_futex_wake(&ch.requests->tail);
+                } else if (shm_ring_park_producer(&producer)) {
+                    shm_futex_wait(&ch.requests->head, producer.cache,
+                                   100000000);
+                }
+            }
+
+            sent += len;
+        }
+
+        _exit(0);
+    }
+
+    struct shm_port consumer;
+    char chunk[1500];
+    size_t received = 0;
+
+    shm_port_init(&consumer, &ch, ch.requests);
+
+    while (received < STREAM) {
+        ssize_t n = shm_ring_read(&consumer, chunk, sizeof(chunk));
+
+        assert(n >= 0);
+
+        if (!n) {
+            if (shm_ring_park_consumer(&consumer))
+                shm_futex_wait(&ch.requests->tail, consumer.pos, 100000000);
+            continue;
+        }
+
+        if (shm_ring_notify_producer(&consumer))
+            shm_futex_wake(&ch.requests->head);
+
+        for (ssize_t i = 0; i < n; i++)
+            assert((uint8_t)chunk[i] == (received + i) % 251);
+
+        received += n;
+    }
+
+    int status;
+
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && !WEXITSTATUS(status));
+
+    shm_channel_destroy(&ch);
+}
+
+int main()
+{
+    test_channel();
+    test_park();
+    test_processes();
+
+    printf("Success\n");
+}
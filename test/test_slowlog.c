@@ -0,0 +1,53 @@
+#include "../src/slowlog.c"
+
+#include <stdio.h>
+
+void test_slowlog()
+{
+    struct slowlog log;
+    struct slowlog_entry entries[4];
+
+    assert(!slowlog_init(&log, 3, 1000));
+    assert(!slowlog_slow(&log, 999) && slowlog_slow(&log, 1000));
+
+    for (int i = 0; i < 5; i++) {
+        struct slowlog_entry entry = { .exec_ns = 1000 + i };
+
+        slowlog_add(&log, &entry);
+    }
+
+    /*
+     * The newest are kept, and come out first.
+     */
+    assert(slowlog_len(&log) == 3);
+    assert(slowlog_get(&log, entries, 4) == 3);
+    assert(entries[0].id == 4 && entries[0].exec_ns == 1004);
+    assert(entries[2].id == 2 && entries[2].exec_ns == 1002);
+    assert(entries[0].time > 0);
+
+    assert(slowlog_get(&log, entries, 1) == 1 && entries[0].id == 4);
+
+    /*
+     * Ids go on after a reset.
+     */
+    slowlog_reset(&log);
+    assert(!slowlog_len(&log) && !slowlog_get(&log, entries, 4));
+    slowlog_add(&log, &(struct slowlog_entry){ 0 });
+    assert(slowlog_get(&log, entries, 4) == 1 && entries[0].id == 5);
+
+    slowlog_destroy(&log);
+
+    /*
+     * Kept to no length, nothing is slow.
+     */
+    assert(!slowlog_init(&log, 0, 0));
+    assert(!slowlog_slow(&log, UINT64_MAX));
+    slowlog_destroy(&log);
+}
+
+int main()
+{
+    test_slowlog();
+
+    printf("Success\n");
+}
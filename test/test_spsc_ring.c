@@ -0,0 +1,77 @@
+#include "../src/spsc_ring.c"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+#define ITEMS 200000
+
+void test_fill_drain()
+{
+    struct spsc_ring ring;
+
+    assert(!spsc_ring_init(&ring, 5));
+    assert(ring.mask == 7);
+    assert(spsc_ring_empty(&ring));
+    assert(!spsc_ring_pop(&ring));
+
+    for (uintptr_t i = 1; i <= 8; i++)
+        assert(spsc_ring_push(&ring, (void *)i));
+
+    assert(!spsc_ring_push(&ring, (void *)9));
+
+    for (uintptr_t round = 0; round < 3; round++) {
+        for (uintptr_t i = 1; i <= 8; i++) {
+            assert(spsc_ring_pop(&ring) == (void *)i);
+            assert(spsc_ring_push(&ring, (void *)i));
+        }
+    }
+
+    for (uintptr_t i = 1; i <= 8; i++)
+        assert(spsc_ring_pop(&ring) == (void *)i);
+
+    assert(spsc_ring_empty(&ring));
+    spsc_ring_destroy(&ring);
+}
+
+static void *producer(void *arg)
+{
+    struct spsc_ring *ring = arg;
+
+    for (uintptr_t i = 1; i <= ITEMS; i++) {
+        while (!spsc_ring_push(ring, (void *)i))
+            sched_yield();
+    }
+
+    return NULL;
+}
+
+void test_threads()
+{
+    struct spsc_ring ring;
+    pthread_t thread;
+
+    assert(!spsc_ring_init(&ring, 64));
+    assert(!pthread_create(&thread, NULL, producer, &ring));
+
+    for (uintptr_t i = 1; i <= ITEMS; i++) {
+        void *item;
+
+        while (!(item = spsc_ring_pop(&ring)))
+            sched_yield();
+
+        assert(item == (void *)i);
+    }
+
+    pthread_join(thread, NULL);
+    assert(spsc_ring_empty(&ring));
+    spsc_ring_destroy(&ring);
+}
+
+int main()
+{
+    test_fill_drain();
+    test_threads();
+
+    printf("Success\n");
+}
@@ -0,0 +1,179 @@
+#include "../src/thread_pool.c"
+#include "../src/histogram.c"
+#include "../src/malloc.c"
+#include "../src/sys.c"
+
+#include <stdio.h>
+
+struct thread_pool tp;
+
+pthread_mutex_t gate = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t running = PTHREAD_COND_INITIALIZER;
+int blocked;
+
+int order[64];
+int order_len;
+int cancelled;
+
+void *block(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+    blocked++;
+    pthread_cond_signal(&running);
+    pthread_mutex_unlock(&lock);
+
+    pthread_mutex_lock(&gate);
+    pthread_mutex_unlock(&gate);
+    return NULL;
+}
+
+/*
+ * Waits until `count` workers are held on `block()`.
+ */
+void wait_blocked(int count)
+{
+    pthread_mutex_lock(&lock);
+    while (blocked < count)
+        pthread_cond_wait(&running, &lock);
+    blocked -= count;
+    pthread_mutex_unlock(&lock);
+}
+
+void *record(void *arg)
+{
+    order[order_len++] = (intptr_t)arg;
+    return NULL;
+}
+
+void cancel(void *arg)
+{
+    (void)arg;
+    cancelled++;
+}
+
+void submit(int id, enum thread_pool_priority priority, uint64_t deadline)
+{
+    thread_pool_submit(&tp, &(struct thread_pool_job){
+                                .routine = record,
+                                .arg = (void *)(intptr_t)id,
+                                .cancel = cancel,
+                                .priority = priority,
+                                .deadline = deadline,
+                            });
+}
+
+/*
+ * Holds the single worker on `block()` while jobs are queued, so dequeue order
+ * is deterministic.
+ */
+void run_blocked(void (*queue)())
+{
+    order_len = 0;
+    cancelled = 0;
+
+    thread_pool_init(&tp, 1);
+    pthread_mutex_lock(&gate);
+    thread_pool_run(&tp, block, NULL);
+    wait_blocked(1);
+    queue();
+    pthread_mutex_unlock(&gate);
+    thread_pool_destroy(&tp);
+}
+
+void queue_priorities()
+{
+    submit(3, THREAD_POOL_BACKGROUND, 0);
+    submit(2, THREAD_POOL_NORMAL, 0);
+    submit(1, THREAD_POOL_INTERACTIVE, 0);
+    submit(4, THREAD_POOL_BACKGROUND, 0);
+}
+
+void test_priorities()
+{
+    run_blocked(queue_priorities);
+
+    assert(order_len == 4);
+    assert(order[0] == 1);
+    assert(order[1] == 2);
+    assert(order[2] == 3);
+    assert(order[3] == 4);
+}
+
+void queue_starvation()
+{
+    submit(-1, THREAD_POOL_BACKGROUND, 0);
+
+    for (int i = 0; i < 2 * THREAD_POOL_STARVATION_LIMIT; i++)
+        submit(i, THREAD_POOL_INTERACTIVE, 0);
+}
+
+void test_starvation()
+{
+    run_blocked(queue_starvation);
+
+    assert(order_len == 2 * THREAD_POOL_STARVATION_LIMIT + 1);
+    assert(order[THREAD_POOL_STARVATION_LIMIT] == -1);
+}
+
+void queue_deadlines()
+{
+    uint64_t now = monotonic_ns();
+
+    submit(1, THREAD_POOL_NORMAL, now);
+    submit(2, THREAD_POOL_NORMAL, now + 60 * 1000000000ull);
+    submit(3, THREAD_POOL_NORMAL, 0);
+}
+
+void test_deadlines()
+{
+    run_blocked(queue_deadlines);
+
+    assert(cancelled == 1);
+    assert(order_len == 2);
+    assert(order[0] == 2);
+    assert(order[1] == 3);
+}
+
+void test_stats()
+{
+    struct thread_pool_stats stats;
+
+    thread_pool_init(&tp, 2);
+    pthread_mutex_lock(&gate);
+    thread_pool_run(&tp, block, NULL);
+    thread_pool_run(&tp, block, NULL);
+    wait_blocked(2);
+    submit(1, THREAD_POOL_BACKGROUND, 0);
+    submit(2, THREAD_POOL_BACKGROUND, monotonic_ns());
+
+    thread_pool_stats(&tp, &stats);
+    assert(stats.thread_count == 2);
+    assert(stats.queued[THREAD_POOL_BACKGROUND] +
+               stats.queued[THREAD_POOL_NORMAL] >=
+           2);
+
+    pthread_mutex_unlock(&gate);
+
+    do {
+        thread_pool_stats(&tp, &stats);
+    } while (stats.jobs + stats.cancelled < 4);
+
+    assert(stats.jobs == 3);
+    assert(stats.cancelled == 1);
+    assert(histogram_count(&stats.queue_wait) == 4);
+    assert(stats.queued[THREAD_POOL_BACKGROUND] == 0);
+
+    thread_pool_destroy(&tp);
+}
+
+int main()
+{
+    test_priorities();
+    test_starvation();
+    test_deadlines();
+    test_stats();
+    printf("Success\n");
+}
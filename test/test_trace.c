@@ -0,0 +1,146 @@
+#include "../src/trace.c"
+#include "../src/sys.c"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+struct line {
+    uint64_t ns;
+    uint32_t thread;
+    uint32_t conn;
+    char point[16];
+    uint64_t value;
+    char name[16];
+};
+
+/*
+ * Dumps the last `count` events, parsed back into `lines`. Returns how many.
+ */
+static size_t dump(size_t count, struct line *lines)
+{
+    char *text;
+    size_t len, n = 0;
+    FILE *stream = open_memstream(&text, &len);
+
+    assert(stream && !trace_dump(stream, count));
+    assert(!fclose(stream));
+
+    for (char *line = text; *line; line = strchr(line, '\n') + 1) {
+        struct line *l = &lines[n++];
+
+        l->name[0] = '\0';
+        assert(sscanf(line, "%" SCNu64 " %" SCNu32 " %" SCNu32 " %15s %" SCNu64
+                            " %15s",
+                      &l->ns, &l->thread, &l->conn, l->point, &l->value,
+                      l->name) >= 5);
+    }
+
+    free(text);
+    return n;
+}
+
+static struct line lines[2 * TRACE_RING_SIZE];
+
+void test_record()
+{
+    assert(trace_thread() == 0);
+
+    trace_record_at(10, TRACE_READ, 7, 100, NULL);
+    trace_record_at(20, TRACE_EXECUTE, 7, 5, "GET");
+    trace_record_at(30, TRACE_PARSE, 7, 12, NULL);
+
+    /*
+     * Events come out oldest first, and only the last asked for.
+     */
+    assert(dump(2, lines) == 2);
+    assert(lines[0].ns == 20 && !strcmp(lines[0].point, "execute") &&
+           lines[0].value == 5 && !strcmp(lines[0].name, "GET"));
+    assert(lines[1].ns == 30 && !strcmp(lines[1].point, "parse") &&
+           lines[1].conn == 7 && lines[1].value == 12 && !lines[1].name[0]);
+}
+
+void test_wrap()
+{
+    for (uint64_t i = 0; i < TRACE_RING_SIZE + 10; i++)
+        trace_record_at(1000 + i, TRACE_WRITE, 1, i, NULL);
+
+    /*
+     * The slot of the oldest event is the next written, so it is left out.
+     */
+    assert(dump(2 * TRACE_RING_SIZE, lines) == TRACE_RING_SIZE - 1);
+    assert(lines[0].value == 11);
+    assert(lines[TRACE_RING_SIZE - 2].value == TRACE_RING_SIZE + 9);
+}
+
+static atomic_bool started, stop;
+
+/*
+ * Records events whose value is their time, to tell if any is read half
+ * overwritten. Yielding between them paces it nearer a server thread, which
+ * would otherwise lap the dump before it was done copying.
+ */
+static void *writer(void *arg)
+{
+    uint64_t ns = 1 << 20;
+
+    (void)arg;
+
+    while (!atomic_load(&stop)) {
+        trace_record_at(ns, TRACE_SERVICE, 2, ns, NULL);
+        atomic_store(&started, true);
+        ns++;
+        sched_yield();
+    }
+
+    return NULL;
+}
+
+void test_threads()
+{
+    pthread_t thread;
+
+    atomic_init(&started, false);
+    atomic_init(&stop, false);
+    assert(!pthread_create(&thread, NULL, writer, NULL));
+
+    while (!atomic_load(&started))
+        ;
+
+    /*
+     * Events of both threads are merged in time order, whole, though one
+     * keeps writing.
+     */
+    for (int round = 0; round < 100; round++) {
+        size_t n = dump(2 * TRACE_RING_SIZE, lines);
+        bool other = false;
+
+        assert(n <= 2 * TRACE_RING_SIZE);
+
+        for (size_t i = 0; i < n; i++) {
+            if (i)
+                assert(lines[i].ns >= lines[i - 1].ns);
+
+            if (lines[i].thread == 1) {
+                assert(lines[i].value == lines[i].ns);
+                other = true;
+            } else {
+                assert(lines[i].thread == 0);
+            }
+        }
+
+        assert(other);
+    }
+
+    atomic_store(&stop, true);
+    pthread_join(thread, NULL);
+}
+
+int main()
+{
+    test_record();
+    test_wrap();
+    test_threads();
+
+    printf("Success\n");
+}
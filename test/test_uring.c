@@ -0,0 +1,164 @@
+#include "../src/uring.c"
+
+#include <stdio.h>
+
+#ifdef URING_SUPPORTED
+
+#include <sys/socket.h>
+
+#define ENTRIES 8
+
+/*
+ * Submits what is queued and returns the next completion, which must be
+ * released with `uring_cqe_seen()`.
+ */
+static struct io_uring_cqe *complete(struct uring *ring)
+{
+    struct io_uring_cqe *cqe;
+
+    while (!(cqe = uring_peek(ring)))
+        assert(uring_submit(ring, 1, 1000) >= 0);
+
+    return cqe;
+}
+
+void test_nop(struct uring *ring)
+{
+    /*
+     * More entries than the submission queue holds: `uring_sqe()` submits
+     * the full queue to make room.
+     */
+    for (uint64_t i = 0; i < ENTRIES * 2; i++) {
+        struct io_uring_sqe *sqe = uring_sqe(ring);
+
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = i;
+    }
+
+    for (uint64_t i = 0; i < ENTRIES * 2; i++) {
+        struct io_uring_cqe *cqe = complete(ring);
+
+        assert(cqe->user_data == i && !cqe->res);
+        uring_cqe_seen(ring);
+    }
+
+    assert(!uring_peek(ring));
+    assert(ring->completions == ENTRIES * 2);
+}
+
+void test_send_recv(struct uring *ring)
+{
+    static const char msg[] = "loopback";
+    char buf[sizeof(msg)] = { 0 };
+    int fds[2];
+
+    assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fds[1];
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = sizeof(buf);
+    sqe->user_data = 2;
+
+    sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fds[0];
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = sizeof(msg);
+    sqe->user_data = 1;
+
+    /*
+     * Completions arrive in either order.
+     */
+    for (int i = 0; i < 2; i++) {
+        struct io_uring_cqe *cqe = complete(ring);
+
+        assert(cqe->user_data == 1 || cqe->user_data == 2);
+        assert(cqe->res == sizeof(msg));
+        uring_cqe_seen(ring);
+    }
+
+    assert(!memcmp(buf, msg, sizeof(msg)));
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void test_buf_ring(struct uring *ring)
+{
+    struct uring_buf_ring br;
+    int fds[2];
+
+    if (uring_buf_ring_init(ring, &br, 0, 4, 16)) {
+        printf("Provided buffer rings unsupported, skipped\n");
+        return;
+    }
+
+    assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+    /*
+     * Each read takes a buffer picked by the kernel, returned by id.
+     */
+    for (int i = 0; i < 8; i++) {
+        char msg[16];
+        int len = snprintf(msg, sizeof(msg), "message %d", i);
+
+        assert(write(fds[0], msg, len) == len);
+
+        struct io_uring_sqe *sqe = uring_sqe(ring);
+
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fds[1];
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = br.bgid;
+
+        struct io_uring_cqe *cqe = complete(ring);
+
+        assert(cqe->res == len);
+        assert(cqe->flags & IORING_CQE_F_BUFFER);
+
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        assert(bid < br.entries);
+        assert(!memcmp(uring_buf(&br, bid), msg, len));
+        uring_cqe_seen(ring);
+
+        uring_buf_ring_recycle(&br, bid);
+        uring_buf_ring_publish(&br);
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+    uring_buf_ring_destroy(ring, &br);
+}
+
+int main()
+{
+    struct uring ring;
+    int ret = uring_init(&ring, ENTRIES);
+
+    if (ret) {
+        printf("io_uring unavailable (%s), skipped\n", strerror(-ret));
+        return 0;
+    }
+
+    assert(uring_probe(&ring, IORING_OP_NOP));
+
+    test_nop(&ring);
+    test_send_recv(&ring);
+    test_buf_ring(&ring);
+    uring_destroy(&ring);
+
+    printf("Success\n");
+}
+
+#else
+
+int main()
+{
+    printf("io_uring unsupported, skipped\n");
+}
+
+#endif
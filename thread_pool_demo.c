@@ -1,5 +1,7 @@
 #include <unistd.h>
 #include "./src/thread_pool.c"
+#include "./src/histogram.c"
+#include "./src/sys.c"
 
 #define THREAD_COUNT 8
 #define HIST_COUNT 10